@@ -2,22 +2,94 @@
  *
  * Features
  * - Subcommands:
- *     prime  <n>
- *     factor <n> [--timeout_ms T] [--p1_B B] [--rho_restarts R] [--rho_iters I]
+ *     prime  <n> [--cache FILE]
+ *     factor <n> [--timeout_ms T] [--trial_B B] [--p1_B B] [--p1_B2 B2] [--rho_restarts R] [--rho_iters I]
+ *                [--ecm_curves C] [--ecm_B1 B1] [--ecm_B2 B2] [--siqs 0|1] [--small_bits K]
+ *                [--threads N] [--cpus LIST] [--schedule luby|doubling|fixed] [--cap M]
+ *                [--checkpoint FILE] [--checkpoint_ms MS] [--resume FILE] [--progress_ms MS]
+ *                [--plan auto|fixed] [--plan_stats FILE] [--cache FILE]
+ *     batch  [factor flags] [--flush L]   (integers or JSON requests on stdin)
+ *     batchgcd [factor flags] [--chunk K] (integers on stdin)
+ *     serve  --socket PATH [--workers W] [factor flags]
+ *     submit --socket PATH               (stdin to a serve daemon)
+ *     bench  [--seed S] [--bits LIST] [--count K] [--methods LIST] [--classes LIST]
+ *            [--baseline FILE] [--tolerance PCT] [factor flags]
+ *     range  <lo> <hi> [--threads N] [--format text|delta|binary]
+ *     count  <lo> <hi> [--threads N]
+ *     nextprime|prevprime <n> [--threads N] [--sieve_B B]
+ *     scan   <start> <width> [--threads N] [--sieve_B B]
  * - Outputs a single JSON line with:
  *     { "n": <uint>, "n_str":"<decimal>", "classification":"prime|composite",
  *       "factors":{"p1":e1,"p2":e2,...}, "bits": <int>,
- *       "status":"ok|timeout|error", "params":{...} }
+ *       "status":"ok|timeout|interrupted|error", "params":{...} }
  * - Uses GMP for big integers
+ * - Primality: deterministic Miller-Rabin below 2^64, BPSW above (two-limb
+ *   Montgomery words below 2^128), each classification memoized per run
+ * - Primes <= --trial_B (default 2^16) are stripped once up front, screened
+ *   a word-sized product at a time with mpz_tdiv_ui()
  * - Pollard’s Rho (Brent variant) with restarts + iteration caps
- * - Optional small P-1 trial stage via B smoothness bound (--p1_B)
+ * - --timeout_ms is enforced inside the walks and P-1/ECM stages (a clock
+ *   read every 1024 rho steps, per P-1 chunk or stage-2 block); on timeout
+ *   or SIGINT/SIGTERM the line still lists the primes found, plus the
+ *   "cofactors" left unsplit ("status":"timeout"|"interrupted")
+ * - Odd n of 3..16 limbs (up to 1024 bits) runs rho and P-1 stage 2 in
+ *   Montgomery form on mpn limb arrays, one kernel per limb count
+ * - Optional small P-1 trial stage via B smoothness bound (--p1_B), with an
+ *   optional stage 2 over primes in (B, B2] (--p1_B2)
+ * - Optional ECM between P-1 and rho (--ecm_curves C, --ecm_B1, --ecm_B2),
+ *   curves shared by the --threads workers; up to 4096 curves per composite
+ *   are listed in "ecm", all are counted in "ecm_curves_run"
+ * - Self-initialising quadratic sieve for 72..160-bit cofactors (--siqs 0
+ *   disables it); relations are gathered by the --threads workers
+ * - Cofactors of at most --small_bits (default 64) bits are finished in
+ *   machine words: perfect powers, Hart/Lehman, 64-bit Montgomery rho
+ * - --threads N runs a work-stealing pool of N workers (a deque each):
+ *   every cofactor is a task, so independent cofactors split at once, and
+ *   the rho walkers, ECM curves and SIQS sievers of a method attempt are
+ *   tasks idle workers steal (own RNG stream each, first split cancels the
+ *   others); optional pinning via --cpus 0-7,9
+ * - --checkpoint FILE snapshots the run (primes so far, cofactors left, P-1
+ *   position, ECM curve and rho restart counters, each walk's x/y/q/c/r)
+ *   atomically every --checkpoint_ms; --resume FILE continues from it
+ * - "stats" splits the time and work by stage (P-1 gcds and stage-2 primes,
+ *   rho restarts/iterations/gcds, primality tests) and lists each split
+ *   with the method that found it; --progress_ms MS prints a heartbeat
+ *   ({"progress":{...}}) to stderr every MS ms
+ * - --plan auto replaces the fixed P-1/ECM/SIQS/rho chain with a planner
+ *   that orders escalating attempts by chance of success per expected
+ *   cost, from per-size history kept in --plan_stats FILE across runs
+ * - --cache FILE keeps primes, full and partial factorizations in an
+ *   append-only file keyed by a hash of n (mmap'd, appends under flock, so
+ *   several processes can share it); n and each cofactor are looked up
+ *   before any splitting work
+ * - Restart budgets follow --schedule (rho_iters x luby/doubling/fixed
+ *   multiplier, clamped to --cap); trial division and P-1 run once
+ * - batch streams one JSON line per input, keyed by "seq" (and "id" when the
+ *   request carries one), reusing one RNG and P-1 plan cache for the run;
+ *   with --threads N the inputs are tasks on that pool too, printed in order
+ * - batchgcd reports gcd(n_i, product of the other inputs) for every input
+ *   via product/remainder trees (chunked through a temp file, levels spread
+ *   over --threads) and factors the inputs that share a prime
+ * - serve runs a job queue on a Unix-domain socket: W workers, priorities,
+ *   deadlines, progress events and cancel by id ("status":"cancelled"),
+ *   with P-1 plans, trial primes and primality scratch kept warm
+ * - bench times each method alone and the pipeline on a seeded corpus
+ *   (semiprime, smooth, p1_smooth at 32..160 bits): median/p90/p99 per
+ *   row, mulmods/s and rho iterations/s per size, --baseline comparison
+ * - range/count sieve [lo, hi] (hi < 2^64 - 2^32) with a wheel-210 bit
+ *   sieve in cache-sized segments, large primes kept in per-segment
+ *   buckets; sieving primes past 2^25 are streamed per chunk (or the
+ *   survivors PRP-tested), so memory stays bounded; chunks are spread
+ *   over --threads and printed in order
+ * - nextprime/prevprime/scan sieve a window of odd candidates by the primes
+ *   up to --sieve_B, then PRP-test only the survivors on --threads workers
  * - --help and --version flags
  *
  * Build (requires libgmp-dev):
- *   gcc -O3 -march=x86-64 -mtune=generic -pipe -o cprime_cli_demo cprime.c -lgmp -lm
+ *   gcc -O3 -march=x86-64 -mtune=generic -pipe -o cprime_cli_demo cprime.c -lgmp -lm -pthread
  */
 
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,7 +97,21 @@
 #include <inttypes.h>
 #include <math.h>
 #include <errno.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <gmp.h>
 
 #ifndef GIT_DESC
@@ -40,340 +126,7897 @@ static uint64_t now_ms(void) {
     return (uint64_t)ts.tv_sec * 1000ull + (uint64_t)(ts.tv_nsec / 1000000ull);
 }
 
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ull + (uint64_t)(ts.tv_nsec / 1000ull);
+}
+
+/* Deadline of the run on this thread (now_us() clock, 0 => none) and the
+ * SIGINT/SIGTERM flag.  Hot loops call deadline_hit() every step; it reads
+ * the clock once per DEADLINE_STEPS steps (a few microseconds of mulmods). */
+#define DEADLINE_STEPS 1024u
+
+static _Thread_local uint64_t thread_deadline_us;
+static atomic_bool interrupted;
+
+static bool deadline_passed(void) {
+    return atomic_load_explicit(&interrupted, memory_order_relaxed)
+        || (thread_deadline_us && now_us() >= thread_deadline_us);
+}
+
+static inline bool deadline_hit(uint64_t step) {
+    return (step & (DEADLINE_STEPS - 1)) == 0 && deadline_passed();
+}
+
+static void on_interrupt(int sig) {
+    (void) sig;
+    atomic_store(&interrupted, true);
+}
+
+/* SIGINT/SIGTERM stop the run like a deadline, so what was found is still
+ * printed; a second signal kills as usual. */
+static void catch_interrupts(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = on_interrupt;
+    sa.sa_flags = SA_RESETHAND;         // no SA_RESTART: a blocked read returns
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
 /* ---------- util: parsing & printing ---------- */
 
-static void die_usage(const char *prog) {
-    fprintf(stderr,
-        "Usage:\n"
-        "  %s --help | -h\n"
-        "  %s --version | -V\n"
-        "  %s prime  <n>\n"
-        "  %s factor <n> [--timeout_ms T] [--p1_B B] [--rho_restarts R] [--rho_iters I]\n"
-        "Notes:\n"
-        "  - <n> is a non-negative integer (decimal string).\n"
-        "  - timeout: T=0 disables time limit; rho_iters=0 => unlimited when T=0.\n",
-        prog, prog, prog, prog
-    );
+static void die_usage(const char *prog) {
+    fprintf(stderr,
+        "Usage:\n"
+        "  %s --help | -h\n"
+        "  %s --version | -V\n"
+        "  %s prime  <n> [--cache FILE]\n"
+        "  %s factor <n> [--timeout_ms T] [--trial_B B] [--p1_B B] [--p1_B2 B2] [--rho_restarts R] [--rho_iters I]\n"
+        "                [--ecm_curves C] [--ecm_B1 B1] [--ecm_B2 B2] [--siqs 0|1] [--small_bits K]\n"
+        "                [--threads N] [--cpus LIST] [--schedule luby|doubling|fixed] [--cap M]\n"
+        "                [--checkpoint FILE] [--checkpoint_ms MS] [--resume FILE] [--progress_ms MS]\n"
+        "                [--plan auto|fixed] [--plan_stats FILE] [--cache FILE]\n"
+        "  %s batch  [factor flags] [--flush L]  < inputs\n"
+        "  %s batchgcd [factor flags] [--chunk K]  < integers\n"
+        "  %s serve  --socket PATH [--workers W] [factor flags]\n"
+        "  %s submit --socket PATH  < requests\n"
+        "  %s bench  [--seed S] [--bits LIST] [--count K] [--methods LIST] [--classes LIST]\n"
+        "                [--baseline FILE] [--tolerance PCT] [factor flags]\n"
+        "  %s range  <lo> <hi> [--threads N] [--format text|delta|binary]\n"
+        "  %s count  <lo> <hi> [--threads N]\n"
+        "  %s nextprime|prevprime <n> [--threads N] [--sieve_B B]\n"
+        "  %s scan   <start> <width> [--threads N] [--sieve_B B]\n"
+        "Notes:\n"
+        "  - <n> is a non-negative integer (decimal string).\n"
+        "  - timeout: T=0 disables time limit; rho_iters=0 => unlimited when T=0.\n"
+        "    SIGINT/SIGTERM end the run the same way: factors so far plus \"cofactors\".\n"
+        "  - trial_B: strip all primes <= B first (default 65536, max 2^32-1).\n"
+        "  - p1_B2: P-1 stage 2 bound (0 => stage 1 only; 50-100 x p1_B is typical).\n"
+        "  - ecm: C curves (0 => skip) before rho; B1=11000 and B2=100*B1 suit ~20 digits.\n"
+        "  - siqs: quadratic sieve for 72..160-bit cofactors after P-1/ECM (default 1).\n"
+        "  - small_bits: cofactors up to K bits (max 64, 0 => off) skip the GMP pipeline.\n"
+        "  - threads: N workers share the cofactors and each method's walkers or curves;\n"
+        "    batch inputs run N at a time and still print in input order.\n"
+        "  - cpus: pin worker i to the i-th cpu of LIST (e.g. 0-7 or 0,2,4-6).\n"
+        "  - schedule: restart i gets rho_iters x luby(i) | 2^(i-2) | 1 iterations,\n"
+        "    clamped to cap (M=0 => no cap); default fixed.\n"
+        "  - checkpoint: snapshot the run to FILE every MS ms (default 10000) and at\n"
+        "    the end; resume: continue the run saved in FILE (same <n>).\n"
+        "  - progress_ms: print the current stage and work done to stderr every MS ms.\n"
+        "  - plan: auto picks the method order and P-1/ECM/rho budgets per cofactor from\n"
+        "    its size and past outcomes, escalating what fails (budget flags ignored,\n"
+        "    not under checkpoint); plan_stats: keep those outcomes in FILE (implies auto).\n"
+        "  - cache: answer n (and any cofactor) from FILE when an earlier run factored or\n"
+        "    classified it, and record new results there (created if missing; n > 64 bits).\n"
+        "  - batch: one integer or JSON object ({\"n\":\"...\",\"id\":...,<flag>:<value>})\n"
+        "    per line (<flag> not cache/plan_stats, nor cpus under --threads N > 1);\n"
+        "    output is flushed every L lines (default 256) or 100 ms.\n"
+        "  - batchgcd: K inputs per in-memory product tree (default 65536); inputs with\n"
+        "    a shared prime (gcd > 1) are split there and factored.\n"
+        "  - serve: batch-style JSON lines over the socket, plus \"op\" (factor|cancel|\n"
+        "    ping|shutdown), \"priority\" and \"deadline_ms\" (epoch ms); W defaults to\n"
+        "    the online CPUs. submit sends stdin and prints the replies.\n"
+        "  - bench: K inputs per class and size (default 8; bits 32,48,...,160; seed 1),\n"
+        "    methods trial,p1,ecm,siqs,rho,pipeline; each run gets --timeout_ms (default\n"
+        "    1000). With --baseline (a saved run) it exits 1 if a median or a throughput\n"
+        "    figure is more than PCT%% worse (default 10).\n"
+        "  - range: the primes in [lo, hi] in order, one decimal per line (text), the\n"
+        "    first then gaps (delta), or 8-byte LE first then LEB128 gaps (binary);\n"
+        "    count prints their number only. N defaults to the online CPUs.\n"
+        "  - nextprime/prevprime: the first (probable) prime above/below n, as JSON;\n"
+        "    scan: the primes in [start, start+width), one per line. Candidates with a\n"
+        "    factor <= B are never tested (default 4096 x bits, 65536..2^26).\n",
+        prog, prog, prog, prog, prog, prog, prog, prog, prog, prog, prog, prog, prog
+    );
+}
+
+static int parse_mpz_or_err(mpz_t out, const char *s) {
+    if (!s || !*s) return -1;
+    // Disallow leading '+' and any sign; treat as unsigned integer.
+    for (const char *p=s; *p; ++p) {
+        if (*p < '0' || *p > '9') return -2;
+    }
+    if (mpz_init_set_str(out, s, 10) != 0) return -3;
+    return 0;
+}
+
+/* Parse a cpu list like "0-7" or "0,2,4-6" into a malloc'd array. */
+static int parse_cpu_list(const char *s, int **out, size_t *len) {
+    *out = NULL; *len = 0;
+    size_t cap = 0;
+    const char *p = s;
+    while (*p) {
+        char *end;
+        long a = strtol(p, &end, 10);
+        if (end == p || a < 0 || a >= CPU_SETSIZE) goto bad;
+        long b = a;
+        p = end;
+        if (*p == '-') {
+            b = strtol(++p, &end, 10);
+            if (end == p || b < a || b >= CPU_SETSIZE) goto bad;
+            p = end;
+        }
+        for (long c=a; c<=b; ++c) {
+            if (*len == cap) {
+                cap = cap ? cap*2 : 16;
+                int *np = (int*)realloc(*out, cap*sizeof(int));
+                if (!np) goto bad;
+                *out = np;
+            }
+            (*out)[(*len)++] = (int)c;
+        }
+        if (*p == ',') ++p;
+        else if (*p) goto bad;
+    }
+    if (*len) return 0;
+bad:
+    free(*out); *out = NULL; *len = 0;
+    return -1;
+}
+
+static int bits_of(const mpz_t n) {
+    return (int) mpz_sizeinbase(n, 2);
+}
+
+static char* mpz_to_cstr(const mpz_t x) {
+    // Caller must free
+    return mpz_get_str(NULL, 10, x);
+}
+
+/* ---------- math helpers ---------- */
+
+static void gcd_mpz(mpz_t r, const mpz_t a, const mpz_t b) {
+    mpz_gcd(r, a, b);
+}
+
+/* ---------- segmented sieve of Eratosthenes ---------- */
+
+#define SIEVE_SEG_ODDS 32768u   // odd numbers per segment (one L1-sized byte map)
+
+typedef int (*prime_visit)(uint64_t p, void *ctx);   // nonzero => stop early
+
+static uint64_t isqrt_u64(uint64_t x) {
+    uint64_t r = (uint64_t) sqrtl((long double) x);
+    if (r > UINT32_MAX) r = UINT32_MAX;     // (r+1)^2 would wrap
+    while (r * r > x) --r;
+    while (r < UINT32_MAX && (r+1) * (r+1) <= x) ++r;
+    return r;
+}
+
+/* Odd primes <= lim by a plain sieve; malloc'd array, count in *cnt. */
+static uint32_t *odd_base_primes(uint32_t lim, size_t *cnt) {
+    *cnt = 0;
+    if (lim < 3) return NULL;
+    size_t nodd = (lim - 1) / 2;            // 3,5,...,lim  ->  index (k-3)/2
+    unsigned char *comp = (unsigned char*)calloc(nodd, 1);
+    uint32_t *out = (uint32_t*)malloc((nodd + 1) * sizeof(uint32_t));
+    if (!comp || !out) { free(comp); free(out); return NULL; }
+    for (size_t i=0; i<nodd; ++i) {
+        if (comp[i]) continue;
+        uint64_t p = 2*i + 3;
+        out[(*cnt)++] = (uint32_t)p;
+        for (uint64_t m = p*p; m <= lim; m += 2*p) comp[(m-3)/2] = 1;
+    }
+    free(comp);
+    return out;
+}
+
+/* Calls visit(p) for every prime p in [lo, hi], in increasing order.
+ * Returns 1 if visit asked to stop, 0 otherwise. */
+static int sieve_range(uint64_t lo, uint64_t hi, prime_visit visit, void *ctx) {
+    if (hi < 2 || lo > hi) return 0;
+    if (lo <= 2) { if (visit(2, ctx)) return 1; lo = 3; }
+    if (!(lo & 1)) ++lo;
+    if (lo > hi) return 0;
+
+    size_t nbase;
+    uint32_t *base = odd_base_primes((uint32_t) isqrt_u64(hi), &nbase);
+    unsigned char *seg = (unsigned char*)malloc(SIEVE_SEG_ODDS);
+    if (!seg) { free(base); return 0; }
+
+    int stopped = 0;
+    for (uint64_t s = lo; s <= hi && !stopped; ) {
+        // segment covers the odd numbers s, s+2, ..., s+2*(len-1)
+        uint64_t len = (hi - s) / 2 + 1;
+        if (len > SIEVE_SEG_ODDS) len = SIEVE_SEG_ODDS;
+        uint64_t last = s + 2*(len-1);
+        memset(seg, 0, len);
+        for (size_t i=0; i<nbase; ++i) {
+            uint64_t p = base[i];
+            if (p*p > last) break;
+            uint64_t m = p*p;
+            if (m < s) {
+                m = ((s + p - 1) / p) * p;
+                if (!(m & 1)) m += p;
+            }
+            for (; m <= last; m += 2*p) seg[(m - s) / 2] = 1;
+        }
+        if (s == 1) seg[0] = 1;
+        for (uint64_t i=0; i<len; ++i) {
+            if (!seg[i] && visit(s + 2*i, ctx)) { stopped = 1; break; }
+        }
+        if (last >= hi) break;
+        s = last + 2;
+    }
+    free(seg);
+    free(base);
+    return stopped;
+}
+
+/* ---------- small primes table ---------- */
+
+static const unsigned small_primes[] = {
+    2u,3u,5u,7u,11u,13u,17u,19u,23u,29u,31u,37u,41u,43u,47u,53u,59u,61u,
+    67u,71u,73u,79u,83u,89u,97u,101u,103u,107u,109u,113u,127u,131u,137u,139u,149u
+};
+static const size_t small_primes_len = sizeof(small_primes)/sizeof(small_primes[0]);
+
+/* ---------- work counters (per thread, harvested by the caller) ---------- */
+
+/* Bumped by the kernels at their gcd boundaries, never reset: whoever runs
+ * a kernel reads the difference over its call and files it in the stats. */
+typedef struct {
+    uint64_t rho_iters;
+    uint64_t rho_gcds;
+    uint64_t p1_gcds;       // stage 1 chunks and stage 2 blocks, replays included
+    uint64_t p1s2_primes;   // stage 2 primes walked
+} work_counts;
+
+static _Thread_local work_counts work;
+
+/* ---------- checkpoint hooks (shared by the long-running kernels) ---------- */
+
+/* A kernel that can be checkpointed is handed a ck_slot (NULL => none).  It
+ * polls ck_due() at its natural boundaries -- a rho gcd batch, a P-1 chunk
+ * or stage-2 block -- and, when the writer has asked for a snapshot, copies
+ * its state into the slot between ck_begin() and ck_answer().  A slot that
+ * is valid on entry holds a state to resume from. */
+
+typedef struct ck_slot {
+    struct ck_core *core;
+    uint64_t seen;          // last snapshot epoch this slot answered
+    bool passive;           // state never changes mid-task (ECM): no answer needed
+    bool valid;             // fields below hold a resumable state
+    uint64_t id;            // rho restart / ECM curve index, P-1 bound
+    uint64_t pos;           // rho round length r, P-1 next chunk / last prime
+    uint64_t k, iters;      // rho: steps into the round, steps taken
+    mpz_t x, y, q, c;       // rho walk (kernel-native form); P-1: x = residue, y = base
+} ck_slot;
+
+typedef struct ck_core {
+    pthread_mutex_t lock;
+    pthread_cond_t cv;              // slot answered or closed, writer wakeup
+    atomic_uint_fast64_t epoch;     // bumped by the writer to ask for a snapshot
+    atomic_uint_fast64_t next;      // ECM curve / rho restart counter of the stage
+    ck_slot **act;                  // open slots
+    size_t nact, actcap;
+    ck_slot *saved;                 // slots loaded by --resume, not yet claimed
+    size_t nsaved;
+} ck_core;
+
+static inline bool ck_due(const ck_slot *s) {
+    return s && atomic_load_explicit(&s->core->epoch, memory_order_relaxed) != s->seen;
+}
+
+static void ck_begin(ck_slot *s) {
+    pthread_mutex_lock(&s->core->lock);
+}
+
+static void ck_answer(ck_slot *s) {
+    s->seen = atomic_load(&s->core->epoch);
+    s->valid = true;
+    pthread_cond_broadcast(&s->core->cv);
+    pthread_mutex_unlock(&s->core->lock);
+}
+
+static void ck_slot_copy(ck_slot *dst, const ck_slot *src) {
+    dst->valid = src->valid;
+    dst->id = src->id; dst->pos = src->pos; dst->k = src->k; dst->iters = src->iters;
+    mpz_set(dst->x, src->x); mpz_set(dst->y, src->y);
+    mpz_set(dst->q, src->q); mpz_set(dst->c, src->c);
+}
+
+/* Next unit of work for s: a saved slot from --resume if one is left, else a
+ * fresh index from *next.  Without a slot this is just the counter. */
+static uint64_t ck_claim(ck_slot *s, atomic_uint_fast64_t *next) {
+    if (!s) return atomic_fetch_add(next, 1);
+    ck_core *K = s->core;
+    pthread_mutex_lock(&K->lock);
+    if (K->nsaved) {
+        ck_slot *sv = &K->saved[--K->nsaved];
+        ck_slot_copy(s, sv);
+        mpz_clears(sv->x, sv->y, sv->q, sv->c, NULL);
+    } else {
+        s->id = atomic_fetch_add(next, 1);
+        s->valid = false;
+    }
+    s->seen = atomic_load(&K->epoch);
+    pthread_mutex_unlock(&K->lock);
+    return s->id;
+}
+
+/* ---------- Pollard Rho (Brent) ---------- */
+
+/* Relaxed load of a (possibly NULL) cancel flag; cheap enough for every step. */
+static inline bool stop_requested(const atomic_bool *stop) {
+    return stop && atomic_load_explicit(stop, memory_order_relaxed);
+}
+
+static void brent_rho(mpz_t factor, const mpz_t n, gmp_randstate_t rng,
+                      uint64_t max_iters, const atomic_bool *stop, ck_slot *s)
+{
+    // Precondition: n is odd composite (best-effort), factor result 1 or non-trivial.
+    mpz_set_ui(factor, 1);
+    if (mpz_even_p(n)) { mpz_set_ui(factor, 2); return; }
+
+    mpz_t y, c, g, q, x, ys, t;
+    mpz_inits(y,c,g,q,x,ys,t, NULL);
+
+    const uint64_t m = 128;                   // steps per gcd
+    uint64_t r = 1, k = 0, iters = 0;
+    bool mid = s && s->valid;                 // resuming inside a round
+    if (mid) {
+        mpz_set(x, s->x); mpz_set(y, s->y); mpz_set(q, s->q); mpz_set(c, s->c);
+        r = s->pos; k = s->k; iters = s->iters;
+    }
+    const uint64_t iters0 = iters;
+    if (!mid) {
+        // y in [0..n-1], c in [1..n-1]
+        mpz_urandomm(y, rng, n);
+        do { mpz_urandomm(c, rng, n); } while (mpz_sgn(c) == 0);
+        mpz_set_ui(q, 1);
+    }
+    mpz_set_ui(g, 1);
+
+#define RHO_STEP(v) do { mpz_mul(v,v,v); mpz_add(v,v,c); mpz_mod(v,v,n); } while (0)
+#define RHO_BUDGET() do { \
+        if (++iters >= max_iters && max_iters) goto done; /* give up */ \
+        if (stop_requested(stop)) goto done;              /* another walker won */ \
+        if (deadline_hit(iters)) goto done;               /* out of time */ \
+    } while (0)
+
+    while (mpz_cmp_ui(g,1) == 0) {
+        if (!mid) {
+            mpz_set(x, y);
+            for (uint64_t i=0; i<r; ++i) { RHO_STEP(y); RHO_BUDGET(); }
+            k = 0;
+        }
+        mid = false;
+        while (k < r && mpz_cmp_ui(g,1) == 0) {
+            mpz_set(ys, y);
+            uint64_t lim = (r - k < m) ? r - k : m;
+            for (uint64_t i=0; i<lim; ++i) {
+                // q = q * (x - y) % n
+                RHO_STEP(y);
+                mpz_sub(t, x, y);
+                mpz_mul(q, q, t);
+                mpz_mod(q, q, n);
+                RHO_BUDGET();
+            }
+            gcd_mpz(g, q, n);
+            work.rho_gcds++;
+            k += lim;
+            if (mpz_cmp_ui(g,1) == 0 && ck_due(s)) {
+                ck_begin(s);
+                mpz_set(s->x, x); mpz_set(s->y, y); mpz_set(s->q, q); mpz_set(s->c, c);
+                s->pos = r; s->k = k; s->iters = iters;
+                ck_answer(s);
+            }
+        }
+        r *= 2;
+    }
+
+    if (mpz_cmp(g, n) == 0) {
+        // backtrack from the last batch one step at a time
+        do {
+            RHO_STEP(ys);
+            mpz_sub(t, x, ys);
+            gcd_mpz(g, t, n);
+        } while (mpz_cmp_ui(g,1) == 0);
+    }
+#undef RHO_STEP
+#undef RHO_BUDGET
+done:
+    work.rho_iters += iters - iters0;
+    if (mpz_cmp_ui(g,1) > 0 && mpz_cmp(g, n) < 0) mpz_set(factor, g);
+    mpz_clears(y,c,g,q,x,ys,t, NULL);
+}
+
+/* ---------- Pollard Rho (Brent), fixed-width kernel for n < 2^128 ---------- */
+
+/* Two 64-bit limbs, Montgomery form with R = 2^128.  No division and no
+ * allocation inside the walk; GMP is only touched on entry and exit. */
+
+#if GMP_LIMB_BITS == 64
+#define HAVE_RHO128 1
+
+typedef unsigned __int128 u128;
+
+typedef struct {
+    uint64_t n0, n1;   // modulus limbs
+    uint64_t ninv;     // -n^{-1} mod 2^64
+    u128 n;
+} mont128;
+
+static inline u128 mont128_mul(u128 a, u128 b, const mont128 *M) {
+    // CIOS: two rounds of (t += a*b_i; t = (t + m*n) / 2^64)
+    uint64_t a0 = (uint64_t)a, a1 = (uint64_t)(a >> 64);
+    uint64_t b0 = (uint64_t)b, b1 = (uint64_t)(b >> 64);
+    uint64_t t0, t1, t2, t3, m, C;
+    u128 t;
+
+    t = (u128)a0*b0;               t0 = (uint64_t)t; C = (uint64_t)(t >> 64);
+    t = (u128)a1*b0 + C;           t1 = (uint64_t)t; t2 = (uint64_t)(t >> 64);
+    m = t0 * M->ninv;
+    t = (u128)m*M->n0 + t0;        C = (uint64_t)(t >> 64);
+    t = (u128)m*M->n1 + t1 + C;    t0 = (uint64_t)t; C = (uint64_t)(t >> 64);
+    t = (u128)t2 + C;              t1 = (uint64_t)t; t2 = (uint64_t)(t >> 64);
+
+    t = (u128)a0*b1 + t0;          t0 = (uint64_t)t; C = (uint64_t)(t >> 64);
+    t = (u128)a1*b1 + t1 + C;      t1 = (uint64_t)t; C = (uint64_t)(t >> 64);
+    t = (u128)t2 + C;              t2 = (uint64_t)t; t3 = (uint64_t)(t >> 64);
+    m = t0 * M->ninv;
+    t = (u128)m*M->n0 + t0;        C = (uint64_t)(t >> 64);
+    t = (u128)m*M->n1 + t1 + C;    t0 = (uint64_t)t; C = (uint64_t)(t >> 64);
+    t = (u128)t2 + C;              t1 = (uint64_t)t; t2 = t3 + (uint64_t)(t >> 64);
+
+    u128 r = ((u128)t1 << 64) | t0;
+    if (t2 || r >= M->n) r -= M->n;
+    return r;
+}
+
+static inline u128 add128_mod(u128 a, u128 b, u128 n) {
+    u128 s = a + b;
+    if (s < a || s >= n) s -= n;
+    return s;
+}
+
+static inline u128 sub128_mod(u128 a, u128 b, u128 n) {
+    return a >= b ? a - b : a - b + n;
+}
+
+static inline int ctz128(u128 x) {
+    uint64_t lo = (uint64_t)x;
+    return lo ? __builtin_ctzll(lo) : 64 + __builtin_ctzll((uint64_t)(x >> 64));
+}
+
+static u128 gcd128(u128 a, u128 b) {
+    // binary (Stein) gcd
+    if (!a) return b;
+    if (!b) return a;
+    int sh = ctz128(a | b);
+    a >>= ctz128(a);
+    do {
+        b >>= ctz128(b);
+        if (a > b) { u128 t = a; a = b; b = t; }
+        b -= a;
+    } while (b);
+    return a << sh;
+}
+
+static u128 mpz_get_u128(const mpz_t x) {
+    return ((u128)mpz_getlimbn(x, 1) << 64) | mpz_getlimbn(x, 0);
+}
+
+static void mpz_set_u128(mpz_t r, u128 x) {
+    mpz_set_ui(r, (unsigned long)(x >> 64));
+    mpz_mul_2exp(r, r, 64);
+    mpz_add_ui(r, r, (unsigned long)x);
+}
+
+/* Montgomery context for odd n < 2^128. */
+static mont128 mont128_setup(const mpz_t n) {
+    mont128 M;
+    M.n0 = mpz_getlimbn(n, 0);
+    M.n1 = mpz_size(n) > 1 ? mpz_getlimbn(n, 1) : 0;
+    M.n  = ((u128)M.n1 << 64) | M.n0;
+    uint64_t inv = M.n0;                      // Newton: 5 steps reach 64 bits
+    for (int i=0; i<5; ++i) inv *= 2 - M.n0 * inv;
+    M.ninv = (uint64_t)0 - inv;
+    return M;
+}
+
+static void brent_rho128(mpz_t factor, const mpz_t n, gmp_randstate_t rng,
+                         uint64_t max_iters, const atomic_bool *stop, ck_slot *s)
+{
+    // Precondition: n odd, 1 < n < 2^128.  Same contract as brent_rho().
+    mpz_set_ui(factor, 1);
+    if (mpz_even_p(n)) { mpz_set_ui(factor, 2); return; }
+
+    mont128 M = mont128_setup(n);
+
+    // Random residues are taken directly in Montgomery form: x -> x^2 + c
+    // there is conjugate to a random polynomial of the same shape mod n.
+    mpz_t t; mpz_init(t);
+    mpz_urandomm(t, rng, n);
+    u128 y = mpz_get_u128(t);
+    do { mpz_urandomm(t, rng, n); } while (mpz_sgn(t) == 0);
+    u128 c = mpz_get_u128(t);
+    mpz_set_ui(t, 1); mpz_mul_2exp(t, t, 128); mpz_mod(t, t, n);
+    u128 one = mpz_get_u128(t);               // R mod n
+    mpz_clear(t);
+
+    const u128 nn = M.n;
+    const uint64_t m = 128;                   // steps per gcd
+    u128 x = y, ys = y, q = one, g = 1;
+    uint64_t r = 1, k = 0, iters = 0;
+    bool mid = s && s->valid;                 // resuming inside a round
+    if (mid) {
+        x = mpz_get_u128(s->x); y = mpz_get_u128(s->y);
+        q = mpz_get_u128(s->q); c = mpz_get_u128(s->c);
+        r = s->pos; k = s->k; iters = s->iters;
+    }
+    const uint64_t iters0 = iters;
+
+#define RHO128_STEP(v) ((v) = add128_mod(mont128_mul((v), (v), &M), c, nn))
+#define RHO128_BUDGET() do { \
+        if (++iters >= max_iters && max_iters) goto done; \
+        if (stop_requested(stop)) goto done; \
+        if (deadline_hit(iters)) goto done; \
+    } while (0)
+
+    while (g == 1) {
+        if (!mid) {
+            x = y;
+            for (uint64_t i=0; i<r; ++i) { RHO128_STEP(y); RHO128_BUDGET(); }
+            k = 0;
+        }
+        mid = false;
+        while (k < r && g == 1) {
+            ys = y;
+            uint64_t lim = (r - k < m) ? r - k : m;
+            for (uint64_t i=0; i<lim; ++i) {
+                RHO128_STEP(y);
+                q = mont128_mul(q, sub128_mod(x, y, nn), &M);
+                RHO128_BUDGET();
+            }
+            g = gcd128(q, nn);
+            work.rho_gcds++;
+            k += lim;
+            if (g == 1 && ck_due(s)) {
+                ck_begin(s);
+                mpz_set_u128(s->x, x); mpz_set_u128(s->y, y);
+                mpz_set_u128(s->q, q); mpz_set_u128(s->c, c);
+                s->pos = r; s->k = k; s->iters = iters;
+                ck_answer(s);
+            }
+        }
+        r *= 2;
+    }
+
+    if (g == nn) {
+        // backtrack from the last checkpoint one step at a time
+        do {
+            RHO128_STEP(ys);
+            g = gcd128(sub128_mod(x, ys, nn), nn);
+        } while (g == 1);
+    }
+#undef RHO128_STEP
+#undef RHO128_BUDGET
+done:
+    work.rho_iters += iters - iters0;
+    if (g > 1 && g < nn) mpz_set_u128(factor, g);
+}
+#else
+#define HAVE_RHO128 0
+#endif
+
+/* ---------- Pollard Rho (Brent), mpn Montgomery kernels for 3..16 limbs ---------- */
+
+/* Above two limbs the walk runs on fixed-size limb arrays in Montgomery form
+ * (R = 2^(N*GMP_NUMB_BITS)) with GMP's mpn layer: mpn_sqr / mpn_mul_n for
+ * the product and a word-by-word REDC (mpn_addmul_1), so a step costs two
+ * multiplications and no division.  The body is written once, inline, with
+ * N as a parameter; MONTN_KERNELS stamps out one function per limb count,
+ * so each copy sees N as a constant, and rho_kernel_for() picks one from
+ * n's size.  Only the gcd (once per 128 steps) and entry/exit touch mpz,
+ * through read-only views of the limb arrays. */
+
+#define MONTN_MIN 3
+#define MONTN_MAX 16            // 1024-bit n with 64-bit limbs
+#define MONTN_KERNELS(X) X(3) X(4) X(5) X(6) X(7) X(8) X(9) X(10) \
+                         X(11) X(12) X(13) X(14) X(15) X(16)
+
+typedef struct montn {
+    mp_size_t N;                // limbs of n (top limb nonzero)
+    mp_limb_t n[MONTN_MAX];
+    mp_limb_t ninv;             // -n^{-1} mod 2^GMP_NUMB_BITS
+    mp_limb_t one[MONTN_MAX];   // R mod n
+    mp_limb_t r2[MONTN_MAX];    // R^2 mod n, to enter Montgomery form
+    void (*mul)(mp_limb_t *r, const mp_limb_t *a, const mp_limb_t *b, const struct montn *M);
+} montn;
+
+/* Copy x < n into N limbs, zero-padded. */
+static void montn_load(mp_limb_t *r, const mpz_t x, mp_size_t N) {
+    mp_size_t k = (mp_size_t) mpz_size(x);
+    for (mp_size_t i=0; i<N; ++i) r[i] = i < k ? mpz_getlimbn(x, i) : 0;
+}
+
+/* r = t / R mod n for t < n*R (2N limbs, clobbered); r may not alias t. */
+static inline __attribute__((always_inline))
+void montn_redc_body(mp_limb_t *r, mp_limb_t *t, const montn *M, const mp_size_t N) {
+    for (mp_size_t i=0; i<N; ++i) {
+        // t[i] becomes 0; park the carry there, it belongs at t[i+N]
+        t[i] = mpn_addmul_1(t + i, M->n, N, t[i] * M->ninv);
+    }
+    mp_limb_t hi = mpn_add_n(r, t + N, t, N);
+    if (hi || mpn_cmp(r, M->n, N) >= 0) mpn_sub_n(r, r, M->n, N);
+}
+
+static inline __attribute__((always_inline))
+void montn_mul_body(mp_limb_t *r, const mp_limb_t *a, const mp_limb_t *b, const montn *M,
+                    const mp_size_t N) {
+    mp_limb_t t[2*MONTN_MAX];
+    if (a == b) mpn_sqr(t, a, N);
+    else mpn_mul_n(t, a, b, N);
+    montn_redc_body(r, t, M, N);
+}
+
+static inline __attribute__((always_inline))
+void montn_add_body(mp_limb_t *r, const mp_limb_t *a, const mp_limb_t *b, const montn *M,
+                    const mp_size_t N) {
+    mp_limb_t cy = mpn_add_n(r, a, b, N);
+    if (cy || mpn_cmp(r, M->n, N) >= 0) mpn_sub_n(r, r, M->n, N);
+}
+
+static inline __attribute__((always_inline))
+void montn_sub_body(mp_limb_t *r, const mp_limb_t *a, const mp_limb_t *b, const montn *M,
+                    const mp_size_t N) {
+    if (mpn_sub_n(r, a, b, N)) mpn_add_n(r, r, M->n, N);
+}
+
+#define MONTN_MUL_DEF(K) \
+    static void montn_mul##K(mp_limb_t *r, const mp_limb_t *a, const mp_limb_t *b, const montn *M) { \
+        montn_mul_body(r, a, b, M, K); \
+    }
+MONTN_KERNELS(MONTN_MUL_DEF)
+#undef MONTN_MUL_DEF
+
+#define MONTN_MUL_ENTRY(K) [K] = montn_mul##K,
+static void (*const montn_muls[MONTN_MAX+1])(mp_limb_t*, const mp_limb_t*, const mp_limb_t*, const montn*) = {
+    MONTN_KERNELS(MONTN_MUL_ENTRY)
+};
+#undef MONTN_MUL_ENTRY
+
+/* Montgomery context for odd n of MONTN_MIN..MONTN_MAX limbs. */
+static bool montn_setup(montn *M, const mpz_t n) {
+    mp_size_t N = (mp_size_t) mpz_size(n);
+    if (N < MONTN_MIN || N > MONTN_MAX || mpz_even_p(n)) return false;
+    M->N = N;
+    M->mul = montn_muls[N];
+    montn_load(M->n, n, N);
+    mp_limb_t inv = M->n[0];                  // Newton: each step doubles the bits
+    for (int i=0; i<6; ++i) inv *= 2 - M->n[0] * inv;
+    M->ninv = (mp_limb_t)0 - inv;
+    mpz_t t; mpz_init(t);
+    mpz_set_ui(t, 1); mpz_mul_2exp(t, t, (mp_bitcnt_t) N * GMP_NUMB_BITS); mpz_mod(t, t, n);
+    montn_load(M->one, t, N);
+    mpz_mul(t, t, t); mpz_mod(t, t, n);
+    montn_load(M->r2, t, N);
+    mpz_clear(t);
+    return true;
+}
+
+/* r = x R mod n for x < n. */
+static void montn_to(mp_limb_t *r, const mpz_t x, const montn *M) {
+    mp_limb_t a[MONTN_MAX];
+    montn_load(a, x, M->N);
+    M->mul(r, a, M->r2, M);
+}
+
+/* r = a / R mod n, as an mpz. */
+static void montn_from(mpz_t r, const mp_limb_t *a, const montn *M) {
+    mp_limb_t plain[MONTN_MAX] = {1}, t[MONTN_MAX];
+    M->mul(t, a, plain, M);
+    mpz_t v;
+    mpz_set(r, mpz_roinit_n(v, t, M->N));
+}
+
+static inline __attribute__((always_inline))
+void rho_mpn_body(mpz_t factor, const mpz_t n, gmp_randstate_t rng,
+                  uint64_t max_iters, const atomic_bool *stop, ck_slot *s, const mp_size_t N)
+{
+    // Precondition: n odd with N limbs.  Same contract as brent_rho().
+    mpz_set_ui(factor, 1);
+    if (mpz_even_p(n)) { mpz_set_ui(factor, 2); return; }
+
+    montn M;
+    montn_setup(&M, n);
+
+    // random residues taken directly in Montgomery form, as in brent_rho128()
+    mp_limb_t x[MONTN_MAX], y[MONTN_MAX], ys[MONTN_MAX], q[MONTN_MAX], c[MONTN_MAX], d[MONTN_MAX];
+    mpz_t g, v; mpz_init2(g, (mp_bitcnt_t) N * GMP_NUMB_BITS);
+    mpz_urandomm(g, rng, n);
+    montn_load(y, g, N);
+    do { mpz_urandomm(g, rng, n); } while (mpz_sgn(g) == 0);
+    montn_load(c, g, N);
+    mpn_copyi(q, M.one, N);
+    mpn_copyi(x, y, N);
+
+    const uint64_t m = 128;                   // steps per gcd
+    uint64_t r = 1, k = 0, iters = 0;
+    bool mid = s && s->valid;                 // resuming inside a round
+    if (mid) {
+        montn_load(x, s->x, N); montn_load(y, s->y, N);
+        montn_load(q, s->q, N); montn_load(c, s->c, N);
+        r = s->pos; k = s->k; iters = s->iters;
+    }
+    const uint64_t iters0 = iters;
+    mpz_set_ui(g, 1);
+
+#define RHON_STEP(w) do { montn_mul_body(w, w, w, &M, N); montn_add_body(w, w, c, &M, N); } while (0)
+#define RHON_BUDGET() do { \
+        if (++iters >= max_iters && max_iters) goto done; \
+        if (stop_requested(stop)) goto done; \
+        if (deadline_hit(iters)) goto done; \
+    } while (0)
+
+    while (mpz_cmp_ui(g, 1) == 0) {
+        if (!mid) {
+            mpn_copyi(x, y, N);
+            for (uint64_t i=0; i<r; ++i) { RHON_STEP(y); RHON_BUDGET(); }
+            k = 0;
+        }
+        mid = false;
+        while (k < r && mpz_cmp_ui(g, 1) == 0) {
+            mpn_copyi(ys, y, N);
+            uint64_t lim = (r - k < m) ? r - k : m;
+            for (uint64_t i=0; i<lim; ++i) {
+                RHON_STEP(y);
+                montn_sub_body(d, x, y, &M, N);
+                montn_mul_body(q, q, d, &M, N);
+                RHON_BUDGET();
+            }
+            gcd_mpz(g, mpz_roinit_n(v, q, N), n);
+            work.rho_gcds++;
+            k += lim;
+            if (mpz_cmp_ui(g, 1) == 0 && ck_due(s)) {
+                ck_begin(s);
+                mpz_set(s->x, mpz_roinit_n(v, x, N)); mpz_set(s->y, mpz_roinit_n(v, y, N));
+                mpz_set(s->q, mpz_roinit_n(v, q, N)); mpz_set(s->c, mpz_roinit_n(v, c, N));
+                s->pos = r; s->k = k; s->iters = iters;
+                ck_answer(s);
+            }
+        }
+        r *= 2;
+    }
+
+    if (mpz_cmp(g, n) == 0) {
+        // backtrack from the last batch one step at a time
+        do {
+            RHON_STEP(ys);
+            montn_sub_body(d, x, ys, &M, N);
+            gcd_mpz(g, mpz_roinit_n(v, d, N), n);
+        } while (mpz_cmp_ui(g, 1) == 0);
+    }
+#undef RHON_STEP
+#undef RHON_BUDGET
+done:
+    work.rho_iters += iters - iters0;
+    if (mpz_cmp_ui(g, 1) > 0 && mpz_cmp(g, n) < 0) mpz_set(factor, g);
+    mpz_clear(g);
+}
+
+#define RHO_MPN_DEF(K) \
+    static void brent_rho_mpn##K(mpz_t factor, const mpz_t n, gmp_randstate_t rng, \
+                                 uint64_t max_iters, const atomic_bool *stop, ck_slot *s) { \
+        rho_mpn_body(factor, n, rng, max_iters, stop, s, K); \
+    }
+MONTN_KERNELS(RHO_MPN_DEF)
+#undef RHO_MPN_DEF
+
+typedef void (*rho_kernel)(mpz_t factor, const mpz_t n, gmp_randstate_t rng,
+                           uint64_t max_iters, const atomic_bool *stop, ck_slot *s);
+
+#define RHO_MPN_ENTRY(K) [K] = brent_rho_mpn##K,
+static const rho_kernel rho_mpn_kernels[MONTN_MAX+1] = { MONTN_KERNELS(RHO_MPN_ENTRY) };
+#undef RHO_MPN_ENTRY
+
+/* The walk for odd n: two-limb words below 2^128, a limb-count kernel up to
+ * MONTN_MAX limbs, mpz above. */
+static rho_kernel rho_kernel_for(const mpz_t n) {
+    if (mpz_even_p(n)) return brent_rho;
+#if HAVE_RHO128
+    if (bits_of(n) <= 128) return brent_rho128;
+#endif
+    size_t N = mpz_size(n);
+    if (N >= MONTN_MIN && N <= MONTN_MAX) return rho_mpn_kernels[N];
+    return brent_rho;
+}
+
+/* ---------- primality: BPSW, deterministic below 2^64, memoized ---------- */
+
+/* n < 2^64 gets a deterministic Miller-Rabin in 64-bit Montgomery form,
+ * n < 2^128 a BPSW (strong base 2 + strong Lucas, Selfridge parameters)
+ * on two-limb Montgomery words, anything larger the same BPSW on mpz
+ * scratch kept per thread.  Results above 2^64 are remembered in a small
+ * per-thread table, so a number classified in main() is not tested again
+ * when factor_rec() reaches it. */
+
+#define PRIME_MEMO 8            // remembered classifications per thread
+
+#if HAVE_RHO128
+typedef struct {
+    uint64_t n;
+    uint64_t ninv;     // n * ninv == 1 mod 2^64
+    uint64_t one;      // R mod n, R = 2^64
+} mont64;
+
+static mont64 mont64_setup(uint64_t n) {
+    mont64 M; M.n = n;
+    uint64_t inv = n;                         // Newton: 5 steps reach 64 bits
+    for (int i=0; i<5; ++i) inv *= 2 - n * inv;
+    M.ninv = inv;
+    M.one = (uint64_t)(((u128)1 << 64) % n);
+    return M;
+}
+
+static inline uint64_t mont64_mul(uint64_t a, uint64_t b, const mont64 *M) {
+    // REDC as hi(t) - hi(m*n) with m = lo(t) * n^{-1}; inputs and result < n
+    u128 t = (u128)a * b;
+    uint64_t m = (uint64_t)t * M->ninv;
+    uint64_t mnh = (uint64_t)(((u128)m * M->n) >> 64);
+    uint64_t th = (uint64_t)(t >> 64);
+    return th >= mnh ? th - mnh : th - mnh + M->n;
+}
+
+static inline uint64_t mont64_from(uint64_t a, const mont64 *M) {
+    return (uint64_t)(((u128)(a % M->n) << 64) % M->n);
+}
+
+static inline uint64_t add64_mod(uint64_t a, uint64_t b, uint64_t n) {
+    uint64_t s = a + b;
+    return (s < a || s >= n) ? s - n : s;
+}
+
+static inline uint64_t sub64_mod(uint64_t a, uint64_t b, uint64_t n) {
+    return a >= b ? a - b : a - b + n;
+}
+
+/* Deterministic Miller-Rabin for n < 2^64: no composite below 2^64 is a
+ * strong pseudoprime to all seven of these bases. */
+static bool is_prime_u64(uint64_t n) {
+    if (n < 2) return false;
+    for (size_t i=0; i<small_primes_len; ++i) {
+        if (n == small_primes[i]) return true;
+        if (n % small_primes[i] == 0) return false;
+    }
+    if (n < 151ull * 151ull) return true;
+
+    static const uint64_t bases[] = { 2, 325, 9375, 28178, 450775, 9780504, 1795265022 };
+    mont64 M = mont64_setup(n);
+    const uint64_t mone = n - M.one;          // -1 in Montgomery form
+    uint64_t d = n - 1;
+    int s = __builtin_ctzll(d);
+    d >>= s;
+    for (size_t i=0; i<sizeof(bases)/sizeof(bases[0]); ++i) {
+        uint64_t a = bases[i] % n;
+        if (a == 0) continue;
+        uint64_t x = M.one, b = mont64_from(a, &M);
+        for (uint64_t e = d; e; e >>= 1) {
+            if (e & 1) x = mont64_mul(x, b, &M);
+            b = mont64_mul(b, b, &M);
+        }
+        if (x == M.one || x == mone) continue;
+        int r = 1;
+        for (; r < s; ++r) {
+            x = mont64_mul(x, x, &M);
+            if (x == mone) break;
+        }
+        if (r == s) return false;
+    }
+    return true;
+}
+
+/* Jacobi symbol (a/m), m odd */
+static int jacobi_u64(uint64_t a, uint64_t m) {
+    int t = 1;
+    a %= m;
+    while (a) {
+        int z = __builtin_ctzll(a);
+        a >>= z;
+        if ((z & 1) && ((m & 7) == 3 || (m & 7) == 5)) t = -t;
+        if ((a & 3) == 3 && (m & 3) == 3) t = -t;
+        uint64_t r = m % a; m = a; a = r;
+    }
+    return m == 1 ? t : 0;
+}
+
+/* (D/n) for a small odd D and odd n < 2^128, by one reciprocity step. */
+static int jacobi_small128(int64_t D, u128 n) {
+    uint64_t a = D < 0 ? (uint64_t) -D : (uint64_t) D;
+    int t = (D < 0 && (n & 3) == 3) ? -1 : 1;          // (-1/n)
+    if ((a & 3) == 3 && (n & 3) == 3) t = -t;          // a odd: (a/n) = ±(n/a)
+    return t * jacobi_u64((uint64_t)(n % a), a);
+}
+
+static inline u128 half128_mod(u128 x, u128 n) {
+    // x/2 mod odd n, without the overflow of x + n
+    return (x & 1) ? (x >> 1) + (n >> 1) + 1 : x >> 1;
+}
+
+/* BPSW for odd n < 2^128 with no factor below 151. */
+static bool bpsw128(u128 n) {
+    mont128 M;
+    M.n = n; M.n0 = (uint64_t) n; M.n1 = (uint64_t)(n >> 64);
+    uint64_t inv = M.n0;
+    for (int i=0; i<5; ++i) inv *= 2 - M.n0 * inv;
+    M.ninv = (uint64_t)0 - inv;
+    const u128 one = ((u128)0 - n) % n;                // R mod n
+    u128 r2 = one;                                     // R^2 mod n by doubling
+    for (int i=0; i<128; ++i) r2 = add128_mod(r2, r2, n);
+#define TO_MONT128(v) mont128_mul((u128)(v) % n, r2, &M)
+
+    // strong probable prime to base 2
+    const u128 mone = n - one;
+    u128 d = n - 1;
+    int s = ctz128(d);
+    d >>= s;
+    u128 x = one, b = add128_mod(one, one, n);
+    for (u128 e = d; e; e >>= 1) {
+        if (e & 1) x = mont128_mul(x, b, &M);
+        b = mont128_mul(b, b, &M);
+    }
+    if (x != one && x != mone) {
+        int r = 1;
+        for (; r < s; ++r) {
+            x = mont128_mul(x, x, &M);
+            if (x == mone) break;
+        }
+        if (r == s) return false;
+    }
+
+    // Selfridge: first D in 5, -7, 9, -11, ... with (D/n) = -1; P = 1, Q = (1-D)/4
+    int64_t D = 5;
+    for (int tries = 0; ; ++tries) {
+        int j = jacobi_small128(D, n);
+        if (j == -1) break;
+        if (j == 0) return false;                      // |D| < 151^2 <= n shares a factor
+        if (tries == 16) {                             // squares never reach j = -1
+            mpz_t t; mpz_init(t);
+            mpz_set_u128(t, n);
+            bool sq = mpz_perfect_square_p(t);
+            mpz_clear(t);
+            if (sq) return false;
+        }
+        D = D > 0 ? -(D + 2) : -D + 2;
+    }
+    const int64_t Q = (1 - D) / 4;
+    const u128 Dm = D > 0 ? TO_MONT128(D) : sub128_mod(0, TO_MONT128(-D), n);
+    const u128 Qm = Q > 0 ? TO_MONT128(Q) : sub128_mod(0, TO_MONT128(-Q), n);
+#undef TO_MONT128
+
+    // strong Lucas: U_d, V_d, Q^d for n + 1 = d * 2^s (n + 1 cannot overflow: 3 | 2^128 - 1)
+    d = n + 1;
+    s = ctz128(d);
+    d >>= s;
+    u128 U = one, V = one, Qk = Qm;
+    int top = 127 - (d >> 64 ? __builtin_clzll((uint64_t)(d >> 64)) : 64 + __builtin_clzll((uint64_t) d));
+    for (int i = top - 1; i >= 0; --i) {
+        U = mont128_mul(U, V, &M);
+        V = sub128_mod(mont128_mul(V, V, &M), add128_mod(Qk, Qk, n), n);
+        Qk = mont128_mul(Qk, Qk, &M);
+        if ((d >> i) & 1) {
+            u128 U1 = half128_mod(add128_mod(U, V, n), n);
+            V = half128_mod(add128_mod(mont128_mul(Dm, U, &M), V, n), n);
+            U = U1;
+            Qk = mont128_mul(Qk, Qm, &M);
+        }
+    }
+    if (U == 0 || V == 0) return true;
+    for (int r = 1; r < s; ++r) {
+        V = sub128_mod(mont128_mul(V, V, &M), add128_mod(Qk, Qk, n), n);
+        if (V == 0) return true;
+        Qk = mont128_mul(Qk, Qk, &M);
+    }
+    return false;
+}
+#endif
+
+typedef struct {
+    bool init;
+    mpz_t d, x, U, V, Qk, t;
+    mpz_t memo_n[PRIME_MEMO];
+    bool memo_isp[PRIME_MEMO];
+    unsigned memo_len, memo_next;
+} prime_scratch;
+
+static _Thread_local prime_scratch prime_tls;
+
+static prime_scratch *prime_scratch_get(void) {
+    prime_scratch *S = &prime_tls;
+    if (!S->init) {
+        mpz_inits(S->d, S->x, S->U, S->V, S->Qk, S->t, NULL);
+        for (unsigned i=0; i<PRIME_MEMO; ++i) mpz_init(S->memo_n[i]);
+        S->init = true;
+    }
+    return S;
+}
+
+/* Release this thread's scratch (threads that classified anything call it on exit). */
+static void prime_scratch_free(void) {
+    prime_scratch *S = &prime_tls;
+    if (!S->init) return;
+    mpz_clears(S->d, S->x, S->U, S->V, S->Qk, S->t, NULL);
+    for (unsigned i=0; i<PRIME_MEMO; ++i) mpz_clear(S->memo_n[i]);
+    memset(S, 0, sizeof *S);
+}
+
+/* x/2 mod odd n, in place */
+static void half_mod(mpz_t x, const mpz_t n) {
+    if (mpz_odd_p(x)) mpz_add(x, x, n);
+    mpz_tdiv_q_2exp(x, x, 1);
+}
+
+/* BPSW for odd n with no factor below 151, on S's scratch. */
+static bool bpsw_mpz(const mpz_t n, prime_scratch *S) {
+    // strong probable prime to base 2
+    mpz_sub_ui(S->d, n, 1);
+    mp_bitcnt_t s = mpz_scan1(S->d, 0);
+    mpz_tdiv_q_2exp(S->d, S->d, s);
+    mpz_set_ui(S->x, 2);
+    mpz_powm(S->x, S->x, S->d, n);
+    mpz_sub_ui(S->t, n, 1);                            // t = n - 1
+    if (mpz_cmp_ui(S->x, 1) != 0 && mpz_cmp(S->x, S->t) != 0) {
+        mp_bitcnt_t r = 1;
+        for (; r < s; ++r) {
+            mpz_powm_ui(S->x, S->x, 2, n);
+            if (mpz_cmp(S->x, S->t) == 0) break;
+        }
+        if (r == s) return false;
+    }
+
+    // Selfridge parameters, then the strong Lucas test as in bpsw128()
+    long D = 5;
+    for (int tries = 0; ; ++tries) {
+        mpz_set_si(S->t, D);
+        int j = mpz_jacobi(S->t, n);
+        if (j == -1) break;
+        if (j == 0) return false;
+        if (tries == 16 && mpz_perfect_square_p(n)) return false;
+        D = D > 0 ? -(D + 2) : -D + 2;
+    }
+    const long Q = (1 - D) / 4;
+    mpz_add_ui(S->d, n, 1);
+    s = mpz_scan1(S->d, 0);
+    mpz_tdiv_q_2exp(S->d, S->d, s);
+    mpz_set_ui(S->U, 1);
+    mpz_set_ui(S->V, 1);
+    mpz_set_si(S->Qk, Q);
+    mpz_mod(S->Qk, S->Qk, n);
+    for (mp_bitcnt_t i = mpz_sizeinbase(S->d, 2) - 1; i-- > 0; ) {
+        mpz_mul(S->U, S->U, S->V);            mpz_mod(S->U, S->U, n);
+        mpz_mul(S->V, S->V, S->V);            mpz_submul_ui(S->V, S->Qk, 2); mpz_mod(S->V, S->V, n);
+        mpz_mul(S->Qk, S->Qk, S->Qk);         mpz_mod(S->Qk, S->Qk, n);
+        if (mpz_tstbit(S->d, i)) {
+            mpz_mul_si(S->t, S->U, D);         // t = D*U + V, U = U + V, both halved
+            mpz_add(S->t, S->t, S->V);         mpz_mod(S->t, S->t, n);
+            mpz_add(S->U, S->U, S->V);         mpz_mod(S->U, S->U, n);
+            half_mod(S->U, n);
+            half_mod(S->t, n);
+            mpz_swap(S->V, S->t);
+            mpz_mul_si(S->Qk, S->Qk, Q);       mpz_mod(S->Qk, S->Qk, n);
+        }
+    }
+    if (mpz_sgn(S->U) == 0 || mpz_sgn(S->V) == 0) return true;
+    for (mp_bitcnt_t r = 1; r < s; ++r) {
+        mpz_mul(S->V, S->V, S->V);            mpz_submul_ui(S->V, S->Qk, 2); mpz_mod(S->V, S->V, n);
+        if (mpz_sgn(S->V) == 0) return true;
+        mpz_mul(S->Qk, S->Qk, S->Qk);         mpz_mod(S->Qk, S->Qk, n);
+    }
+    return false;
+}
+
+static bool is_probable_prime(const mpz_t n) {
+    if (mpz_cmp_ui(n, 2) < 0) return false;
+#if HAVE_RHO128
+    if (mpz_size(n) == 1) return is_prime_u64(mpz_getlimbn(n, 0));
+#endif
+    for (size_t i=0; i<small_primes_len; ++i) {
+        if (mpz_cmp_ui(n, small_primes[i]) == 0) return true;
+        if (mpz_divisible_ui_p(n, small_primes[i])) return false;
+    }
+    if (mpz_cmp_ui(n, 151ul * 151ul) < 0) return true;
+
+    prime_scratch *S = prime_scratch_get();
+    for (unsigned i=0; i<S->memo_len; ++i)
+        if (mpz_cmp(S->memo_n[i], n) == 0) return S->memo_isp[i];
+
+    bool isp;
+#if HAVE_RHO128
+    if (mpz_size(n) == 2) isp = bpsw128(mpz_get_u128(n));
+    else
+#endif
+    isp = bpsw_mpz(n, S);
+
+    unsigned k = S->memo_next;
+    S->memo_next = (k + 1) % PRIME_MEMO;
+    if (S->memo_len < PRIME_MEMO) S->memo_len++;
+    mpz_set(S->memo_n[k], n);
+    S->memo_isp[k] = isp;
+    return isp;
+}
+
+/* ---------- P-1 stage 1 (sieved prime powers, cached exponent plan) ---------- */
+
+/* The exponent E = prod_{p<=B} p^floor(log_p B) is built once per B: prime
+ * powers from the segmented sieve are packed into 64-bit words, and each run
+ * of P1_CHUNK_WORDS words is multiplied up with a product tree.  Stage 1 is
+ * then one mpz_powm per chunk, with a gcd after each so a factor is caught
+ * early.  The plan grows only as far as its users have got, one sieve span
+ * at a time under its own lock, so a deadline also stops the build of a
+ * large B.  Plans are kept for the life of the process.
+ *
+ * A chunk is about 128 x 64 = 8k bits of exponent, so one powm is ~8k
+ * squarings: ~3 ms at 1024-bit n, ~20 ms at 2048, ~45 ms at 4096.  That is
+ * the spacing of the deadline and checkpoint checks; the gcd per chunk
+ * costs well under 1% of it. */
+
+#define P1_CHUNK_WORDS 128u
+
+typedef struct {
+    unsigned long B;
+    uint64_t *words;
+    size_t len, cap;
+    uint64_t cur;
+} p1_pack;
+
+typedef struct p1_plan {
+    unsigned long B;
+    pthread_mutex_t lock;   // guards the rest: the plan grows as chunks are asked for
+    p1_pack pk;             // packed prime powers so far
+    uint64_t sieved;        // primes <= sieved are in pk (complete once == B)
+    mpz_t *E;               // E[c] = product of chunk c's words, 0 until built
+    size_t nE;              // E slots initialised
+    struct p1_plan *next;
+} p1_plan;
+
+#define P1_SIEVE_SPAN (1u << 18)    // numbers sieved per extension of a plan
+
+static p1_plan *p1_plans = NULL;
+static pthread_mutex_t p1_plans_lock = PTHREAD_MUTEX_INITIALIZER;   // guards the list only
+
+static int p1_pack_flush(p1_pack *pk) {
+    if (pk->len == pk->cap) {
+        size_t ncap = pk->cap ? pk->cap*2 : 1024;
+        uint64_t *nw = (uint64_t*)realloc(pk->words, ncap*sizeof(uint64_t));
+        if (!nw) return 1;
+        pk->words = nw; pk->cap = ncap;
+    }
+    pk->words[pk->len++] = pk->cur;
+    pk->cur = 1;
+    return 0;
+}
+
+static int p1_pack_prime(uint64_t p, void *ctx) {
+    p1_pack *pk = (p1_pack*)ctx;
+    uint64_t pe = p;
+    while (pe <= pk->B / p) pe *= p;        // highest power of p <= B
+    if (pk->cur > UINT64_MAX / pe && p1_pack_flush(pk)) return 1;
+    pk->cur *= pe;
+    return 0;
+}
+
+static void prod_tree_words(mpz_t r, const uint64_t *w, size_t n) {
+    if (n <= 4) {
+        mpz_set_ui(r, 1);
+        for (size_t i=0; i<n; ++i) mpz_mul_ui(r, r, (unsigned long) w[i]);
+        return;
+    }
+    mpz_t t; mpz_init(t);
+    prod_tree_words(r, w, n/2);
+    prod_tree_words(t, w + n/2, n - n/2);
+    mpz_mul(r, r, t);
+    mpz_clear(t);
+}
+
+/* The (possibly still empty) plan for B. */
+static p1_plan *p1_plan_get(unsigned long B) {
+    pthread_mutex_lock(&p1_plans_lock);
+    p1_plan *pl = p1_plans;
+    while (pl && pl->B != B) pl = pl->next;
+    if (!pl && (pl = (p1_plan*)calloc(1, sizeof(p1_plan)))) {
+        pl->B = B;
+        pthread_mutex_init(&pl->lock, NULL);
+        pl->pk = (p1_pack){ .B = B, .cur = 1 };
+        pl->sieved = 1;
+        pl->next = p1_plans;
+        p1_plans = pl;
+    }
+    pthread_mutex_unlock(&p1_plans_lock);
+    return pl;
+}
+
+/* Copy chunk c of pl to w[0..*cnt) and, unless E is NULL, its product to E,
+ * sieving further first if needed (pl->lock held for one span at a time).
+ * Returns 1, 0 past the last chunk, or -1 if the deadline passed first or
+ * memory ran out. */
+static int p1_plan_chunk(p1_plan *pl, size_t c, mpz_t E, uint64_t *w, size_t *cnt) {
+    const size_t lo = c * P1_CHUNK_WORDS;
+    pthread_mutex_lock(&pl->lock);
+    int rc = 1;
+    while (pl->pk.len < lo + P1_CHUNK_WORDS && pl->sieved < pl->B) {
+        if (deadline_passed()) { rc = -1; break; }
+        uint64_t hi = pl->B - pl->sieved > P1_SIEVE_SPAN ? pl->sieved + P1_SIEVE_SPAN : pl->B;
+        if (sieve_range(pl->sieved + 1, hi, p1_pack_prime, &pl->pk)) { rc = -1; break; }
+        pl->sieved = hi;
+        if (hi == pl->B && pl->pk.cur > 1 && p1_pack_flush(&pl->pk)) { rc = -1; break; }
+    }
+    if (rc > 0 && lo >= pl->pk.len) rc = 0;
+    if (rc > 0) {
+        *cnt = pl->pk.len - lo < P1_CHUNK_WORDS ? pl->pk.len - lo : P1_CHUNK_WORDS;
+        memcpy(w, pl->pk.words + lo, *cnt * sizeof *w);
+    }
+    if (rc > 0 && E) {
+        if (c >= pl->nE) {
+            size_t n = c + 1 > 2*pl->nE ? c + 1 : 2*pl->nE;
+            mpz_t *ne = (mpz_t*)realloc(pl->E, n * sizeof(mpz_t));
+            if (ne) {
+                for (size_t i=pl->nE; i<n; ++i) mpz_init(ne[i]);
+                pl->E = ne; pl->nE = n;
+            }
+        }
+        if (c >= pl->nE) rc = -1;
+        else {
+            if (!mpz_sgn(pl->E[c])) prod_tree_words(pl->E[c], w, *cnt);
+            mpz_set(E, pl->E[c]);
+        }
+    }
+    pthread_mutex_unlock(&pl->lock);
+    return rc;
+}
+
+static void p1_plans_free(void) {
+    pthread_mutex_lock(&p1_plans_lock);
+    while (p1_plans) {
+        p1_plan *pl = p1_plans;
+        p1_plans = pl->next;
+        for (size_t c=0; c<pl->nE; ++c) mpz_clear(pl->E[c]);
+        free(pl->E);
+        free(pl->pk.words);
+        pthread_mutex_destroy(&pl->lock);
+        free(pl);
+    }
+    pthread_mutex_unlock(&p1_plans_lock);
+}
+
+/* On a miss, residue holds 2^E mod n for stage 2 (residue may be NULL).  A
+ * valid slot for the same B resumes at chunk s->pos from residue s->x. */
+static void pollard_p1_stage1(mpz_t factor, mpz_t residue, const mpz_t n, unsigned long B,
+                              ck_slot *s) {
+    mpz_set_ui(factor, 1);
+    if (residue) mpz_set_ui(residue, 1);
+    if (B < 5) return;
+    p1_plan *pl = p1_plan_get(B);
+    if (!pl) return;
+
+    uint64_t w[P1_CHUNK_WORDS];
+    size_t cnt;
+    mpz_t a, prev, d, t, E;
+    mpz_inits(a,prev,d,t,E,NULL);
+    mpz_set_ui(a, 2);
+    mpz_set_ui(d, 1);
+    size_t c0 = 0;
+    if (s && s->valid && s->id == B) {
+        c0 = (size_t) s->pos;
+        mpz_set(a, s->x);
+    }
+
+    for (size_t c=c0; ; ++c) {
+        if (deadline_passed()) break;       // one chunk: ~8k squarings mod n
+        if (p1_plan_chunk(pl, c, E, w, &cnt) <= 0) break;
+        mpz_set(prev, a);
+        mpz_powm(a, a, E, n);
+
+        // d = gcd(a-1, n) once per chunk
+        mpz_sub_ui(t, a, 1);
+        mpz_gcd(d, t, n);
+        work.p1_gcds++;
+        if (mpz_cmp_ui(d,1) == 0) {
+            if (ck_due(s)) {
+                ck_begin(s);
+                s->id = B; s->pos = c + 1;
+                mpz_set(s->x, a);
+                ck_answer(s);
+            }
+            continue;
+        }
+        if (mpz_cmp(d, n) == 0) {
+            // every factor went smooth inside this chunk: replay it word by word
+            mpz_set(a, prev);
+            for (size_t i=0; i<cnt; ++i) {
+                mpz_powm_ui(a, a, (unsigned long) w[i], n);
+                mpz_sub_ui(t, a, 1);
+                mpz_gcd(d, t, n);
+                work.p1_gcds++;
+                if (mpz_cmp_ui(d,1) != 0) break;
+            }
+        }
+        break;
+    }
+
+    if (mpz_cmp_ui(d,1)>0 && mpz_cmp(d, n)<0) mpz_set(factor, d);
+    if (residue) mpz_set(residue, a);
+    mpz_clears(a,prev,d,t,E,NULL);
+}
+
+/* ---------- P-1 stage 2 (prime continuation over a gap table) ---------- */
+
+/* With b = 2^E from stage 1, walk the primes q in (B1, B2]: x = b^q is
+ * advanced by x *= b^(q - q_prev) using a table of b^(2k) for the small even
+ * prime gaps, and (x - 1) is multiplied into acc.  gcd(acc, n) runs once per
+ * P1_S2_BLOCK primes; a block that collapses to n is replayed prime by prime.
+ * n of MONTN_MIN..MONTN_MAX limbs keeps x, acc and the table as Montgomery
+ * limb arrays (montn); gcd(acc R, n) = gcd(acc, n), so only the checkpoint
+ * converts back. */
+
+#define P1_S2_BLOCK 2048u
+#define P1_S2_GAPS  512u        // b^(2k) for k < 512: gaps up to 1022
+
+typedef struct {
+    mpz_srcptr n, b;
+    mpz_t *bpow;                // bpow[k] = b^(2k) mod n
+    mpz_t x, xblk, acc, t, g;
+    uint64_t q;                 // last prime visited (0 before the first)
+    uint64_t gaps[P1_S2_BLOCK]; // gaps taken in the current block
+    size_t ngap;
+    ck_slot *ck;
+    const montn *M;             // NULL => the mpz fields above
+    mp_limb_t *bw;              // bw + k*N = b^(2k) R mod n
+    mp_limb_t xw[MONTN_MAX], xblkw[MONTN_MAX], accw[MONTN_MAX], tw[MONTN_MAX];
+} p1s2_ctx;
+
+static void p1s2_advance(p1s2_ctx *c, mpz_t x, uint64_t gap) {
+    if (!(gap & 1) && gap/2 < P1_S2_GAPS) {
+        mpz_mul(x, x, c->bpow[gap/2]);
+        mpz_mod(x, x, c->n);
+    } else {
+        mpz_powm_ui(c->t, c->b, (unsigned long) gap, c->n);
+        mpz_mul(x, x, c->t);
+        mpz_mod(x, x, c->n);
+    }
+}
+
+static void p1s2_advance_w(p1s2_ctx *c, mp_limb_t *x, uint64_t gap) {
+    const montn *M = c->M;
+    if (!(gap & 1) && gap/2 < P1_S2_GAPS) {
+        M->mul(x, x, c->bw + (gap/2) * M->N, M);
+    } else {
+        mpz_powm_ui(c->t, c->b, (unsigned long) gap, c->n);
+        montn_to(c->tw, c->t, M);
+        M->mul(x, x, c->tw, M);
+    }
+}
+
+/* gcd over the finished block; 1 => keep going, else g holds the result. */
+static int p1s2_check(p1s2_ctx *c) {
+    const montn *M = c->M;
+    mpz_t v;
+    mpz_gcd(c->g, M ? mpz_roinit_n(v, c->accw, M->N) : c->acc, c->n);
+    work.p1_gcds++;
+    if (mpz_cmp_ui(c->g, 1) != 0 && mpz_cmp(c->g, c->n) == 0) {
+        if (M) mpn_copyi(c->xw, c->xblkw, M->N);
+        else mpz_set(c->x, c->xblk);
+        for (size_t i=0; i<c->ngap; ++i) {
+            if (M) {
+                p1s2_advance_w(c, c->xw, c->gaps[i]);
+                montn_sub_body(c->tw, c->xw, M->one, M, M->N);
+                mpz_gcd(c->g, mpz_roinit_n(v, c->tw, M->N), c->n);
+            } else {
+                p1s2_advance(c, c->x, c->gaps[i]);
+                mpz_sub_ui(c->t, c->x, 1);
+                mpz_gcd(c->g, c->t, c->n);
+            }
+            if (mpz_cmp_ui(c->g, 1) != 0) break;
+        }
+    }
+    c->ngap = 0;
+    if (M) mpn_copyi(c->xblkw, c->xw, M->N);
+    else mpz_set(c->xblk, c->x);
+    return mpz_cmp_ui(c->g, 1) != 0;
+}
+
+static int p1s2_prime(uint64_t q, void *ctx) {
+    p1s2_ctx *c = (p1s2_ctx*)ctx;
+    uint64_t gap = q - c->q;
+    c->q = q;
+    work.p1s2_primes++;
+    const montn *M = c->M;
+    if (M) {
+        p1s2_advance_w(c, c->xw, gap);
+        montn_sub_body(c->tw, c->xw, M->one, M, M->N);
+        M->mul(c->accw, c->accw, c->tw, M);
+    } else {
+        p1s2_advance(c, c->x, gap);
+        mpz_sub_ui(c->t, c->x, 1);
+        mpz_mul(c->acc, c->acc, c->t);
+        mpz_mod(c->acc, c->acc, c->n);
+    }
+    c->gaps[c->ngap++] = gap;
+    if (c->ngap < P1_S2_BLOCK) return 0;
+    if (p1s2_check(c)) return 1;
+    if (deadline_passed()) return 1;        // g is 1: no factor
+    if (ck_due(c->ck)) {
+        ck_begin(c->ck);
+        c->ck->pos = c->q;
+        if (M) montn_from(c->ck->x, c->xw, M);
+        else mpz_set(c->ck->x, c->x);
+        mpz_set(c->ck->y, c->b);
+        ck_answer(c->ck);
+    }
+    return 0;
+}
+
+/* A valid slot resumes after prime s->pos with x = s->x (its base is s->y). */
+static void pollard_p1_stage2(mpz_t factor, const mpz_t b, const mpz_t n,
+                              unsigned long B1, uint64_t B2, ck_slot *s) {
+    mpz_set_ui(factor, 1);
+    if (B2 <= B1 || mpz_cmp_ui(b, 1) <= 0) return;
+
+    p1s2_ctx c = { .n = n, .b = b, .q = 0, .ngap = 0, .ck = s };
+    mpz_inits(c.x, c.xblk, c.acc, c.t, c.g, NULL);
+    mpz_set_ui(c.x, 1);                 // b^0; the first "gap" is q0 itself
+    uint64_t lo = B1;
+    if (s && s->valid && s->pos > B1) {
+        c.q = lo = s->pos;
+        mpz_set(c.x, s->x);
+    }
+    mpz_set(c.xblk, c.x);
+    mpz_set_ui(c.acc, 1);
+    mpz_set_ui(c.g, 1);
+
+    // b^(2k) table: Montgomery limbs when n fits a kernel, else mpz
+    montn M;
+    mpz_powm_ui(c.t, b, 2, n);
+    if (montn_setup(&M, n) && (c.bw = (mp_limb_t*)malloc(P1_S2_GAPS * M.N * sizeof(mp_limb_t)))) {
+        mp_size_t N = M.N;
+        c.M = &M;
+        montn_to(c.tw, c.t, &M);
+        mpn_copyi(c.bw, M.one, N);
+        for (size_t k=1; k<P1_S2_GAPS; ++k) M.mul(c.bw + k*N, c.bw + (k-1)*N, c.tw, &M);
+        montn_to(c.xw, c.x, &M);
+        mpn_copyi(c.xblkw, c.xw, N);
+        mpn_copyi(c.accw, M.one, N);
+    } else if ((c.bpow = (mpz_t*)malloc(P1_S2_GAPS * sizeof(mpz_t)))) {
+        mpz_init_set_ui(c.bpow[0], 1);
+        for (size_t k=1; k<P1_S2_GAPS; ++k) {
+            mpz_init(c.bpow[k]);
+            mpz_mul(c.bpow[k], c.bpow[k-1], c.t);
+            mpz_mod(c.bpow[k], c.bpow[k], n);
+        }
+    } else {
+        mpz_clears(c.x, c.xblk, c.acc, c.t, c.g, NULL);
+        return;
+    }
+
+    int hit = sieve_range(lo + 1, B2, p1s2_prime, &c);
+    if (!hit && c.ngap) hit = p1s2_check(&c);
+    if (hit && mpz_cmp(c.g, n) < 0) mpz_set(factor, c.g);
+
+    if (c.bpow) {
+        for (size_t k=0; k<P1_S2_GAPS; ++k) mpz_clear(c.bpow[k]);
+        free(c.bpow);
+    }
+    free(c.bw);
+    mpz_clears(c.x, c.xblk, c.acc, c.t, c.g, NULL);
+}
+
+/* ---------- ECM (Montgomery curves, x-only) ---------- */
+
+/* Curves By^2 = x^3 + Ax^2 + x from Suyama's parametrisation, points kept as
+ * (X:Z).  Stage 1 runs the Montgomery ladder over the cached P-1 plan words
+ * for B1 (the same prime-power product); stage 2 pairs each prime q in
+ * (B1, B2] as q = kD +- j with baby steps [j]Q and giant steps [kD]Q and
+ * multiplies X_g Z_j - X_j Z_g into an accumulator. */
+
+#define ECM_D     2310u                 // 2*3*5*7*11
+#define ECM_BABY  (ECM_D/4 + 1)         // odd j < D/2  ->  index (j-1)/2
+#define ECM_BLOCK 4096u                 // stage 2 primes per gcd
+
+typedef struct { mpz_t x, z; } ecm_pt;
+
+typedef struct {
+    mpz_srcptr n;
+    mpz_t a24;                          // (A+2)/4
+    mpz_t t1, t2, t3;
+    ecm_pt r0, r1, tp;                  // ladder scratch
+} ecm_curve;
+
+static void ecm_pt_init(ecm_pt *P)  { mpz_inits(P->x, P->z, NULL); }
+static void ecm_pt_clear(ecm_pt *P) { mpz_clears(P->x, P->z, NULL); }
+static void ecm_pt_set(ecm_pt *R, const ecm_pt *P) { mpz_set(R->x, P->x); mpz_set(R->z, P->z); }
+
+static inline void mulmod(mpz_t r, const mpz_t a, const mpz_t b, const mpz_t n) {
+    mpz_mul(r, a, b);
+    mpz_mod(r, r, n);
+}
+
+/* R = 2P; R may alias P. */
+static void ecm_dbl(ecm_pt *R, const ecm_pt *P, ecm_curve *E) {
+    mpz_add(E->t1, P->x, P->z); mulmod(E->t1, E->t1, E->t1, E->n);   // (X+Z)^2
+    mpz_sub(E->t2, P->x, P->z); mulmod(E->t2, E->t2, E->t2, E->n);   // (X-Z)^2
+    mulmod(R->x, E->t1, E->t2, E->n);
+    mpz_sub(E->t3, E->t1, E->t2);                                    // 4XZ
+    mulmod(E->t1, E->a24, E->t3, E->n);
+    mpz_add(E->t1, E->t1, E->t2);
+    mulmod(R->z, E->t3, E->t1, E->n);
+}
+
+/* R = P + Q given D = P - Q; R may alias P or Q but not D. */
+static void ecm_add(ecm_pt *R, const ecm_pt *P, const ecm_pt *Q, const ecm_pt *D, ecm_curve *E) {
+    mpz_sub(E->t1, P->x, P->z); mpz_add(E->t2, Q->x, Q->z); mulmod(E->t3, E->t1, E->t2, E->n);
+    mpz_add(E->t1, P->x, P->z); mpz_sub(E->t2, Q->x, Q->z); mulmod(E->t1, E->t1, E->t2, E->n);
+    mpz_add(E->t2, E->t3, E->t1); mulmod(E->t2, E->t2, E->t2, E->n);
+    mpz_sub(E->t3, E->t3, E->t1); mulmod(E->t3, E->t3, E->t3, E->n);
+    mulmod(R->x, D->z, E->t2, E->n);
+    mulmod(R->z, D->x, E->t3, E->n);
+}
+
+/* R = [k]P by the Montgomery ladder; R may alias P. */
+static void ecm_mul(ecm_pt *R, const ecm_pt *P, uint64_t k, ecm_curve *E) {
+    if (k == 0) { mpz_set_ui(R->x, 1); mpz_set_ui(R->z, 0); return; }
+    if (k == 1) { ecm_pt_set(R, P); return; }
+    ecm_pt_set(&E->tp, P);
+    ecm_pt_set(&E->r0, P);
+    ecm_dbl(&E->r1, P, E);
+    for (int b = 62 - __builtin_clzll(k); b >= 0; --b) {
+        if ((k >> b) & 1) { ecm_add(&E->r0, &E->r0, &E->r1, &E->tp, E); ecm_dbl(&E->r1, &E->r1, E); }
+        else              { ecm_add(&E->r1, &E->r0, &E->r1, &E->tp, E); ecm_dbl(&E->r0, &E->r0, E); }
+    }
+    ecm_pt_set(R, &E->r0);
+}
+
+typedef struct {
+    ecm_curve *E;
+    const ecm_pt *Q;
+    ecm_pt *baby;                       // [j]Q for odd j < D/2
+    ecm_pt G, Gprev, GD, T;             // [kD]Q, [(k-1)D]Q, [D]Q, scratch
+    uint64_t k;                         // current giant index (0 => none yet)
+    mpz_t acc, g;
+    unsigned since_gcd;
+    const atomic_bool *stop;
+    bool cut;                           // stopped before B2
+} ecm_s2_ctx;
+
+static int ecm_s2_check(ecm_s2_ctx *c) {
+    c->since_gcd = 0;
+    mpz_gcd(c->g, c->acc, c->E->n);
+    return mpz_cmp_ui(c->g, 1) != 0;
+}
+
+static int ecm_s2_prime(uint64_t q, void *ctx) {
+    ecm_s2_ctx *c = (ecm_s2_ctx*)ctx;
+    ecm_curve *E = c->E;
+    uint64_t k = (q + ECM_D/2) / ECM_D;
+    if (k == 0) {
+        // below the first giant step: take [q]Q directly
+        ecm_mul(&c->T, c->Q, q, E);
+        mulmod(c->acc, c->acc, c->T.z, E->n);
+    } else {
+        if (k != c->k) {
+            if (c->k >= 2 && k == c->k + 1) {
+                ecm_add(&c->T, &c->G, &c->GD, &c->Gprev, E);
+                ecm_pt_set(&c->Gprev, &c->G);
+                ecm_pt_set(&c->G, &c->T);
+            } else {
+                ecm_mul(&c->G, c->Q, k * ECM_D, E);
+                ecm_mul(&c->Gprev, c->Q, (k-1) * ECM_D, E);
+            }
+            c->k = k;
+        }
+        uint64_t j = q > k*ECM_D ? q - k*ECM_D : k*ECM_D - q;
+        const ecm_pt *B = &c->baby[(j-1)/2];
+        mulmod(E->t1, c->G.x, B->z, E->n);
+        mulmod(E->t2, B->x, c->G.z, E->n);
+        mpz_sub(E->t1, E->t1, E->t2);
+        mulmod(c->acc, c->acc, E->t1, E->n);
+    }
+    if (++c->since_gcd < ECM_BLOCK) return 0;
+    if (ecm_s2_check(c)) return 1;
+    c->cut = stop_requested(c->stop) || deadline_passed();
+    return c->cut;
+}
+
+/* One curve; returns the stage that found a factor (1 or 2), 0 when it ran
+ * to B2 without one, or -1 when it was cut short (stop, deadline, no plan or
+ * no memory for stage 2). */
+static int ecm_curve_run(mpz_t factor, const mpz_t n, uint64_t sigma,
+                         unsigned long B1, uint64_t B2, const atomic_bool *stop)
+{
+    mpz_set_ui(factor, 1);
+    p1_plan *pl = p1_plan_get(B1);
+    if (!pl) return -1;
+    uint64_t pw[P1_CHUNK_WORDS];
+    size_t cnt;
+
+    ecm_curve E;
+    E.n = n;
+    mpz_inits(E.a24, E.t1, E.t2, E.t3, NULL);
+    ecm_pt_init(&E.r0); ecm_pt_init(&E.r1); ecm_pt_init(&E.tp);
+    ecm_pt Q; ecm_pt_init(&Q);
+    mpz_t u, v, w, g;
+    mpz_inits(u, v, w, g, NULL);
+    int stage = 0;
+
+    // Suyama: u = s^2 - 5, v = 4s, Q = (u^3 : v^3), a24 = (v-u)^3 (3u+v) / (16 u^3 v)
+    mpz_set_ui(u, (unsigned long) sigma);
+    mulmod(u, u, u, n);
+    mpz_sub_ui(u, u, 5);
+    mpz_mod(u, u, n);
+    mpz_set_ui(v, (unsigned long) sigma);
+    mpz_mul_ui(v, v, 4);
+    mpz_mod(v, v, n);
+    mulmod(Q.x, u, u, n); mulmod(Q.x, Q.x, u, n);
+    mulmod(Q.z, v, v, n); mulmod(Q.z, Q.z, v, n);
+    mpz_sub(w, v, u); mulmod(E.a24, w, w, n); mulmod(E.a24, E.a24, w, n);
+    mpz_mul_ui(w, u, 3); mpz_add(w, w, v); mulmod(E.a24, E.a24, w, n);
+    mpz_mul_ui(w, Q.x, 16); mulmod(w, w, v, n);
+    if (!mpz_invert(g, w, n)) {
+        // the curve setup itself hit a factor of n
+        mpz_gcd(g, w, n);
+        if (mpz_cmp_ui(g,1)>0 && mpz_cmp(g,n)<0) { mpz_set(factor, g); stage = 1; }
+        goto out;
+    }
+    mulmod(E.a24, E.a24, g, n);
+
+    // stage 1, a plan chunk at a time
+    for (size_t c=0; ; ++c) {
+        int got = p1_plan_chunk(pl, c, NULL, pw, &cnt);
+        if (got < 0) { stage = -1; goto out; }
+        if (!got) break;
+        for (size_t i=0; i<cnt; ++i) {
+            ecm_mul(&Q, &Q, pw[i], &E);
+            if ((i & 63) == 63 && (stop_requested(stop) || deadline_passed())) { stage = -1; goto out; }
+        }
+    }
+    mpz_gcd(g, Q.z, n);
+    if (mpz_cmp_ui(g,1) != 0) {
+        if (mpz_cmp(g,n) < 0) { mpz_set(factor, g); stage = 1; }
+        goto out;
+    }
+
+    // stage 2
+    if (B2 > B1) {
+        ecm_s2_ctx c = { .E = &E, .Q = &Q, .k = 0, .since_gcd = 0, .stop = stop, .cut = false };
+        c.baby = (ecm_pt*)malloc(ECM_BABY * sizeof(ecm_pt));
+        if (!c.baby) { stage = -1; goto out; }
+        for (size_t i=0; i<ECM_BABY; ++i) ecm_pt_init(&c.baby[i]);
+        ecm_pt_init(&c.G); ecm_pt_init(&c.Gprev); ecm_pt_init(&c.GD); ecm_pt_init(&c.T);
+        mpz_init_set_ui(c.acc, 1);
+        mpz_init(c.g);
+
+        ecm_pt_set(&c.baby[0], &Q);                       // [1]Q
+        ecm_dbl(&c.T, &Q, &E);                            // [2]Q
+        if (ECM_BABY > 1) ecm_add(&c.baby[1], &c.T, &Q, &Q, &E);
+        for (size_t i=2; i<ECM_BABY; ++i)                 // [j+2] = [j] + [2], diff [j-2]
+            ecm_add(&c.baby[i], &c.baby[i-1], &c.T, &c.baby[i-2], &E);
+        ecm_mul(&c.GD, &Q, ECM_D, &E);
+
+        int hit = sieve_range((uint64_t) B1 + 1, B2, ecm_s2_prime, &c);
+        if (!hit || mpz_cmp_ui(c.g,1) == 0) hit = ecm_s2_check(&c);
+        if (hit && mpz_cmp_ui(c.g, 1) > 0 && mpz_cmp(c.g, n) < 0) { mpz_set(factor, c.g); stage = 2; }
+        else if (c.cut) stage = -1;
+
+        for (size_t i=0; i<ECM_BABY; ++i) ecm_pt_clear(&c.baby[i]);
+        free(c.baby);
+        ecm_pt_clear(&c.G); ecm_pt_clear(&c.Gprev); ecm_pt_clear(&c.GD); ecm_pt_clear(&c.T);
+        mpz_clears(c.acc, c.g, NULL);
+    }
+
+out:
+    mpz_clears(u, v, w, g, NULL);
+    ecm_pt_clear(&Q);
+    ecm_pt_clear(&E.r0); ecm_pt_clear(&E.r1); ecm_pt_clear(&E.tp);
+    mpz_clears(E.a24, E.t1, E.t2, E.t3, NULL);
+    return stage;
+}
+
+/* ---------- factor recursion ---------- */
+
+typedef struct {
+    mpz_t *p;  // array of primes
+    int   *e;  // exponents
+    size_t len, cap;
+} factor_list;
+
+static void fl_init(factor_list *fl) {
+    fl->p = NULL; fl->e = NULL; fl->len = 0; fl->cap = 0;
+}
+static void fl_free(factor_list *fl) {
+    if (fl->p) {
+        for (size_t i=0;i<fl->len;i++) mpz_clear(fl->p[i]);
+        free(fl->p);
+    }
+    free(fl->e);
+    fl->p = NULL; fl->e = NULL; fl->len = fl->cap = 0;
+}
+static void fl_push(factor_list *fl, const mpz_t prime, int exp) {
+    // merge if exists
+    for (size_t i=0;i<fl->len;i++) {
+        if (mpz_cmp(fl->p[i], prime) == 0) { fl->e[i] += exp; return; }
+    }
+    if (fl->len == fl->cap) {
+        size_t ncap = fl->cap? fl->cap*2 : 8;
+        fl->p = (mpz_t*)realloc(fl->p, ncap*sizeof(mpz_t));
+        fl->e = (int*)realloc(fl->e, ncap*sizeof(int));
+        for (size_t j=fl->cap;j<ncap;j++) mpz_init(fl->p[j]);
+        fl->cap = ncap;
+    }
+    mpz_set(fl->p[fl->len], prime);
+    fl->e[fl->len] = exp;
+    fl->len++;
+}
+
+/* Composites still to split, the current one on top. */
+typedef struct {
+    mpz_t *v;
+    size_t len, cap;
+} mpz_stack;
+
+static void stack_init(mpz_stack *st) {
+    st->v = NULL; st->len = st->cap = 0;
+}
+static void stack_free(mpz_stack *st) {
+    for (size_t i=0;i<st->cap;i++) mpz_clear(st->v[i]);
+    free(st->v);
+    st->v = NULL; st->len = st->cap = 0;
+}
+static void stack_push(mpz_stack *st, const mpz_t x) {
+    if (st->len == st->cap) {
+        size_t ncap = st->cap? st->cap*2 : 8;
+        st->v = (mpz_t*)realloc(st->v, ncap*sizeof(mpz_t));
+        for (size_t j=st->cap;j<ncap;j++) mpz_init(st->v[j]);
+        st->cap = ncap;
+    }
+    mpz_set(st->v[st->len++], x);
+}
+
+typedef enum { SCH_FIXED=0, SCH_LUBY=1, SCH_DOUBLING=2 } schedule_t;
+
+static const char *schedule_name(schedule_t s) {
+    switch (s) {
+        case SCH_LUBY:     return "luby";
+        case SCH_DOUBLING: return "doubling";
+        default:           return "fixed";
+    }
+}
+
+static int parse_schedule(const char *s, schedule_t *out) {
+    if (!strcmp(s, "luby"))     { *out = SCH_LUBY;     return 0; }
+    if (!strcmp(s, "doubling")) { *out = SCH_DOUBLING; return 0; }
+    if (!strcmp(s, "fixed"))    { *out = SCH_FIXED;    return 0; }
+    return -1;
+}
+
+// Correct Luby (1-indexed): 1,1,2,1,1,2,4,1,1,2,1,1,2,4,8,...
+static uint64_t luby(uint64_t i) {
+    unsigned k = 1;
+    while (k < 63 && ((1ull<<k) - 1ull) < i) k++;
+    if (i == ((1ull<<k) - 1ull)) return 1ull<<(k-1);
+    return luby(i - (1ull<<(k-1)) + 1ull);
+}
+
+/* One ECM curve as reported in the JSON output. */
+typedef struct {
+    int bits;              // size of the composite it ran on
+    uint64_t sigma;
+    int stage;             // 1|2 => found there, 0 => nothing, -1 => cancelled
+    char *factor;          // decimal, NULL unless stage > 0
+} ecm_record;
+
+/* One split of a composite: which method found which factor. */
+typedef struct {
+    int bits;              // size of the composite it split
+    const char *method;    // "p1" | "p1_stage2" | "ecm" | "siqs" | "rho"
+    char *factor;          // decimal
+} split_record;
+
+/* Per-run counters filled in by the methods, one thread at a time (a run on
+ * the task pool gives each worker its own and merges them at the end). */
+typedef struct factor_stats {
+    uint64_t p1_stage1_us;
+    uint64_t p1_stage2_us;
+    uint64_t p1_gcds;
+    uint64_t p1s2_primes;
+    uint64_t ecm_us;
+    uint64_t ecm_curves_run; // curves finished (listed in "ecm" up to ECM_RECORDS each)
+    uint64_t siqs_us;
+    uint64_t siqs_rels;
+    uint64_t siqs_polys;
+    uint64_t rho_us;
+    uint64_t rho_restarts; // restarts begun, over all walkers
+    uint64_t rho_iters;
+    uint64_t rho_gcds;
+    uint64_t trial_us;     // up-front strip of primes <= trial_B
+    uint64_t trial_primes; // distinct primes it found
+    uint64_t small_us;     // native word-sized cofactor stage
+    uint64_t small_calls;
+    uint64_t prime_us;     // primality tests of cofactors
+    uint64_t prime_tests;
+    uint64_t checkpoints;  // snapshots written by --checkpoint
+    uint64_t plan_attempts; // method attempts made by --plan auto
+    uint64_t cache_hits;    // n and cofactors answered by --cache
+    atomic_uint_fast64_t live_restarts;   // bumped by the walkers per restart,
+    atomic_uint_fast64_t live_rho_iters;  // read by the --progress_ms heartbeat
+    struct factor_stats *live;            // where live_* go instead (NULL => here)
+    ecm_record *ecm;
+    size_t ecm_len, ecm_cap;
+    split_record *splits;
+    size_t splits_len, splits_cap;
+} factor_stats;
+
+static void stats_free(factor_stats *st) {
+    for (size_t i=0; i<st->ecm_len; ++i) free(st->ecm[i].factor);
+    free(st->ecm);
+    st->ecm = NULL; st->ecm_len = st->ecm_cap = 0;
+    for (size_t i=0; i<st->splits_len; ++i) free(st->splits[i].factor);
+    free(st->splits);
+    st->splits = NULL; st->splits_len = st->splits_cap = 0;
+}
+
+static void stats_split(factor_stats *st, const char *method, const mpz_t d, const mpz_t n) {
+    if (st->splits_len == st->splits_cap) {
+        size_t ncap = st->splits_cap ? st->splits_cap*2 : 8;
+        split_record *nv = (split_record*)realloc(st->splits, ncap*sizeof *nv);
+        if (!nv) return;
+        st->splits = nv; st->splits_cap = ncap;
+    }
+    st->splits[st->splits_len++] = (split_record){ .bits = bits_of(n), .method = method, .factor = mpz_to_cstr(d) };
+}
+
+/* The work counted on this thread since w0. */
+static work_counts work_since(const work_counts *w0) {
+    return (work_counts){
+        .rho_iters   = work.rho_iters - w0->rho_iters,
+        .rho_gcds    = work.rho_gcds - w0->rho_gcds,
+        .p1_gcds     = work.p1_gcds - w0->p1_gcds,
+        .p1s2_primes = work.p1s2_primes - w0->p1s2_primes
+    };
+}
+
+static void stats_work(factor_stats *st, const work_counts *d) {
+    st->rho_iters   += d->rho_iters;
+    st->rho_gcds    += d->rho_gcds;
+    st->p1_gcds     += d->p1_gcds;
+    st->p1s2_primes += d->p1s2_primes;
+}
+
+/* Add src's counters to dst and move its ECM and split records over (src
+ * is left empty).  live_* are not summed: src->live already pointed at dst. */
+static void stats_merge(factor_stats *dst, factor_stats *src) {
+    dst->p1_stage1_us  += src->p1_stage1_us;
+    dst->p1_stage2_us  += src->p1_stage2_us;
+    dst->p1_gcds       += src->p1_gcds;
+    dst->p1s2_primes   += src->p1s2_primes;
+    dst->ecm_us        += src->ecm_us;
+    dst->ecm_curves_run += src->ecm_curves_run;
+    dst->siqs_us       += src->siqs_us;
+    dst->siqs_rels     += src->siqs_rels;
+    dst->siqs_polys    += src->siqs_polys;
+    dst->rho_us        += src->rho_us;
+    dst->rho_restarts  += src->rho_restarts;
+    dst->rho_iters     += src->rho_iters;
+    dst->rho_gcds      += src->rho_gcds;
+    dst->trial_us      += src->trial_us;
+    dst->trial_primes  += src->trial_primes;
+    dst->small_us      += src->small_us;
+    dst->small_calls   += src->small_calls;
+    dst->prime_us      += src->prime_us;
+    dst->prime_tests   += src->prime_tests;
+    dst->checkpoints   += src->checkpoints;
+    dst->plan_attempts += src->plan_attempts;
+    dst->cache_hits    += src->cache_hits;
+    for (size_t i=0; i<src->ecm_len; ++i) {
+        if (dst->ecm_len == dst->ecm_cap) {
+            size_t ncap = dst->ecm_cap ? dst->ecm_cap*2 : 64;
+            ecm_record *nr = (ecm_record*)realloc(dst->ecm, ncap*sizeof *nr);
+            if (!nr) { free(src->ecm[i].factor); continue; }
+            dst->ecm = nr; dst->ecm_cap = ncap;
+        }
+        dst->ecm[dst->ecm_len++] = src->ecm[i];
+    }
+    for (size_t i=0; i<src->splits_len; ++i) {
+        if (dst->splits_len == dst->splits_cap) {
+            size_t ncap = dst->splits_cap ? dst->splits_cap*2 : 8;
+            split_record *nv = (split_record*)realloc(dst->splits, ncap*sizeof *nv);
+            if (!nv) { free(src->splits[i].factor); continue; }
+            dst->splits = nv; dst->splits_cap = ncap;
+        }
+        dst->splits[dst->splits_len++] = src->splits[i];
+    }
+    src->ecm_len = src->splits_len = 0;
+    stats_free(src);
+}
+
+typedef struct {
+    uint64_t timeout_ms;   // 0 => no timeout
+    uint64_t start_ms;
+    uint64_t trial_B;      // primes up to here are stripped up front (< 2^32)
+    unsigned long p1_B;    // 0 => skip
+    uint64_t p1_B2;        // stage 2 bound (<= p1_B => skip)
+    unsigned long ecm_B1;
+    uint64_t ecm_B2;       // <= ecm_B1 => stage 1 only
+    uint64_t ecm_curves;   // 0 => skip ECM
+    int siqs;              // 0 => never use SIQS, else by size
+    int small_bits;        // cofactors up to this size skip GMP (0 => off)
+    uint64_t rho_restarts;
+    uint64_t rho_iters;    // per-restart iteration cap (0 => unlimited if no timeout)
+    schedule_t schedule;   // per-restart budget multiplier
+    uint64_t rho_cap;      // absolute per-restart budget cap (0 => none)
+    unsigned threads;      // pool workers (<=1 => run in the calling thread)
+    const int *cpus;       // optional pin list, walker i -> cpus[i % ncpus]
+    size_t ncpus;
+    factor_stats *stats;
+    struct ckpt *ck;       // --checkpoint / --resume state (NULL => none)
+    struct factor_cancel *cancel;  // serve: cancel by id (NULL => none)
+    void (*progress)(void *ctx, const char *stage, const mpz_t n);  // stage entered (NULL => none)
+    void *progress_ctx;
+    uint64_t progress_ms;  // stderr heartbeat period (0 => none)
+    int plan;              // 0 => fixed chain, 1 => adaptive planner (--plan auto)
+} factor_params;
+
+/* Cancellation of one run from another thread.  The method running on it
+ * parks its own stop flag here, so a cancel stops walkers mid-walk rather
+ * than at the next restart. */
+typedef struct factor_cancel {
+    atomic_bool cancelled;
+    pthread_mutex_t lock;   // guards stop
+    atomic_bool *stop;      // stop flag of the method running now (NULL => none)
+} factor_cancel;
+
+static void cancel_init(factor_cancel *fc) {
+    atomic_init(&fc->cancelled, false);
+    pthread_mutex_init(&fc->lock, NULL);
+    fc->stop = NULL;
+}
+
+static void cancel_fire(factor_cancel *fc) {
+    pthread_mutex_lock(&fc->lock);
+    atomic_store(&fc->cancelled, true);
+    if (fc->stop) atomic_store(fc->stop, true);
+    pthread_mutex_unlock(&fc->lock);
+}
+
+/* Park (stop != NULL) or unpark the running method's stop flag. */
+static void cancel_attach(const factor_params *fp, atomic_bool *stop) {
+    factor_cancel *fc = fp->cancel;
+    if (!fc) return;
+    pthread_mutex_lock(&fc->lock);
+    fc->stop = stop;
+    if (stop && atomic_load(&fc->cancelled)) atomic_store(stop, true);
+    pthread_mutex_unlock(&fc->lock);
+}
+
+static bool fp_cancelled(const factor_params *fp) {
+    return fp->cancel && atomic_load_explicit(&fp->cancel->cancelled, memory_order_relaxed);
+}
+
+/* Out of time or cancelled: stop starting new work. */
+static bool fp_expired(const factor_params *fp) {
+    return fp_cancelled(fp) || atomic_load_explicit(&interrupted, memory_order_relaxed)
+        || (fp->timeout_ms && now_ms() - fp->start_ms >= fp->timeout_ms);
+}
+
+/* fp's deadline on the now_us() clock, for thread_deadline_us (0 => none). */
+static uint64_t fp_deadline_us(const factor_params *fp) {
+    return fp->timeout_ms ? (fp->start_ms + fp->timeout_ms) * 1000ull : 0;
+}
+
+static void fp_stage(const factor_params *fp, const char *stage, const mpz_t n) {
+    if (fp->progress) fp->progress(fp->progress_ctx, stage, n);
+}
+
+static int factor_rec(mpz_t n, factor_list *out, mpz_stack *left, gmp_randstate_t rng, const factor_params *fp);
+
+/* Iteration budget of 0-indexed restart r; 0 => unlimited. */
+static uint64_t rho_budget(const factor_params *fp, uint64_t r) {
+    uint64_t base = fp->rho_iters;
+    if (fp->timeout_ms && base == 0) base = 5000000ull; // sensible default under timeout regime
+    if (base == 0) return 0;
+
+    uint64_t i = r + 1, mult = 1;
+    switch (fp->schedule) {
+        case SCH_LUBY:     mult = luby(i); break;
+        case SCH_DOUBLING: mult = (i<=1) ? 1ull : 1ull << (i-2 < 63 ? i-2 : 63); break; // 1,1,2,4,8,...
+        case SCH_FIXED:    mult = 1; break;
+    }
+    uint64_t budget = (mult > UINT64_MAX / base) ? UINT64_MAX : base * mult;
+    if (fp->rho_cap && budget > fp->rho_cap) budget = fp->rho_cap;
+    return budget;
+}
+
+/* ---------- checkpoint / resume (--checkpoint FILE, --resume FILE) ---------- */
+
+/* While `factor` runs with --checkpoint, a writer thread wakes every
+ * --checkpoint_ms, bumps the snapshot epoch, waits until every open slot has
+ * answered at its next boundary, and serializes the run: N, the primes found
+ * so far, the composites still to split, how far the current one got (stage
+ * and ECM curve / rho restart counter) and the state of each walk.  The
+ * bytes go to FILE.tmp, which is fsync'd and renamed over FILE, so FILE is
+ * always a complete snapshot.  A last snapshot is taken when the run ends.
+ *
+ * Format (little-endian; "int" is a u32 byte count then magnitude bytes):
+ *   "CPCK" u8 version, int N
+ *   u32 nf, nf x { int p, u32 e }
+ *   u32 nc, nc x { int cofactor }          bottom of the stack first
+ *   u8 stage, u64 next
+ *   u32 ns, ns x { u64 id, pos, k, iters; u8 valid; valid => int x, y, q, c }
+ *
+ * SIQS keeps no resumable state; a run stopped inside it sieves again. */
+
+#define CK_MAGIC    "CPCK"
+#define CK_VERSION  1
+#define CK_EVERY_MS 10000u
+#define CK_MAX_LEN  (1u << 20)  // sanity bound on counts and integer sizes read back
+
+enum { CK_FRESH=0, CK_P1=1, CK_P1S2=2, CK_ECM=3, CK_SIQS=4, CK_RHO=5 };
+
+typedef struct ckpt {
+    ck_core core;
+    const char *path;        // NULL => resume only, nothing written
+    uint64_t every_ms;
+    uint64_t writes;         // snapshots written
+    bool write_failed;       // reported once on stderr
+    int stage;               // how far the top cofactor has got (CK_*)
+    bool resumed;            // the state below came from --resume
+    bool rs_live;            // loaded stage, counter and slots still apply
+    mpz_t N;
+    factor_list fl;          // primes found so far
+    mpz_stack stk;           // composites still to split; the top one is current
+    bool quit;               // tells the writer thread to exit
+} ckpt;
+
+static void ck_init(ckpt *ck, const mpz_t N, const char *path, uint64_t every_ms) {
+    memset(ck, 0, sizeof *ck);
+    pthread_mutex_init(&ck->core.lock, NULL);
+    pthread_cond_init(&ck->core.cv, NULL);
+    atomic_init(&ck->core.epoch, 0);
+    atomic_init(&ck->core.next, 0);
+    ck->path = path;
+    ck->every_ms = every_ms ? every_ms : 1;
+    mpz_init_set(ck->N, N);
+    fl_init(&ck->fl);
+    stack_init(&ck->stk);
+}
+
+static void ck_drop_saved(ck_core *K) {
+    for (size_t i=0; i<K->nsaved; ++i)
+        mpz_clears(K->saved[i].x, K->saved[i].y, K->saved[i].q, K->saved[i].c, NULL);
+    free(K->saved);
+    K->saved = NULL;
+    K->nsaved = 0;
+}
+
+static void ck_free(ckpt *ck) {
+    ck_drop_saved(&ck->core);
+    free(ck->core.act);
+    pthread_cond_destroy(&ck->core.cv);
+    pthread_mutex_destroy(&ck->core.lock);
+    mpz_clear(ck->N);
+    fl_free(&ck->fl);
+    stack_free(&ck->stk);
+}
+
+static void ck_hold(ckpt *ck)    { if (ck) pthread_mutex_lock(&ck->core.lock); }
+static void ck_release(ckpt *ck) { if (ck) pthread_mutex_unlock(&ck->core.lock); }
+
+/* The top cofactor changed (lock held): nothing has run on the new one. */
+static void ck_fresh(ckpt *ck) {
+    if (!ck) return;
+    ck->stage = CK_FRESH;
+    ck->rs_live = false;
+    atomic_store(&ck->core.next, 0);
+    ck_drop_saved(&ck->core);
+}
+
+/* Stage s is about to run on the top cofactor.  Returns false when a resumed
+ * run had already got past it; on the stage it stopped in, the loaded counter
+ * and slots are kept for the workers to claim. */
+static bool ck_enter(ckpt *ck, int s) {
+    if (!ck) return true;
+    bool run = true;
+    pthread_mutex_lock(&ck->core.lock);
+    if (ck->rs_live && s < ck->stage) {
+        run = false;
+    } else if (ck->rs_live && s == ck->stage) {
+        ck->rs_live = false;
+    } else {
+        ck_fresh(ck);
+        ck->stage = s;
+    }
+    pthread_mutex_unlock(&ck->core.lock);
+    return run;
+}
+
+static ck_slot *ck_slot_open(ckpt *ck, bool passive) {
+    if (!ck) return NULL;
+    ck_slot *s = (ck_slot*)calloc(1, sizeof(ck_slot));
+    if (!s) return NULL;
+    ck_core *K = &ck->core;
+    mpz_inits(s->x, s->y, s->q, s->c, NULL);
+    s->core = K;
+    s->passive = passive;
+    s->id = UINT64_MAX;         // nothing claimed yet
+    pthread_mutex_lock(&K->lock);
+    if (K->nact == K->actcap) {
+        size_t ncap = K->actcap ? K->actcap*2 : 16;
+        ck_slot **na = (ck_slot**)realloc(K->act, ncap*sizeof(ck_slot*));
+        if (!na) {
+            pthread_mutex_unlock(&K->lock);
+            mpz_clears(s->x, s->y, s->q, s->c, NULL);
+            free(s);
+            return NULL;        // the kernel just runs without snapshots
+        }
+        K->act = na; K->actcap = ncap;
+    }
+    K->act[K->nact++] = s;
+    s->seen = atomic_load(&K->epoch);
+    pthread_mutex_unlock(&K->lock);
+    return s;
+}
+
+static void ck_slot_close(ckpt *ck, ck_slot *s) {
+    if (!s) return;
+    ck_core *K = &ck->core;
+    pthread_mutex_lock(&K->lock);
+    for (size_t i=0; i<K->nact; ++i) {
+        if (K->act[i] == s) { K->act[i] = K->act[--K->nact]; break; }
+    }
+    pthread_cond_broadcast(&K->cv);
+    pthread_mutex_unlock(&K->lock);
+    mpz_clears(s->x, s->y, s->q, s->c, NULL);
+    free(s);
+}
+
+static void ck_put_u32(FILE *f, uint32_t v) {
+    unsigned char b[4];
+    for (int i=0; i<4; ++i) b[i] = (unsigned char)(v >> (8*i));
+    fwrite(b, 1, 4, f);
+}
+
+static void ck_put_u64(FILE *f, uint64_t v) {
+    ck_put_u32(f, (uint32_t) v);
+    ck_put_u32(f, (uint32_t)(v >> 32));
+}
+
+static void ck_put_int(FILE *f, const mpz_t x) {
+    size_t len = (mpz_sizeinbase(x, 2) + 7) / 8;
+    unsigned char *buf = (unsigned char*)malloc(len ? len : 1);
+    if (!buf) { ck_put_u32(f, 0); return; }
+    size_t cnt = 0;
+    mpz_export(buf, &cnt, -1, 1, 0, 0, x);
+    ck_put_u32(f, (uint32_t) cnt);
+    fwrite(buf, 1, cnt, f);
+    free(buf);
+}
+
+static int ck_get_u32(FILE *f, uint32_t *v) {
+    unsigned char b[4];
+    if (fread(b, 1, 4, f) != 4) return -1;
+    *v = (uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24;
+    return 0;
+}
+
+static int ck_get_u64(FILE *f, uint64_t *v) {
+    uint32_t lo, hi;
+    if (ck_get_u32(f, &lo) || ck_get_u32(f, &hi)) return -1;
+    *v = (uint64_t)hi << 32 | lo;
+    return 0;
+}
+
+static int ck_get_int(FILE *f, mpz_t x) {
+    uint32_t len;
+    if (ck_get_u32(f, &len) || len > CK_MAX_LEN) return -1;
+    unsigned char *buf = (unsigned char*)malloc(len ? len : 1);
+    if (!buf) return -1;
+    int rc = fread(buf, 1, len, f) == len ? 0 : -1;
+    if (rc == 0) mpz_import(x, len, -1, 1, 0, 0, buf);
+    free(buf);
+    return rc;
+}
+
+static void ck_put_slot(FILE *f, const ck_slot *s) {
+    ck_put_u64(f, s->id); ck_put_u64(f, s->pos);
+    ck_put_u64(f, s->k);  ck_put_u64(f, s->iters);
+    fputc(s->valid, f);
+    if (s->valid) { ck_put_int(f, s->x); ck_put_int(f, s->y); ck_put_int(f, s->q); ck_put_int(f, s->c); }
+}
+
+/* Serialize the run (lock held). */
+static void ck_snapshot(ckpt *ck, FILE *f) {
+    const ck_core *K = &ck->core;
+    fwrite(CK_MAGIC, 1, 4, f);
+    fputc(CK_VERSION, f);
+    ck_put_int(f, ck->N);
+    ck_put_u32(f, (uint32_t) ck->fl.len);
+    for (size_t i=0; i<ck->fl.len; ++i) { ck_put_int(f, ck->fl.p[i]); ck_put_u32(f, (uint32_t) ck->fl.e[i]); }
+    ck_put_u32(f, (uint32_t) ck->stk.len);
+    for (size_t i=0; i<ck->stk.len; ++i) ck_put_int(f, ck->stk.v[i]);
+
+    // an ECM curve still running is redone: resume from the lowest one
+    uint64_t next = atomic_load(&K->next);
+    size_t ns = K->nsaved;
+    for (size_t i=0; i<K->nact; ++i) {
+        const ck_slot *s = K->act[i];
+        if (s->passive) { if (s->id < next) next = s->id; }
+        else if (s->valid || s->id != UINT64_MAX) ++ns;
+    }
+    fputc(ck->stage, f);
+    ck_put_u64(f, next);
+    ck_put_u32(f, (uint32_t) ns);
+    for (size_t i=0; i<K->nact; ++i) {
+        const ck_slot *s = K->act[i];
+        if (!s->passive && (s->valid || s->id != UINT64_MAX)) ck_put_slot(f, s);
+    }
+    for (size_t i=0; i<K->nsaved; ++i) ck_put_slot(f, &K->saved[i]);
+}
+
+static int ck_write_file(const char *path, const char *buf, size_t len) {
+    size_t plen = strlen(path);
+    char *tmp = (char*)malloc(plen + 5);
+    if (!tmp) return -1;
+    memcpy(tmp, path, plen);
+    memcpy(tmp + plen, ".tmp", 5);
+    FILE *f = fopen(tmp, "wb");
+    int rc = f ? 0 : -1;
+    if (f) {
+        if (fwrite(buf, 1, len, f) != len || fflush(f) != 0 || fsync(fileno(f)) != 0) rc = -1;
+        if (fclose(f) != 0) rc = -1;
+        if (rc == 0 && rename(tmp, path) != 0) rc = -1;
+        if (rc != 0) remove(tmp);
+    }
+    free(tmp);
+    return rc;
+}
+
+/* Write one snapshot (lock held; dropped around the file I/O). */
+static void ck_save(ckpt *ck) {
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *m = open_memstream(&buf, &len);
+    if (!m) return;
+    ck_snapshot(ck, m);
+    fclose(m);
+    pthread_mutex_unlock(&ck->core.lock);
+    int rc = ck_write_file(ck->path, buf, len);
+    pthread_mutex_lock(&ck->core.lock);
+    free(buf);
+    if (rc == 0) {
+        ck->writes++;
+    } else if (!ck->write_failed) {
+        ck->write_failed = true;
+        fprintf(stderr, "{\"ok\":false,\"error\":\"checkpoint_write\",\"arg\":\"%s\"}\n", ck->path);
+    }
+}
+
+static bool ck_answered(const ck_core *K, uint64_t epoch) {
+    for (size_t i=0; i<K->nact; ++i)
+        if (!K->act[i]->passive && K->act[i]->seen != epoch) return false;
+    return true;
+}
+
+static void ck_deadline(struct timespec *ts, uint64_t ms) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += (time_t)(ms / 1000);
+    ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) { ts->tv_sec++; ts->tv_nsec -= 1000000000L; }
+}
+
+static void *ck_writer_main(void *arg) {
+    ckpt *ck = (ckpt*)arg;
+    ck_core *K = &ck->core;
+    struct timespec ts;
+    pthread_mutex_lock(&K->lock);
+    while (!ck->quit) {
+        ck_deadline(&ts, ck->every_ms);
+        while (!ck->quit && pthread_cond_timedwait(&K->cv, &K->lock, &ts) != ETIMEDOUT) {}
+        if (ck->quit) break;
+
+        // ask for a snapshot; a slot stuck in one long step (a P-1 chunk on a
+        // huge n) is waited for at most one more period, then we try again
+        uint64_t e = atomic_fetch_add(&K->epoch, 1) + 1;
+        ck_deadline(&ts, ck->every_ms);
+        int rc = 0;
+        while (!ck->quit && !ck_answered(K, e) && rc != ETIMEDOUT)
+            rc = pthread_cond_timedwait(&K->cv, &K->lock, &ts);
+        if (!ck->quit && ck_answered(K, e)) ck_save(ck);
+    }
+    pthread_mutex_unlock(&K->lock);
+    return NULL;
+}
+
+/* Load FILE into a fresh ck.  Returns NULL, or the error tag. */
+static const char *ck_load(ckpt *ck, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return "bad_resume";
+    const char *err = "bad_resume";
+    char magic[4];
+    uint32_t cnt, e;
+    uint64_t next;
+    int ver, stage;
+    mpz_t t, u; mpz_inits(t, u, NULL);
+
+    if (fread(magic, 1, 4, f) != 4 || memcmp(magic, CK_MAGIC, 4)) goto out;
+    if ((ver = fgetc(f)) != CK_VERSION) goto out;
+    if (ck_get_int(f, t)) goto out;
+    if (mpz_cmp(t, ck->N) != 0) { err = "resume_mismatch"; goto out; }
+
+    if (ck_get_u32(f, &cnt) || cnt > CK_MAX_LEN) goto out;
+    for (uint32_t i=0; i<cnt; ++i) {
+        if (ck_get_int(f, t) || ck_get_u32(f, &e) || e > INT32_MAX) goto out;
+        fl_push(&ck->fl, t, (int) e);
+    }
+    if (ck_get_u32(f, &cnt) || cnt > CK_MAX_LEN) goto out;
+    for (uint32_t i=0; i<cnt; ++i) {
+        if (ck_get_int(f, t)) goto out;
+        stack_push(&ck->stk, t);
+    }
+
+    // the primes times the cofactors left must give N back: a truncated or
+    // edited file would otherwise resume into wrong factors
+    mpz_set_ui(u, 1);
+    for (size_t i=0; i<ck->fl.len; ++i) {
+        if ((size_t) ck->fl.e[i] > mpz_sizeinbase(ck->N, 2) || !is_probable_prime(ck->fl.p[i])) goto out;
+        mpz_pow_ui(t, ck->fl.p[i], (unsigned long) ck->fl.e[i]);
+        mpz_mul(u, u, t);
+    }
+    for (size_t i=0; i<ck->stk.len; ++i) mpz_mul(u, u, ck->stk.v[i]);
+    if (mpz_cmp(u, ck->N) != 0) goto out;
+    if ((stage = fgetc(f)) == EOF || stage > CK_RHO || ck_get_u64(f, &next)) goto out;
+    if (ck_get_u32(f, &cnt) || cnt > CK_MAX_LEN) goto out;
+
+    ck_core *K = &ck->core;
+    K->saved = (ck_slot*)calloc(cnt ? cnt : 1, sizeof(ck_slot));
+    if (!K->saved) goto out;
+    for (uint32_t i=0; i<cnt; ++i) {
+        ck_slot *s = &K->saved[i];
+        mpz_inits(s->x, s->y, s->q, s->c, NULL);
+        K->nsaved++;
+        int valid;
+        if (ck_get_u64(f, &s->id) || ck_get_u64(f, &s->pos) ||
+            ck_get_u64(f, &s->k) || ck_get_u64(f, &s->iters) || (valid = fgetc(f)) == EOF) goto out;
+        s->valid = valid != 0;
+        if (s->valid && (ck_get_int(f, s->x) || ck_get_int(f, s->y) ||
+                         ck_get_int(f, s->q) || ck_get_int(f, s->c))) goto out;
+        if (s->valid && s->pos == 0 && stage == CK_RHO) goto out;  // rho rounds start at r = 1
+    }
+    if (fgetc(f) != EOF) goto out;
+
+    ck->stage = stage;
+    atomic_store(&K->next, next);
+    ck->resumed = ck->rs_live = true;
+    err = NULL;
+out:
+    mpz_clears(t, u, NULL);
+    fclose(f);
+    return err;
+}
+
+/* ---------- work-stealing task pool (pthreads, a deque per worker) ---------- */
+
+/* A fixed set of workers, each owning a deque of tasks.  A worker pushes and
+ * pops at the bottom of its own deque (newest first, so a cofactor tree is
+ * walked depth-first) and, when that runs dry, steals the oldest task from
+ * the top of another's.  Tasks handed in from outside the pool go on top,
+ * so every bottom belongs to its owner alone.  Tasks are coarse (a cofactor,
+ * a batch input, a method's worker loop), so each deque is a mutex-guarded
+ * ring rather than a lock-free one. */
+
+typedef struct {
+    void (*run)(void *arg);
+    void *arg;
+    atomic_size_t *group;   // decremented once run (NULL => none)
+} tp_task;
+
+typedef struct {
+    pthread_mutex_t lock;
+    tp_task *v;             // ring of cap slots, oldest at head
+    size_t head, len, cap;
+} tp_deque;
+
+typedef struct task_pool task_pool;
+
+typedef struct {
+    task_pool *tp;
+    unsigned i;
+} tp_worker;
+
+struct task_pool {
+    unsigned n;             // deques (== workers asked for)
+    unsigned started;       // workers running
+    tp_deque *dq;
+    tp_worker *w;
+    pthread_t *th;
+    const int *cpus;        // optional pin list, worker i -> cpus[i % ncpus]
+    size_t ncpus;
+    pthread_mutex_t lock;   // sleeping workers and waiters
+    pthread_cond_t cv;
+    atomic_size_t queued;   // tasks sitting in the deques
+    atomic_uint next;       // round robin for tasks from outside
+    bool quit;
+};
+
+static _Thread_local task_pool *tp_pool;    // pool the calling thread works for (NULL => none)
+static _Thread_local unsigned tp_self;      // its deque there
+
+static void tp_wake(task_pool *tp) {
+    pthread_mutex_lock(&tp->lock);
+    pthread_cond_broadcast(&tp->cv);
+    pthread_mutex_unlock(&tp->lock);
+}
+
+static void tp_run_task(task_pool *tp, const tp_task *t) {
+    t->run(t->arg);
+    if (t->group && atomic_fetch_sub(t->group, 1) == 1) tp_wake(tp);
+}
+
+/* Queue run(arg): at the bottom of the caller's deque when it works for tp,
+ * else on top of the next deque in turn.  Runs it inline if out of memory. */
+static void tp_spawn(task_pool *tp, void (*run)(void*), void *arg, atomic_size_t *group) {
+    tp_task t = { .run = run, .arg = arg, .group = group };
+    bool own = tp_pool == tp;
+    tp_deque *q = &tp->dq[own ? tp_self : atomic_fetch_add(&tp->next, 1) % tp->n];
+    pthread_mutex_lock(&q->lock);
+    if (q->len == q->cap) {
+        size_t ncap = q->cap ? q->cap*2 : 16;
+        tp_task *nv = (tp_task*)malloc(ncap * sizeof *nv);
+        if (!nv) { pthread_mutex_unlock(&q->lock); tp_run_task(tp, &t); return; }
+        for (size_t i=0; i<q->len; ++i) nv[i] = q->v[(q->head + i) % q->cap];
+        free(q->v);
+        q->v = nv; q->head = 0; q->cap = ncap;
+    }
+    if (own) {
+        q->v[(q->head + q->len) % q->cap] = t;
+    } else {
+        q->head = (q->head + q->cap - 1) % q->cap;
+        q->v[q->head] = t;
+    }
+    q->len++;
+    atomic_fetch_add(&tp->queued, 1);
+    pthread_mutex_unlock(&q->lock);
+    tp_wake(tp);
+}
+
+/* Take the newest (bottom) or oldest (top) task of deque i. */
+static bool tp_take(task_pool *tp, unsigned i, bool bottom, tp_task *t) {
+    tp_deque *q = &tp->dq[i];
+    pthread_mutex_lock(&q->lock);
+    bool got = q->len > 0;
+    if (got) {
+        if (bottom) {
+            *t = q->v[(q->head + q->len - 1) % q->cap];
+        } else {
+            *t = q->v[q->head];
+            q->head = (q->head + 1) % q->cap;
+        }
+        q->len--;
+        atomic_fetch_sub(&tp->queued, 1);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return got;
+}
+
+/* The calling worker's next task: its own newest, else another's oldest. */
+static bool tp_next(task_pool *tp, tp_task *t) {
+    if (tp_take(tp, tp_self, true, t)) return true;
+    for (unsigned k=1; k<tp->n; ++k)
+        if (tp_take(tp, (tp_self + k) % tp->n, false, t)) return true;
+    return false;
+}
+
+static void *tp_worker_main(void *arg) {
+    tp_worker *w = (tp_worker*)arg;
+    task_pool *tp = w->tp;
+    tp_pool = tp;
+    tp_self = w->i;
+    if (tp->ncpus) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(tp->cpus[w->i % tp->ncpus], &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set); // best effort
+    }
+    pthread_mutex_lock(&tp->lock);
+    while (!tp->quit) {
+        if (!atomic_load(&tp->queued)) { pthread_cond_wait(&tp->cv, &tp->lock); continue; }
+        pthread_mutex_unlock(&tp->lock);
+        tp_task t;
+        while (tp_next(tp, &t)) tp_run_task(tp, &t);
+        pthread_mutex_lock(&tp->lock);
+    }
+    pthread_mutex_unlock(&tp->lock);
+    prime_scratch_free();
+    return NULL;
+}
+
+/* Start n workers.  Returns false (nothing to stop) if none would start. */
+static bool tp_start(task_pool *tp, unsigned n, const int *cpus, size_t ncpus) {
+    *tp = (task_pool){ .n = n ? n : 1, .cpus = cpus, .ncpus = ncpus };
+    tp->dq = (tp_deque*)calloc(tp->n, sizeof *tp->dq);
+    tp->w = (tp_worker*)calloc(tp->n, sizeof *tp->w);
+    tp->th = (pthread_t*)calloc(tp->n, sizeof *tp->th);
+    if (!tp->dq || !tp->w || !tp->th) { free(tp->dq); free(tp->w); free(tp->th); return false; }
+    pthread_mutex_init(&tp->lock, NULL);
+    pthread_cond_init(&tp->cv, NULL);
+    atomic_init(&tp->queued, 0);
+    atomic_init(&tp->next, 0);
+    for (unsigned i=0; i<tp->n; ++i) {
+        pthread_mutex_init(&tp->dq[i].lock, NULL);
+        tp->w[i] = (tp_worker){ .tp = tp, .i = i };
+    }
+    // a worker that fails to start leaves its deque to the thieves
+    for (unsigned i=0; i<tp->n; ++i)
+        if (pthread_create(&tp->th[tp->started], NULL, tp_worker_main, &tp->w[i]) == 0) tp->started++;
+    if (tp->started) return true;
+    for (unsigned i=0; i<tp->n; ++i) pthread_mutex_destroy(&tp->dq[i].lock);
+    pthread_cond_destroy(&tp->cv);
+    pthread_mutex_destroy(&tp->lock);
+    free(tp->dq); free(tp->w); free(tp->th);
+    return false;
+}
+
+/* Stop the workers once the queued work is done (tp_wait() first). */
+static void tp_stop(task_pool *tp) {
+    pthread_mutex_lock(&tp->lock);
+    tp->quit = true;
+    pthread_cond_broadcast(&tp->cv);
+    pthread_mutex_unlock(&tp->lock);
+    for (unsigned i=0; i<tp->started; ++i) pthread_join(tp->th[i], NULL);
+    for (unsigned i=0; i<tp->n; ++i) {
+        pthread_mutex_destroy(&tp->dq[i].lock);
+        free(tp->dq[i].v);
+    }
+    pthread_cond_destroy(&tp->cv);
+    pthread_mutex_destroy(&tp->lock);
+    free(tp->dq); free(tp->w); free(tp->th);
+}
+
+/* Wait until *group drops to 0.  With help set, a worker of tp runs queued
+ * tasks meanwhile, so waiting on subtasks never idles a core. */
+static void tp_wait(task_pool *tp, atomic_size_t *group, bool help) {
+    help = help && tp_pool == tp;
+    tp_task t;
+    while (atomic_load(group)) {
+        if (help && tp_next(tp, &t)) { tp_run_task(tp, &t); continue; }
+        pthread_mutex_lock(&tp->lock);
+        while (atomic_load(group) && !(help && atomic_load(&tp->queued)))
+            pthread_cond_wait(&tp->cv, &tp->lock);
+        pthread_mutex_unlock(&tp->lock);
+    }
+}
+
+/* A method's worker loops (rho walkers, ECM curves, SIQS sievers), one per
+ * thread.  Inside a pool, member 0 runs on the caller and the rest are
+ * tasks for idle workers to steal; once member 0 returns the method is
+ * over, so members nobody has started yet are dropped. */
+typedef struct {
+    atomic_bool closed;
+    atomic_size_t left;     // member tasks not finished
+} tp_gang;
+
+typedef struct {
+    tp_gang *g;
+    void *(*fn)(void*);
+    void *arg;
+} tp_member;
+
+static void tp_member_run(void *arg) {
+    tp_member *m = (tp_member*)arg;
+    if (!atomic_load(&m->g->closed)) m->fn(m->arg);
+}
+
+/* Run fn(args + i*size) for i < k: on k pthreads, or as a gang on the
+ * caller's pool.  Falls back to a single inline call. */
+static void gang_run(void *(*fn)(void*), void *args, size_t size, unsigned k) {
+    char *a = (char*)args;
+    task_pool *tp = tp_pool;
+    tp_member *m = (k > 1 && tp) ? (tp_member*)calloc(k, sizeof *m) : NULL;
+    if (k <= 1 || (tp && !m)) { fn(a); return; }
+
+    if (!tp) {
+        pthread_t *th = (pthread_t*)calloc(k, sizeof *th);
+        unsigned started = 0;
+        for (; th && started<k; ++started)
+            if (pthread_create(&th[started], NULL, fn, a + (size_t) started * size) != 0) break;
+        if (started == 0) fn(a); // could not spawn: run inline
+        for (unsigned t=0; t<started; ++t) pthread_join(th[t], NULL);
+        free(th);
+        return;
+    }
+
+    tp_gang g;
+    atomic_init(&g.closed, false);
+    atomic_init(&g.left, k - 1);
+    for (unsigned i=1; i<k; ++i) {
+        m[i] = (tp_member){ .g = &g, .fn = fn, .arg = a + (size_t) i * size };
+        tp_spawn(tp, tp_member_run, &m[i], &g.left);
+    }
+    fn(a);
+    atomic_store(&g.closed, true);
+
+    // members still queued are the newest on the caller's own deque
+    tp_deque *q = &tp->dq[tp_self];
+    pthread_mutex_lock(&q->lock);
+    while (q->len) {
+        tp_task *t = &q->v[(q->head + q->len - 1) % q->cap];
+        if (t->run != tp_member_run || ((tp_member*)t->arg)->g != &g) break;
+        q->len--;
+        atomic_fetch_sub(&tp->queued, 1);
+        atomic_fetch_sub(&g.left, 1);
+    }
+    pthread_mutex_unlock(&q->lock);
+    tp_wait(tp, &g.left, false);    // the stolen ones see the method's stop flag
+    free(m);
+}
+
+/* ---------- parallel rho walkers (pthreads) ---------- */
+
+typedef struct {
+    mpz_srcptr n;
+    const factor_params *fp;
+    rho_kernel rho;
+    atomic_bool *stop;       // set by the first walker that splits n
+    pthread_mutex_t *lock;   // guards *result
+    mpz_ptr result;
+    atomic_uint_fast64_t *next;  // next unclaimed restart index
+    unsigned long seed;      // per-walker RNG stream
+    unsigned tid;
+    work_counts done;        // this walker's work, filled in on exit
+    uint64_t restarts;       // restarts it began
+} rho_walker;
+
+static void pin_self(const factor_params *fp, unsigned tid) {
+    if (!fp->ncpus || tp_pool) return;     // pool workers are pinned once, by index
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(fp->cpus[tid % fp->ncpus], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set); // best effort
+}
+
+static void *rho_walker_main(void *arg) {
+    rho_walker *w = (rho_walker*)arg;
+    const factor_params *fp = w->fp;
+    pin_self(fp, w->tid);
+    thread_deadline_us = fp_deadline_us(fp);
+
+    gmp_randstate_t rng;
+    gmp_randinit_default(rng);
+    gmp_randseed_ui(rng, w->seed);
+
+    uint64_t restarts = fp->rho_restarts ? fp->rho_restarts : 256;
+    ck_slot *s = ck_slot_open(fp->ck, false);
+    const work_counts w0 = work;
+
+    mpz_t g; mpz_init(g);
+    // restarts are claimed in order from the shared counter (walks left
+    // mid-round by --resume first)
+    for (;;) {
+        if (stop_requested(w->stop)) break;
+        if (fp_expired(fp)) break;
+        uint64_t r = ck_claim(s, w->next);
+        if (r >= restarts) break;
+        w->restarts++;
+        uint64_t it0 = work.rho_iters;
+        w->rho(g, w->n, rng, rho_budget(fp, r), w->stop, s);
+        factor_stats *live = fp->stats->live ? fp->stats->live : fp->stats;
+        atomic_fetch_add_explicit(&live->live_restarts, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&live->live_rho_iters, work.rho_iters - it0, memory_order_relaxed);
+        if (mpz_cmp_ui(g,1)>0 && mpz_cmp(g,w->n)<0) {
+            pthread_mutex_lock(w->lock);
+            if (!atomic_load(w->stop)) {
+                mpz_set(w->result, g);
+                atomic_store(w->stop, true);
+            }
+            pthread_mutex_unlock(w->lock);
+            break;
+        }
+    }
+    w->done = work_since(&w0);
+    ck_slot_close(fp->ck, s);
+    mpz_clear(g);
+    gmp_randclear(rng);
+    return NULL;
+}
+
+/* Run rho restarts on fp->threads walkers; returns 1 and sets d on success. */
+static int parallel_rho(mpz_t d, const mpz_t n, gmp_randstate_t rng, rho_kernel rho,
+                        const factor_params *fp) {
+    unsigned nt = fp->threads ? fp->threads : 1;
+    atomic_bool stop = false;
+    atomic_uint_fast64_t next0 = 0;
+    atomic_uint_fast64_t *next = fp->ck ? &fp->ck->core.next : &next0;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    mpz_t result; mpz_init_set_ui(result, 0);
+
+    rho_walker *ws = (rho_walker*)calloc(nt, sizeof(rho_walker));
+    if (!ws) { mpz_clear(result); return 0; }
+
+    cancel_attach(fp, &stop);
+    for (unsigned t=0; t<nt; ++t) {
+        ws[t] = (rho_walker){ .n = n, .fp = fp, .rho = rho, .stop = &stop, .lock = &lock,
+                              .result = result, .next = next,
+                              .seed = gmp_urandomb_ui(rng, 32), .tid = t };
+    }
+    gang_run(rho_walker_main, ws, sizeof *ws, nt);
+    cancel_attach(fp, NULL);
+    for (unsigned t=0; t<nt; ++t) {
+        stats_work(fp->stats, &ws[t].done);
+        fp->stats->rho_restarts += ws[t].restarts;
+    }
+
+    int ok = mpz_cmp_ui(result, 1) > 0;
+    if (ok) mpz_set(d, result);
+    mpz_clear(result);
+    pthread_mutex_destroy(&lock);
+    free(ws);
+    return ok;
+}
+
+/* ---------- parallel ECM curves (pthreads) ---------- */
+
+typedef struct {
+    mpz_srcptr n;
+    const factor_params *fp;
+    atomic_bool *stop;
+    pthread_mutex_t *lock;       // guards *result
+    mpz_ptr result;
+    atomic_uint_fast64_t *next;  // next unclaimed curve index
+    ecm_record *recs;            // recs[i] belongs to whoever claimed curve i < nrec;
+    uint64_t nrec;               // recs[nrec] to the first split found past them
+    unsigned long seed;
+    unsigned tid;
+    uint64_t ran;                // curves it finished
+} ecm_worker;
+
+static void *ecm_worker_main(void *arg) {
+    ecm_worker *w = (ecm_worker*)arg;
+    const factor_params *fp = w->fp;
+    pin_self(fp, w->tid);
+    thread_deadline_us = fp_deadline_us(fp);
+
+    gmp_randstate_t rng;
+    gmp_randinit_default(rng);
+    gmp_randseed_ui(rng, w->seed);
+    ck_slot *s = ck_slot_open(fp->ck, true);
+
+    mpz_t g; mpz_init(g);
+    for (;;) {
+        uint64_t i = ck_claim(s, w->next);
+        if (i >= fp->ecm_curves) break;
+        if (stop_requested(w->stop)) break;
+        if (fp_expired(fp)) break;
+        uint64_t sigma = 6 + gmp_urandomb_ui(rng, 32);
+        int stage = ecm_curve_run(g, w->n, sigma, fp->ecm_B1, fp->ecm_B2, w->stop);
+        if (stage < 0) break;   // stopped or out of time: not a curve that ran
+        w->ran++;
+        ecm_record *r = i < w->nrec ? &w->recs[i] : NULL;
+        if (stage > 0) {
+            pthread_mutex_lock(w->lock);
+            if (!atomic_load(w->stop)) {
+                mpz_set(w->result, g);
+                atomic_store(w->stop, true);
+                if (!r) r = &w->recs[w->nrec];
+            }
+            pthread_mutex_unlock(w->lock);
+        }
+        if (r) {
+            r->sigma = sigma;
+            r->stage = stage;
+            if (stage > 0) r->factor = mpz_to_cstr(g);
+        }
+        if (stage > 0) break;
+    }
+    ck_slot_close(fp->ck, s);
+    mpz_clear(g);
+    gmp_randclear(rng);
+    return NULL;
+}
+
+/* Curves listed per composite in "ecm" (plus the one that split it); any
+ * further curves run but are only counted, in "ecm_curves_run". */
+#define ECM_RECORDS 4096u
+
+/* Run fp->ecm_curves curves on fp->threads workers; returns 1 and sets d on success. */
+static int parallel_ecm(mpz_t d, const mpz_t n, gmp_randstate_t rng, const factor_params *fp) {
+    unsigned nt = fp->threads ? fp->threads : 1;
+    if ((uint64_t) nt > fp->ecm_curves) nt = (unsigned) fp->ecm_curves;
+    atomic_bool stop = false;
+    atomic_uint_fast64_t next0 = 0;
+    atomic_uint_fast64_t *next = fp->ck ? &fp->ck->core.next : &next0;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    mpz_t result; mpz_init_set_ui(result, 0);
+
+    const uint64_t nrec = fp->ecm_curves < ECM_RECORDS ? fp->ecm_curves : ECM_RECORDS;
+    ecm_record *recs = (ecm_record*)calloc(nrec + 1, sizeof(ecm_record));
+    ecm_worker *ws = (ecm_worker*)calloc(nt, sizeof(ecm_worker));
+    if (!recs || !ws) { free(recs); free(ws); mpz_clear(result); return 0; }
+    for (uint64_t i=0; i<=nrec; ++i) { recs[i].bits = bits_of(n); recs[i].stage = -1; }
+
+    cancel_attach(fp, &stop);
+    for (unsigned t=0; t<nt; ++t) {
+        ws[t] = (ecm_worker){ .n = n, .fp = fp, .stop = &stop, .lock = &lock, .result = result,
+                              .next = next, .recs = recs, .nrec = nrec,
+                              .seed = gmp_urandomb_ui(rng, 32), .tid = t };
+    }
+    gang_run(ecm_worker_main, ws, sizeof *ws, nt);
+    cancel_attach(fp, NULL);
+
+    // keep the curves that actually ran, in claim order
+    factor_stats *st = fp->stats;
+    for (unsigned t=0; t<nt; ++t) st->ecm_curves_run += ws[t].ran;
+    for (uint64_t i=0; i<=nrec; ++i) {
+        if (recs[i].stage < 0) continue;
+        if (st->ecm_len == st->ecm_cap) {
+            size_t ncap = st->ecm_cap ? st->ecm_cap*2 : 64;
+            ecm_record *nr = (ecm_record*)realloc(st->ecm, ncap*sizeof(ecm_record));
+            if (!nr) { free(recs[i].factor); continue; }
+            st->ecm = nr; st->ecm_cap = ncap;
+        }
+        st->ecm[st->ecm_len++] = recs[i];
+    }
+
+    int ok = mpz_cmp_ui(result, 1) > 0;
+    if (ok) mpz_set(d, result);
+    mpz_clear(result);
+    pthread_mutex_destroy(&lock);
+    free(recs); free(ws);
+    return ok;
+}
+
+/* ---------- SIQS (self-initialising quadratic sieve) ---------- */
+
+/* For n of roughly 60..160 bits.  kn (Knuth-Schroeppel multiplier k) is
+ * sieved with polynomials (Ax+B)^2 - kn, A = q_1...q_s over factor-base
+ * primes, the 2^(s-1) B values per A walked in Gray-code order so each switch
+ * is one add per root.  The interval is sieved in SIQS_BLOCK-byte blocks with
+ * byte logs; survivors are trial divided with mpz and kept as full relations
+ * or single-large-prime partials (paired on the large prime).  Dependencies
+ * come from singleton pruning plus dense GF(2) elimination on packed rows.
+ * Every --threads worker sieves its own A values into the shared store. */
+
+#define SIQS_MIN_BITS   72       // find_split() range for SIQS
+#define SIQS_MAX_BITS   160
+#define SIQS_BLOCK      32768
+#define SIQS_SMALL_P    30u      // primes below this are not sieved
+#define SIQS_EXTRA_RELS 64
+#define SIQS_MAX_COLS   320      // prime factors of one |V| (< 2^300), with repeats
+
+typedef struct {
+    int bits;                    // size of n
+    uint32_t fb_size;
+    uint32_t blocks;             // per side: M = blocks * SIQS_BLOCK
+    uint32_t lp_mult;            // large prime bound = lp_mult * max fb prime
+} siqs_param;
+
+static const siqs_param siqs_params[] = {
+    {  50,   60, 1,  20 },
+    {  64,  100, 1,  30 },
+    {  80,  150, 1,  30 },
+    {  96,  230, 1,  40 },
+    { 112,  330, 1,  40 },
+    { 128,  480, 1,  50 },
+    { 144,  700, 2,  60 },
+    { 160, 1000, 2,  70 },
+    { 176, 1500, 3,  80 },
+    { 192, 2200, 4,  90 },
+};
+
+typedef struct {
+    mpz_t Y;                     // (Ax+B), Y^2 == V (mod kn)
+    uint32_t *col;               // columns of V's factorisation, with repeats
+    uint32_t ncol;
+    uint64_t L;                  // large prime (1 => full relation)
+} siqs_rel;
+
+typedef struct {
+    uint32_t a, b;               // raw relation indexes; b == UINT32_MAX => single
+} siqs_row;
+
+typedef struct {
+    mpz_srcptr n;
+    mpz_t kn;
+    unsigned long k;
+    uint32_t *fb;                // fb[0] = 2, then odd primes with (kn|p) != -1
+    uint32_t *sqrtkn;
+    uint8_t *logp;
+    uint32_t fb_len;
+    uint32_t sieve_from;         // first fb index that is sieved
+    int M;                       // half interval
+    uint64_t lp_max;
+    uint8_t thresh;
+    int s;                       // primes in A
+    uint32_t qlo, qhi;           // window of fb indexes for A's primes
+    mpz_t target_A;
+
+    pthread_mutex_t lock;        // guards everything below
+    siqs_rel *rels;
+    uint32_t nrels, rels_cap;
+    siqs_row *rows;
+    uint32_t nrows, rows_cap;
+    uint64_t *lp_key;            // open addressing: large prime -> raw relation
+    uint32_t *lp_val;
+    uint32_t lp_cap, lp_used;
+    uint32_t needed;             // rows wanted (columns + extra)
+    uint64_t polys;
+    atomic_bool done;
+
+    const factor_params *fp;
+} siqs_ctx;
+
+/* ---- small modular helpers (p < 2^32) ---- */
+
+static uint32_t powmod_u32(uint32_t a, uint32_t e, uint32_t p) {
+    uint64_t r = 1, b = a % p;
+    while (e) {
+        if (e & 1) r = r * b % p;
+        b = b * b % p;
+        e >>= 1;
+    }
+    return (uint32_t) r;
+}
+
+static uint32_t invmod_u32(uint32_t a, uint32_t p) {
+    int64_t t = 0, nt = 1, r = p, nr = a % p;
+    while (nr) {
+        int64_t q = r / nr, tmp;
+        tmp = t - q*nt; t = nt; nt = tmp;
+        tmp = r - q*nr; r = nr; nr = tmp;
+    }
+    if (t < 0) t += p;
+    return (uint32_t) t;
+}
+
+/* Tonelli-Shanks; a must be a nonzero square mod odd prime p. */
+static uint32_t sqrtmod_u32(uint32_t a, uint32_t p) {
+    a %= p;
+    if (p % 4 == 3) return powmod_u32(a, (p+1)/4, p);
+    uint32_t q = p - 1, s = 0;
+    while (!(q & 1)) { q >>= 1; ++s; }
+    uint32_t z = 2;
+    while (powmod_u32(z, (p-1)/2, p) != p-1) ++z;
+    uint64_t c = powmod_u32(z, q, p), r = powmod_u32(a, (q+1)/2, p), t = powmod_u32(a, q, p);
+    uint32_t m = s;
+    while (t != 1) {
+        uint32_t i = 0; uint64_t tt = t;
+        while (tt != 1) { tt = tt * tt % p; ++i; }
+        uint64_t b = c;
+        for (uint32_t j=0; j+i+1<m; ++j) b = b * b % p;
+        r = r * b % p; c = b * b % p; t = t * c % p; m = i;
+    }
+    return (uint32_t) r;
+}
+
+/* Knuth-Schroeppel: pick k maximising the expected log contribution of small primes. */
+static unsigned long siqs_multiplier(const mpz_t n) {
+    static const unsigned long ks[] = { 1,2,3,5,6,7,10,11,13,14,15,17,19,21,22,23,26,
+                                        29,30,31,33,34,35,37,38,39,41,42,43,46,47,51,
+                                        53,55,57,58,59,61,62,65,66,67,69,70,71,73 };
+    unsigned long best = 1;
+    double best_f = -1e300;
+    mpz_t kn; mpz_init(kn);
+    for (size_t i=0; i<sizeof(ks)/sizeof(ks[0]); ++i) {
+        unsigned long k = ks[i];
+        mpz_mul_ui(kn, n, k);
+        double f = -0.5 * log((double) k);
+        unsigned long m8 = mpz_fdiv_ui(kn, 8);
+        if (m8 == 1) f += 2.0 * log(2.0);
+        else if (m8 == 5) f += log(2.0);
+        else if (m8 == 3 || m8 == 7) f += 0.5 * log(2.0);
+        for (size_t j=1; j<small_primes_len && small_primes[j] < 100; ++j) {
+            unsigned p = small_primes[j];
+            unsigned long r = mpz_fdiv_ui(kn, p);
+            if (r == 0) f += log((double) p) / p;
+            else if (powmod_u32((uint32_t) r, (p-1)/2, p) == 1) f += 2.0 * log((double) p) / (p - 1);
+        }
+        if (f > best_f) { best_f = f; best = k; }
+    }
+    mpz_clear(kn);
+    return best;
+}
+
+typedef struct {
+    siqs_ctx *S;
+    uint32_t want;
+    uint32_t got;
+    int stop;                    // n itself shares a factor-base prime
+    uint32_t hit;
+} siqs_fb_build;
+
+static int siqs_fb_prime(uint64_t p, void *ctx) {
+    siqs_fb_build *b = (siqs_fb_build*)ctx;
+    siqs_ctx *S = b->S;
+    if (p == 2) {
+        S->fb[0] = 2; S->sqrtkn[0] = 1; S->logp[0] = 1;
+        b->got = 1;
+        return 0;
+    }
+    if (mpz_fdiv_ui(S->n, (unsigned long) p) == 0) { b->stop = 1; b->hit = (uint32_t) p; return 1; }
+    uint32_t r = (uint32_t) mpz_fdiv_ui(S->kn, (unsigned long) p);
+    if (r != 0 && powmod_u32(r, ((uint32_t) p - 1)/2, (uint32_t) p) != 1) return 0;
+    S->fb[b->got] = (uint32_t) p;
+    S->sqrtkn[b->got] = r ? sqrtmod_u32(r, (uint32_t) p) : 0;
+    S->logp[b->got] = (uint8_t) lrint(log2((double) p));
+    return ++b->got == b->want;
+}
+
+static int siqs_sieved(const siqs_ctx *S, uint32_t i) {
+    return i >= S->sieve_from && S->sqrtkn[i] != 0;
+}
+
+/* ---- relation store (caller holds S->lock) ---- */
+
+static void siqs_add_row(siqs_ctx *S, uint32_t a, uint32_t b) {
+    if (S->nrows == S->rows_cap) {
+        uint32_t ncap = S->rows_cap ? S->rows_cap*2 : 1024;
+        siqs_row *nr = (siqs_row*)realloc(S->rows, ncap*sizeof(siqs_row));
+        if (!nr) return;
+        S->rows = nr; S->rows_cap = ncap;
+    }
+    S->rows[S->nrows++] = (siqs_row){ a, b };
+    if (S->nrows >= S->needed) atomic_store(&S->done, true);
+}
+
+static int siqs_lp_grow(siqs_ctx *S);
+
+/* A partial that cannot be placed (no memory to grow a full table) is kept
+ * as a relation but never paired. */
+static void siqs_lp_insert(siqs_ctx *S, uint64_t L, uint32_t rel) {
+    if (2*(S->lp_used + 1) > S->lp_cap && siqs_lp_grow(S) && S->lp_used + 1 >= S->lp_cap) return;
+    uint32_t mask = S->lp_cap - 1, h = (uint32_t)((L * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+    while (S->lp_key[h]) h = (h + 1) & mask;
+    S->lp_key[h] = L; S->lp_val[h] = rel;
+    S->lp_used++;
+}
+
+/* Double the table; -1 (old table kept) if either array cannot be had. */
+static int siqs_lp_grow(siqs_ctx *S) {
+    uint32_t ncap = S->lp_cap ? S->lp_cap*2 : 4096;
+    uint64_t *nk = (uint64_t*)calloc(ncap, sizeof(uint64_t));
+    uint32_t *nv = (uint32_t*)calloc(ncap, sizeof(uint32_t));
+    if (!nk || !nv) { free(nk); free(nv); return -1; }
+    uint32_t mask = ncap - 1;
+    for (uint32_t i=0; i<S->lp_cap; ++i) {
+        uint64_t L = S->lp_key[i];
+        if (!L) continue;
+        uint32_t h = (uint32_t)((L * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+        while (nk[h]) h = (h + 1) & mask;
+        nk[h] = L; nv[h] = S->lp_val[i];
+    }
+    free(S->lp_key); free(S->lp_val);
+    S->lp_key = nk; S->lp_val = nv; S->lp_cap = ncap;
+    return 0;
+}
+
+static int siqs_lp_find(const siqs_ctx *S, uint64_t L, uint32_t *rel) {
+    if (!S->lp_cap) return 0;
+    uint32_t mask = S->lp_cap - 1, h = (uint32_t)((L * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+    while (S->lp_key[h]) {
+        if (S->lp_key[h] == L) { *rel = S->lp_val[h]; return 1; }
+        h = (h + 1) & mask;
+    }
+    return 0;
+}
+
+/* Takes ownership of col; Y is copied. */
+static void siqs_store(siqs_ctx *S, const mpz_t Y, uint32_t *col, uint32_t ncol, uint64_t L) {
+    pthread_mutex_lock(&S->lock);
+    uint32_t other = 0;
+    int pair = L > 1 && siqs_lp_find(S, L, &other);
+    if (pair && mpz_cmp(S->rels[other].Y, Y) == 0) {   // same relation seen twice
+        pthread_mutex_unlock(&S->lock);
+        free(col);
+        return;
+    }
+    if (S->nrels == S->rels_cap) {
+        uint32_t ncap = S->rels_cap ? S->rels_cap*2 : 1024;
+        siqs_rel *nr = (siqs_rel*)realloc(S->rels, ncap*sizeof(siqs_rel));
+        if (!nr) { pthread_mutex_unlock(&S->lock); free(col); return; }
+        S->rels = nr; S->rels_cap = ncap;
+    }
+    uint32_t id = S->nrels++;
+    siqs_rel *r = &S->rels[id];
+    mpz_init_set(r->Y, Y);
+    r->col = col; r->ncol = ncol; r->L = L;
+    if (L == 1)     siqs_add_row(S, id, UINT32_MAX);
+    else if (pair)  siqs_add_row(S, other, id);
+    else            siqs_lp_insert(S, L, id);
+    pthread_mutex_unlock(&S->lock);
+}
+
+/* ---- sieving worker ---- */
+
+typedef struct {
+    siqs_ctx *S;
+    unsigned long seed;
+    unsigned tid;
+} siqs_worker;
+
+typedef struct {
+    siqs_ctx *S;
+    gmp_randstate_t rng;
+    mpz_t A, B, Y, V, t;
+    mpz_t *Bj;                   // s terms, B = sum sgn_j * Bj[j]
+    int *sgn;
+    uint32_t *qidx;              // fb indexes of A's primes
+    uint32_t *root1, *root2;     // roots in interval coordinates (x + M) mod p
+    uint32_t *next1, *next2;
+    uint32_t *delta;             // delta[j*fb_len + i] = 2 Bj Ainv mod p
+    uint8_t *isA;                // fb index divides A
+    uint8_t *sieve;
+    uint32_t *col;
+    uint32_t col_cap;
+} siqs_local;
+
+static void siqs_new_A(siqs_local *W) {
+    siqs_ctx *S = W->S;
+    const uint32_t fl = S->fb_len;
+    int s = S->s;
+    for (;;) {
+        memset(W->isA, 0, fl);
+        mpz_set_ui(W->A, 1);
+        int ok = 1;
+        for (int j=0; j<s-1; ++j) {
+            uint32_t i, tries = 0;
+            do {
+                i = S->qlo + (uint32_t) gmp_urandomm_ui(W->rng, S->qhi - S->qlo);
+            } while ((W->isA[i] || S->sqrtkn[i] == 0) && ++tries < 100);
+            if (W->isA[i] || S->sqrtkn[i] == 0) { ok = 0; break; }
+            W->isA[i] = 1; W->qidx[j] = i;
+            mpz_mul_ui(W->A, W->A, S->fb[i]);
+        }
+        if (!ok) continue;
+        // last prime: the fb prime closest to target/A
+        mpz_tdiv_q(W->t, S->target_A, W->A);
+        uint64_t want = mpz_fits_ulong_p(W->t) ? mpz_get_ui(W->t) : UINT64_MAX;
+        uint32_t best = UINT32_MAX; uint64_t bd = UINT64_MAX;
+        for (uint32_t i=S->sieve_from; i<fl; ++i) {
+            if (W->isA[i] || S->sqrtkn[i] == 0) continue;
+            uint64_t p = S->fb[i], dd = p > want ? p - want : want - p;
+            if (dd < bd) { bd = dd; best = i; }
+        }
+        if (best == UINT32_MAX) continue;
+        W->isA[best] = 1; W->qidx[s-1] = best;
+        mpz_mul_ui(W->A, W->A, S->fb[best]);
+        break;
+    }
+
+    // B_j = (A/q_j) * gamma_j, gamma_j = sqrt(kn) * (A/q_j)^-1 mod q_j, |gamma_j| <= q_j/2
+    mpz_set_ui(W->B, 0);
+    for (int j=0; j<s; ++j) {
+        uint32_t q = S->fb[W->qidx[j]];
+        mpz_divexact_ui(W->t, W->A, q);
+        uint64_t g = (uint64_t) S->sqrtkn[W->qidx[j]] * invmod_u32((uint32_t) mpz_fdiv_ui(W->t, q), q) % q;
+        if (g > q/2) g = q - g;
+        mpz_mul_ui(W->Bj[j], W->t, (unsigned long) g);
+        mpz_add(W->B, W->B, W->Bj[j]);
+        W->sgn[j] = 1;
+    }
+
+    // roots of (Ax+B)^2 == kn: x = Ainv (+-sqrt(kn) - B) mod p
+    for (uint32_t i=S->sieve_from; i<fl; ++i) {
+        if (!siqs_sieved(S, i) || W->isA[i]) continue;
+        uint32_t p = S->fb[i];
+        uint64_t ainv = invmod_u32((uint32_t) mpz_fdiv_ui(W->A, p), p);
+        uint64_t b = mpz_fdiv_ui(W->B, p), Mp = (uint64_t) S->M % p;
+        uint64_t r1 = ainv * ((S->sqrtkn[i] + p - b) % p) % p;
+        uint64_t r2 = ainv * ((2ull*p - S->sqrtkn[i] - b) % p) % p;
+        W->root1[i] = (uint32_t)((r1 + Mp) % p);
+        W->root2[i] = (uint32_t)((r2 + Mp) % p);
+        for (int j=0; j<s; ++j)
+            W->delta[(size_t) j*fl + i] = (uint32_t)(2 * ainv % p * mpz_fdiv_ui(W->Bj[j], p) % p);
+    }
+}
+
+/* Flip the sign of Bj[j]: B -= 2 sgn_j Bj, roots += sgn_j * delta_j. */
+static void siqs_next_B(siqs_local *W, int j) {
+    siqs_ctx *S = W->S;
+    const uint32_t fl = S->fb_len;
+    const uint32_t *dj = W->delta + (size_t) j*fl;
+    if (W->sgn[j] > 0) {
+        mpz_submul_ui(W->B, W->Bj[j], 2);
+        for (uint32_t i=S->sieve_from; i<fl; ++i) {
+            if (!siqs_sieved(S, i) || W->isA[i]) continue;
+            uint32_t p = S->fb[i], d = dj[i];
+            uint32_t a = W->root1[i] + d; W->root1[i] = a >= p ? a - p : a;
+            uint32_t b = W->root2[i] + d; W->root2[i] = b >= p ? b - p : b;
+        }
+    } else {
+        mpz_addmul_ui(W->B, W->Bj[j], 2);
+        for (uint32_t i=S->sieve_from; i<fl; ++i) {
+            if (!siqs_sieved(S, i) || W->isA[i]) continue;
+            uint32_t p = S->fb[i], d = dj[i];
+            W->root1[i] = W->root1[i] >= d ? W->root1[i] - d : W->root1[i] + p - d;
+            W->root2[i] = W->root2[i] >= d ? W->root2[i] - d : W->root2[i] + p - d;
+        }
+    }
+    W->sgn[j] = -W->sgn[j];
+}
+
+static void siqs_push_col(siqs_local *W, uint32_t c) {
+    if (W->col_cap < SIQS_MAX_COLS) W->col[W->col_cap++] = c;
+}
+
+/* Trial divide V = Y^2 - kn at interval index ix; stores a relation if smooth. */
+static void siqs_check(siqs_local *W, uint32_t ix) {
+    siqs_ctx *S = W->S;
+    const uint32_t fl = S->fb_len;
+    mpz_mul_si(W->Y, W->A, (long) ix - S->M);
+    mpz_add(W->Y, W->Y, W->B);
+    mpz_mul(W->V, W->Y, W->Y);
+    mpz_sub(W->V, W->V, S->kn);
+
+    W->col = (uint32_t*)malloc(SIQS_MAX_COLS * sizeof(uint32_t));
+    if (!W->col) return;
+    W->col_cap = 0;
+    if (mpz_sgn(W->V) < 0) { siqs_push_col(W, 0); mpz_neg(W->V, W->V); }
+    while (mpz_even_p(W->V)) { mpz_tdiv_q_2exp(W->V, W->V, 1); siqs_push_col(W, 1); }
+    for (uint32_t i=1; i<fl; ++i) {
+        uint32_t p = S->fb[i];
+        int hit;
+        if (siqs_sieved(S, i) && !W->isA[i]) {
+            uint32_t r = ix % p;
+            hit = (r == W->root1[i] || r == W->root2[i]);
+        } else {
+            hit = mpz_divisible_ui_p(W->V, p) != 0;
+        }
+        if (!hit) continue;
+        while (mpz_divisible_ui_p(W->V, p)) {
+            mpz_divexact_ui(W->V, W->V, p);
+            siqs_push_col(W, i + 1);
+        }
+    }
+    uint64_t L = 0;
+    if (mpz_cmp_ui(W->V, 1) == 0) L = 1;
+    else if (mpz_fits_ulong_p(W->V) && mpz_get_ui(W->V) <= S->lp_max) L = mpz_get_ui(W->V);
+    if (!L || W->col_cap == SIQS_MAX_COLS) { free(W->col); W->col = NULL; return; }
+    siqs_store(S, W->Y, W->col, W->col_cap, L);
+    W->col = NULL;
+}
+
+static void siqs_sieve_poly(siqs_local *W) {
+    siqs_ctx *S = W->S;
+    const uint32_t fl = S->fb_len, span = 2u * (uint32_t) S->M;
+    const uint8_t init = (uint8_t)(0x80 - S->thresh);
+
+    for (uint32_t i=S->sieve_from; i<fl; ++i) { W->next1[i] = W->root1[i]; W->next2[i] = W->root2[i]; }
+    for (uint32_t base=0; base<span; base+=SIQS_BLOCK) {
+        const uint32_t end = base + SIQS_BLOCK;
+        memset(W->sieve, init, SIQS_BLOCK);
+        for (uint32_t i=S->sieve_from; i<fl; ++i) {
+            if (!siqs_sieved(S, i) || W->isA[i]) continue;
+            const uint32_t p = S->fb[i];
+            const uint8_t lg = S->logp[i];
+            uint32_t a = W->next1[i], b = W->next2[i];
+            for (; a < end; a += p) W->sieve[a - base] += lg;
+            for (; b < end; b += p) W->sieve[b - base] += lg;
+            W->next1[i] = a; W->next2[i] = b;
+        }
+        // scan eight cells at a time for the high bit
+        const uint64_t *w = (const uint64_t*) W->sieve;
+        for (uint32_t k=0; k<SIQS_BLOCK/8; ++k) {
+            if (!(w[k] & 0x8080808080808080ull)) continue;
+            for (uint32_t j=0; j<8; ++j)
+                if (W->sieve[8*k + j] & 0x80) siqs_check(W, base + 8*k + j);
+        }
+    }
+}
+
+static void *siqs_worker_main(void *arg) {
+    siqs_worker *wk = (siqs_worker*)arg;
+    siqs_ctx *S = wk->S;
+    const factor_params *fp = S->fp;
+    pin_self(fp, wk->tid);
+
+    const uint32_t fl = S->fb_len;
+    const int s = S->s;
+    siqs_local W = { .S = S };
+    gmp_randinit_default(W.rng);
+    gmp_randseed_ui(W.rng, wk->seed);
+    mpz_inits(W.A, W.B, W.Y, W.V, W.t, NULL);
+    W.Bj = (mpz_t*)malloc(s * sizeof(mpz_t));
+    for (int j=0; j<s; ++j) mpz_init(W.Bj[j]);
+    W.sgn = (int*)malloc(s * sizeof(int));
+    W.qidx = (uint32_t*)malloc(s * sizeof(uint32_t));
+    W.root1 = (uint32_t*)calloc(fl, sizeof(uint32_t));
+    W.root2 = (uint32_t*)calloc(fl, sizeof(uint32_t));
+    W.next1 = (uint32_t*)calloc(fl, sizeof(uint32_t));
+    W.next2 = (uint32_t*)calloc(fl, sizeof(uint32_t));
+    W.delta = (uint32_t*)calloc((size_t) s * fl, sizeof(uint32_t));
+    W.isA = (uint8_t*)calloc(fl, 1);
+    W.sieve = (uint8_t*)aligned_alloc(64, SIQS_BLOCK);
+
+    if (W.sgn && W.qidx && W.root1 && W.root2 && W.next1 && W.next2 && W.delta && W.isA && W.sieve) {
+        while (!atomic_load_explicit(&S->done, memory_order_relaxed)) {
+            if (fp_expired(fp)) break;
+            siqs_new_A(&W);
+            uint32_t npoly = 1u << (s - 1);
+            for (uint32_t k=0; k<npoly; ++k) {
+                if (k) siqs_next_B(&W, __builtin_ctz(k));
+                siqs_sieve_poly(&W);
+                if (atomic_load_explicit(&S->done, memory_order_relaxed)) break;
+            }
+            pthread_mutex_lock(&S->lock);
+            S->polys += npoly;
+            pthread_mutex_unlock(&S->lock);
+        }
+    }
+
+    free(W.sieve); free(W.isA); free(W.delta);
+    free(W.next2); free(W.next1); free(W.root2); free(W.root1);
+    free(W.qidx); free(W.sgn);
+    for (int j=0; j<s; ++j) mpz_clear(W.Bj[j]);
+    free(W.Bj);
+    mpz_clears(W.A, W.B, W.Y, W.V, W.t, NULL);
+    gmp_randclear(W.rng);
+    return NULL;
+}
+
+/* ---- linear algebra over GF(2) and square root ---- */
+
+/* Sum the column counts of one matrix row into e[] and multiply its Y's
+ * (and its paired large prime, once) into X / Lprod. */
+static void siqs_row_accum(const siqs_ctx *S, const siqs_row *rw, uint32_t *e, mpz_t X, mpz_t Lprod) {
+    const siqs_rel *r = &S->rels[rw->a];
+    for (uint32_t c=0; c<r->ncol; ++c) e[r->col[c]]++;
+    mpz_mul(X, X, r->Y); mpz_mod(X, X, S->n);
+    if (rw->b != UINT32_MAX) {
+        const siqs_rel *q = &S->rels[rw->b];
+        for (uint32_t c=0; c<q->ncol; ++c) e[q->col[c]]++;
+        mpz_mul(X, X, q->Y); mpz_mod(X, X, S->n);
+        mpz_mul_ui(Lprod, Lprod, (unsigned long) r->L); mpz_mod(Lprod, Lprod, S->n);
+    }
+}
+
+static int siqs_solve(mpz_t d, siqs_ctx *S) {
+    const uint32_t ncols = S->fb_len + 1;      // column 0 = sign, column i+1 = fb[i]
+    uint32_t nr = S->nrows;
+    if (nr == 0) return 0;
+
+    uint32_t *cnt = (uint32_t*)calloc(ncols, sizeof(uint32_t));
+    uint8_t *alive = (uint8_t*)malloc(nr);
+    uint32_t *e = (uint32_t*)calloc(ncols, sizeof(uint32_t));
+    if (!cnt || !alive || !e) { free(cnt); free(alive); free(e); return 0; }
+    memset(alive, 1, nr);
+
+    // parity of every row, one byte per column, for singleton pruning
+    uint8_t *par = (uint8_t*)calloc((size_t) nr * ncols, 1);
+    if (!par) { free(cnt); free(alive); free(e); return 0; }
+    mpz_t X, Lp; mpz_inits(X, Lp, NULL);
+    for (uint32_t r=0; r<nr; ++r) {
+        const siqs_row *rw = &S->rows[r];
+        const siqs_rel *a = &S->rels[rw->a];
+        for (uint32_t c=0; c<a->ncol; ++c) par[(size_t) r*ncols + a->col[c]] ^= 1;
+        if (rw->b != UINT32_MAX) {
+            const siqs_rel *b = &S->rels[rw->b];
+            for (uint32_t c=0; c<b->ncol; ++c) par[(size_t) r*ncols + b->col[c]] ^= 1;
+        }
+        for (uint32_t c=0; c<ncols; ++c) cnt[c] += par[(size_t) r*ncols + c];
+    }
+    // structured step: drop rows holding a column nobody else has
+    for (int changed = 1; changed; ) {
+        changed = 0;
+        for (uint32_t r=0; r<nr; ++r) {
+            if (!alive[r]) continue;
+            const uint8_t *pr = par + (size_t) r*ncols;
+            uint32_t c = 0;
+            for (; c<ncols; ++c) if (pr[c] && cnt[c] == 1) break;
+            if (c == ncols) continue;
+            alive[r] = 0; changed = 1;
+            for (c=0; c<ncols; ++c) cnt[c] -= pr[c];
+        }
+    }
+    // compact live columns and rows into packed bit matrices
+    uint32_t *cmap = (uint32_t*)malloc(ncols * sizeof(uint32_t));
+    uint32_t nc = 0;
+    for (uint32_t c=0; c<ncols; ++c) cmap[c] = cnt[c] ? nc++ : UINT32_MAX;
+    uint32_t *ridx = (uint32_t*)malloc(nr * sizeof(uint32_t));
+    uint32_t m = 0;
+    for (uint32_t r=0; r<nr; ++r) if (alive[r]) ridx[m++] = r;
+
+    int found = 0;
+    size_t cw = (nc + 63) / 64, hw = (m + 63) / 64, rw = cw + hw;
+    uint64_t *mat = (m && cmap && ridx) ? (uint64_t*)calloc((size_t) m * rw, sizeof(uint64_t)) : NULL;
+    if (mat) {
+        for (uint32_t i=0; i<m; ++i) {
+            uint64_t *row = mat + (size_t) i*rw;
+            const uint8_t *pr = par + (size_t) ridx[i]*ncols;
+            for (uint32_t c=0; c<ncols; ++c)
+                if (pr[c]) row[cmap[c] >> 6] |= 1ull << (cmap[c] & 63);
+            row[cw + (i >> 6)] |= 1ull << (i & 63);      // history: which rows were combined
+        }
+        // forward elimination; rows that end up zero on the left are dependencies
+        uint32_t rank = 0;
+        for (uint32_t c=0; c<nc && rank<m; ++c) {
+            uint64_t bit = 1ull << (c & 63);
+            size_t wi = c >> 6;
+            uint32_t piv = rank;
+            while (piv < m && !(mat[(size_t) piv*rw + wi] & bit)) ++piv;
+            if (piv == m) continue;
+            if (piv != rank)
+                for (size_t k=0; k<rw; ++k) {
+                    uint64_t t = mat[(size_t) piv*rw + k];
+                    mat[(size_t) piv*rw + k] = mat[(size_t) rank*rw + k];
+                    mat[(size_t) rank*rw + k] = t;
+                }
+            const uint64_t *pr = mat + (size_t) rank*rw;
+            for (uint32_t r=rank+1; r<m; ++r) {
+                uint64_t *row = mat + (size_t) r*rw;
+                if (row[wi] & bit) for (size_t k=wi; k<rw; ++k) row[k] ^= pr[k];
+            }
+            ++rank;
+        }
+        // each null row: X = prod Y, Y' = prod p^(e/2) * prod L; try gcd(X - Y', n)
+        mpz_t Yv, t; mpz_inits(Yv, t, NULL);
+        for (uint32_t r=rank; r<m && !found; ++r) {
+            const uint64_t *row = mat + (size_t) r*rw;
+            memset(e, 0, ncols * sizeof(uint32_t));
+            mpz_set_ui(X, 1); mpz_set_ui(Lp, 1);
+            for (uint32_t i=0; i<m; ++i)
+                if (row[cw + (i >> 6)] >> (i & 63) & 1) siqs_row_accum(S, &S->rows[ridx[i]], e, X, Lp);
+            int odd = 0;
+            mpz_set(Yv, Lp);
+            for (uint32_t c=1; c<ncols && !odd; ++c) {
+                if (e[c] & 1) { odd = 1; break; }
+                if (!e[c]) continue;
+                mpz_set_ui(t, S->fb[c-1]);
+                mpz_powm_ui(t, t, e[c] / 2, S->n);
+                mpz_mul(Yv, Yv, t); mpz_mod(Yv, Yv, S->n);
+            }
+            if (odd || (e[0] & 1)) continue;
+            mpz_sub(t, X, Yv);
+            mpz_gcd(t, t, S->n);
+            if (mpz_cmp_ui(t, 1) > 0 && mpz_cmp(t, S->n) < 0) { mpz_set(d, t); found = 1; }
+        }
+        mpz_clears(Yv, t, NULL);
+    }
+    mpz_clears(X, Lp, NULL);
+    free(mat); free(ridx); free(cmap);
+    free(par); free(e); free(alive); free(cnt);
+    return found;
+}
+
+static const siqs_param *siqs_pick(int bits, siqs_param *tmp) {
+    const size_t np = sizeof(siqs_params)/sizeof(siqs_params[0]);
+    if (bits <= siqs_params[0].bits) return &siqs_params[0];
+    if (bits >= siqs_params[np-1].bits) return &siqs_params[np-1];
+    size_t i = 1;
+    while (siqs_params[i].bits < bits) ++i;
+    const siqs_param *lo = &siqs_params[i-1], *hi = &siqs_params[i];
+    double f = (double)(bits - lo->bits) / (hi->bits - lo->bits);
+    tmp->bits = bits;
+    tmp->fb_size = (uint32_t) lrint(lo->fb_size + f * (hi->fb_size - lo->fb_size));
+    tmp->blocks = f < 0.5 ? lo->blocks : hi->blocks;
+    tmp->lp_mult = (uint32_t) lrint(lo->lp_mult + f * (hi->lp_mult - lo->lp_mult));
+    return tmp;
+}
+
+/* Returns 1 and sets d to a proper factor of n on success. */
+static int siqs_factor(mpz_t d, const mpz_t n, gmp_randstate_t rng, const factor_params *fp) {
+    if (mpz_perfect_square_p(n)) { mpz_sqrt(d, n); return 1; }
+
+    siqs_param tmp;
+    const siqs_param *P = siqs_pick(bits_of(n), &tmp);
+    siqs_ctx *S = (siqs_ctx*)calloc(1, sizeof(siqs_ctx));
+    if (!S) return 0;
+    S->n = n;
+    S->fp = fp;
+    S->k = siqs_multiplier(n);
+    mpz_init(S->kn);
+    mpz_mul_ui(S->kn, n, S->k);
+    mpz_init(S->target_A);
+    pthread_mutex_init(&S->lock, NULL);
+    atomic_init(&S->done, false);
+
+    int found = 0;
+    S->fb = (uint32_t*)malloc(P->fb_size * sizeof(uint32_t));
+    S->sqrtkn = (uint32_t*)malloc(P->fb_size * sizeof(uint32_t));
+    S->logp = (uint8_t*)malloc(P->fb_size);
+    if (!S->fb || !S->sqrtkn || !S->logp) goto out;
+
+    siqs_fb_build fb = { .S = S, .want = P->fb_size, .got = 0, .stop = 0, .hit = 0 };
+    sieve_range(2, UINT32_MAX, siqs_fb_prime, &fb);
+    if (fb.stop) { mpz_set_ui(d, fb.hit); found = mpz_cmp_ui(n, fb.hit) != 0; goto out; }
+    S->fb_len = fb.got;
+    S->sieve_from = 1;
+    while (S->sieve_from < S->fb_len && S->fb[S->sieve_from] < SIQS_SMALL_P) ++S->sieve_from;
+    S->M = (int)(P->blocks * SIQS_BLOCK);
+    uint32_t pmax = S->fb[S->fb_len - 1];
+    S->lp_max = (uint64_t) pmax * P->lp_mult;
+
+    // target A = sqrt(2 kn) / M; pick s so that A's primes sit mid-to-high in the base
+    mpz_mul_2exp(S->target_A, S->kn, 1);
+    mpz_sqrt(S->target_A, S->target_A);
+    mpz_tdiv_q_ui(S->target_A, S->target_A, (unsigned long) S->M);
+    double tbits = (double) mpz_sizeinbase(S->target_A, 2);
+    double qbits = log2((double) S->fb[S->fb_len * 2 / 3]);
+    S->s = (int) lrint(tbits / qbits);
+    if (S->s < 2) S->s = 2;
+    if (S->s > 20) S->s = 20;
+    double qwant = exp2(tbits / S->s);
+    uint32_t qi = S->sieve_from;
+    while (qi + 1 < S->fb_len && S->fb[qi] < qwant) ++qi;
+    uint32_t half = 10 + 2 * (uint32_t) S->s;
+    S->qlo = qi > S->sieve_from + half ? qi - half : S->sieve_from;
+    S->qhi = qi + half < S->fb_len ? qi + half : S->fb_len;
+    if (S->qhi - S->qlo < (uint32_t) S->s + 2) goto out;
+
+    // threshold: log2 of a typical |V/A| = M sqrt(kn/2), less the large prime slack
+    double vbits = log2((double) S->M) + 0.5 * (double) mpz_sizeinbase(S->kn, 2) - 0.5;
+    double thr = vbits - log2((double) S->lp_max) - 2.0;
+    if (thr < 8) thr = 8;
+    if (thr > 120) thr = 120;
+    S->thresh = (uint8_t) lrint(thr);
+    S->needed = S->fb_len + 1 + SIQS_EXTRA_RELS;
+
+    unsigned nt = fp->threads ? fp->threads : 1;
+    for (int round = 0; round < 4 && !found; ++round) {
+        atomic_store(&S->done, false);
+        cancel_attach(fp, &S->done);
+        siqs_worker *ws = (siqs_worker*)calloc(nt, sizeof(siqs_worker));
+        if (!ws) break;
+        for (unsigned t=0; t<nt; ++t)
+            ws[t] = (siqs_worker){ .S = S, .seed = gmp_urandomb_ui(rng, 32), .tid = t };
+        gang_run(siqs_worker_main, ws, sizeof *ws, nt);
+        free(ws);
+        if (S->nrows < S->needed) break;           // timed out or cancelled
+        found = siqs_solve(d, S);
+        S->needed += SIQS_EXTRA_RELS;              // unlucky: gather a few more
+    }
+    cancel_attach(fp, NULL);
+    fp->stats->siqs_rels += S->nrows;
+    fp->stats->siqs_polys += S->polys;
+
+out:
+    for (uint32_t i=0; i<S->nrels; ++i) { mpz_clear(S->rels[i].Y); free(S->rels[i].col); }
+    free(S->rels); free(S->rows);
+    free(S->lp_key); free(S->lp_val);
+    free(S->fb); free(S->sqrtkn); free(S->logp);
+    mpz_clears(S->kn, S->target_A, NULL);
+    pthread_mutex_destroy(&S->lock);
+    free(S);
+    return found;
+}
+
+/* ---------- deep trial division (sieved primes, word-sized products) ---------- */
+
+/* Every prime <= --trial_B is divided out once, up front, with its
+ * multiplicity.  Primes stream from sieve_range() and are packed into
+ * products below 2^64, so one mpz_tdiv_ui() screens a whole group; only a
+ * group whose remainder shares a factor with it is split prime by prime.
+ * When n is longer than a block of such words, n is first reduced modulo
+ * the block's product (one level of a remainder tree), so each word then
+ * costs a division of that short remainder instead of n. */
+
+#define TD_BLOCK     64         // words per block
+#define TD_GROUP_MAX 15         // 2*3*5*...*47 is the longest prime product < 2^64
+#define TD_MIN_B     150        // always cover the small_primes table
+
+typedef struct {
+    mpz_ptr n;
+    factor_list *out;
+    uint64_t w[TD_BLOCK];                  // closed group products of this block
+    uint8_t np[TD_BLOCK];                  // primes per closed group
+    uint32_t p[(TD_BLOCK + 1) * TD_GROUP_MAX];
+    size_t nw, nprimes;                    // closed words; primes stored (incl. open group)
+    uint64_t open;                         // product of the open group
+    size_t nopen;
+    mpz_t P, r;
+} td_ctx;
+
+static void td_close_group(td_ctx *T) {
+    if (!T->nopen) return;
+    T->w[T->nw] = T->open;
+    T->np[T->nw++] = (uint8_t) T->nopen;
+    T->nopen = 0;
+    T->open = 1;
+}
+
+static void td_flush_block(td_ctx *T) {
+    td_close_group(T);
+    mpz_srcptr src = T->n;
+    if (mpz_size(T->n) > TD_BLOCK) {
+        prod_tree_words(T->P, T->w, T->nw);
+        mpz_tdiv_r(T->r, T->n, T->P);
+        src = T->r;
+    }
+    const uint32_t *p = T->p;
+    for (size_t i=0; i<T->nw; p += T->np[i++]) {
+        uint64_t rem = mpz_tdiv_ui(src, (unsigned long) T->w[i]);
+        for (size_t j=0; j<T->np[i]; ++j) {
+            if (rem % p[j]) continue;            // a few word divisions beat a gcd
+            int e = 0;
+            while (mpz_divisible_ui_p(T->n, p[j])) { mpz_divexact_ui(T->n, T->n, p[j]); ++e; }
+            if (e) {
+                mpz_set_ui(T->P, p[j]);
+                fl_push(T->out, T->P, e);
+            }
+        }
+    }
+    T->nw = 0;
+    T->nprimes = 0;
+}
+
+static int td_prime(uint64_t p, void *ctx) {
+    td_ctx *T = (td_ctx*)ctx;
+    if (mpz_cmp_ui(T->n, (unsigned long)(p * p)) < 0) {
+        // what is left is 1 or a prime: factors below p are all pending
+        td_flush_block(T);
+        return 1;
+    }
+    if (T->nopen && T->open > UINT64_MAX / p) {
+        td_close_group(T);
+        if (T->nw == TD_BLOCK) td_flush_block(T);
+    }
+    T->p[T->nprimes++] = (uint32_t) p;
+    T->open *= p;
+    T->nopen++;
+    return 0;
+}
+
+/* Primes up to TD_CACHE_B are sieved once and kept for the life of the
+ * process (batch, serve), growing by doubling as larger B are asked for;
+ * superseded arrays are retired, not freed, so a pointer handed out stays
+ * valid until td_primes_free(). */
+
+#define TD_CACHE_B (1u << 24)   // ~1.08M primes, 4 MB
+
+typedef struct td_primes_arr {
+    uint32_t *p;
+    size_t len;
+    uint64_t B;                 // holds every prime <= B
+    struct td_primes_arr *older;
+} td_primes_arr;
+
+static td_primes_arr *td_primes = NULL;
+static pthread_mutex_t td_primes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    uint32_t *p;
+    size_t len, cap;
+} td_collect_ctx;
+
+static int td_collect(uint64_t p, void *ctx) {
+    td_collect_ctx *c = (td_collect_ctx*)ctx;
+    if (c->len == c->cap) {
+        size_t ncap = c->cap ? c->cap*2 : 4096;
+        uint32_t *np = (uint32_t*)realloc(c->p, ncap*sizeof(uint32_t));
+        if (!np) return 1;
+        c->p = np; c->cap = ncap;
+    }
+    c->p[c->len++] = (uint32_t) p;
+    return 0;
+}
+
+/* Ascending primes covering at least [2, B] (B <= TD_CACHE_B); NULL if out
+ * of memory.  *len counts all of them, so some may exceed B. */
+static const uint32_t *td_primes_get(uint64_t B, size_t *len) {
+    pthread_mutex_lock(&td_primes_lock);
+    if (!td_primes || td_primes->B < B) {
+        uint64_t nb = td_primes ? td_primes->B * 2 : 65536;
+        if (nb < B) nb = B;
+        if (nb > TD_CACHE_B) nb = TD_CACHE_B;
+        td_collect_ctx c = { NULL, 0, 0 };
+        td_primes_arr *a = (td_primes_arr*)malloc(sizeof *a);
+        if (a && !sieve_range(2, nb, td_collect, &c)) {
+            *a = (td_primes_arr){ .p = c.p, .len = c.len, .B = nb, .older = td_primes };
+            td_primes = a;
+        } else {
+            free(a);
+            free(c.p);
+        }
+    }
+    const td_primes_arr *a = td_primes && td_primes->B >= B ? td_primes : NULL;
+    pthread_mutex_unlock(&td_primes_lock);
+    if (!a) return NULL;
+    *len = a->len;
+    return a->p;
+}
+
+static void td_primes_free(void) {
+    pthread_mutex_lock(&td_primes_lock);
+    while (td_primes) {
+        td_primes_arr *a = td_primes;
+        td_primes = a->older;
+        free(a->p);
+        free(a);
+    }
+    pthread_mutex_unlock(&td_primes_lock);
+}
+
+/* Divide every prime <= B (at least the small_primes table) out of n,
+ * pushing each with its multiplicity.  B must stay below 2^32. */
+static void trial_strip(mpz_t n, factor_list *out, uint64_t B) {
+    if (mpz_cmp_ui(n, 1) <= 0) return;
+    if (B < TD_MIN_B) B = TD_MIN_B;
+    td_ctx *T = (td_ctx*)malloc(sizeof *T);
+    if (!T) return;
+    T->n = n; T->out = out;
+    T->nw = T->nprimes = T->nopen = 0;
+    T->open = 1;
+    mpz_inits(T->P, T->r, NULL);
+
+    // cached primes first, then sieve whatever lies above TD_CACHE_B
+    uint64_t cb = B < TD_CACHE_B ? B : TD_CACHE_B;
+    size_t np = 0;
+    const uint32_t *pr = td_primes_get(cb, &np);
+    int stopped = 0;
+    for (size_t i=0; pr && i<np && pr[i] <= cb && !stopped; ++i) stopped = td_prime(pr[i], T);
+    if (!stopped) stopped = sieve_range(pr ? cb + 1 : 2, B, td_prime, T);
+    if (!stopped) td_flush_block(T);
+    mpz_clears(T->P, T->r, NULL);
+    free(T);
+}
+
+/* ---------- small cofactors (n < 2^64, machine words) ---------- */
+
+/* Word-sized cofactors are finished here without touching GMP: trial
+ * division, perfect powers, then Hart's one-line method backed by Lehman
+ * up to 42 bits and a 64-bit Montgomery Brent rho above that.  (SQUFOF
+ * lost to this rho at every size from 36 to 62 bits, so it is not used.) */
+
+#if HAVE_RHO128
+#define SMALL_MAX_BITS  64
+#define SMALL_HART_BITS 42     // Hart/Lehman at or below, rho above
+#define SMALL_HART_MULT 480    // Hart's multiplier: s^2 - 480*i*n is square more often
+
+static uint64_t gcd64(uint64_t a, uint64_t b) {
+    // binary (Stein) gcd
+    if (!a) return b;
+    if (!b) return a;
+    int sh = __builtin_ctzll(a | b);
+    a >>= __builtin_ctzll(a);
+    do {
+        b >>= __builtin_ctzll(b);
+        if (a > b) { uint64_t t = a; a = b; b = t; }
+        b -= a;
+    } while (b);
+    return a << sh;
+}
+
+/* floor(sqrt(x)) for x < 2^62 via double precision, fixed up by one step */
+static inline uint64_t isqrt_u62(uint64_t x) {
+    uint64_t r = (uint64_t) sqrt((double) x);
+    if (r * r > x) --r;
+    else if ((r+1) * (r+1) <= x) ++r;
+    return r;
+}
+
+static bool is_square_u64(uint64_t x, uint64_t *root) {
+    // squares mod 64 first: rejects 52 of 64 residues without a sqrt
+    if (!((0x0202021202030213ull >> (x & 63)) & 1)) return false;
+    uint64_t r = x < ((uint64_t)1 << 62) ? isqrt_u62(x) : isqrt_u64(x);
+    if (r * r != x) return false;
+    *root = r;
+    return true;
+}
+
+/* r^k, or UINT64_MAX once it exceeds lim. */
+static uint64_t pow_u64_sat(uint64_t r, unsigned k, uint64_t lim) {
+    uint64_t p = 1;
+    for (unsigned i=0; i<k; ++i) {
+        if (r && p > lim / r) return UINT64_MAX;
+        p *= r;
+    }
+    return p;
+}
+
+/* floor(n^(1/k)) for k >= 2 */
+static uint64_t iroot_u64(uint64_t n, unsigned k) {
+    uint64_t r = (uint64_t) powl((long double) n, 1.0L / k);
+    while (r && pow_u64_sat(r, k, n) > n) --r;
+    while (pow_u64_sat(r + 1, k, n) <= n) ++r;
+    return r;
+}
+
+/* Replace *n by its smallest root; returns the exponent.  *n has no prime
+ * factor below 151 here, so only k in {2,3,5,7} can apply. */
+static unsigned strip_power_u64(uint64_t *n) {
+    static const unsigned ks[] = { 2, 3, 5, 7 };
+    unsigned e = 1;
+    for (size_t i=0; i<sizeof(ks)/sizeof(ks[0]); ) {
+        uint64_t r = iroot_u64(*n, ks[i]);
+        if (r > 1 && pow_u64_sat(r, ks[i], *n) == *n) { *n = r; e *= ks[i]; continue; }
+        ++i;
+    }
+    return e;
+}
+
+/* Hart's one-line factoring: s = ceil(sqrt(M*i*n)), s^2 - M*i*n a square t^2
+ * gives gcd(s - t, n).  Returns 0 when the iteration limit runs out. */
+static uint64_t hart_olf(uint64_t n) {
+    const uint64_t mn = SMALL_HART_MULT * n;
+    const uint64_t imax = ((uint64_t)1 << 62) / mn;     // keeps i*mn < 2^62
+    for (uint64_t i=1, in = mn; i <= imax; ++i, in += mn) {
+        uint64_t s = isqrt_u62(in), t;
+        if (s * s < in) ++s;
+        if (is_square_u64(s * s - in, &t)) {
+            uint64_t g = gcd64(s - t, n);
+            if (g > 1 && g < n) return g;
+        }
+    }
+    return 0;
+}
+
+/* Lehman: complete for n < 2^42 once trial division reaches n^(1/3). */
+static uint64_t lehman(uint64_t n) {
+    uint64_t c = iroot_u64(n, 3) + 1;
+    for (uint64_t p = 151; p <= c; p += 2)
+        if (n % p == 0) return p;
+    const double n6 = pow((double) n, 1.0 / 6.0);
+    for (uint64_t k = 1; k <= c; ++k) {
+        uint64_t fkn = 4 * k * n;
+        uint64_t a = isqrt_u64(fkn), b;
+        if (a * a < fkn) ++a;
+        uint64_t amax = (uint64_t)(sqrt((double) fkn) + n6 / (4.0 * sqrt((double) k)));
+        for (; a <= amax; ++a) {
+            if (is_square_u64(a * a - fkn, &b)) {
+                uint64_t g = gcd64(a + b, n);
+                if (g > 1 && g < n) return g;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Brent rho mod odd composite n in Montgomery form; retries with new c. */
+static uint64_t brent_rho64(uint64_t n) {
+    const mont64 M = mont64_setup(n);
+    const uint64_t m = 128;                   // steps per gcd
+    for (uint64_t c0 = 1; ; ++c0) {
+        const uint64_t c = mont64_from(c0, &M);
+        uint64_t y = mont64_from(c0 + 1, &M), x = y, ys = y, q = M.one, g = 1;
+#define RHO64_STEP(v) ((v) = add64_mod(mont64_mul((v), (v), &M), c, n))
+        for (uint64_t r = 1; g == 1 && r <= ((uint64_t)1 << 26); r *= 2) {
+            x = y;
+            for (uint64_t i=0; i<r; ++i) RHO64_STEP(y);
+            for (uint64_t k=0; k<r && g == 1; k += m) {
+                ys = y;
+                uint64_t lim = (r - k < m) ? r - k : m;
+                for (uint64_t i=0; i<lim; ++i) {
+                    RHO64_STEP(y);
+                    q = mont64_mul(q, sub64_mod(x, y, n), &M);
+                }
+                g = gcd64(q, n);
+            }
+        }
+        if (g == n) {
+            do {
+                RHO64_STEP(ys);
+                g = gcd64(sub64_mod(x, ys, n), n);
+            } while (g == 1);
+        }
+#undef RHO64_STEP
+        if (g > 1 && g < n) return g;
+    }
+}
+
+/* Nontrivial divisor of an odd composite n with no factor below 151 that
+ * is not a perfect power. */
+static uint64_t small_split(uint64_t n) {
+    uint64_t d = 0;
+    if (64 - __builtin_clzll(n) <= SMALL_HART_BITS) {
+        d = hart_olf(n);
+        if (!d) d = lehman(n);
+    }
+    return d ? d : brent_rho64(n);
+}
+
+static void small_push(factor_list *out, uint64_t p, int e) {
+    mpz_t z; mpz_init(z);
+    mpz_set_u128(z, p);
+    fl_push(out, z, e);
+    mpz_clear(z);
+}
+
+/* Push the full factorization of n^e into out. */
+static void factor_small(uint64_t n, int e, factor_list *out) {
+    for (size_t i=0; i<small_primes_len && n > 1; ++i) {
+        unsigned p = small_primes[i];
+        int k = 0;
+        while (n % p == 0) { n /= p; ++k; }
+        if (k) small_push(out, p, k * e);
+    }
+    if (n == 1) return;
+    e *= (int) strip_power_u64(&n);
+    if (is_prime_u64(n)) { small_push(out, n, e); return; }
+    uint64_t d = small_split(n);
+    factor_small(d, e, out);
+    factor_small(n / d, e, out);
+}
+#else
+#define SMALL_MAX_BITS 0
+#endif
+
+/* ---------- known-factor cache (--cache FILE) ---------- */
+
+/* Results outlive the run in an append-only file shared by any number of
+ * processes.  After a 16-byte header it holds records
+ *   fc_rec | n | entries
+ * where n and each entry are a word (limb count | exponent << 32) followed
+ * by the limbs.  An entry with exponent 0 is a cofactor still unsplit, so a
+ * record says "n is prime", "n is this product of primes" or "n is these
+ * primes times a composite rest".  Appends are one write() under flock();
+ * readers mmap the file and keep an in-memory index from n's hash to the
+ * best record for it, catching up on what others appended when a lookup
+ * misses.  A torn tail (a writer died mid-record) is cut off by the next
+ * writer.  Only n above FC_MIN_BITS are stored: smaller ones factor faster
+ * than a lookup. */
+
+#define FC_MAGIC    "cprime cache v1\n"
+#define FC_HEAD     16
+#define FC_TAG      0x31524346u     // "FCR1"
+#define FC_MIN_BITS 64
+
+enum { FC_NONE = 0, FC_PARTIAL = 1, FC_FULL = 2, FC_PRIME = 3 };
+
+typedef struct {
+    uint32_t tag;
+    uint32_t words;         // record length in 8-byte words, this header included
+    uint64_t key;           // fc_hash() of n
+    uint64_t sum;           // fc_hash() of the words after the header
+    uint32_t kind;          // FC_PRIME | FC_FULL | FC_PARTIAL
+    uint32_t nents;         // entries after n
+} fc_rec;
+
+static pthread_mutex_t fc_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *fc_path;
+static int fc_fd = -1;
+static const uint8_t *fc_map;
+static size_t fc_maplen, fc_end;        // mapped bytes; end of the last valid record
+static uint64_t *fc_ix;                 // open addressing: record offsets (0 = empty)
+static size_t fc_ixcap, fc_ixlen;
+
+static uint64_t fc_hash(const uint64_t *w, size_t n) {
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ n;
+    for (size_t i=0; i<n; ++i) {
+        h ^= w[i];
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+static const fc_rec *fc_at(uint64_t off) { return (const fc_rec*)(fc_map + off); }
+
+/* n's limbs inside the record at off. */
+static const uint64_t *fc_n(uint64_t off, size_t *len) {
+    const uint64_t *w = (const uint64_t*)(fc_map + off + sizeof(fc_rec));
+    *len = (size_t) (uint32_t) w[0];
+    return w + 1;
+}
+
+static bool fc_same_n(uint64_t off, const uint64_t *limbs, size_t len) {
+    size_t l;
+    const uint64_t *w = fc_n(off, &l);
+    return l == len && !memcmp(w, limbs, len * sizeof *w);
+}
+
+static void fc_ix_put(uint64_t off);
+
+static bool fc_ix_grow(void) {
+    size_t ncap = fc_ixcap ? fc_ixcap * 2 : 1024;
+    uint64_t *old = fc_ix;
+    size_t ocap = fc_ixcap;
+    fc_ix = (uint64_t*)calloc(ncap, sizeof *fc_ix);
+    if (!fc_ix) { fc_ix = old; return false; }
+    fc_ixcap = ncap;
+    fc_ixlen = 0;
+    for (size_t i=0; i<ocap; ++i) if (old[i]) fc_ix_put(old[i]);
+    free(old);
+    return true;
+}
+
+/* Index the record at off; a record of at least the same kind replaces the older one. */
+static void fc_ix_put(uint64_t off) {
+    if (2 * (fc_ixlen + 1) > fc_ixcap && !fc_ix_grow()) return;
+    size_t len;
+    const uint64_t *limbs = fc_n(off, &len);
+    size_t mask = fc_ixcap - 1;
+    for (size_t i = fc_at(off)->key & mask; ; i = (i + 1) & mask) {
+        if (!fc_ix[i]) { fc_ix[i] = off; fc_ixlen++; return; }
+        if (fc_at(fc_ix[i])->key == fc_at(off)->key && fc_same_n(fc_ix[i], limbs, len)) {
+            if (fc_at(off)->kind >= fc_at(fc_ix[i])->kind) fc_ix[i] = off;
+            return;
+        }
+    }
+}
+
+/* Map what the file holds now and index the records past fc_end. */
+static void fc_refresh(void) {
+    struct stat sb;
+    if (fstat(fc_fd, &sb) != 0 || (size_t) sb.st_size <= fc_maplen) return;
+    if (fc_map) munmap((void*) fc_map, fc_maplen);
+    fc_map = (const uint8_t*)mmap(NULL, (size_t) sb.st_size, PROT_READ, MAP_SHARED, fc_fd, 0);
+    if (fc_map == MAP_FAILED) { fc_map = NULL; fc_maplen = 0; return; }
+    fc_maplen = (size_t) sb.st_size;
+    if (fc_end < FC_HEAD) fc_end = FC_HEAD;
+    while (fc_end + sizeof(fc_rec) <= fc_maplen) {
+        const fc_rec *r = fc_at(fc_end);
+        size_t bytes = (size_t) r->words * 8;
+        if (r->tag != FC_TAG || bytes < sizeof(fc_rec) + 8 || bytes > fc_maplen - fc_end) break;
+        const uint64_t *body = (const uint64_t*)(r + 1);
+        size_t nlen = (size_t) (uint32_t) body[0];
+        if (r->sum != fc_hash(body, (bytes - sizeof(fc_rec)) / 8) || 1 + nlen > (bytes - sizeof(fc_rec)) / 8) break;
+        fc_ix_put(fc_end);
+        fc_end += bytes;
+    }
+}
+
+static void fc_close_locked(void) {
+    if (fc_map) munmap((void*) fc_map, fc_maplen);
+    if (fc_fd >= 0) close(fc_fd);
+    free(fc_ix);
+    free(fc_path);
+    fc_map = NULL; fc_maplen = fc_end = 0;
+    fc_ix = NULL; fc_ixcap = fc_ixlen = 0;
+    fc_fd = -1;
+    fc_path = NULL;
+}
+
+/* Use the cache at path (created if missing).  NULL, or the error tag. */
+static const char *fc_open(const char *path) {
+    const char *err = NULL;
+    pthread_mutex_lock(&fc_lock);
+    if (!fc_path || strcmp(fc_path, path)) {
+        fc_close_locked();
+        fc_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        char head[FC_HEAD];
+        if (fc_fd < 0 || flock(fc_fd, LOCK_EX) != 0) {
+            err = "bad_cache";
+        } else {
+            ssize_t got = pread(fc_fd, head, FC_HEAD, 0);
+            if (got == 0) {
+                if (write(fc_fd, FC_MAGIC, FC_HEAD) != FC_HEAD) err = "bad_cache";
+            } else if (got != FC_HEAD || memcmp(head, FC_MAGIC, FC_HEAD)) {
+                err = "bad_cache";
+            }
+            flock(fc_fd, LOCK_UN);
+        }
+        if (!err) {
+            fc_path = strdup(path);
+            fc_refresh();
+        } else {
+            fc_close_locked();
+        }
+    }
+    pthread_mutex_unlock(&fc_lock);
+    return err;
+}
+
+static void fc_close(void) {
+    pthread_mutex_lock(&fc_lock);
+    fc_close_locked();
+    pthread_mutex_unlock(&fc_lock);
+}
+
+static bool fc_active(void) {
+    pthread_mutex_lock(&fc_lock);
+    bool on = fc_path != NULL;
+    pthread_mutex_unlock(&fc_lock);
+    return on;
+}
+
+static uint64_t fc_probe(const uint64_t *limbs, size_t len, uint64_t key) {
+    if (!fc_ixcap || !fc_map) return 0;
+    size_t mask = fc_ixcap - 1;
+    for (size_t i = key & mask; fc_ix[i]; i = (i + 1) & mask)
+        if (fc_at(fc_ix[i])->key == key && fc_same_n(fc_ix[i], limbs, len)) return fc_ix[i];
+    return 0;
+}
+
+/* What the cache knows about n: FC_PRIME, FC_FULL (its primes pushed to
+ * out), FC_PARTIAL (known primes pushed, the unsplit rest in rest) or FC_NONE. */
+static int fc_lookup(const mpz_t n, factor_list *out, mpz_t rest) {
+    if (mpz_sizeinbase(n, 2) <= FC_MIN_BITS) return FC_NONE;
+    size_t len = mpz_size(n);
+    const uint64_t *limbs = (const uint64_t*)mpz_limbs_read(n);
+    uint64_t key = fc_hash(limbs, len);
+    int kind = FC_NONE;
+    pthread_mutex_lock(&fc_lock);
+    if (fc_path) {
+        uint64_t off = fc_probe(limbs, len, key);
+        if (!off) { fc_refresh(); off = fc_probe(limbs, len, key); }
+        if (off) {
+            const fc_rec *r = fc_at(off);
+            kind = (int) r->kind;
+            const uint64_t *w = (const uint64_t*)(r + 1);
+            w += 1 + (uint32_t) w[0];
+            mpz_set_ui(rest, 1);
+            for (uint32_t i=0; i<r->nents; ++i) {
+                size_t l = (size_t) (uint32_t) w[0];
+                int e = (int) (w[0] >> 32);
+                mpz_t x;
+                mpz_roinit_n(x, (const mp_limb_t*)(w + 1), (mp_size_t) l);
+                if (e) fl_push(out, x, e); else mpz_set(rest, x);
+                w += 1 + l;
+            }
+            if (kind == FC_PRIME) fl_push(out, n, 1);
+        }
+    }
+    pthread_mutex_unlock(&fc_lock);
+    return kind;
+}
+
+static void fc_put_mpz(uint64_t *w, size_t *at, const mpz_t x, int e) {
+    size_t l = mpz_size(x);
+    w[(*at)++] = (uint64_t) l | (uint64_t) (uint32_t) e << 32;
+    memcpy(w + *at, mpz_limbs_read(x), l * sizeof *w);
+    *at += l;
+}
+
+/* Append what is known about n: kind, its primes in fl (FC_FULL and
+ * FC_PARTIAL) and the unsplit rest (FC_PARTIAL).  A partial record with
+ * no primes says nothing a lookup could use, so it is not written. */
+static void fc_store(const mpz_t n, int kind, const factor_list *fl, const mpz_t rest) {
+    if (mpz_sizeinbase(n, 2) <= FC_MIN_BITS || !fc_active()) return;
+    if (kind == FC_PARTIAL && !fl->len) return;
+    size_t words = sizeof(fc_rec) / 8 + 1 + mpz_size(n);
+    size_t nents = 0;
+    if (kind != FC_PRIME) {
+        for (size_t i=0; i<fl->len; ++i) words += 1 + mpz_size(fl->p[i]);
+        nents = fl->len;
+        if (kind == FC_PARTIAL) { words += 1 + mpz_size(rest); nents++; }
+    }
+    uint64_t *w = (uint64_t*)calloc(words, sizeof *w);
+    if (!w) return;
+    size_t at = sizeof(fc_rec) / 8;
+    fc_put_mpz(w, &at, n, 1);
+    for (size_t i=0; kind != FC_PRIME && i<fl->len; ++i) fc_put_mpz(w, &at, fl->p[i], fl->e[i]);
+    if (kind == FC_PARTIAL) fc_put_mpz(w, &at, rest, 0);
+    fc_rec *r = (fc_rec*)w;
+    r->tag = FC_TAG;
+    r->words = (uint32_t) words;
+    r->key = fc_hash(w + sizeof(fc_rec) / 8 + 1, mpz_size(n));
+    r->sum = fc_hash(w + sizeof(fc_rec) / 8, words - sizeof(fc_rec) / 8);
+    r->kind = (uint32_t) kind;
+    r->nents = (uint32_t) nents;
+
+    pthread_mutex_lock(&fc_lock);
+    if (fc_fd >= 0 && flock(fc_fd, LOCK_EX) == 0) {
+        fc_refresh();
+        if (fc_end < fc_maplen && ftruncate(fc_fd, (off_t) fc_end) == 0) {   // a torn tail
+            munmap((void*) fc_map, fc_maplen);
+            fc_map = NULL;
+            fc_maplen = 0;
+            fc_refresh();
+        }
+        if (write(fc_fd, w, words * 8) != (ssize_t) (words * 8)) {
+            if (ftruncate(fc_fd, (off_t) fc_end) != 0) {}
+            fprintf(stderr, "{\"ok\":false,\"error\":\"cache_write\",\"arg\":\"%s\"}\n", fc_path);
+        }
+        flock(fc_fd, LOCK_UN);
+    }
+    pthread_mutex_unlock(&fc_lock);
+    free(w);
+}
+
+/* ---------- adaptive planner (--plan auto, --plan_stats FILE) ---------- */
+
+/* With --plan auto, find_split() does not walk the fixed P-1, ECM, SIQS, rho
+ * chain with the flag budgets.  It runs a sequence of attempts instead: P-1
+ * with B1 = PLAN_P1_B1 << level, ECM at the next digit level of plan_ecm[],
+ * SIQS once, or a round of rho walks of 2^(20+level) steps.  Before each
+ * attempt every method is ranked by p/c, the chance that its next attempt
+ * splits n over what it is expected to cost, and the best one runs.  A
+ * method that fails moves to its next level (dearer, and its p drops), so
+ * time shifts to the others as the run goes: greedy p/c order is what
+ * minimizes the expected time to the first split.
+ *
+ * p and c come from a table of (tries, wins, us) per 16-bit size bucket and
+ * method, with us scaled back to level 0.  Without history they come from
+ * plan_prior(); with --plan_stats FILE the table is loaded from FILE, kept
+ * for the whole process (batch and serve jobs learn from each other) and
+ * written back atomically when the subcommand ends.  FILE is text:
+ *   # cprime plan v1
+ *   <bucket low bits> <method> <tries> <wins> <level-0 us>
+ *
+ * Budget flags are ignored under the planner; --siqs 0 still keeps SIQS
+ * out.  --checkpoint / --resume runs keep the fixed chain. */
+
+#define PLAN_BUCKET_BITS 16
+#define PLAN_BUCKETS     64       // n above 1024 bits shares the last bucket
+#define PLAN_P1_B1       20000ul  // level-0 P-1 bound, B2 = 50 x B1
+#define PLAN_P1_LEVELS   11
+#define PLAN_RHO_LEVELS  17       // 2^20 .. 2^36 steps per walk
+#define PLAN_MAGIC       "# cprime plan v1"
+
+enum { PM_P1, PM_ECM, PM_SIQS, PM_RHO, PM_COUNT };
+static const char *const plan_names[PM_COUNT] = { "p1", "ecm", "siqs", "rho" };
+
+/* ECM digit levels (15..40 digits): B1 and curves per attempt. */
+static const struct { unsigned long B1; uint64_t curves; } plan_ecm[] = {
+    { 2000, 25 }, { 11000, 90 }, { 50000, 300 }, { 250000, 700 }, { 1000000, 1800 }, { 3000000, 5100 }
+};
+#define PLAN_ECM_LEVELS ((int)(sizeof plan_ecm / sizeof plan_ecm[0]))
+
+typedef struct { uint64_t tries, wins, us; } plan_cell;
+
+static plan_cell plan_cells[PLAN_BUCKETS][PM_COUNT];
+static char *plan_path = NULL;      // file behind plan_cells (NULL => this process only)
+static bool plan_dirty = false;
+static pthread_mutex_t plan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int plan_bucket(int bits) {
+    int b = bits / PLAN_BUCKET_BITS;
+    return b < PLAN_BUCKETS ? b : PLAN_BUCKETS - 1;
+}
+
+static int plan_levels(int m) {
+    switch (m) {
+        case PM_P1:  return PLAN_P1_LEVELS;
+        case PM_ECM: return PLAN_ECM_LEVELS;
+        case PM_SIQS: return 1;
+        default:     return PLAN_RHO_LEVELS;
+    }
+}
+
+/* Work of level L relative to level 0. */
+static double plan_scale(int m, int L) {
+    if (m == PM_SIQS) return 1.0;
+    if (m == PM_ECM)
+        return (double) plan_ecm[L].B1 * plan_ecm[L].curves / ((double) plan_ecm[0].B1 * plan_ecm[0].curves);
+    return ldexp(1.0, L);
+}
+
+/* Level-0 cost (us) and failure pseudo-count (against one success) for a
+ * method nobody has tried at this size yet.  SIQS nearly always finishes;
+ * its cost grows ~2^(bits/9) (bench: 2 ms at 80 bits, ~1 s at 160); rho
+ * needs ~2^(bits/4) steps for a balanced split. */
+static void plan_prior(int m, int nb, double *us, double *fails) {
+    switch (m) {
+        case PM_P1:   *us = 15000.0; *fails = 4.0; break;
+        case PM_ECM:  *us = 10000.0 * ((double) nb / 128.0) * ((double) nb / 128.0); *fails = 4.0; break;
+        case PM_SIQS: *us = 2000.0 * exp2((nb - 80) / 9.0); *fails = 0.05; break;
+        default:
+            *us = 50000.0;
+            *fails = fmax(1.0, exp2(nb / 4.0 - 20.0));
+            break;
+    }
+}
+
+static void plan_parse(FILE *f) {
+    char line[256];
+    while (fgets(line, sizeof line, f)) {
+        int bits;
+        char name[16];
+        unsigned long long tries, wins, us;
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%d %15s %llu %llu %llu", &bits, name, &tries, &wins, &us) != 5 || bits < 0) continue;
+        for (int m=0; m<PM_COUNT; ++m) {
+            if (strcmp(name, plan_names[m])) continue;
+            plan_cell *c = &plan_cells[plan_bucket(bits)][m];
+            c->tries += tries;
+            c->wins  += wins < tries ? wins : tries;
+            c->us    += us;
+        }
+    }
+}
+
+/* Write the table to plan_path (lock held). */
+static int plan_save(void) {
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *m = open_memstream(&buf, &len);
+    if (!m) return -1;
+    fprintf(m, "%s\n# bucket method tries wins us\n", PLAN_MAGIC);
+    for (int b=0; b<PLAN_BUCKETS; ++b)
+        for (int k=0; k<PM_COUNT; ++k) {
+            const plan_cell *c = &plan_cells[b][k];
+            if (c->tries)
+                fprintf(m, "%d %s %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+                        b * PLAN_BUCKET_BITS, plan_names[k], c->tries, c->wins, c->us);
+        }
+    fclose(m);
+    int rc = ck_write_file(plan_path, buf, len);
+    free(buf);
+    if (rc == 0) plan_dirty = false;
+    return rc;
+}
+
+/* Back the table with FILE (a missing FILE starts empty and is created
+ * at the end).  Returns NULL or an error tag. */
+static const char *plan_open(const char *path) {
+    const char *err = NULL;
+    pthread_mutex_lock(&plan_lock);
+    if (!plan_path || strcmp(plan_path, path)) {
+        if (plan_path && plan_dirty) plan_save();
+        free(plan_path);
+        plan_path = strdup(path);
+        memset(plan_cells, 0, sizeof plan_cells);
+        plan_dirty = false;
+        FILE *f = fopen(path, "r");
+        char head[64];
+        if (!f) {
+            if (errno != ENOENT) err = "bad_plan_stats";
+        } else {
+            if (!fgets(head, sizeof head, f) || strncmp(head, PLAN_MAGIC, strlen(PLAN_MAGIC)))
+                err = "bad_plan_stats";
+            else
+                plan_parse(f);
+            fclose(f);
+        }
+        if (err) { free(plan_path); plan_path = NULL; }
+    }
+    pthread_mutex_unlock(&plan_lock);
+    return err;
+}
+
+/* Save the table if it changed, and forget the file. */
+static void plan_close(void) {
+    pthread_mutex_lock(&plan_lock);
+    if (plan_path && plan_dirty && plan_save() != 0)
+        fprintf(stderr, "{\"ok\":false,\"error\":\"plan_stats_write\",\"arg\":\"%s\"}\n", plan_path);
+    free(plan_path);
+    plan_path = NULL;
+    pthread_mutex_unlock(&plan_lock);
+}
+
+static void plan_record(int nb, int m, int L, bool won, uint64_t us) {
+    pthread_mutex_lock(&plan_lock);
+    plan_cell *c = &plan_cells[plan_bucket(nb)][m];
+    c->tries++;
+    c->wins += won;
+    c->us += (uint64_t) ((double) us / plan_scale(m, L));
+    plan_dirty = true;
+    pthread_mutex_unlock(&plan_lock);
+}
+
+/* p/c of method m's attempt at level L on an nb-bit n. */
+static double plan_rank(int m, int L, int nb) {
+    double us0, fails;
+    plan_prior(m, nb, &us0, &fails);
+    pthread_mutex_lock(&plan_lock);
+    plan_cell c = plan_cells[plan_bucket(nb)][m];
+    pthread_mutex_unlock(&plan_lock);
+    if (c.tries) us0 = (double) c.us / (double) c.tries;
+    double p = (c.wins + 1.0) / (c.tries + 1.0 + fails);
+    double cost = fmax(us0, 1.0) * plan_scale(m, L);
+    return p / cost;
+}
+
+/* One attempt of method m at level L; returns the split's method name. */
+static const char *plan_attempt(mpz_t d, const mpz_t n, gmp_randstate_t rng, const factor_params *fp,
+                                int m, int L) {
+    factor_params q = *fp;
+    factor_stats *st = fp->stats;
+    const work_counts w0 = work;
+    const char *by = NULL;
+    uint64_t t0 = now_us();
+    fp_stage(fp, plan_names[m], n);
+    switch (m) {
+    case PM_P1: {
+        unsigned long B = PLAN_P1_B1 << L;
+        mpz_t b; mpz_init(b);
+        mpz_set_ui(d, 1);
+        pollard_p1_stage1(d, b, n, B, NULL);
+        st->p1_stage1_us += now_us() - t0;
+        by = "p1";
+        if (mpz_cmp_ui(d, 1) == 0) {
+            uint64_t t1 = now_us();
+            pollard_p1_stage2(d, b, n, B, 50ull * B, NULL);
+            st->p1_stage2_us += now_us() - t1;
+            by = "p1_stage2";
+        }
+        mpz_clear(b);
+        if (mpz_cmp_ui(d, 1) <= 0 || mpz_cmp(d, n) >= 0) by = NULL;
+        break;
+    }
+    case PM_ECM:
+        q.ecm_B1 = plan_ecm[L].B1;
+        q.ecm_B2 = 100ull * q.ecm_B1;
+        q.ecm_curves = plan_ecm[L].curves;
+        if (parallel_ecm(d, n, rng, &q)) by = "ecm";
+        st->ecm_us += now_us() - t0;
+        break;
+    case PM_SIQS:
+        if (siqs_factor(d, n, rng, fp)) by = "siqs";
+        st->siqs_us += now_us() - t0;
+        break;
+    default: {
+        rho_kernel rho = rho_kernel_for(n);
+        q.rho_restarts = q.threads ? q.threads : 1;
+        q.rho_iters = 1ull << (20 + L);
+        q.schedule = SCH_FIXED;
+        q.rho_cap = 0;
+        if (parallel_rho(d, n, rng, rho, &q)) by = "rho";
+        st->rho_us += now_us() - t0;
+        break;
+    }
+    }
+    if (m == PM_P1) {
+        const work_counts done = work_since(&w0);
+        stats_work(st, &done);
+    }
+    st->plan_attempts++;
+    // a cut-short attempt says nothing about the method
+    if (by || !fp_expired(fp)) plan_record(bits_of(n), m, L, by != NULL, now_us() - t0);
+    return by;
+}
+
+static const char *plan_split(mpz_t d, const mpz_t n, gmp_randstate_t rng, const factor_params *fp) {
+    int nb = bits_of(n);
+    int level[PM_COUNT] = {0};
+    if (!fp->siqs || nb < SIQS_MIN_BITS || nb > SIQS_MAX_BITS) level[PM_SIQS] = 1;
+    for (;;) {
+        if (fp_expired(fp)) return NULL;
+        int best = -1;
+        double best_rank = 0;
+        for (int m=0; m<PM_COUNT; ++m) {
+            if (level[m] >= plan_levels(m)) continue;
+            double r = plan_rank(m, level[m], nb);
+            if (best < 0 || r > best_rank) { best = m; best_rank = r; }
+        }
+        if (best < 0) return NULL;   // every method spent its last level
+        mpz_set_ui(d, 0);
+        const char *by = plan_attempt(d, n, rng, fp, best, level[best]);
+        if (by) return by;
+        level[best]++;
+    }
+}
+
+/* Split n into (d, n/d).  Returns the name of the method that found d, or
+ * NULL if none did (timeout, caps, cancel). */
+static const char *find_split(mpz_t d, const mpz_t n, gmp_randstate_t rng, const factor_params *fp) {
+    thread_deadline_us = fp_deadline_us(fp);
+    if (fp->plan && !fp->ck) return plan_split(d, n, rng, fp);
+    mpz_set_ui(d, 0);
+    ckpt *ck = fp->ck;      // stage bookkeeping for --checkpoint (NULL => none)
+    // (primes <= trial_B were stripped once by factor_full())
+
+    // 1) Optional Pollard P-1 stage 1, then stage 2 from its residue
+    if (fp->p1_B > 0) {
+        mpz_t p1d, b; mpz_inits(p1d, b, NULL);
+        mpz_set_ui(p1d, 1);
+        ck_slot *s = ck_slot_open(ck, false);
+        const char *by = "p1";
+        const work_counts w0 = work;
+        if (ck_enter(ck, CK_P1)) {
+            fp_stage(fp, "p1", n);
+            if (s) ck_claim(s, &ck->core.next);
+            uint64_t t0 = now_us();
+            pollard_p1_stage1(p1d, b, n, fp->p1_B, s);
+            fp->stats->p1_stage1_us += now_us() - t0;
+        }
+        if (mpz_cmp_ui(p1d,1) == 0 && fp->p1_B2 > fp->p1_B && !fp_expired(fp) && ck_enter(ck, CK_P1S2)) {
+            fp_stage(fp, "p1_stage2", n);
+            by = "p1_stage2";
+            if (s) {
+                // the stage-2 slot always carries its base: a resumed run
+                // that skipped stage 1 takes b from there
+                ck_claim(s, &ck->core.next);
+                ck_begin(s);
+                if (s->valid) mpz_set(b, s->y);
+                else { s->pos = 0; mpz_set_ui(s->x, 1); mpz_set(s->y, b); }
+                ck_answer(s);
+            }
+            uint64_t t1 = now_us();
+            pollard_p1_stage2(p1d, b, n, fp->p1_B, fp->p1_B2, s);
+            fp->stats->p1_stage2_us += now_us() - t1;
+        }
+        ck_slot_close(ck, s);
+        const work_counts done = work_since(&w0);
+        stats_work(fp->stats, &done);
+        if (mpz_cmp_ui(p1d,1)>0 && mpz_cmp(p1d,n)<0) { mpz_set(d, p1d); mpz_clears(p1d, b, NULL); return by; }
+        mpz_clears(p1d, b, NULL);
+        if (fp_expired(fp)) return NULL;    // P-1 may have stopped short: resume there
+    }
+
+    // 2) Optional ECM curves, spread over fp->threads workers
+    if (fp->ecm_curves > 0 && ck_enter(ck, CK_ECM)) {
+        fp_stage(fp, "ecm", n);
+        uint64_t t0 = now_us();
+        int ok = parallel_ecm(d, n, rng, fp);
+        fp->stats->ecm_us += now_us() - t0;
+        if (ok) return "ecm";
+    }
+
+    // 3) SIQS for mid-size n, after a short rho probe for small factors
+    int nb = bits_of(n);
+    if (fp->siqs && nb >= SIQS_MIN_BITS && nb <= SIQS_MAX_BITS && ck_enter(ck, CK_SIQS)) {
+        fp_stage(fp, "siqs", n);
+#if HAVE_RHO128
+        if (nb <= 128 && mpz_odd_p(n)) {
+            const work_counts w0 = work;
+            uint64_t t0 = now_us();
+            brent_rho128(d, n, rng, 1u << 16, NULL, NULL);
+            fp->stats->rho_us += now_us() - t0;
+            const work_counts done = work_since(&w0);
+            stats_work(fp->stats, &done);
+            if (mpz_cmp_ui(d,1) > 0) return "rho";
+        }
+#endif
+        uint64_t t0 = now_us();
+        int ok = siqs_factor(d, n, rng, fp);
+        fp->stats->siqs_us += now_us() - t0;
+        if (ok) return "siqs";
+    }
+
+    // 4) Pollard Rho (Brent) with restarts, spread over fp->threads walkers;
+    //    odd n up to MONTN_MAX limbs gets a fixed-width Montgomery kernel
+    rho_kernel rho = rho_kernel_for(n);
+    if (!ck_enter(ck, CK_RHO)) return NULL;
+    fp_stage(fp, "rho", n);
+    uint64_t t0 = now_us();
+    int ok = parallel_rho(d, n, rng, rho, fp);
+    fp->stats->rho_us += now_us() - t0;
+    return ok ? "rho" : NULL;
+}
+
+/* Finish n without splitting it when it is 1, prime, word-sized or fully
+ * known to --cache: its primes go to fin.  false => n needs find_split(). */
+static bool cofactor_settle(const mpz_t n, factor_list *fin, const factor_params *fp) {
+    // base cases: 0 and 1 have no prime factors
+    if (mpz_cmp_ui(n, 1) <= 0) return true;
+    uint64_t t0 = now_us();
+    bool isp = is_probable_prime(n);
+    fp->stats->prime_us += now_us() - t0;
+    fp->stats->prime_tests++;
+    if (isp) { fl_push(fin, n, 1); return true; }
+
+#if HAVE_RHO128
+    // word-sized cofactors are finished natively in microseconds
+    if (bits_of(n) <= fp->small_bits) {
+        t0 = now_us();
+        factor_small((uint64_t) mpz_getlimbn(n, 0), 1, fin);
+        fp->stats->small_us += now_us() - t0;
+        fp->stats->small_calls++;
+        return true;
+    }
+#endif
+
+    // a cofactor that an earlier run factored
+    mpz_t rest; mpz_init(rest);
+    bool hit = fc_lookup(n, fin, rest) == FC_FULL && fin->len;
+    mpz_clear(rest);
+    if (hit) fp->stats->cache_hits++;
+    else fl_free(fin);
+    return hit;
+}
+
+/* Split the composites on st until none is left; primes go to out.  A split
+ * n = d*m leaves m in n's place and pushes d, so d is finished first.  Under
+ * --checkpoint, st and out belong to fp->ck and change only under its lock.
+ * Returns 0, -1 on timeout, or -2 if a cofactor would not split. */
+static int factor_drain(mpz_stack *st, factor_list *out, gmp_randstate_t rng, const factor_params *fp) {
+    ckpt *ck = fp->ck;
+    mpz_t d, m; mpz_inits(d, m, NULL);
+    factor_list fin; fl_init(&fin);
+    int rc = 0;
+    while (st->len) {
+        mpz_ptr n = st->v[st->len - 1];
+
+        if (cofactor_settle(n, &fin, fp)) {
+            ck_hold(ck);
+            for (size_t i=0; i<fin.len; ++i) fl_push(out, fin.p[i], fin.e[i]);
+            st->len--;
+            ck_fresh(ck);
+            ck_release(ck);
+            fl_free(&fin);
+            continue;
+        }
+
+        // Timeout?
+        if (fp_expired(fp)) { rc = -1; break; }
+
+        // find a nontrivial factor d
+        const char *by = find_split(d, n, rng, fp);
+        if (!by) { rc = fp_expired(fp) ? -1 : -2; break; }   // out of time, or budgets spent
+        stats_split(fp->stats, by, d, n);
+
+        mpz_divexact(m, n, d);
+        ck_hold(ck);
+        mpz_set(n, m);
+        stack_push(st, d);      // may move st->v: n is not used past here
+        ck_fresh(ck);
+        ck_release(ck);
+    }
+    mpz_clears(d, m, NULL);
+    return rc;
+}
+
+/* Cofactors still unsplit when the drain stopped go to left (NULL => dropped). */
+static void stack_leftover(const mpz_stack *st, mpz_stack *left) {
+    for (size_t i=0; left && i<st->len; ++i) stack_push(left, st->v[i]);
+}
+
+/* ---------- cofactor tree on the task pool (--threads N) ---------- */
+
+/* Each composite is a task: a split n = d*m queues d and carries on with m,
+ * so independent cofactors are worked on at once and one that will not
+ * split holds up only itself.  The method attempts inside (rho walkers,
+ * ECM curves, SIQS sievers) run as gangs on the same pool, so workers left
+ * idle by the tree join whichever attempt is running.  Every worker keeps
+ * its own primes, leftovers and stats; they are merged once the tree is
+ * done, and factor_print() sorts what it prints. */
+
+typedef struct {
+    task_pool *tp;
+    const factor_params *fp;
+    factor_list *fl;        // per worker
+    mpz_stack *left;        // per worker
+    factor_stats *st;       // per worker
+    atomic_size_t tasks;    // queued or running
+    atomic_bool timed_out, stuck;
+} ft_tree;
+
+typedef struct {
+    ft_tree *T;
+    mpz_t n;
+    unsigned long seed;     // the task's own RNG stream
+} ft_task;
+
+static void ft_run(void *arg);
+
+static bool ft_push(ft_tree *T, const mpz_t n, unsigned long seed) {
+    ft_task *t = (ft_task*)malloc(sizeof *t);
+    if (!t) return false;
+    t->T = T;
+    mpz_init_set(t->n, n);
+    t->seed = seed;
+    atomic_fetch_add(&T->tasks, 1);
+    tp_spawn(T->tp, ft_run, t, &T->tasks);
+    return true;
+}
+
+static void ft_run(void *arg) {
+    ft_task *t = (ft_task*)arg;
+    ft_tree *T = t->T;
+    const unsigned w = tp_self;
+    factor_params fp = *T->fp;
+    fp.stats = &T->st[w];
+
+    gmp_randstate_t rng;
+    gmp_randinit_default(rng);
+    gmp_randseed_ui(rng, t->seed);
+    mpz_t d; mpz_init(d);
+    factor_list fin; fl_init(&fin);
+    mpz_ptr n = t->n;
+    for (;;) {
+        if (cofactor_settle(n, &fin, &fp)) {
+            for (size_t i=0; i<fin.len; ++i) fl_push(&T->fl[w], fin.p[i], fin.e[i]);
+            fl_free(&fin);
+            break;
+        }
+        const char *by = fp_expired(&fp) ? NULL : find_split(d, n, rng, &fp);
+        if (!by) {
+            atomic_store(fp_expired(&fp) ? &T->timed_out : &T->stuck, true);
+            stack_push(&T->left[w], n);
+            break;
+        }
+        stats_split(fp.stats, by, d, n);
+        mpz_divexact(n, n, d);
+        if (!ft_push(T, d, gmp_urandomb_ui(rng, 32))) {
+            atomic_store(&T->stuck, true);
+            stack_push(&T->left[w], d);
+        }
+    }
+    fl_free(&fin);
+    mpz_clear(d);
+    gmp_randclear(rng);
+    mpz_clear(t->n);
+    free(t);
+}
+
+/* factor_rec() on the caller's pool, or on one of fp->threads workers
+ * started for it.  false => no pool (the caller runs serially). */
+static bool factor_tree(mpz_t n, factor_list *out, mpz_stack *left, gmp_randstate_t rng,
+                        const factor_params *fp, int *rc) {
+    task_pool own, *tp = tp_pool;
+    if (!tp) {
+        if (!tp_start(&own, fp->threads, fp->cpus, fp->ncpus)) return false;
+        tp = &own;
+    }
+    ft_tree T = { .tp = tp, .fp = fp };
+    T.fl = (factor_list*)calloc(tp->n, sizeof *T.fl);
+    T.left = (mpz_stack*)calloc(tp->n, sizeof *T.left);
+    T.st = (factor_stats*)calloc(tp->n, sizeof *T.st);
+    atomic_init(&T.tasks, 0);
+    atomic_init(&T.timed_out, false);
+    atomic_init(&T.stuck, false);
+    bool ok = T.fl && T.left && T.st;
+    if (ok) {
+        for (unsigned w=0; w<tp->n; ++w) {
+            fl_init(&T.fl[w]);
+            stack_init(&T.left[w]);
+            T.st[w].live = fp->stats->live ? fp->stats->live : fp->stats;
+        }
+        ok = ft_push(&T, n, gmp_urandomb_ui(rng, 32));
+    }
+    if (ok) tp_wait(tp, &T.tasks, true);
+    if (tp == &own) tp_stop(&own);
+
+    for (unsigned w=0; ok && w<tp->n; ++w) {
+        for (size_t i=0; i<T.fl[w].len; ++i) fl_push(out, T.fl[w].p[i], T.fl[w].e[i]);
+        stack_leftover(&T.left[w], left);
+        stats_merge(fp->stats, &T.st[w]);
+        fl_free(&T.fl[w]);
+        stack_free(&T.left[w]);
+    }
+    free(T.fl); free(T.left); free(T.st);
+    *rc = atomic_load(&T.timed_out) ? -1 : atomic_load(&T.stuck) ? -2 : 0;
+    return ok;
+}
+
+/* Split n completely: on the task pool when fp->threads > 1 (except under
+ * --checkpoint, whose snapshot is one stack), else depth-first here. */
+static int factor_rec(mpz_t n, factor_list *out, mpz_stack *left, gmp_randstate_t rng, const factor_params *fp) {
+    int rc;
+    if (fp->threads > 1 && !fp->ck && bits_of(n) > fp->small_bits && factor_tree(n, out, left, rng, fp, &rc))
+        return rc;
+    mpz_stack st; stack_init(&st);
+    stack_push(&st, n);
+    rc = factor_drain(&st, out, rng, fp);
+    stack_leftover(&st, left);
+    stack_free(&st);
+    return rc;
+}
+
+/* Entry point for a fresh composite: strip the primes <= trial_B once,
+ * with multiplicity, then split what is left.  Word-sized n skips the
+ * strip: factor_small() trial-divides on its own and is faster than a
+ * sieve up to trial_B. */
+static int factor_full(mpz_t n, factor_list *out, mpz_stack *left, gmp_randstate_t rng, const factor_params *fp) {
+    if (bits_of(n) <= fp->small_bits) return factor_rec(n, out, left, rng, fp);
+    fp_stage(fp, "trial", n);
+    uint64_t t0 = now_us();
+    size_t had = out->len;
+    trial_strip(n, out, fp->trial_B);
+    fp->stats->trial_us += now_us() - t0;
+    fp->stats->trial_primes += out->len - had;
+    return factor_rec(n, out, left, rng, fp);
+}
+
+/* factor_full() under --checkpoint/--resume: the run's stack and primes live
+ * in ck, where the writer thread can snapshot them.  A resumed run picks up
+ * the loaded stack as is. */
+static int ck_factor(ckpt *ck, mpz_t n, factor_list *out, mpz_stack *left, gmp_randstate_t rng, const factor_params *fp) {
+    if (!ck->resumed) {
+        if (bits_of(n) > fp->small_bits) {
+            fp_stage(fp, "trial", n);
+            uint64_t t0 = now_us();
+            size_t had = ck->fl.len;
+            trial_strip(n, &ck->fl, fp->trial_B);
+            fp->stats->trial_us += now_us() - t0;
+            fp->stats->trial_primes += ck->fl.len - had;
+        }
+        stack_push(&ck->stk, n);
+    }
+
+    pthread_t writer;
+    bool threaded = ck->path && pthread_create(&writer, NULL, ck_writer_main, ck) == 0;
+    int rc = factor_drain(&ck->stk, &ck->fl, rng, fp);
+    pthread_mutex_lock(&ck->core.lock);
+    ck->quit = true;
+    pthread_cond_broadcast(&ck->core.cv);
+    pthread_mutex_unlock(&ck->core.lock);
+    if (threaded) pthread_join(writer, NULL);
+
+    pthread_mutex_lock(&ck->core.lock);
+    if (ck->path) ck_save(ck);          // final state, including a timeout's leftovers
+    pthread_mutex_unlock(&ck->core.lock);
+    fp->stats->checkpoints = ck->writes;
+    for (size_t i=0; i<ck->fl.len; ++i) fl_push(out, ck->fl.p[i], ck->fl.e[i]);
+    stack_leftover(&ck->stk, left);
+    return rc;
+}
+
+/* ---------- JSON output helpers ---------- */
+
+static void print_json_n(FILE *out, const mpz_t n) {
+    char *ns = mpz_to_cstr(n);
+    gmp_fprintf(out, "\"n\": %Zd, \"n_str\":\"%s\", ", n, ns);
+    free(ns);
+}
+
+static void print_json_header(const mpz_t n) {
+    printf("{");
+    print_json_n(stdout, n);
+}
+
+static void print_factors_json(FILE *out, const factor_list *fl) {
+    // factors as object with string keys (primes) -> exponents
+    fprintf(out, "\"factors\":{");
+    for (size_t i=0;i<fl->len;i++) {
+        char *ps = mpz_to_cstr(fl->p[i]);
+        fprintf(out, "%s\"%s\": %d", (i? ",": ""), ps, fl->e[i]);
+        free(ps);
+    }
+    fprintf(out, "}");
+}
+
+static void print_ecm_json(FILE *out, const factor_stats *st) {
+    fprintf(out, ", \"ecm\":[");
+    for (size_t i=0;i<st->ecm_len;i++) {
+        const ecm_record *r = &st->ecm[i];
+        fprintf(out, "%s{\"bits\": %d, \"sigma\": %" PRIu64 ", \"stage\": %d",
+               (i? ",": ""), r->bits, r->sigma, r->stage);
+        if (r->factor) fprintf(out, ", \"factor\":\"%s\"", r->factor);
+        fprintf(out, "}");
+    }
+    fprintf(out, "]");
+}
+
+static void print_splits_json(FILE *out, const factor_stats *st) {
+    fprintf(out, "\"splits\":[");
+    for (size_t i=0; i<st->splits_len; ++i) {
+        const split_record *r = &st->splits[i];
+        fprintf(out, "%s{\"bits\": %d, \"method\":\"%s\", \"factor\":\"%s\"}",
+                i ? "," : "", r->bits, r->method, r->factor ? r->factor : "");
+    }
+    fprintf(out, "]");
+}
+
+/* Decimal strings by value: shorter is smaller. */
+static int dec_cmp(const char *a, const char *b) {
+    size_t la = strlen(a), lb = strlen(b);
+    return la != lb ? (la < lb ? -1 : 1) : strcmp(a, b);
+}
+
+static int split_cmp(const void *a, const void *b) {
+    const split_record *x = (const split_record*)a, *y = (const split_record*)b;
+    if (x->bits != y->bits) return x->bits > y->bits ? -1 : 1;
+    return dec_cmp(x->factor ? x->factor : "", y->factor ? y->factor : "");
+}
+
+static int mpz_qcmp(const void *a, const void *b) {
+    return mpz_cmp(*(const mpz_t*)a, *(const mpz_t*)b);
+}
+
+static void sort_factors(factor_list *fl) {
+    // simple insertion sort by numeric value ascending (tiny lists)
+    for (size_t i=1;i<fl->len;i++) {
+        size_t j=i;
+        while (j>0 && mpz_cmp(fl->p[j-1], fl->p[j]) > 0) {
+            // swap p
+            mpz_t tmp; mpz_init_set(tmp, fl->p[j-1]);
+            mpz_set(fl->p[j-1], fl->p[j]);
+            mpz_set(fl->p[j], tmp);
+            mpz_clear(tmp);
+            // swap e
+            int te = fl->e[j-1]; fl->e[j-1] = fl->e[j]; fl->e[j] = te;
+            --j;
+        }
+    }
+}
+
+/* ---------- factor subcommand (shared with batch) ---------- */
+
+static void factor_params_default(factor_params *fp, factor_stats *stats) {
+    *fp = (factor_params){
+        .timeout_ms   = 0,
+        .start_ms     = now_ms(),
+        .trial_B      = 65536,
+        .p1_B         = 200000,      // small but helpful default
+        .p1_B2        = 0,
+        .ecm_B1       = 11000,
+        .ecm_B2       = 0,           // 0 => 100 * ecm_B1
+        .ecm_curves   = 0,
+        .siqs         = 1,
+        .small_bits   = SMALL_MAX_BITS,
+        .rho_restarts = 256,
+        .rho_iters    = 5000000,     // per restart; 0 => unlimited if no timeout
+        .schedule     = SCH_FIXED,
+        .rho_cap      = 0,
+        .threads      = 1,
+        .cpus         = NULL,
+        .ncpus        = 0,
+        .stats        = stats,
+        .ck           = NULL,
+        .cancel       = NULL,
+        .progress     = NULL,
+        .progress_ctx = NULL,
+        .progress_ms  = 0,
+        .plan         = 0
+    };
+}
+
+/* Apply one "--name value" factor flag.  *cpus owns the --cpus array.
+ * Returns NULL, or the error tag for the JSON error line. */
+static const char *factor_flag(factor_params *fp, const char *name, const char *val, int **cpus) {
+    if (!strcmp(name, "--timeout_ms")) {
+        fp->timeout_ms = strtoull(val, NULL, 10);
+    } else if (!strcmp(name, "--trial_B")) {
+        fp->trial_B = strtoull(val, NULL, 10);
+        if (fp->trial_B > UINT32_MAX) fp->trial_B = UINT32_MAX;
+    } else if (!strcmp(name, "--p1_B")) {
+        fp->p1_B = strtoul(val, NULL, 10);
+    } else if (!strcmp(name, "--p1_B2")) {
+        fp->p1_B2 = strtoull(val, NULL, 10);
+    } else if (!strcmp(name, "--ecm_curves")) {
+        fp->ecm_curves = strtoull(val, NULL, 10);
+    } else if (!strcmp(name, "--ecm_B1")) {
+        fp->ecm_B1 = strtoul(val, NULL, 10);
+    } else if (!strcmp(name, "--ecm_B2")) {
+        fp->ecm_B2 = strtoull(val, NULL, 10);
+    } else if (!strcmp(name, "--siqs")) {
+        fp->siqs = atoi(val);
+    } else if (!strcmp(name, "--small_bits")) {
+        fp->small_bits = atoi(val);
+        if (fp->small_bits < 0) fp->small_bits = 0;
+        if (fp->small_bits > SMALL_MAX_BITS) fp->small_bits = SMALL_MAX_BITS;
+    } else if (!strcmp(name, "--rho_restarts")) {
+        fp->rho_restarts = strtoull(val, NULL, 10);
+    } else if (!strcmp(name, "--rho_iters")) {
+        fp->rho_iters = strtoull(val, NULL, 10);
+    } else if (!strcmp(name, "--schedule")) {
+        if (parse_schedule(val, &fp->schedule) != 0) return "bad_schedule";
+    } else if (!strcmp(name, "--cap")) {
+        fp->rho_cap = strtoull(val, NULL, 10);
+    } else if (!strcmp(name, "--threads")) {
+        fp->threads = (unsigned) strtoul(val, NULL, 10);
+        if (fp->threads == 0) fp->threads = 1;
+    } else if (!strcmp(name, "--progress_ms")) {
+        fp->progress_ms = strtoull(val, NULL, 10);
+    } else if (!strcmp(name, "--plan")) {
+        if (!strcmp(val, "auto")) fp->plan = 1;
+        else if (!strcmp(val, "fixed")) fp->plan = 0;
+        else return "bad_plan";
+    } else if (!strcmp(name, "--plan_stats")) {
+        const char *err = plan_open(val);
+        if (err) return err;
+        fp->plan = 1;
+    } else if (!strcmp(name, "--cache")) {
+        const char *err = fc_open(val);
+        if (err) return err;
+    } else if (!strcmp(name, "--cpus")) {
+        free(*cpus);
+        fp->cpus = NULL;
+        if (parse_cpu_list(val, cpus, &fp->ncpus) != 0) return "bad_cpus";
+        fp->cpus = *cpus;
+    } else {
+        return "bad_flag";
+    }
+    return NULL;
+}
+
+/* --progress_ms: a thread prints {"progress":{...}} to stderr every period.
+ * The stage hook runs on the factoring thread and copies what the beat
+ * shows (the stats of the stages already finished) under the lock. */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    bool quit;
+    uint64_t every_ms, t0, stage_t0;
+    const char *stage;       // NULL before the first stage
+    int bits;
+    factor_stats *stats;     // live_* are read directly, the rest at stage changes
+    size_t splits;
+    uint64_t p1_gcds, siqs_rels;
+} heartbeat;
+
+static void hb_stage(void *ctx, const char *stage, const mpz_t n) {
+    heartbeat *hb = (heartbeat*)ctx;
+    pthread_mutex_lock(&hb->lock);
+    hb->stage = stage;
+    hb->bits = bits_of(n);
+    hb->stage_t0 = now_ms();
+    hb->splits = hb->stats->splits_len;
+    hb->p1_gcds = hb->stats->p1_gcds;
+    hb->siqs_rels = hb->stats->siqs_rels;
+    pthread_mutex_unlock(&hb->lock);
+}
+
+static void *hb_main(void *arg) {
+    heartbeat *hb = (heartbeat*)arg;
+    pthread_mutex_lock(&hb->lock);
+    while (!hb->quit) {
+        struct timespec ts;
+        ck_deadline(&ts, hb->every_ms);
+        pthread_cond_timedwait(&hb->cv, &hb->lock, &ts);
+        if (hb->quit) break;
+        uint64_t now = now_ms();
+        fprintf(stderr, "{\"progress\":{\"ms\": %" PRIu64 ", \"stage\":\"%s\", \"stage_ms\": %" PRIu64 ", "
+                "\"bits\": %d, \"splits\": %zu, \"rho_restarts\": %" PRIu64 ", \"rho_iters\": %" PRIu64 ", "
+                "\"p1_gcds\": %" PRIu64 ", \"siqs_rels\": %" PRIu64 "}}\n",
+                now - hb->t0, hb->stage ? hb->stage : "start", hb->stage ? now - hb->stage_t0 : 0,
+                hb->bits, hb->splits,
+                (uint64_t) atomic_load_explicit(&hb->stats->live_restarts, memory_order_relaxed),
+                (uint64_t) atomic_load_explicit(&hb->stats->live_rho_iters, memory_order_relaxed),
+                hb->p1_gcds, hb->siqs_rels);
+        fflush(stderr);
+    }
+    pthread_mutex_unlock(&hb->lock);
+    return NULL;
+}
+
+/* Factor N under fp and print the rest of its JSON line (after the header). */
+static void factor_print(FILE *out, const mpz_t N, factor_params *fp, gmp_randstate_t rng) {
+    if (fp->ecm_B2 == 0) fp->ecm_B2 = 100ull * fp->ecm_B1;
+    fp->start_ms = now_ms();
+
+    // heartbeat, unless someone else (serve) already watches the stages
+    heartbeat hb = { .every_ms = fp->progress_ms, .t0 = fp->start_ms, .stats = fp->stats, .bits = bits_of(N) };
+    pthread_t hb_thread;
+    bool beating = false;
+    if (fp->progress_ms && !fp->progress) {
+        pthread_mutex_init(&hb.lock, NULL);
+        pthread_cond_init(&hb.cv, NULL);
+        beating = pthread_create(&hb_thread, NULL, hb_main, &hb) == 0;
+        if (beating) { fp->progress = hb_stage; fp->progress_ctx = &hb; }
+        else { pthread_cond_destroy(&hb.cv); pthread_mutex_destroy(&hb.lock); }
+    }
+
+    // What an earlier run found (--cache), then quick classification
+    int bits = bits_of(N);
+    factor_list fl; fl_init(&fl);
+    mpz_stack left; stack_init(&left);
+    mpz_t rest; mpz_init(rest);
+    int known = fc_lookup(N, &fl, rest);
+    // a partial hit is no use under checkpoint (the snapshot holds N's own
+    // split) or without primes (an older file's bare "composite" record)
+    if (known == FC_PARTIAL && (fp->ck || !fl.len)) { fl_free(&fl); known = FC_NONE; }
+    if (known != FC_NONE) fp->stats->cache_hits++;
+    size_t known_len = fl.len;
+    bool isp = known == FC_PRIME || (known == FC_NONE && is_probable_prime(N));
+
+    char status[16]; strcpy(status, "ok");
+    if (known == FC_PRIME || known == FC_FULL) {
+        // answered by the cache
+    } else if (isp) {
+        // prime: factors = {N:1}
+        fl_push(&fl, N, 1);
+    } else {
+        // composite: attempt to factor (after a partial hit, only the unsplit rest)
+        mpz_t ncopy; mpz_init_set(ncopy, known == FC_PARTIAL ? rest : N);
+        int fr = fp->ck ? ck_factor(fp->ck, ncopy, &fl, &left, rng, fp) : factor_full(ncopy, &fl, &left, rng, fp);
+        mpz_clear(ncopy);
+
+        if (fr < 0 && fp_cancelled(fp)) { strcpy(status, "cancelled"); }
+        else if (fr < 0 && atomic_load(&interrupted)) { strcpy(status, "interrupted"); }
+        else if (fr == -1) { strcpy(status, "timeout"); }
+        else if (fr < 0) { strcpy(status, "error"); }
+    }
+    thread_deadline_us = 0;
+
+    // what was left unsplit: primes among it are factors too, the rest is reported
+    mpz_stack cof; stack_init(&cof);
+    for (size_t i=0; i<left.len; ++i) {
+        if (mpz_cmp_ui(left.v[i], 1) <= 0) continue;
+        if (is_probable_prime(left.v[i])) fl_push(&fl, left.v[i], 1);
+        else stack_push(&cof, left.v[i]);
+    }
+    stack_free(&left);
+    if (beating) {
+        pthread_mutex_lock(&hb.lock);
+        hb.quit = true;
+        pthread_cond_signal(&hb.cv);
+        pthread_mutex_unlock(&hb.lock);
+        pthread_join(hb_thread, NULL);
+        pthread_cond_destroy(&hb.cv);
+        pthread_mutex_destroy(&hb.lock);
+        fp->progress = NULL;
+        fp->progress_ctx = NULL;
+    }
+
+    // the same order whichever workers found what
+    sort_factors(&fl);
+    if (cof.len > 1) qsort(cof.v, cof.len, sizeof *cof.v, mpz_qcmp);
+    if (fp->stats->splits_len > 1) qsort(fp->stats->splits, fp->stats->splits_len, sizeof *fp->stats->splits, split_cmp);
+
+    // record what this run learned: a prime, a full split, or more primes of a partial one
+    if (known != FC_PRIME && known != FC_FULL && fc_active()) {
+        if (isp) {
+            fc_store(N, FC_PRIME, &fl, rest);
+        } else {
+            mpz_set(rest, N);
+            for (size_t i=0; i<fl.len; ++i)
+                for (int e=0; e<fl.e[i]; ++e) mpz_divexact(rest, rest, fl.p[i]);
+            if (mpz_cmp_ui(rest, 1) == 0) fc_store(N, FC_FULL, &fl, rest);
+            else if (fl.len > known_len) fc_store(N, FC_PARTIAL, &fl, rest);
+        }
+    }
+    mpz_clear(rest);
+
+    const factor_stats *st = fp->stats;
+    fprintf(out, "\"classification\":\"%s\", ", isp? "prime":"composite");
+    print_factors_json(out, &fl);
+    if (cof.len) {
+        fprintf(out, ", \"cofactors\":[");
+        for (size_t i=0; i<cof.len; ++i) {
+            char *cs = mpz_to_cstr(cof.v[i]);
+            fprintf(out, "%s\"%s\"", i ? "," : "", cs);
+            free(cs);
+        }
+        fprintf(out, "]");
+    }
+    stack_free(&cof);
+    fprintf(out, ", \"bits\": %d, \"status\":\"%s\", \"params\":{", bits, status);
+    fprintf(out, "\"timeout_ms\": %" PRIu64 ", ", fp->timeout_ms);
+    fprintf(out, "\"trial_B\": %" PRIu64 ", ", fp->trial_B);
+    fprintf(out, "\"p1_B\": %lu, ", fp->p1_B);
+    fprintf(out, "\"p1_B2\": %" PRIu64 ", ", fp->p1_B2);
+    fprintf(out, "\"ecm_curves\": %" PRIu64 ", \"ecm_B1\": %lu, \"ecm_B2\": %" PRIu64 ", ",
+           fp->ecm_curves, fp->ecm_B1, fp->ecm_B2);
+    fprintf(out, "\"siqs\": %d, ", fp->siqs);
+    fprintf(out, "\"small_bits\": %d, ", fp->small_bits);
+    fprintf(out, "\"rho_restarts\": %" PRIu64 ", ", fp->rho_restarts);
+    fprintf(out, "\"rho_iters\": %" PRIu64 ", ", fp->rho_iters);
+    fprintf(out, "\"schedule\":\"%s\", ", schedule_name(fp->schedule));
+    fprintf(out, "\"cap\": %" PRIu64 ", ", fp->rho_cap);
+    fprintf(out, "\"threads\": %u, ", fp->threads);
+    fprintf(out, "\"plan\":\"%s\"}, ", fp->plan ? "auto" : "fixed");
+    fprintf(out, "\"stats\":{\"trial_us\": %" PRIu64 ", \"p1_stage1_us\": %" PRIu64 ", \"p1_stage2_us\": %" PRIu64 ", "
+           "\"ecm_us\": %" PRIu64 ", \"ecm_curves_run\": %" PRIu64 ", \"siqs_us\": %" PRIu64 ", \"siqs_rels\": %" PRIu64 ", "
+           "\"siqs_polys\": %" PRIu64 ", \"small_us\": %" PRIu64 ", \"small_calls\": %" PRIu64 ", "
+           "\"checkpoints\": %" PRIu64 ", \"plan_attempts\": %" PRIu64 ", \"cache_hits\": %" PRIu64 ", ",
+           st->trial_us, st->p1_stage1_us, st->p1_stage2_us, st->ecm_us, st->ecm_curves_run,
+           st->siqs_us, st->siqs_rels, st->siqs_polys, st->small_us, st->small_calls,
+           st->checkpoints, st->plan_attempts, st->cache_hits);
+    fprintf(out, "\"trial_primes\": %" PRIu64 ", \"p1_gcds\": %" PRIu64 ", \"p1_stage2_primes\": %" PRIu64 ", "
+           "\"rho_us\": %" PRIu64 ", \"rho_restarts\": %" PRIu64 ", \"rho_iters\": %" PRIu64 ", "
+           "\"rho_gcds\": %" PRIu64 ", \"prime_tests\": %" PRIu64 ", \"prime_us\": %" PRIu64 ", ",
+           st->trial_primes, st->p1_gcds, st->p1s2_primes, st->rho_us, st->rho_restarts,
+           st->rho_iters, st->rho_gcds, st->prime_tests, st->prime_us);
+    print_splits_json(out, st);
+    fprintf(out, "}");
+    if (fp->ecm_curves > 0 || st->ecm_len) print_ecm_json(out, st);
+    fprintf(out, "}\n");
+    fl_free(&fl);
+}
+
+/* ---------- batch subcommand (stdin -> JSON lines) ---------- */
+
+/* One input per line: a bare decimal integer, or a flat JSON object such as
+ *   {"id":"job-7","n":"1234567","p1_B":1000,"timeout_ms":50}
+ * where "n" is required, "id" (string or number) is echoed back, and every
+ * other key is applied as the factor flag of the same name on top of the
+ * command-line defaults.  Output lines carry "seq", the 0-based index of the
+ * input among non-blank, non-comment lines, so they can be re-keyed. */
+
+#define BATCH_FLUSH_LINES 256   // default --flush
+#define BATCH_FLUSH_MS    100   // also flush when output is this stale
+
+/* Scan one JSON scalar at p into buf (strings unquoted, no escapes).
+ * *quoted tells whether it was a string.  Returns the end or NULL. */
+static const char *json_scalar(const char *p, char *buf, size_t cap, bool *quoted) {
+    size_t len = 0;
+    *quoted = (*p == '"');
+    if (*quoted) {
+        for (++p; *p && *p != '"'; ++p) {
+            if (*p == '\\' || (unsigned char)*p < 0x20 || len + 1 >= cap) return NULL;
+            buf[len++] = *p;
+        }
+        if (*p++ != '"') return NULL;
+    } else {
+        for (; *p && (isalnum((unsigned char)*p) || *p == '-' || *p == '+' || *p == '.'); ++p) {
+            if (len + 1 >= cap) return NULL;
+            buf[len++] = *p;
+        }
+        if (!len) return NULL;
+    }
+    buf[len] = 0;
+    return p;
+}
+
+static const char *json_ws(const char *p) {
+    while (*p == ' ' || *p == '\t') ++p;
+    return p;
+}
+
+typedef struct {
+    char n[4096];
+    char id[256];          // JSON token to echo ("..." or a bare number), "" => none
+    const char *err;       // "bad_json" | factor_flag() tag
+    char arg[64];
+    char op[16];           // serve only: "factor" (default) | "cancel" | "ping" | "shutdown"
+    long priority;         // serve only: higher runs first
+    uint64_t deadline_ms;  // serve only: wall-clock ms since the epoch, 0 => none
+} batch_item;
+
+/* Parse a JSON request line, applying its params to fp.  The serve-only
+ * keys are flags (bad_flag) unless serve is set; "cache" and "plan_stats"
+ * always are: they open a file shared by every job in the process, so they
+ * come from the command line only.  "cpus" is bad_flag when cpus is NULL
+ * (pooled batch: the workers are pinned once).  0 => ok. */
+static int batch_parse_json(const char *p, batch_item *it, factor_params *fp, int **cpus, bool serve) {
+    char key[64], val[4096];
+    bool q;
+    p = json_ws(p + 1);
+    while (*p && *p != '}') {
+        if (*p != '"' || !(p = json_scalar(p, key, sizeof key, &q))) goto bad;
+        p = json_ws(p);
+        if (*p++ != ':') goto bad;
+        p = json_ws(p);
+        if (!(p = json_scalar(p, val, sizeof val, &q))) goto bad;
+        if (!strcmp(key, "n")) {
+            strcpy(it->n, val);
+        } else if (!strcmp(key, "id")) {
+            snprintf(it->id, sizeof it->id, q ? "\"%s\"" : "%s", val);
+        } else if (serve && !strcmp(key, "op")) {
+            if (strlen(val) >= sizeof it->op) {
+                it->err = "bad_op";
+                strcpy(it->arg, "op");
+                return -1;
+            }
+            strcpy(it->op, val);
+        } else if (serve && !strcmp(key, "priority")) {
+            it->priority = strtol(val, NULL, 10);
+        } else if (serve && !strcmp(key, "deadline_ms")) {
+            it->deadline_ms = strtoull(val, NULL, 10);
+        } else if (!strcmp(key, "cache") || !strcmp(key, "plan_stats") || (!cpus && !strcmp(key, "cpus"))) {
+            it->err = "bad_flag";
+            strcpy(it->arg, key);
+            return -1;
+        } else {
+            char flag[80];
+            snprintf(flag, sizeof flag, "--%s", key);
+            const char *v = !strcmp(val, "true") ? "1" : !strcmp(val, "false") ? "0" : val;
+            if ((it->err = factor_flag(fp, flag, v, cpus))) {
+                snprintf(it->arg, sizeof it->arg, "%s", key);
+                return -1;
+            }
+        }
+        p = json_ws(p);
+        if (*p == ',') p = json_ws(p + 1);
+        else if (*p != '}') goto bad;
+    }
+    if (*p == '}') return 0;
+bad:
+    it->err = "bad_json";
+    it->arg[0] = 0;
+    return -1;
+}
+
+/* --threads N > 1: every input is a task on one pool of N workers, which
+ * also runs the cofactor trees and method gangs of the inputs in flight.
+ * A finished line waits in a ring until the lines before it are out, so
+ * the output keeps input order. */
+#define BATCH_INFLIGHT 4        // inputs in flight per worker
+
+typedef struct batch_ring batch_ring;
+
+typedef struct {
+    batch_ring *R;
+    uint64_t seq;
+    factor_params fp;
+    factor_stats stats;
+    mpz_t N;
+    unsigned long seed;
+    FILE *out;              // the line so far (NULL => no memory for it)
+    char *buf;
+    size_t len;
+    bool done;
+} batch_job;
+
+struct batch_ring {
+    pthread_mutex_t lock;   // guards all below and stdout
+    pthread_cond_t cv;      // a slot was freed
+    batch_job **slot;       // job seq lives in slot[seq % cap]
+    uint64_t cap, head;     // head: next seq to print
+    uint64_t pending, last_flush, flush_lines;
+};
+
+/* Print the finished jobs at the head of the ring (R->lock held). */
+static void batch_emit(batch_ring *R) {
+    batch_job *j;
+    while ((j = R->slot[R->head % R->cap]) && j->done) {
+        if (j->buf) fwrite(j->buf, 1, j->len, stdout);
+        else printf("{\"seq\": %" PRIu64 ", \"ok\":false, \"error\":\"no_memory\"}\n", j->seq);
+        free(j->buf);
+        free(j);
+        R->slot[R->head++ % R->cap] = NULL;
+        if (++R->pending >= R->flush_lines || now_ms() - R->last_flush >= BATCH_FLUSH_MS) {
+            fflush(stdout);
+            R->pending = 0;
+            R->last_flush = now_ms();
+        }
+    }
+    pthread_cond_broadcast(&R->cv);
+}
+
+static void batch_job_done(batch_job *j) {
+    if (j->out && fclose(j->out) != 0) { free(j->buf); j->buf = NULL; }
+    j->out = NULL;
+    batch_ring *R = j->R;   // j is freed once printed
+    pthread_mutex_lock(&R->lock);
+    j->done = true;
+    batch_emit(R);
+    pthread_mutex_unlock(&R->lock);
+}
+
+static void batch_job_run(void *arg) {
+    batch_job *j = (batch_job*)arg;
+    gmp_randstate_t rng;
+    gmp_randinit_default(rng);
+    gmp_randseed_ui(rng, j->seed);
+    factor_print(j->out, j->N, &j->fp, rng);
+    gmp_randclear(rng);
+    mpz_clear(j->N);
+    stats_free(&j->stats);
+    batch_job_done(j);
+}
+
+/* The batch loop on a pool of base->threads workers.  false => no pool. */
+static bool batch_pooled(const factor_params *base, uint64_t flush_lines, gmp_randstate_t rng) {
+    task_pool tp;
+    if (!tp_start(&tp, base->threads, base->cpus, base->ncpus)) return false;
+    batch_ring R = { .cap = (uint64_t) tp.n * BATCH_INFLIGHT, .flush_lines = flush_lines,
+                     .last_flush = now_ms() };
+    R.slot = (batch_job**)calloc(R.cap, sizeof *R.slot);
+    batch_item *it = (batch_item*)malloc(sizeof *it);
+    pthread_mutex_init(&R.lock, NULL);
+    pthread_cond_init(&R.cv, NULL);
+    atomic_size_t inflight;
+    atomic_init(&inflight, 0);
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    uint64_t seq = 0;
+    while (R.slot && it && !atomic_load(&interrupted) && (len = getline(&line, &cap, stdin)) >= 0) {
+        while (len > 0 && isspace((unsigned char)line[len-1])) line[--len] = 0;
+        const char *p = json_ws(line);
+        if (!*p || *p == '#') continue;
+
+        batch_job *j = (batch_job*)calloc(1, sizeof *j);
+        if (!j) break;
+        *j = (batch_job){ .R = &R, .seq = seq++, .fp = *base, .seed = gmp_urandomb_ui(rng, 32) };
+        j->fp.stats = &j->stats;
+        it->n[0] = it->id[0] = it->arg[0] = 0;
+        it->err = NULL;
+        if (*p == '{') {
+            batch_parse_json(p, it, &j->fp, NULL, false);
+        } else if (strlen(p) < sizeof it->n) {
+            strcpy(it->n, p);
+        }
+        if (!it->err && parse_mpz_or_err(j->N, it->n) != 0) it->err = "bad_n";
+
+        j->out = open_memstream(&j->buf, &j->len);
+        if (j->out) {
+            fprintf(j->out, "{\"seq\": %" PRIu64 ", ", j->seq);
+            if (it->id[0]) fprintf(j->out, "\"id\": %s, ", it->id);
+            if (it->err) {
+                fprintf(j->out, "\"ok\":false, \"error\":\"%s\"", it->err);
+                if (it->arg[0]) fprintf(j->out, ", \"arg\":\"%s\"", it->arg);
+                fprintf(j->out, "}\n");
+            } else {
+                print_json_n(j->out, j->N);
+            }
+        }
+
+        // wait for the ring slot, printing whatever is ready meanwhile
+        pthread_mutex_lock(&R.lock);
+        while (j->seq - R.head >= R.cap) {
+            fflush(stdout);
+            R.last_flush = now_ms();
+            R.pending = 0;
+            pthread_cond_wait(&R.cv, &R.lock);
+        }
+        R.slot[j->seq % R.cap] = j;
+        pthread_mutex_unlock(&R.lock);
+
+        if (it->err || !j->out) {
+            if (!it->err) mpz_clear(j->N);
+            stats_free(&j->stats);
+            batch_job_done(j);
+        } else {
+            atomic_fetch_add(&inflight, 1);
+            tp_spawn(&tp, batch_job_run, j, &inflight);
+        }
+    }
+    tp_wait(&tp, &inflight, false);
+    tp_stop(&tp);
+    fflush(stdout);
+
+    pthread_cond_destroy(&R.cv);
+    pthread_mutex_destroy(&R.lock);
+    free(R.slot);
+    free(it);
+    free(line);
+    return true;
+}
+
+static int run_batch(int argc, char **argv) {
+    factor_stats stats = {0};
+    factor_params base;
+    factor_params_default(&base, &stats);
+    int *cpus = NULL;
+    uint64_t flush_lines = BATCH_FLUSH_LINES;
+
+    for (int i=2; i<argc; ++i) {
+        const char *err = "bad_flag";
+        if (i+1 < argc && !strcmp(argv[i], "--flush")) {
+            flush_lines = strtoull(argv[i+1], NULL, 10);
+            if (flush_lines == 0) flush_lines = 1;
+            err = NULL;
+        } else if (i+1 < argc) {
+            err = factor_flag(&base, argv[i], argv[i+1], &cpus);
+        }
+        if (err) {
+            const char *arg = strcmp(err, "bad_flag") ? argv[i+1] : argv[i];
+            fprintf(stderr, "{\"ok\":false,\"error\":\"%s\",\"arg\":\"%s\"}\n", err, arg);
+            free(cpus);
+            return 2;
+        }
+        ++i;
+    }
+
+    // one context for the whole stream: RNG, P-1 plans, stdout buffer
+    static char outbuf[1 << 16];
+    setvbuf(stdout, outbuf, _IOFBF, sizeof outbuf);
+    gmp_randstate_t rng; gmp_randinit_default(rng);
+    gmp_randseed_ui(rng, (unsigned long) (now_ms() & 0xffffffffu));
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    uint64_t seq = 0, pending = 0, last_flush = now_ms();
+    batch_item *it = (batch_item*)malloc(sizeof *it);
+
+    catch_interrupts();
+    bool pooled = base.threads > 1 && batch_pooled(&base, flush_lines, rng);
+    while (!pooled && it && !atomic_load(&interrupted) && (len = getline(&line, &cap, stdin)) >= 0) {
+        while (len > 0 && isspace((unsigned char)line[len-1])) line[--len] = 0;
+        const char *p = json_ws(line);
+        if (!*p || *p == '#') continue;
+
+        factor_params fp = base;
+        int *item_cpus = NULL;
+        it->n[0] = it->id[0] = it->arg[0] = 0;
+        it->err = NULL;
+        if (*p == '{') {
+            batch_parse_json(p, it, &fp, &item_cpus, false);
+        } else if (strlen(p) < sizeof it->n) {
+            strcpy(it->n, p);
+        }
+        mpz_t N;
+        if (!it->err && parse_mpz_or_err(N, it->n) != 0) it->err = "bad_n";
+
+        printf("{\"seq\": %" PRIu64 ", ", seq++);
+        if (it->id[0]) printf("\"id\": %s, ", it->id);
+        if (it->err) {
+            printf("\"ok\":false, \"error\":\"%s\"", it->err);
+            if (it->arg[0]) printf(", \"arg\":\"%s\"", it->arg);
+            printf("}\n");
+        } else {
+            print_json_n(stdout, N);
+            factor_print(stdout, N, &fp, rng);
+            mpz_clear(N);
+        }
+        free(item_cpus);
+        stats_free(&stats);
+        memset(&stats, 0, sizeof stats);
+
+        if (++pending >= flush_lines || now_ms() - last_flush >= BATCH_FLUSH_MS) {
+            fflush(stdout);
+            pending = 0;
+            last_flush = now_ms();
+        }
+    }
+    fflush(stdout);
+
+    free(it);
+    free(line);
+    gmp_randclear(rng);
+    free(cpus);
+    p1_plans_free();
+    plan_close();
+    fc_close();
+    td_primes_free();
+    prime_scratch_free();
+    return 0;
+}
+
+/* ---------- batchgcd subcommand (Bernstein product / remainder trees) ---------- */
+
+/* For every input n_i, g_i = gcd(n_i, prod_{j != i} n_j) in quasi-linear
+ * time.  Inputs are cut into chunks of --chunk integers: chunk c keeps a
+ * product tree, and the root P_c of every chunk is spooled to a temp file
+ * with the chunk itself, so only one chunk tree is in memory at a time.
+ * For chunk i, P_i mod n^2 (divided by n) and P_j mod n for j != i are
+ * pushed down the remainder tree and multiplied into an accumulator per
+ * leaf.  Tree levels are spread over --threads workers.  Inputs with
+ * g_i > 1 are split at g_i and handed to factor_rec(). */
+
+#define BGCD_CHUNK 65536        // default --chunk
+
+typedef void (*level_fn)(void *ctx, size_t i);
+
+typedef struct {
+    level_fn fn;
+    void *ctx;
+    size_t count;
+    atomic_size_t next;
+} level_job;
+
+static void *level_worker(void *arg) {
+    level_job *J = (level_job*)arg;
+    for (size_t i; (i = atomic_fetch_add_explicit(&J->next, 1, memory_order_relaxed)) < J->count; )
+        J->fn(J->ctx, i);
+    return NULL;
+}
+
+/* fn(ctx, i) for i in [0, count) on up to `threads` workers (caller included). */
+static void level_run(unsigned threads, size_t count, level_fn fn, void *ctx) {
+    level_job J = { fn, ctx, count, 0 };
+    unsigned nt = threads;
+    if ((size_t) nt > count) nt = (unsigned) count;
+    if (nt <= 1) { level_worker(&J); return; }
+    pthread_t *thr = (pthread_t*)malloc((nt - 1) * sizeof(pthread_t));
+    unsigned started = 0;
+    while (thr && started < nt - 1 && pthread_create(&thr[started], NULL, level_worker, &J) == 0) ++started;
+    level_worker(&J);
+    for (unsigned t=0; t<started; ++t) pthread_join(thr[t], NULL);
+    free(thr);
+}
+
+typedef struct {
+    mpz_t **lv;             // lv[0] = leaves, lv[nlv-1][0] = root
+    size_t *cnt;
+    int nlv;
+} prod_tree;
+
+typedef struct {
+    mpz_t *dst;
+    mpz_t *src;
+    size_t nsrc;
+    int square;             // remainder tree: reduce mod node^2
+} tree_level;
+
+static void ptree_mul_node(void *ctx, size_t i) {
+    tree_level *L = (tree_level*)ctx;
+    if (2*i + 1 < L->nsrc) mpz_mul(L->dst[i], L->src[2*i], L->src[2*i + 1]);
+    else                   mpz_set(L->dst[i], L->src[2*i]);
+}
+
+/* Takes ownership of leaves[0..n). */
+static void ptree_build(prod_tree *T, mpz_t *leaves, size_t n, unsigned threads) {
+    int cap = 1;
+    for (size_t c = n; c > 1; c = (c + 1) / 2) ++cap;
+    T->lv = (mpz_t**)malloc(cap * sizeof(mpz_t*));
+    T->cnt = (size_t*)malloc(cap * sizeof(size_t));
+    T->lv[0] = leaves; T->cnt[0] = n; T->nlv = 1;
+    while (T->cnt[T->nlv - 1] > 1) {
+        size_t c = T->cnt[T->nlv - 1], up = (c + 1) / 2;
+        mpz_t *dst = (mpz_t*)malloc(up * sizeof(mpz_t));
+        for (size_t i=0; i<up; ++i) mpz_init(dst[i]);
+        tree_level L = { dst, T->lv[T->nlv - 1], c, 0 };
+        level_run(threads, up, ptree_mul_node, &L);
+        T->lv[T->nlv] = dst; T->cnt[T->nlv] = up; T->nlv++;
+    }
+}
+
+static void ptree_free(prod_tree *T) {
+    for (int k=0; k<T->nlv; ++k) {
+        for (size_t i=0; i<T->cnt[k]; ++i) mpz_clear(T->lv[k][i]);
+        free(T->lv[k]);
+    }
+    free(T->lv); free(T->cnt);
+}
+
+typedef struct {
+    tree_level L;
+    mpz_t *node;            // tree level the remainders are taken against
+} rem_level;
+
+static void rtree_node(void *ctx, size_t i) {
+    rem_level *R = (rem_level*)ctx;
+    if (R->L.square) {
+        mpz_t sq; mpz_init(sq);
+        mpz_mul(sq, R->node[i], R->node[i]);
+        mpz_mod(R->L.dst[i], R->L.src[i / 2], sq);
+        mpz_clear(sq);
+    } else {
+        mpz_mod(R->L.dst[i], R->L.src[i / 2], R->node[i]);
+    }
+}
+
+/* rem[i] = X mod leaf_i (or leaf_i^2); rem and tmp have cnt[0] entries. */
+static void rtree_descend(const prod_tree *T, const mpz_t X, int square,
+                          mpz_t *rem, mpz_t *tmp, unsigned threads) {
+    // levels alternate between the two buffers so the leaves land in rem
+    mpz_t *cur = (T->nlv & 1) ? tmp : rem, *nxt = (T->nlv & 1) ? rem : tmp;
+    mpz_set(cur[0], X);
+    for (int k = T->nlv - 1; k >= 0; --k) {
+        rem_level R = { { nxt, cur, T->cnt[k], square }, T->lv[k] };
+        level_run(threads, T->cnt[k], rtree_node, &R);
+        mpz_t *t = cur; cur = nxt; nxt = t;
+    }
+}
+
+typedef struct {
+    mpz_t *n, *rem, *acc;
+    int self;               // rem = P mod n^2 of the node's own chunk
+} bgcd_leaf;
+
+static void bgcd_leaf_acc(void *ctx, size_t i) {
+    bgcd_leaf *B = (bgcd_leaf*)ctx;
+    if (mpz_cmp_ui(B->n[i], 1) <= 0) return;
+    if (B->self) mpz_divexact(B->rem[i], B->rem[i], B->n[i]);
+    mpz_mul(B->acc[i], B->acc[i], B->rem[i]);
+    mpz_mod(B->acc[i], B->acc[i], B->n[i]);
+}
+
+/* Spool record: 1 byte tag (1 = integer, 0 = bad line) then mpz_out_raw. */
+static void bgcd_spool_chunk(FILE *f, mpz_t *v, const unsigned char *ok, size_t n) {
+    for (size_t i=0; i<n; ++i) { fputc(ok[i], f); mpz_out_raw(f, v[i]); }
+}
+
+/* g = n means every prime of n is shared (duplicates, or p and q each seen
+ * elsewhere); pairwise gcds against the chunk may still give a split. */
+static void bgcd_print(uint64_t seq, const mpz_t n, const mpz_t acc, mpz_t *chunk,
+                       const unsigned char *ok, size_t len, factor_params *fp,
+                       gmp_randstate_t rng) {
+    mpz_t g, s; mpz_inits(g, s, NULL);
+    mpz_gcd(g, acc, n);                            // acc == 0 => g = n
+    char *gs = mpz_to_cstr(g);
+    printf("{\"seq\": %" PRIu64 ", ", seq);
+    print_json_n(stdout, n);
+    printf("\"gcd\":\"%s\"", gs);
+    free(gs);
+    mpz_set(s, g);
+    for (size_t j=0; j<len && mpz_cmp(s, n) == 0; ++j) {
+        if (ok[j]) mpz_gcd(s, n, chunk[j]);
+        if (mpz_cmp_ui(s, 1) == 0) mpz_set(s, n);
+    }
+    if (mpz_cmp_ui(g, 1) > 0 && mpz_cmp(s, n) == 0) {
+        printf(", \"status\":\"unsplit\"");
+    } else if (mpz_cmp_ui(g, 1) > 0) {
+        mpz_set(g, s);
+        // shared factor: recurse on both sides of the split
+        factor_list fl; fl_init(&fl);
+        fp->start_ms = now_ms();
+        mpz_t m; mpz_init(m);
+        mpz_divexact(m, n, g);
+        int fr = factor_full(g, &fl, NULL, rng, fp);
+        if (fr == 0) fr = factor_full(m, &fl, NULL, rng, fp);
+        mpz_clear(m);
+        sort_factors(&fl);
+        printf(", ");
+        print_factors_json(stdout, &fl);
+        printf(", \"status\":\"%s\"", fr == 0 ? "ok" : fr == -1 ? "timeout" : "error");
+        fl_free(&fl);
+    }
+    printf("}\n");
+    mpz_clears(g, s, NULL);
+}
+
+static int run_batchgcd(int argc, char **argv) {
+    factor_stats stats = {0};
+    factor_params fp;
+    factor_params_default(&fp, &stats);
+    int *cpus = NULL;
+    size_t chunk = BGCD_CHUNK;
+
+    for (int i=2; i<argc; ++i) {
+        const char *err = "bad_flag";
+        if (i+1 < argc && !strcmp(argv[i], "--chunk")) {
+            chunk = strtoull(argv[i+1], NULL, 10);
+            if (chunk < 2) chunk = 2;
+            err = NULL;
+        } else if (i+1 < argc) {
+            err = factor_flag(&fp, argv[i], argv[i+1], &cpus);
+        }
+        if (err) {
+            const char *arg = strcmp(err, "bad_flag") ? argv[i+1] : argv[i];
+            fprintf(stderr, "{\"ok\":false,\"error\":\"%s\",\"arg\":\"%s\"}\n", err, arg);
+            free(cpus);
+            return 2;
+        }
+        ++i;
+    }
+    if (fp.ecm_B2 == 0) fp.ecm_B2 = 100ull * fp.ecm_B1;
+    const unsigned nt = fp.threads;
+
+    FILE *items = tmpfile(), *roots = tmpfile();
+    if (!items || !roots) {
+        fprintf(stderr, "{\"ok\":false,\"error\":\"tmpfile\",\"errno\":%d}\n", errno);
+        if (items) fclose(items);
+        if (roots) fclose(roots);
+        free(cpus);
+        return 1;
+    }
+
+    // pass 1: read and validate stdin, spool each chunk and its product
+    mpz_t *v = (mpz_t*)malloc(chunk * sizeof(mpz_t));
+    unsigned char *ok = (unsigned char*)malloc(chunk);
+    size_t *len_of = NULL, nchunks = 0, fill = 0;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    for (bool eof = false; !eof; ) {
+        len = getline(&line, &cap, stdin);
+        eof = len < 0;
+        if (!eof) {
+            while (len > 0 && isspace((unsigned char)line[len-1])) line[--len] = 0;
+            const char *p = json_ws(line);
+            if (!*p || *p == '#') continue;
+            if (parse_mpz_or_err(v[fill], p) != 0) mpz_init(v[fill]);
+            ok[fill] = mpz_cmp_ui(v[fill], 1) > 0;     // 0, 1 and junk are reported as bad_n
+            ++fill;
+        }
+        if (fill == chunk || (eof && fill)) {
+            bgcd_spool_chunk(items, v, ok, fill);
+            for (size_t i=0; i<fill; ++i) if (!ok[i]) mpz_set_ui(v[i], 1);
+            prod_tree T;
+            ptree_build(&T, v, fill, nt);                // takes v
+            v = (mpz_t*)malloc(chunk * sizeof(mpz_t));
+            mpz_out_raw(roots, T.lv[T.nlv - 1][0]);
+            ptree_free(&T);
+            len_of = (size_t*)realloc(len_of, (nchunks + 1) * sizeof(size_t));
+            len_of[nchunks++] = fill;
+            fill = 0;
+        }
+    }
+    free(line);
+
+    // pass 2: per chunk, fold in every chunk's product and report in order
+    gmp_randstate_t rng; gmp_randinit_default(rng);
+    gmp_randseed_ui(rng, (unsigned long) (now_ms() & 0xffffffffu));
+    rewind(items);
+    uint64_t seq = 0;
+    mpz_t P; mpz_init(P);
+    for (size_t c=0; c<nchunks; ++c) {
+        size_t n = len_of[c];
+        mpz_t *leaves = (mpz_t*)malloc(n * sizeof(mpz_t));
+        mpz_t *rem = (mpz_t*)malloc(n * sizeof(mpz_t));
+        mpz_t *tmp = (mpz_t*)malloc(n * sizeof(mpz_t));
+        mpz_t *acc = (mpz_t*)malloc(n * sizeof(mpz_t));
+        mpz_t *orig = (mpz_t*)malloc(n * sizeof(mpz_t));
+        for (size_t i=0; i<n; ++i) {
+            ok[i] = (unsigned char) fgetc(items);
+            mpz_init(orig[i]);
+            mpz_inp_raw(orig[i], items);
+            mpz_init_set(leaves[i], orig[i]);
+            if (!ok[i]) mpz_set_ui(leaves[i], 1);
+            mpz_inits(rem[i], tmp[i], NULL);
+            mpz_init_set_ui(acc[i], 1);
+        }
+        prod_tree T;
+        ptree_build(&T, leaves, n, nt);
+        bgcd_leaf B = { T.lv[0], rem, acc, 0 };
+
+        rewind(roots);
+        for (size_t j=0; j<nchunks; ++j) {
+            mpz_inp_raw(P, roots);
+            B.self = (j == c);
+            if (!B.self) mpz_mod(P, P, T.lv[T.nlv - 1][0]);
+            rtree_descend(&T, P, B.self, rem, tmp, nt);
+            level_run(nt, n, bgcd_leaf_acc, &B);
+        }
+
+        for (size_t i=0; i<n; ++i) {
+            if (!ok[i]) printf("{\"seq\": %" PRIu64 ", \"ok\":false, \"error\":\"bad_n\"}\n", seq++);
+            else bgcd_print(seq++, orig[i], acc[i], orig, ok, n, &fp, rng);
+        }
+        for (size_t i=0; i<n; ++i) mpz_clears(rem[i], tmp[i], acc[i], orig[i], NULL);
+        fflush(stdout);
+        ptree_free(&T);
+        free(rem); free(tmp); free(acc); free(orig);
+    }
+    mpz_clear(P);
+    gmp_randclear(rng);
+    fclose(items); fclose(roots);
+    free(v); free(ok); free(len_of);
+    stats_free(&stats);
+    free(cpus);
+    p1_plans_free();
+    plan_close();
+    fc_close();
+    td_primes_free();
+    prime_scratch_free();
+    return 0;
+}
+
+/* ---------- range / count subcommands (wheel-210 segmented sieve) ---------- */
+
+/* Of every 210 = 2*3*5*7 integers only the 48 coprime to 210 can be prime
+ * past 7, so the sieve keeps one bit per such m, at G(m) = (m / 210) * 48 +
+ * ws_ridx[m % 210].  The bit line is cut into WS_SEG_BITS segments (32 KiB,
+ * L1-sized) and those into chunks that the --threads workers claim in turn.
+ * A sieving prime p = 210a + b only visits p*q with q coprime to 210: going
+ * from q_i to q_i+1 moves 48*a*gap_i + ws_delta[b][i] bits, one add and one
+ * table read per crossing.  11..43 are not sieved at all: a segment starts
+ * as the AND of three patterns (11..19, 23..31, 37..43), each repeating
+ * every 48 * (product of its primes) bits, which is cheaper than their
+ * crossings, several to a word.  Other primes below WS_BUCKET_MIN walk
+ * every segment; larger ones hit a segment at most a few times, so each
+ * waits in the bucket of the segment holding its next multiple and a
+ * segment only sees the primes that hit it (bucket sieve).
+ * The sieving primes up to WS_KEEP are listed once; a chunk needing larger
+ * ones either generates them segment by segment with this same sieve and
+ * clears their multiples from a chunk-wide mask, or, when it has too few
+ * bits to pay for that (a narrow window near 2^64), sieves by the listed
+ * ones and runs is_prime_u64() on the survivors.  Bucket items live in
+ * recycled fixed-size blocks, so memory stays bounded whatever hi is.  count adds up popcounts; range
+ * streams the primes of chunk k once chunks 0..k-1 are out, as text,
+ * deltas or varint-coded binary gaps. */
+
+#define WS_SEG_BITS      (1u << 18)          // 48 bits per 210 => ~1.15M integers
+#define WS_SEG_WORDS     (WS_SEG_BITS / 64)
+#define WS_BUCKET_MIN    (WS_SEG_BITS / 4)   // primes from here on are bucketed
+#define WS_RANGE_CHUNK   16u                 // segments per chunk for range
+#define WS_COUNT_CHUNK   256u                // ... and at most this many for count
+#define WS_WINDOW        4u                  // range: chunks buffered per thread
+#define WS_BLOCK_ITEMS   1024u               // bucket items per block
+#define WS_MAX_HI        (UINT64_MAX - (1ull << 32))
+#define WS_KEEP          (1u << 25)          // sieving primes listed once (~2M, 8 MB)
+#define WS_PRP_COST      400u                // a survivor test ~ streaming this many integers
+
+enum { WS_TEXT, WS_DELTA, WS_BINARY };
+
+/* ws_gap and ws_delta run twice around the wheel, so WS_STEPS steps from
+ * any wheel index read them without wrapping. */
+#define WS_STEPS 8
+
+#define WS_PRE_MAX 43                        // primes pre-sieved by the patterns
+#define WS_NPRE    3
+
+static const uint8_t ws_pre_primes[WS_NPRE][5] = { {11,13,17,19}, {23,29,31}, {37,41,43} };
+
+static uint8_t ws_res[48], ws_gap[96], ws_ridx[210], ws_up[210];   // ws_up: to the next m coprime to 210
+static int32_t ws_delta[48][96];
+static uint64_t *ws_pre[WS_NPRE];            // period + 128 bits each, wrapping
+static uint64_t ws_pre_bits[WS_NPRE];        // period: 48 * product of its primes
+static bool ws_pre_ok;                       // all patterns built
+static uint64_t ws_pre_self;                 // bits of the pattern primes themselves
+
+static void ws_tables(void) {
+    int k = 0;
+    for (int r=0; r<210; ++r) {
+        ws_ridx[r] = 0xff;
+        if (r % 2 && r % 3 && r % 5 && r % 7) { ws_ridx[r] = (uint8_t) k; ws_res[k++] = (uint8_t) r; }
+    }
+    for (int r=209, d=1; r>=0; --r, ++d) {   // 209 is coprime, so d never runs past it
+        if (ws_ridx[r] != 0xff) d = 0;
+        ws_up[r] = (uint8_t) d;
+    }
+    for (int i=0; i<96; ++i) {
+        int j = i % 48;
+        ws_gap[i] = (uint8_t) ((j < 47 ? ws_res[j+1] : 210 + ws_res[0]) - ws_res[j]);
+    }
+    for (int bi=0; bi<48; ++bi) {
+        int b = ws_res[bi];
+        for (int i=0; i<96; ++i) {
+            int j = i % 48;
+            int s0 = b * ws_res[j] % 210, s1 = b * ws_res[(j+1) % 48] % 210;
+            ws_delta[bi][i] = (b * ws_gap[i] + s0 - s1) / 210 * 48 + ws_ridx[s1] - ws_ridx[s0];
+        }
+    }
+    if (ws_pre_ok) return;
+    ws_pre_ok = true;
+    for (int k=0; k<WS_NPRE; ++k) {
+        const uint8_t *P = ws_pre_primes[k];
+        ws_pre_bits[k] = 48;
+        for (int i=0; P[i]; ++i) ws_pre_bits[k] *= P[i];
+        size_t nw = ws_pre_bits[k] / 64 + 3;
+        ws_pre[k] = (uint64_t*)malloc(nw * sizeof(uint64_t));
+        if (!ws_pre[k]) { ws_pre_ok = false; break; }
+        memset(ws_pre[k], 0xff, nw * sizeof(uint64_t));
+        // p < 210, so p*q moves ws_delta bits per step from q = 1 (bit p)
+        for (int i=0; P[i]; ++i) {
+            const int32_t *D = ws_delta[ws_ridx[P[i]]];
+            ws_pre_self |= 1ull << ws_ridx[P[i]];
+            unsigned wi = 0;
+            for (uint64_t g = ws_ridx[P[i]]; g < nw * 64; g += (uint64_t) D[wi], wi = wi == 47 ? 0 : wi + 1)
+                ws_pre[k][g >> 6] &= ~(1ull << (g & 63));
+        }
+    }
+    if (!ws_pre_ok)
+        for (int k=0; k<WS_NPRE; ++k) { free(ws_pre[k]); ws_pre[k] = NULL; }
+}
+
+/* Fill the segment starting at bit gs with the 11..43 patterns, ANDed in
+ * one pass. */
+static void ws_presieve(uint64_t *bits, uint64_t gs) {
+    uint64_t o[WS_NPRE];
+    for (int k=0; k<WS_NPRE; ++k) o[k] = gs % ws_pre_bits[k];
+    for (size_t w=0; w<WS_SEG_WORDS; ++w) {
+        uint64_t v = ~0ull;
+        for (int k=0; k<WS_NPRE; ++k) {
+            unsigned sh = (unsigned) (o[k] & 63);
+            const uint64_t *s = ws_pre[k] + (o[k] >> 6);
+            v &= sh ? s[0] >> sh | s[1] << (64 - sh) : s[0];
+            o[k] += 64;
+            if (o[k] >= ws_pre_bits[k]) o[k] -= ws_pre_bits[k];
+        }
+        bits[w] = v;
+    }
+}
+
+static inline uint64_t ws_num(uint64_t g) { return g / 48 * 210 + ws_res[g % 48]; }
+
+/* Bit of the first m >= x coprime to 210 (x <= WS_MAX_HI + 1). */
+static uint64_t ws_bit_ceil(uint64_t x) {
+    uint64_t blk = x / 210;
+    unsigned r = (unsigned) (x % 210);
+    r += ws_up[r];
+    return blk * 48 + ws_ridx[r];
+}
+
+typedef struct { uint32_t p; uint8_t bi, wi; uint64_t g; } ws_prime;      // walks every segment
+typedef struct { uint32_t p; uint32_t off; } ws_item;                      // off = bit << 6 | wi
+typedef struct ws_bucket {                                                 // a segment's items, in blocks
+    struct ws_bucket *next;
+    uint32_t len;
+    ws_item v[WS_BLOCK_ITEMS];
+} ws_bucket;
+
+/* One finished range chunk: the first prime is written by whoever knows
+ * the prime before it, the rest are already encoded in buf. */
+typedef struct {
+    char *buf;
+    size_t len, cap;
+    uint64_t first, last, count;
+    bool ready, oom;
+} ws_out;
+
+typedef struct {
+    const uint32_t *primes;     // 11 <= p <= keep
+    size_t nprimes;
+    uint64_t keep;              // min(isqrt(hi), WS_KEEP)
+    uint64_t g_lo, g_hi;        // bits to report: [g_lo, g_hi)
+    uint64_t seg_lo, nchunks, chunk_segs;
+    int format;                 // -1 => count only
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    uint64_t next, written;     // next chunk to claim, chunks written (range)
+    uint64_t window;
+    ws_out *outs;               // [window], chunk k in k % window (range)
+    atomic_uint_fast64_t count;
+    atomic_bool oom;            // an allocation failed: the output is incomplete
+} ws_ctx;
+
+static void ws_put(ws_out *o, const void *p, size_t n) {
+    if (o->len + n > o->cap) {
+        size_t ncap = o->cap ? o->cap * 2 : 1u << 16;
+        while (ncap < o->len + n) ncap *= 2;
+        char *nb = (char*)realloc(o->buf, ncap);
+        if (!nb) { o->oom = true; return; }
+        o->buf = nb; o->cap = ncap;
+    }
+    memcpy(o->buf + o->len, p, n);
+    o->len += n;
+}
+
+/* Encode prime p after prev (0 => p starts the stream). */
+static void ws_encode(ws_out *o, int format, uint64_t p, uint64_t prev) {
+    char tmp[24];
+    int n;
+    if (format == WS_TEXT || !prev) {
+        if (format == WS_BINARY) {
+            for (n=0; n<8; ++n) tmp[n] = (char) (p >> (8*n));
+        } else {
+            n = snprintf(tmp, sizeof tmp, "%" PRIu64 "\n", p);
+        }
+    } else if (format == WS_DELTA) {
+        n = snprintf(tmp, sizeof tmp, "%" PRIu64 "\n", p - prev);
+    } else {
+        uint64_t d = p - prev;
+        for (n=0; d >= 0x80; d >>= 7) tmp[n++] = (char) (0x80 | (d & 0x7f));
+        tmp[n++] = (char) d;
+    }
+    ws_put(o, tmp, (size_t) n);
+}
+
+static void ws_emit(ws_out *o, int format, uint64_t p) {
+    if (o->count++) ws_encode(o, format, p, o->last);
+    else o->first = p;
+    o->last = p;
+}
+
+/* First multiple p*q >= x with q >= p coprime to 210: its bit and the wheel
+ * index of q.  false if it lies past hi. */
+static bool ws_first(uint64_t p, uint64_t x, uint64_t hi, uint64_t *g, uint8_t *wi) {
+    uint64_t q = x / p + (x % p != 0);
+    if (q < p) q = p;
+    uint64_t blk = q / 210;
+    unsigned r = (unsigned) (q % 210);
+    r += ws_up[r];
+    unsigned __int128 m128 = (unsigned __int128) p * (blk * 210 + r);
+    if (m128 > hi) return false;
+    uint64_t m = (uint64_t) m128;
+    *g = m / 210 * 48 + ws_ridx[m % 210];
+    *wi = ws_ridx[r];
+    return true;
+}
+
+typedef struct {
+    ws_ctx *C;
+    uint64_t bits[WS_SEG_WORDS];
+    ws_prime *med;
+    size_t nmed, capmed;
+    ws_bucket **bk;             // [chunk_segs], lists of blocks
+    ws_bucket *spare;           // emptied blocks, reused before malloc
+    uint64_t *mask;             // [chunk_segs * WS_SEG_WORDS], streamed primes cleared
+    uint64_t sbits[WS_SEG_WORDS];   // segment of the prime stream
+    ws_prime *smed;             // ... and its sieving primes
+    size_t nsmed, capsmed;
+} ws_worker;
+
+static void ws_bucket_push(ws_worker *W, ws_bucket **b, uint32_t p, uint32_t off) {
+    ws_bucket *k = *b;
+    if (!k || k->len == WS_BLOCK_ITEMS) {
+        ws_bucket *n = W->spare;
+        if (n) W->spare = n->next;
+        else if (!(n = (ws_bucket*)malloc(sizeof *n))) { atomic_store(&W->C->oom, true); return; }
+        n->next = k;
+        n->len = 0;
+        *b = k = n;
+    }
+    k->v[k->len++] = (ws_item){ p, off };
+}
+
+/* Hand the blocks of *b back to the spare list. */
+static void ws_bucket_clear(ws_worker *W, ws_bucket **b) {
+    while (*b) {
+        ws_bucket *k = *b;
+        *b = k->next;
+        k->next = W->spare;
+        W->spare = k;
+    }
+}
+
+static void ws_med_push(ws_ctx *C, ws_prime **v, size_t *len, size_t *cap, ws_prime P) {
+    if (*len == *cap) {
+        size_t ncap = *cap ? *cap * 2 : 1024;
+        ws_prime *nv = (ws_prime*)realloc(*v, ncap * sizeof *nv);
+        if (!nv) { atomic_store(&C->oom, true); return; }
+        *v = nv; *cap = ncap;
+    }
+    (*v)[(*len)++] = P;
+}
+
+/* Start the segment at bit gs: the 11..43 patterns, or all ones without them. */
+static void ws_seg_init(uint64_t *bits, uint64_t gs) {
+    if (ws_pre_ok) {
+        ws_presieve(bits, gs);
+        if (gs == 0) bits[0] |= ws_pre_self;  // 11..43 themselves
+    } else {
+        memset(bits, 0xff, WS_SEG_WORDS * sizeof(uint64_t));
+    }
+    if (gs == 0) bits[0] &= ~1ull;            // 1 is not prime
+}
+
+/* Clear the multiples of the walking primes in the segment at bit gs. */
+static void ws_walk(uint64_t *bits, ws_prime *med, size_t nmed, uint64_t gs) {
+    uint64_t ge = gs + WS_SEG_BITS;
+    for (size_t j=0; j<nmed; ++j) {
+        ws_prime *P = &med[j];
+        uint64_t g = P->g, a48 = (uint64_t) (P->p / 210) * 48;
+        unsigned wi = P->wi;
+        const int32_t *D = ws_delta[P->bi];
+        // WS_STEPS crossings per round while they surely stay in the segment
+        uint64_t span = (a48 * 10 + 48 * 12) * WS_STEPS;
+        for (; g + span < ge; wi = wi >= 48 - WS_STEPS ? wi + WS_STEPS - 48 : wi + WS_STEPS) {
+            for (unsigned t=0; t<WS_STEPS; ++t) {
+                uint64_t b = g - gs;
+                bits[b >> 6] &= ~(1ull << (b & 63));
+                g += a48 * ws_gap[wi + t] + (uint64_t) (int64_t) D[wi + t];
+            }
+        }
+        while (g < ge) {
+            uint64_t b = g - gs;
+            bits[b >> 6] &= ~(1ull << (b & 63));
+            g += a48 * ws_gap[wi] + (uint64_t) (int64_t) D[wi];
+            wi = wi == 47 ? 0 : wi + 1;
+        }
+        P->g = g; P->wi = (uint8_t) wi;
+    }
+}
+
+/* Clear p's multiples in the chunk [g0, g1) of numbers [x0, x1] from mask. */
+typedef struct { uint64_t *mask; uint64_t g0, g1, x0, x1; } ws_place;
+
+static void ws_mask_prime(const ws_place *L, uint64_t p) {
+    uint64_t g, a48 = p / 210 * 48;
+    uint8_t wi;
+    if (!ws_first(p, L->x0, L->x1, &g, &wi)) return;
+    const int32_t *D = ws_delta[ws_ridx[p % 210]];
+    for (g -= L->g0; g < L->g1 - L->g0; wi = wi == 47 ? 0 : wi + 1) {
+        L->mask[g >> 6] &= ~(1ull << (g & 63));
+        g += a48 * ws_gap[wi] + (uint64_t) (int64_t) D[wi];
+    }
+}
+
+/* The primes in [lo, hi] (hi < 2^32, so the listed primes sieve them) by
+ * the same wheel, each masked out of L's chunk as it comes. */
+static void ws_stream(ws_worker *W, uint64_t lo, uint64_t hi, const ws_place *L) {
+    ws_ctx *C = W->C;
+    uint64_t glo = ws_bit_ceil(lo), ghi = ws_bit_ceil(hi + 1), plim = isqrt_u64(hi);
+    W->nsmed = 0;
+    for (size_t i=0; i<C->nprimes && C->primes[i] <= plim; ++i) {
+        uint64_t p = C->primes[i], g;
+        uint8_t wi;
+        if (p <= WS_PRE_MAX && ws_pre_ok) continue;
+        if (ws_first(p, lo, hi, &g, &wi))
+            ws_med_push(C, &W->smed, &W->nsmed, &W->capsmed, (ws_prime){ (uint32_t) p, ws_ridx[p % 210], wi, g });
+    }
+    for (uint64_t gs = glo / WS_SEG_BITS * WS_SEG_BITS; gs < ghi; gs += WS_SEG_BITS) {
+        ws_seg_init(W->sbits, gs);
+        ws_walk(W->sbits, W->smed, W->nsmed, gs);
+        uint64_t b0 = glo > gs ? glo - gs : 0, b1 = (ghi < gs + WS_SEG_BITS ? ghi : gs + WS_SEG_BITS) - gs;
+        for (uint64_t w = b0 >> 6; w <= (b1 - 1) >> 6; ++w) {
+            uint64_t v = W->sbits[w];
+            if (w == b0 >> 6) v &= ~0ull << (b0 & 63);
+            if (w == (b1 - 1) >> 6 && (b1 & 63)) v &= ~0ull >> (64 - (b1 & 63));
+            for (; v; v &= v - 1) ws_mask_prime(L, ws_num(gs + w*64 + (uint64_t) __builtin_ctzll(v)));
+        }
+    }
+}
+
+static void ws_chunk(ws_worker *W, uint64_t k) {
+    ws_ctx *C = W->C;
+    uint64_t s0 = C->seg_lo + k * C->chunk_segs, s1 = s0 + C->chunk_segs;
+    uint64_t g0 = s0 * WS_SEG_BITS, g1 = s1 * WS_SEG_BITS;
+    if (g1 > C->g_hi) g1 = C->g_hi;
+    uint64_t x0 = ws_num(g0), x1 = ws_num(g1 - 1);
+    uint64_t plim = isqrt_u64(x1);
+    // past the listed primes: stream the rest, or test what they would sieve
+    bool prp = plim > C->keep && (g1 - g0) * WS_PRP_COST < plim - C->keep;
+    bool stream = plim > C->keep && !prp;
+
+    // place every sieving prime at its first multiple in the chunk
+    W->nmed = 0;
+    for (uint64_t s=0; s<C->chunk_segs; ++s) ws_bucket_clear(W, &W->bk[s]);
+    for (size_t i=0; i<C->nprimes && C->primes[i] <= plim; ++i) {
+        uint64_t p = C->primes[i], g;
+        uint8_t wi;
+        if (p <= WS_PRE_MAX && ws_pre_ok) continue;
+        if (!ws_first(p, x0, x1, &g, &wi) || g >= g1) continue;
+        if (p < WS_BUCKET_MIN) {
+            ws_med_push(C, &W->med, &W->nmed, &W->capmed, (ws_prime){ (uint32_t) p, ws_ridx[p % 210], wi, g });
+        } else {
+            uint64_t rel = g - g0;
+            ws_bucket_push(W, &W->bk[rel / WS_SEG_BITS], (uint32_t) p, (uint32_t) ((rel % WS_SEG_BITS) << 6 | wi));
+        }
+    }
+    size_t mwords = (size_t) ((g1 - g0 + 63) / 64);
+    if (stream && !W->mask && !(W->mask = (uint64_t*)malloc(C->chunk_segs * WS_SEG_WORDS * sizeof(uint64_t)))) {
+        atomic_store(&C->oom, true);
+        stream = false;
+    }
+    if (stream) {
+        memset(W->mask, 0xff, mwords * sizeof(uint64_t));
+        ws_place L = { W->mask, g0, g1, x0, x1 };
+        ws_stream(W, C->keep + 1, plim, &L);
+    }
+
+    ws_out *o = C->format >= 0 ? &C->outs[k % C->window] : NULL;
+    uint64_t count = 0;
+    for (uint64_t s=s0; s<s1; ++s) {
+        uint64_t gs = s * WS_SEG_BITS, ge = gs + WS_SEG_BITS;
+        if (gs >= g1) break;
+        ws_seg_init(W->bits, gs);
+        ws_walk(W->bits, W->med, W->nmed, gs);
+
+        // items only move to later segments, so this list is not growing
+        for (ws_bucket *B = W->bk[s - s0]; B; B = B->next) {
+            for (size_t j=0; j<B->len; ++j) {
+                uint32_t p = B->v[j].p;
+                uint64_t b = B->v[j].off >> 6, a48 = (uint64_t) (p / 210) * 48;
+                unsigned wi = B->v[j].off & 63;
+                const int32_t *D = ws_delta[ws_ridx[p % 210]];
+                while (b < WS_SEG_BITS) {
+                    W->bits[b >> 6] &= ~(1ull << (b & 63));
+                    b += a48 * ws_gap[wi] + (uint64_t) (int64_t) D[wi];
+                    wi = wi == 47 ? 0 : wi + 1;
+                }
+                uint64_t t = s - s0 + b / WS_SEG_BITS;
+                if (t < C->chunk_segs) ws_bucket_push(W, &W->bk[t], p, (uint32_t) ((b % WS_SEG_BITS) << 6 | wi));
+            }
+        }
+        ws_bucket_clear(W, &W->bk[s - s0]);
+        if (stream) {
+            const uint64_t *m = W->mask + (s - s0) * WS_SEG_WORDS;
+            size_t nw = mwords - (size_t) (s - s0) * WS_SEG_WORDS;
+            if (nw > WS_SEG_WORDS) nw = WS_SEG_WORDS;
+            for (size_t w=0; w<nw; ++w) W->bits[w] &= m[w];
+        }
+
+        // report the bits inside [g_lo, g_hi)
+        uint64_t lo = C->g_lo > gs ? C->g_lo - gs : 0;
+        uint64_t hi = (C->g_hi < ge ? C->g_hi : ge) - gs;
+        for (uint64_t w = lo >> 6; w <= (hi - 1) >> 6; ++w) {
+            uint64_t v = W->bits[w];
+            if (w == lo >> 6) v &= ~0ull << (lo & 63);
+            if (w == (hi - 1) >> 6 && (hi & 63)) v &= ~0ull >> (64 - (hi & 63));
+            if (!o && !prp) { count += (uint64_t) __builtin_popcountll(v); continue; }
+            for (; v; v &= v - 1) {
+                uint64_t x = ws_num(gs + w*64 + (uint64_t) __builtin_ctzll(v));
+                if (prp && !is_prime_u64(x)) continue;
+                if (o) ws_emit(o, C->format, x);
+                else ++count;
+            }
+        }
+    }
+    if (!o) atomic_fetch_add(&C->count, count);
+}
+
+static void *ws_worker_main(void *arg) {
+    ws_worker *W = (ws_worker*)arg;
+    ws_ctx *C = W->C;
+    for (;;) {
+        pthread_mutex_lock(&C->lock);
+        while (C->format >= 0 && C->next < C->nchunks && C->next >= C->written + C->window)
+            pthread_cond_wait(&C->cv, &C->lock);
+        uint64_t k = C->next < C->nchunks ? C->next++ : UINT64_MAX;
+        pthread_mutex_unlock(&C->lock);
+        if (k == UINT64_MAX) break;
+        ws_chunk(W, k);
+        if (C->format >= 0) {
+            pthread_mutex_lock(&C->lock);
+            C->outs[k % C->window].ready = true;
+            pthread_cond_broadcast(&C->cv);
+            pthread_mutex_unlock(&C->lock);
+        }
+    }
+    return NULL;
+}
+
+typedef struct { uint32_t *v; size_t len, cap; } u32_vec;
+
+static int ws_collect(uint64_t p, void *ctx) {
+    u32_vec *pv = (u32_vec*)ctx;
+    if (p < 11) return 0;
+    if (pv->len == pv->cap) {
+        size_t ncap = pv->cap ? pv->cap * 2 : 1024;
+        uint32_t *nv = (uint32_t*)realloc(pv->v, ncap * sizeof *nv);
+        if (!nv) return 1;
+        pv->v = nv; pv->cap = ncap;
+    }
+    pv->v[pv->len++] = (uint32_t) p;
+    return 0;
+}
+
+static int ws_arg(const char *s, uint64_t *v) {
+    mpz_t z;
+    if (parse_mpz_or_err(z, s) != 0) return -1;
+    int ok = mpz_cmp_ui(z, WS_MAX_HI) <= 0;
+    if (ok) *v = mpz_get_ui(z);
+    mpz_clear(z);
+    return ok ? 0 : -1;
+}
+
+/* range|count <lo> <hi> [--threads N] [--format text|delta|binary] */
+static int run_range(int argc, char **argv) {
+    bool counting = !strcmp(argv[1], "count");
+    uint64_t lo = 0, hi = 0;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned threads = ncpu > 0 ? (unsigned) ncpu : 1;
+    int format = WS_TEXT;
+
+    const char *bad = NULL, *arg = NULL;
+    if (argc < 4) { bad = "bad_range"; arg = argc > 2 ? argv[2] : ""; }
+    else if (ws_arg(argv[2], &lo) != 0) { bad = "bad_range"; arg = argv[2]; }
+    else if (ws_arg(argv[3], &hi) != 0 || hi < lo) { bad = "bad_range"; arg = argv[3]; }
+    for (int i=4; i<argc && !bad; ++i) {
+        if (i+1 < argc && !strcmp(argv[i], "--threads")) {
+            threads = (unsigned) strtoul(argv[++i], NULL, 10);
+            if (threads == 0) threads = 1;
+        } else if (i+1 < argc && !counting && !strcmp(argv[i], "--format")) {
+            ++i;
+            if (!strcmp(argv[i], "text")) format = WS_TEXT;
+            else if (!strcmp(argv[i], "delta")) format = WS_DELTA;
+            else if (!strcmp(argv[i], "binary")) format = WS_BINARY;
+            else { bad = "bad_format"; arg = argv[i]; }
+        } else {
+            bad = "bad_flag"; arg = argv[i];
+        }
+    }
+    if (bad) {
+        fprintf(stderr, "{\"ok\":false,\"error\":\"%s\",\"arg\":\"%s\"}\n", bad, arg);
+        return 2;
+    }
+
+    uint64_t t0 = now_ms();
+    ws_tables();
+    static char outbuf[1 << 16];
+    setvbuf(stdout, outbuf, _IOFBF, sizeof outbuf);
+
+    // 2, 3, 5, 7 are not on the wheel
+    ws_out head = {0};
+    uint64_t prev = 0, count = 0;
+    static const unsigned wheel_primes[] = { 2, 3, 5, 7 };
+    for (int i=0; i<4; ++i) {
+        if (wheel_primes[i] < lo || wheel_primes[i] > hi) continue;
+        count++;
+        if (!counting) { ws_encode(&head, format, wheel_primes[i], prev); prev = wheel_primes[i]; }
+    }
+    if (head.len) fwrite(head.buf, 1, head.len, stdout);
+    free(head.buf);
+
+    ws_ctx C = { .format = counting ? -1 : format };
+    u32_vec pv = {0};
+    bool oom = false;
+    C.g_lo = ws_bit_ceil(lo);
+    C.g_hi = ws_bit_ceil(hi + 1);
+    if (C.g_lo < C.g_hi) {
+        uint64_t plim = isqrt_u64(hi);
+        C.keep = plim < WS_KEEP ? plim : WS_KEEP;
+        oom = sieve_range(11, C.keep, ws_collect, &pv) != 0;
+        C.primes = pv.v;
+        C.nprimes = pv.len;
+        C.seg_lo = C.g_lo / WS_SEG_BITS;
+        uint64_t nseg = (C.g_hi - 1) / WS_SEG_BITS - C.seg_lo + 1;
+        C.chunk_segs = WS_RANGE_CHUNK;
+        if (counting) {
+            // a chunk that streams primes pays for it once: one per thread then
+            C.chunk_segs = nseg / ((uint64_t) threads * (plim > C.keep ? 1 : 4)) + 1;
+            if (C.chunk_segs > WS_COUNT_CHUNK) C.chunk_segs = WS_COUNT_CHUNK;
+        }
+        C.nchunks = (nseg + C.chunk_segs - 1) / C.chunk_segs;
+        if ((uint64_t) threads > C.nchunks) threads = (unsigned) C.nchunks;
+        C.window = (uint64_t) threads * WS_WINDOW;
+        if (!counting) C.outs = (ws_out*)calloc(C.window, sizeof(ws_out));
+        pthread_mutex_init(&C.lock, NULL);
+        pthread_cond_init(&C.cv, NULL);
+        atomic_init(&C.count, 0);
+        atomic_init(&C.oom, false);
+
+        ws_worker *ws = (ws_worker*)calloc(threads, sizeof(ws_worker));
+        pthread_t *th = (pthread_t*)calloc(threads, sizeof(pthread_t));
+        unsigned started = 0;
+        oom = oom || !ws || !th || (!counting && !C.outs);
+        for (unsigned t=0; !oom && t<threads; ++t) {
+            ws[t].C = &C;
+            ws[t].bk = (ws_bucket**)calloc(C.chunk_segs, sizeof(ws_bucket*));
+            oom = !ws[t].bk;
+        }
+        if (!oom) {
+            for (; started<threads; ++started)
+                if (pthread_create(&th[started], NULL, ws_worker_main, &ws[started]) != 0) break;
+            if (started == 0 && counting) ws_worker_main(&ws[0]);   // could not spawn: sieve inline
+        }
+
+        // range: write the chunks in order as they finish (or sieve them here)
+        for (uint64_t k=0; !counting && !oom && k<C.nchunks; ++k) {
+            ws_out *o = &C.outs[k % C.window];
+            if (started == 0) ws_chunk(&ws[0], k);
+            pthread_mutex_lock(&C.lock);
+            while (started && !o->ready) pthread_cond_wait(&C.cv, &C.lock);
+            pthread_mutex_unlock(&C.lock);
+            if (o->oom) atomic_store(&C.oom, true);
+            if (o->count) {
+                ws_out first = {0};
+                ws_encode(&first, format, o->first, prev);
+                fwrite(first.buf, 1, first.len, stdout);
+                fwrite(o->buf, 1, o->len, stdout);
+                free(first.buf);
+                prev = o->last;
+                count += o->count;
+            }
+            free(o->buf);
+            *o = (ws_out){0};
+            pthread_mutex_lock(&C.lock);
+            C.written = k + 1;
+            pthread_cond_broadcast(&C.cv);
+            pthread_mutex_unlock(&C.lock);
+        }
+        for (unsigned t=0; t<started; ++t) pthread_join(th[t], NULL);
+        if (counting) count += atomic_load(&C.count);
+        oom = oom || atomic_load(&C.oom);
+
+        for (unsigned t=0; ws && t<threads; ++t) {
+            for (uint64_t s=0; ws[t].bk && s<C.chunk_segs; ++s) ws_bucket_clear(&ws[t], &ws[t].bk[s]);
+            while (ws[t].spare) {
+                ws_bucket *k = ws[t].spare;
+                ws[t].spare = k->next;
+                free(k);
+            }
+            free(ws[t].bk);
+            free(ws[t].med);
+            free(ws[t].smed);
+            free(ws[t].mask);
+        }
+        free(ws); free(th);
+        for (uint64_t k=0; C.outs && k<C.window; ++k) free(C.outs[k].buf);
+        free(C.outs);
+        pthread_cond_destroy(&C.cv);
+        pthread_mutex_destroy(&C.lock);
+        free(pv.v);
+    }
+
+    if (oom) {
+        fflush(stdout);
+        fprintf(stderr, "{\"ok\":false,\"error\":\"oom\"}\n");
+        return 1;
+    }
+    if (counting)
+        printf("{\"lo\": %" PRIu64 ", \"hi\": %" PRIu64 ", \"count\": %" PRIu64 ", \"threads\": %u, \"ms\": %" PRIu64 "}\n",
+               lo, hi, count, threads, now_ms() - t0);
+    fflush(stdout);
+    return 0;
+}
+
+/* ---------- nextprime / prevprime / scan (sieved PRP search) ---------- */
+
+/* Candidates are the odd numbers of a window, base + 2i for i < len.  Each
+ * prime 3..B removes its multiples from the window by striding from its
+ * first hit; n mod p is computed once per prime (word-sized products of
+ * primes, one mpz_tdiv_ui() each, as in the trial division) and then only
+ * moved along as the search steps from window to window.  The survivors
+ * are PRP-tested in search order by the --threads workers: nextprime and
+ * prevprime stop at the first prime, scan tests them all. */
+
+#define PS_WINDOW_MAX (1u << 16)   // odd candidates per window
+#define PS_BLOCK      64           // words per remainder-tree block
+#define PS_MIN_B      (1ull << 16)
+#define PS_MAX_B      (1ull << 26)
+
+typedef struct {
+    uint32_t *p, *off;           // sieving primes; first hit in the window
+    size_t np, cap;
+    uint64_t *w;                 // products of consecutive primes below 2^64
+    uint8_t *wn;                 // primes per product
+    size_t nw, wcap;
+    uint64_t open;               // product of the open group
+    unsigned nopen;
+    mpz_t P, r;
+} ps_sieve;
+
+typedef struct {
+    mpz_srcptr base;             // the window is base, base+2, ..., base+2(len-1)
+    const uint32_t *cand;        // survivors, in test order
+    size_t ncand;
+    uint8_t *isp;
+    bool all;                    // scan: test every survivor
+    atomic_size_t next, found;   // found: first prime, in test order
+    atomic_uint_fast64_t tests;
+} ps_window;
+
+static int ps_close_group(ps_sieve *S) {
+    if (S->nw == S->wcap) {
+        size_t ncap = S->wcap ? S->wcap * 2 : 1024;
+        uint64_t *nw = (uint64_t*)realloc(S->w, ncap * sizeof *nw);
+        if (nw) S->w = nw;
+        uint8_t *nn = nw ? (uint8_t*)realloc(S->wn, ncap) : NULL;
+        if (!nn) return 1;
+        S->wn = nn; S->wcap = ncap;
+    }
+    S->w[S->nw] = S->open;
+    S->wn[S->nw++] = (uint8_t) S->nopen;
+    S->open = 1;
+    S->nopen = 0;
+    return 0;
+}
+
+static int ps_prime(uint64_t p, void *ctx) {
+    ps_sieve *S = (ps_sieve*)ctx;
+    if (p < 3) return 0;
+    if (S->nopen && S->open > UINT64_MAX / p && ps_close_group(S) != 0) return 1;
+    if (S->np == S->cap) {
+        size_t ncap = S->cap ? S->cap * 2 : 4096;
+        uint32_t *np = (uint32_t*)realloc(S->p, ncap * sizeof *np);
+        if (!np) return 1;
+        S->p = np; S->cap = ncap;
+    }
+    S->p[S->np++] = (uint32_t) p;
+    S->open *= p;
+    S->nopen++;
+    return 0;
+}
+
+static bool ps_sieve_init(ps_sieve *S, uint64_t B) {
+    memset(S, 0, sizeof *S);
+    S->open = 1;
+    mpz_inits(S->P, S->r, NULL);
+    if (sieve_range(3, B, ps_prime, S) != 0 || !S->np) return false;
+    if (S->nopen && ps_close_group(S) != 0) return false;
+    S->off = (uint32_t*)malloc(S->np * sizeof *S->off);
+    return S->off != NULL;
+}
+
+static void ps_sieve_free(ps_sieve *S) {
+    free(S->p); free(S->off); free(S->w); free(S->wn);
+    mpz_clears(S->P, S->r, NULL);
+}
+
+/* First hit of every prime in the window starting at odd base. */
+static void ps_offsets(ps_sieve *S, const mpz_t base) {
+    const uint32_t *p = S->p;
+    uint32_t *off = S->off;
+    for (size_t b=0; b<S->nw; b += PS_BLOCK) {
+        size_t nb = S->nw - b < PS_BLOCK ? S->nw - b : PS_BLOCK;
+        mpz_srcptr src = base;
+        if (mpz_size(base) > PS_BLOCK) {
+            prod_tree_words(S->P, S->w + b, nb);
+            mpz_tdiv_r(S->r, base, S->P);
+            src = S->r;
+        }
+        for (size_t i=b; i<b+nb; ++i) {
+            uint64_t rem = mpz_tdiv_ui(src, (unsigned long) S->w[i]);
+            for (unsigned j=0; j<S->wn[i]; ++j, ++p, ++off) {
+                uint64_t q = *p, r = rem % q;
+                *off = (uint32_t) ((q - r) % q * ((q + 1) / 2) % q);   // base + 2i = 0 mod q
+            }
+        }
+    }
+}
+
+/* Clear the multiples in keep[0..len), then move every offset to the next
+ * window: up (base + 2len) or down (base - 2len). */
+static void ps_sieve_window(ps_sieve *S, const mpz_t base, uint32_t len, uint8_t *keep, int dir) {
+    memset(keep, 1, len);
+    uint64_t b0 = mpz_cmp_ui(base, PS_MAX_B) <= 0 ? mpz_get_ui(base) : 0;   // the primes themselves stay
+    for (size_t i=0; i<S->np; ++i) {
+        uint32_t q = S->p[i], j0 = S->off[i], j = j0;
+        if (b0 && b0 + 2ull * j == q) j += q;
+        for (; j < len; j += q) keep[j] = 0;
+        S->off[i] = dir > 0 ? j - len : (uint32_t) ((j0 + (uint64_t) len) % q);
+    }
+}
+
+static void *ps_worker_main(void *arg) {
+    ps_window *W = (ps_window*)arg;
+    mpz_t x;
+    mpz_init(x);
+    for (;;) {
+        size_t k = atomic_fetch_add(&W->next, 1);
+        if (k >= W->ncand || (!W->all && k > atomic_load(&W->found))) break;
+        mpz_add_ui(x, W->base, 2ul * W->cand[k]);
+        atomic_fetch_add(&W->tests, 1);
+        if (!is_probable_prime(x)) continue;
+        W->isp[k] = 1;
+        size_t f = atomic_load(&W->found);
+        while (k < f && !atomic_compare_exchange_weak(&W->found, &f, k)) {}
+    }
+    mpz_clear(x);
+    prime_scratch_free();
+    return NULL;
+}
+
+/* Test the window's survivors on `threads` workers (the caller is one). */
+static void ps_test(ps_window *W, unsigned threads) {
+    atomic_store(&W->next, 0);
+    atomic_store(&W->found, SIZE_MAX);
+    memset(W->isp, 0, W->ncand);
+    if ((size_t) threads > W->ncand) threads = W->ncand ? (unsigned) W->ncand : 1;
+    pthread_t *th = threads > 1 ? (pthread_t*)calloc(threads - 1, sizeof(pthread_t)) : NULL;
+    unsigned started = 0;
+    for (; th && started + 1 < threads; ++started)
+        if (pthread_create(&th[started], NULL, ps_worker_main, W) != 0) break;
+    ps_worker_main(W);
+    for (unsigned t=0; t<started; ++t) pthread_join(th[t], NULL);
+    free(th);
+}
+
+/* nextprime|prevprime <n> | scan <start> <width>  [--threads N] [--sieve_B B] */
+static int run_psearch(int argc, char **argv) {
+    const char *cmd = argv[1];
+    int dir = strcmp(cmd, "prevprime") ? 1 : -1;
+    bool scan = !strcmp(cmd, "scan");
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned threads = ncpu > 0 ? (unsigned) ncpu : 1;
+    uint64_t B = 0, width = 0;
+    mpz_t n;
+    mpz_init(n);
+
+    const char *bad = NULL, *arg = NULL;
+    int first_flag = scan ? 4 : 3;
+    if (argc < first_flag) { bad = scan ? "bad_width" : "bad_n"; arg = argc > 2 ? argv[2] : ""; }
+    else if (mpz_set_str(n, argv[2], 10) != 0 || !isdigit((unsigned char) argv[2][0])) { bad = "bad_n"; arg = argv[2]; }
+    else if (scan && ws_arg(argv[3], &width) != 0) { bad = "bad_width"; arg = argv[3]; }
+    else if (dir < 0 && mpz_cmp_ui(n, 2) <= 0) { bad = "no_prime"; arg = argv[2]; }
+    for (int i=first_flag; i<argc && !bad; ++i) {
+        if (i+1 < argc && !strcmp(argv[i], "--threads")) {
+            threads = (unsigned) strtoul(argv[++i], NULL, 10);
+            if (threads == 0) threads = 1;
+        } else if (i+1 < argc && !strcmp(argv[i], "--sieve_B")) {
+            if (ws_arg(argv[++i], &B) != 0 || B < 3 || B > PS_MAX_B) { bad = "bad_sieve_B"; arg = argv[i]; }
+        } else {
+            bad = "bad_flag"; arg = argv[i];
+        }
+    }
+    if (bad) {
+        fprintf(stderr, "{\"ok\":false,\"error\":\"%s\",\"arg\":\"%s\"}\n", bad, arg);
+        mpz_clear(n);
+        return 2;
+    }
+
+    uint64_t t0 = now_ms();
+    int bits = bits_of(n);
+    if (!B) {
+        B = (uint64_t) bits << 12;
+        if (B < PS_MIN_B) B = PS_MIN_B;
+        if (B > PS_MAX_B) B = PS_MAX_B;
+    }
+    uint32_t wlen = scan ? PS_WINDOW_MAX : (uint32_t) bits * 8;
+    if (wlen < 256) wlen = 256;
+    if (wlen > PS_WINDOW_MAX) wlen = PS_WINDOW_MAX;
+
+    ps_sieve S;
+    uint8_t *keep = (uint8_t*)malloc(wlen);
+    uint32_t *cand = (uint32_t*)malloc(wlen * sizeof *cand);
+    uint8_t *isp = (uint8_t*)malloc(wlen);
+    if (!ps_sieve_init(&S, B) || !keep || !cand || !isp) {
+        fprintf(stderr, "{\"ok\":false,\"error\":\"oom\"}\n");
+        ps_sieve_free(&S); free(keep); free(cand); free(isp);
+        mpz_clear(n);
+        return 2;
+    }
+
+    // base: the lowest odd number of the window; end: scan's first excluded value
+    mpz_t base, end, x;
+    mpz_inits(base, end, x, NULL);
+    static char outbuf[1 << 16];
+    if (scan) setvbuf(stdout, outbuf, _IOFBF, sizeof outbuf);
+    if (scan) {
+        mpz_add_ui(end, n, width);
+        if (mpz_cmp_ui(n, 2) <= 0 && mpz_cmp_ui(end, 2) > 0) printf("2\n");
+        mpz_set(base, n);
+        if (mpz_even_p(base)) mpz_add_ui(base, base, 1);
+    } else if (dir > 0) {
+        mpz_add_ui(base, n, mpz_odd_p(n) ? 2 : 1);
+    } else {
+        mpz_sub_ui(base, n, mpz_odd_p(n) ? 2 : 1);          // top candidate for now
+    }
+
+    ps_window W = { .base = base, .cand = cand, .isp = isp, .all = scan };
+    atomic_init(&W.next, 0);
+    atomic_init(&W.found, SIZE_MAX);
+    atomic_init(&W.tests, 0);
+    uint64_t sieved = 0;
+    bool have = false, fresh = true;
+    if (!scan && dir > 0 && mpz_cmp_ui(n, 2) < 0) { mpz_set_ui(x, 2); have = true; }
+    while (!have) {
+        uint32_t len = wlen;
+        if (scan) {
+            mpz_sub(x, end, base);
+            if (mpz_sgn(x) <= 0) break;
+            mpz_add_ui(x, x, 1);
+            mpz_tdiv_q_2exp(x, x, 1);                       // odd values left
+            if (mpz_cmp_ui(x, len) < 0) len = (uint32_t) mpz_get_ui(x);
+        } else if (dir < 0) {
+            if (fresh) mpz_set(x, base); else mpz_sub_ui(x, base, 2);
+            if (mpz_cmp_ui(x, 1) < 0) { mpz_set_ui(x, 2); have = true; break; }   // only 2 is left
+            // x is the window's top; its base is x - 2(len-1), not below 1
+            if (mpz_cmp_ui(x, 2ull * (len - 1) + 1) < 0) {
+                len = (uint32_t) (mpz_get_ui(x) / 2 + 1);
+                mpz_set_ui(base, 1);
+                fresh = true;
+            } else {
+                mpz_sub_ui(base, x, 2ull * (len - 1));
+            }
+        }
+        if (fresh) ps_offsets(&S, base);
+        fresh = false;
+        ps_sieve_window(&S, base, len, keep, dir);
+        sieved += len;
+
+        W.ncand = 0;
+        if (dir > 0) { for (uint32_t i=0; i<len; ++i) if (keep[i]) cand[W.ncand++] = i; }
+        else         { for (uint32_t i=len; i-- > 0; )  if (keep[i]) cand[W.ncand++] = i; }
+        ps_test(&W, threads);
+
+        if (scan) {
+            for (size_t k=0; k<W.ncand; ++k) {
+                if (!isp[k]) continue;
+                mpz_add_ui(x, base, 2ul * cand[k]);
+                gmp_printf("%Zd\n", x);
+            }
+            mpz_add_ui(base, base, 2ull * len);
+        } else {
+            size_t f = atomic_load(&W.found);
+            if (f != SIZE_MAX) {
+                mpz_add_ui(x, base, 2ul * cand[f]);
+                have = true;
+            } else if (dir > 0) {
+                mpz_add_ui(base, base, 2ull * len);
+            }
+        }
+    }
+
+    if (!scan) {
+        char *ps = mpz_to_cstr(x);
+        mpz_sub(end, x, n);
+        mpz_abs(end, end);
+        print_json_header(n);
+        printf("\"%s\":\"%s\", \"distance\": %" PRIu64 ", \"bits\": %d, \"sieve_B\": %" PRIu64
+               ", \"sieved\": %" PRIu64 ", \"prp_tests\": %" PRIu64 ", \"threads\": %u, \"ms\": %" PRIu64 "}\n",
+               cmd, ps, (uint64_t) mpz_get_ui(end), bits, B, sieved, (uint64_t) atomic_load(&W.tests),
+               threads, now_ms() - t0);
+        free(ps);
+    }
+    fflush(stdout);
+    mpz_clears(n, base, end, x, NULL);
+    ps_sieve_free(&S);
+    free(keep); free(cand); free(isp);
+    return 0;
+}
+
+/* ---------- serve subcommand (job daemon on a Unix-domain socket) ---------- */
+
+/* cprime serve --socket PATH [--workers W] [factor flags]
+ *
+ * Clients connect to PATH and write one request per line in the batch
+ * syntax, plus three keys:
+ *   "op": "factor" (default) | "cancel" | "ping" | "shutdown"
+ *   "priority": P      higher runs first, FIFO within a priority (default 0)
+ *   "deadline_ms": T   wall-clock ms since the epoch: a job still queued then
+ *                      is dropped ("status":"expired"), a running one gets
+ *                      what is left as its timeout
+ * Replies are JSON lines on the same connection, tagged with the job's
+ * daemon-wide "seq" and its "id":
+ *   {"event":"queued", ...}
+ *   {"event":"progress", ..., "stage":"p1|p1_stage2|ecm|siqs|rho", "bits": B, "ms": T}
+ *   {"event":"result", ...the factor line...}
+ * "cancel" stops every queued or running job with that id, on any
+ * connection; their results come back with "status":"cancelled".  A client
+ * that half-closes still gets its results; one that hangs up, or leaves more
+ * than SERVE_OUT_MAX bytes of replies unread, is dropped and its jobs
+ * cancelled.  W workers (default: online CPUs) run one job each; the P-1 plans,
+ * the trial-division primes and each worker's primality scratch stay warm
+ * from job to job. */
+
+#define SERVE_BACKLOG   64
+#define SERVE_READ      65536        // bytes per read()
+#define SERVE_LINE_MAX  (1u << 20)   // longer request lines drop the connection
+#define SERVE_OUT_MAX   (8u << 20)   // more unread reply bytes drop the connection
+#define SERVE_DRAIN_MS  1000         // shutdown: how long to keep flushing replies
+
+/* Only the poll loop touches the socket: everyone else appends to out and
+ * pokes the wake pipe, so a client that stops reading stalls nobody. */
+typedef struct serve_conn {
+    int fd;                  // non-blocking, -1 once closed
+    int wake;                // write end of the daemon's wake pipe
+    pthread_mutex_t wlock;   // guards fd, out, olen, ocap, overflow
+    atomic_uint jobs;        // queued + running, freed by the poll loop at 0
+    bool eof;                // client half-closed: finish its jobs, then close
+    bool overflow;           // out passed SERVE_OUT_MAX: drop the connection
+    char *buf;               // unparsed input
+    size_t len, cap;
+    char *out;               // replies not yet written
+    size_t olen, ocap;
+} serve_conn;
+
+typedef struct serve_job {
+    uint64_t seq;
+    long priority;
+    uint64_t deadline;       // now_ms() clock, 0 => none
+    uint64_t t0;             // when it was queued
+    char tag[320];           // "\"seq\": k, \"id\": ..., " for every reply
+    char id[256];
+    mpz_t N;
+    factor_params fp;
+    int *cpus;
+    factor_cancel cancel;
+    serve_conn *conn;
+    struct serve_job *next;  // serve_cancel's list of jobs to answer
+} serve_job;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    serve_job **heap;        // max-heap on (priority, -seq)
+    size_t len, cap;
+    serve_job **running;     // running[w]: job on worker w (NULL => idle)
+    unsigned workers;
+    bool quit;
+    uint64_t seq;
+    int wake[2];             // workers poke the poll loop when a job is done
+} serve_ctx;
+
+typedef struct {
+    serve_ctx *S;
+    unsigned idx;
+} serve_worker;
+
+static uint64_t wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000ull + (uint64_t)(ts.tv_nsec / 1000000ull);
+}
+
+/* Queue a reply; the poll loop writes it out when the socket has room. */
+static void conn_send(serve_conn *c, const char *buf, size_t len) {
+    bool poke = false;
+    pthread_mutex_lock(&c->wlock);
+    if (c->fd >= 0 && !c->overflow) {
+        if (c->olen + len > SERVE_OUT_MAX) {
+            c->overflow = true;
+            poke = true;
+        } else {
+            if (c->olen + len > c->ocap) {
+                size_t ncap = c->ocap ? c->ocap : 4096;
+                while (ncap < c->olen + len) ncap *= 2;
+                char *no = (char*)realloc(c->out, ncap);
+                if (no) { c->out = no; c->ocap = ncap; }
+            }
+            if (c->olen + len <= c->ocap) {
+                poke = c->olen == 0;
+                memcpy(c->out + c->olen, buf, len);
+                c->olen += len;
+            } else {
+                c->overflow = poke = true;
+            }
+        }
+    }
+    pthread_mutex_unlock(&c->wlock);
+    char b = 0;
+    if (poke && write(c->wake, &b, 1) < 0) {}   // full pipe: a wakeup is pending anyway
+}
+
+static void conn_close_locked(serve_conn *c) {
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+    c->olen = 0;
+}
+
+static void conn_close(serve_conn *c) {
+    pthread_mutex_lock(&c->wlock);
+    conn_close_locked(c);
+    pthread_mutex_unlock(&c->wlock);
+}
+
+/* Write what the socket takes without blocking; close it on error.
+ * Returns whether replies are still pending. */
+static bool conn_flush(serve_conn *c) {
+    pthread_mutex_lock(&c->wlock);
+    size_t done = 0;
+    while (c->fd >= 0 && done < c->olen) {
+        ssize_t w = send(c->fd, c->out + done, c->olen - done, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (w <= 0) { conn_close_locked(c); break; }
+        done += (size_t) w;
+    }
+    if (c->fd >= 0 && done) {
+        memmove(c->out, c->out + done, c->olen - done);
+        c->olen -= done;
+    }
+    bool pending = c->olen != 0;
+    pthread_mutex_unlock(&c->wlock);
+    return pending;
+}
+
+static bool conn_pending(serve_conn *c) {
+    pthread_mutex_lock(&c->wlock);
+    bool pending = c->olen != 0;
+    pthread_mutex_unlock(&c->wlock);
+    return pending;
 }
 
-static int parse_mpz_or_err(mpz_t out, const char *s) {
-    if (!s || !*s) return -1;
-    // Disallow leading '+' and any sign; treat as unsigned integer.
-    for (const char *p=s; *p; ++p) {
-        if (*p < '0' || *p > '9') return -2;
+static void conn_printf(serve_conn *c, const char *fmt, ...) {
+    char *line = NULL;
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vasprintf(&line, fmt, ap);
+    va_end(ap);
+    if (len >= 0) conn_send(c, line, (size_t) len);
+    free(line);
+}
+
+static bool job_before(const serve_job *a, const serve_job *b) {
+    return a->priority != b->priority ? a->priority > b->priority : a->seq < b->seq;
+}
+
+static void heap_sift_up(serve_ctx *S, size_t i) {
+    while (i && job_before(S->heap[i], S->heap[(i-1)/2])) {
+        serve_job *t = S->heap[i]; S->heap[i] = S->heap[(i-1)/2]; S->heap[(i-1)/2] = t;
+        i = (i-1)/2;
     }
-    if (mpz_init_set_str(out, s, 10) != 0) return -3;
+}
+
+static void heap_sift_down(serve_ctx *S, size_t i) {
+    for (;;) {
+        size_t l = 2*i + 1, r = l + 1, m = i;
+        if (l < S->len && job_before(S->heap[l], S->heap[m])) m = l;
+        if (r < S->len && job_before(S->heap[r], S->heap[m])) m = r;
+        if (m == i) return;
+        serve_job *t = S->heap[i]; S->heap[i] = S->heap[m]; S->heap[m] = t;
+        i = m;
+    }
+}
+
+static int heap_push(serve_ctx *S, serve_job *j) {
+    if (S->len == S->cap) {
+        size_t ncap = S->cap ? S->cap*2 : 64;
+        serve_job **nh = (serve_job**)realloc(S->heap, ncap*sizeof(serve_job*));
+        if (!nh) return -1;
+        S->heap = nh; S->cap = ncap;
+    }
+    S->heap[S->len++] = j;
+    heap_sift_up(S, S->len - 1);
     return 0;
 }
 
-static int bits_of(const mpz_t n) {
-    return (int) mpz_sizeinbase(n, 2);
+static serve_job *heap_take(serve_ctx *S, size_t i) {
+    serve_job *j = S->heap[i];
+    S->heap[i] = S->heap[--S->len];
+    if (i < S->len) { heap_sift_down(S, i); heap_sift_up(S, i); }
+    return j;
 }
 
-static char* mpz_to_cstr(const mpz_t x) {
-    // Caller must free
-    return mpz_get_str(NULL, 10, x);
+static void job_free(serve_job *j) {
+    atomic_fetch_sub(&j->conn->jobs, 1);
+    pthread_mutex_destroy(&j->cancel.lock);
+    mpz_clear(j->N);
+    free(j->cpus);
+    free(j);
 }
 
-/* ---------- math helpers ---------- */
+/* A job that will not run: answer for it (queued result shape). */
+static void job_refuse(serve_job *j, const char *status) {
+    char *ns = mpz_to_cstr(j->N);
+    conn_printf(j->conn, "{\"event\":\"result\", %s\"n_str\":\"%s\", \"status\":\"%s\"}\n",
+                j->tag, ns, status);
+    free(ns);
+}
 
-static void gcd_mpz(mpz_t r, const mpz_t a, const mpz_t b) {
-    mpz_gcd(r, a, b);
+static void job_drop(serve_job *j, const char *status) {
+    job_refuse(j, status);
+    job_free(j);
 }
 
-static bool is_probable_prime(const mpz_t n) {
-    // GMP’s BPSW-like probable prime test: reps=25 is customary.
-    int r = mpz_probab_prime_p(n, 25);
-    return r > 0; // 1 = probably prime, 2 = definitely prime (for small)
+static void serve_progress(void *ctx, const char *stage, const mpz_t n) {
+    serve_job *j = (serve_job*)ctx;
+    conn_printf(j->conn, "{\"event\":\"progress\", %s\"stage\":\"%s\", \"bits\": %d, \"ms\": %" PRIu64 "}\n",
+                j->tag, stage, bits_of(n), now_ms() - j->t0);
 }
 
-/* ---------- trial division by small primes (quick win) ---------- */
+/* Run j and answer for it; the caller frees it once no one can find it. */
+static void serve_run(serve_job *j, gmp_randstate_t rng) {
+    if (fp_cancelled(&j->fp)) { job_refuse(j, "cancelled"); return; }
+    uint64_t now = now_ms();
+    if (j->deadline && now >= j->deadline) { job_refuse(j, "expired"); return; }
+    if (j->deadline) {
+        uint64_t left = j->deadline - now;
+        if (!j->fp.timeout_ms || left < j->fp.timeout_ms) j->fp.timeout_ms = left;
+    }
 
-static const unsigned small_primes[] = {
-    2u,3u,5u,7u,11u,13u,17u,19u,23u,29u,31u,37u,41u,43u,47u,53u,59u,61u,
-    67u,71u,73u,79u,83u,89u,97u,101u,103u,107u,109u,113u,127u,131u,137u,139u,149u
-};
-static const size_t small_primes_len = sizeof(small_primes)/sizeof(small_primes[0]);
+    factor_stats stats = {0};
+    j->fp.stats = &stats;
+    j->fp.cancel = &j->cancel;
+    j->fp.progress = serve_progress;
+    j->fp.progress_ctx = j;
 
-static bool trial_divide(mpz_t n, mpz_t factor_out) {
-    for (size_t i=0; i<small_primes_len; ++i) {
-        unsigned p = small_primes[i];
-        if (mpz_divisible_ui_p(n, p)) {
-            mpz_set_ui(factor_out, p);
-            return true;
-        }
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&buf, &len);
+    if (out) {
+        fprintf(out, "{\"event\":\"result\", %s", j->tag);
+        print_json_n(out, j->N);
+        factor_print(out, j->N, &j->fp, rng);
+        fclose(out);
+        conn_send(j->conn, buf, len);
     }
-    return false;
+    free(buf);
+    stats_free(&stats);
 }
 
-/* ---------- Pollard Rho (Brent) ---------- */
+static void *serve_worker_main(void *arg) {
+    serve_worker *w = (serve_worker*)arg;
+    serve_ctx *S = w->S;
+    gmp_randstate_t rng;
+    gmp_randinit_default(rng);
+    gmp_randseed_ui(rng, (unsigned long) ((now_ms() + w->idx) & 0xffffffffu));
 
-static void brent_rho(mpz_t factor, const mpz_t n, gmp_randstate_t rng,
-                      uint64_t max_iters)
-{
-    // Precondition: n is odd composite (best-effort), factor result 1 or non-trivial.
-    mpz_set_ui(factor, 1);
-    if (mpz_even_p(n)) { mpz_set_ui(factor, 2); return; }
+    pthread_mutex_lock(&S->lock);
+    for (;;) {
+        while (!S->len && !S->quit) pthread_cond_wait(&S->cv, &S->lock);
+        if (S->quit) break;
+        serve_job *j = heap_take(S, 0);
+        S->running[w->idx] = j;
+        pthread_mutex_unlock(&S->lock);
 
-    mpz_t y, c, m, g, r, q, x, ys, tmp, absdiff;
-    mpz_inits(y,c,m,g,r,q,x,ys,tmp,absdiff, NULL);
+        serve_run(j, rng);
 
-    // y in [1..n-1], c in [1..n-1], m in [1..n-1]
-    mpz_urandomm(y, rng, n);
-    do { mpz_urandomm(c, rng, n); } while (mpz_cmp_ui(c,0) == 0);
-    mpz_set_ui(m, 128);
+        // serve_cancel and shutdown look jobs up through running[]
+        pthread_mutex_lock(&S->lock);
+        S->running[w->idx] = NULL;
+        job_free(j);
+        char b = 0;
+        if (write(S->wake[1], &b, 1) < 0) {}   // full pipe: a wakeup is pending anyway
+    }
+    pthread_mutex_unlock(&S->lock);
+    gmp_randclear(rng);
+    prime_scratch_free();
+    return NULL;
+}
 
-    mpz_set_ui(g, 1);
-    mpz_set_ui(r, 1);
-    mpz_set_ui(q, 1);
+/* Cancel the jobs matching id (a JSON token) or, with id NULL, those of
+ * conn.  Queued ones are answered and dropped here.  Returns how many. */
+static size_t serve_cancel(serve_ctx *S, const char *id, const serve_conn *conn) {
+    size_t k = 0;
+    serve_job *dropped = NULL;
+    pthread_mutex_lock(&S->lock);
+    for (size_t i=0; i<S->len; ) {
+        serve_job *j = S->heap[i];
+        if (id ? strcmp(j->id, id) != 0 : j->conn != conn) { ++i; continue; }
+        heap_take(S, i);
+        j->next = dropped;
+        dropped = j;
+        ++k;
+    }
+    for (unsigned w=0; w<S->workers; ++w) {
+        serve_job *j = S->running[w];
+        if (!j || (id ? strcmp(j->id, id) != 0 : j->conn != conn)) continue;
+        cancel_fire(&j->cancel);
+        ++k;
+    }
+    pthread_mutex_unlock(&S->lock);
+    while (dropped) {
+        serve_job *j = dropped;
+        dropped = j->next;
+        job_drop(j, "cancelled");
+    }
+    return k;
+}
 
-    uint64_t iters = 0;
-    while (mpz_cmp_ui(g,1) == 0) {
-        mpz_set(x, y);
-        for (mp_bitcnt_t i = 0; i < mpz_get_ui(r); ++i) {
-            // y = (y*y + c) % n
-            mpz_mul(y,y,y);
-            mpz_add(y,y,c);
-            mpz_mod(y,y,n);
-            if (max_iters && ++iters >= max_iters) goto done; // give up
+/* Handle one request line from conn.  Returns 1 on "shutdown". */
+static int serve_line(serve_ctx *S, serve_conn *conn, const factor_params *base, const char *line) {
+    const char *p = json_ws(line);
+    if (!*p || *p == '#') return 0;
+
+    batch_item *it = (batch_item*)calloc(1, sizeof *it);
+    if (!it) return 0;
+    factor_params fp = *base;
+    int *cpus = NULL;
+    if (*p == '{') {
+        batch_parse_json(p, it, &fp, &cpus, true);
+    } else if (strlen(p) < sizeof it->n) {
+        strcpy(it->n, p);
+    }
+    const char *op = it->op[0] ? it->op : "factor";
+    char idtag[272] = "";
+    if (it->id[0]) snprintf(idtag, sizeof idtag, "\"id\": %s, ", it->id);
+
+    int rc = 0;
+    serve_job *j = NULL;
+    if (it->err) {
+        conn_printf(conn, "{\"event\":\"error\", %s\"ok\":false, \"error\":\"%s\"%s%s%s}\n", idtag, it->err,
+                    it->arg[0] ? ", \"arg\":\"" : "", it->arg, it->arg[0] ? "\"" : "");
+    } else if (!strcmp(op, "ping")) {
+        pthread_mutex_lock(&S->lock);
+        unsigned busy = 0;
+        for (unsigned w=0; w<S->workers; ++w) busy += S->running[w] != NULL;
+        size_t queued = S->len;
+        pthread_mutex_unlock(&S->lock);
+        conn_printf(conn, "{\"event\":\"pong\", %s\"queued\": %zu, \"running\": %u, \"workers\": %u}\n",
+                    idtag, queued, busy, S->workers);
+    } else if (!strcmp(op, "shutdown")) {
+        conn_printf(conn, "{\"event\":\"shutdown\"}\n");
+        rc = 1;
+    } else if (!strcmp(op, "cancel")) {
+        if (!it->id[0]) {
+            conn_printf(conn, "{\"event\":\"error\", \"ok\":false, \"error\":\"bad_json\", \"arg\":\"id\"}\n");
+        } else {
+            size_t k = serve_cancel(S, it->id, NULL);
+            conn_printf(conn, "{\"event\":\"cancel\", %s\"jobs\": %zu}\n", idtag, k);
         }
+    } else if (strcmp(op, "factor")) {
+        conn_printf(conn, "{\"event\":\"error\", %s\"ok\":false, \"error\":\"bad_op\", \"arg\":\"op\"}\n", idtag);
+    } else if (!(j = (serve_job*)calloc(1, sizeof *j)) || parse_mpz_or_err(j->N, it->n) != 0) {
+        conn_printf(conn, "{\"event\":\"error\", %s\"ok\":false, \"error\":\"bad_n\"}\n", idtag);
+        free(j);
+        j = NULL;
+    } else {
+        j->priority = it->priority;
+        if (it->deadline_ms) {
+            uint64_t wall = wall_ms();
+            j->deadline = now_ms() + (it->deadline_ms > wall ? it->deadline_ms - wall : 0);
+            if (!j->deadline) j->deadline = 1;
+        }
+        j->t0 = now_ms();
+        strcpy(j->id, it->id);
+        j->fp = fp;
+        j->cpus = cpus;
+        cpus = NULL;
+        cancel_init(&j->cancel);
+        j->conn = conn;
+        atomic_fetch_add(&conn->jobs, 1);
+
+        // only the poll loop queues jobs, so seq needs no lock; acknowledge
+        // before a worker can see the job, so "queued" comes first
+        j->seq = S->seq++;
+        snprintf(j->tag, sizeof j->tag, "\"seq\": %" PRIu64 ", %s", j->seq, idtag);
+        conn_printf(conn, "{\"event\":\"queued\", %s\"priority\": %ld}\n", j->tag, j->priority);
+        pthread_mutex_lock(&S->lock);
+        int pushed = heap_push(S, j);
+        if (pushed == 0) pthread_cond_signal(&S->cv);
+        pthread_mutex_unlock(&S->lock);
+        if (pushed != 0) job_drop(j, "error");
+    }
+    free(cpus);
+    free(it);
+    return rc;
+}
 
+static void conn_free(serve_conn *c) {
+    conn_close(c);
+    pthread_mutex_destroy(&c->wlock);
+    free(c->buf);
+    free(c->out);
+    free(c);
+}
 
+static int run_serve(int argc, char **argv) {
+    factor_stats stats = {0};
+    factor_params base;
+    factor_params_default(&base, &stats);
+    int *cpus = NULL;
+    const char *path = NULL;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned workers = ncpu > 0 ? (unsigned) ncpu : 1;
 
+    for (int i=2; i<argc; ++i) {
+        const char *err = "bad_flag";
+        if (i+1 < argc && !strcmp(argv[i], "--socket")) {
+            path = argv[i+1];
+            err = NULL;
+        } else if (i+1 < argc && !strcmp(argv[i], "--workers")) {
+            workers = (unsigned) strtoul(argv[i+1], NULL, 10);
+            if (workers == 0) workers = 1;
+            err = NULL;
+        } else if (i+1 < argc) {
+            err = factor_flag(&base, argv[i], argv[i+1], &cpus);
+        }
+        if (err) {
+            const char *arg = strcmp(err, "bad_flag") ? argv[i+1] : argv[i];
+            fprintf(stderr, "{\"ok\":false,\"error\":\"%s\",\"arg\":\"%s\"}\n", err, arg);
+            free(cpus);
+            return 2;
+        }
+        ++i;
+    }
 
-        mpz_set_ui(g,1);
-        mpz_set_ui(q,1);
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    int lfd = -1;
+    if (path && strlen(path) < sizeof sa.sun_path) {
+        strcpy(sa.sun_path, path);
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);   // stale socket
+        lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (lfd >= 0 && (bind(lfd, (struct sockaddr*)&sa, sizeof sa) != 0 || listen(lfd, SERVE_BACKLOG) != 0)) {
+            close(lfd);
+            lfd = -1;
+        }
+    }
+    if (lfd < 0) {
+        fprintf(stderr, "{\"ok\":false,\"error\":\"bad_socket\",\"arg\":\"%s\"}\n", path ? path : "--socket");
+        free(cpus);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
 
-        mpz_t k;
-        mpz_init_set_ui(k,0);
+    serve_ctx S = { .workers = workers };
+    pthread_mutex_init(&S.lock, NULL);
+    pthread_cond_init(&S.cv, NULL);
+    S.running = (serve_job**)calloc(workers, sizeof(serve_job*));
+    serve_worker *ws = (serve_worker*)calloc(workers, sizeof(serve_worker));
+    pthread_t *th = (pthread_t*)calloc(workers, sizeof(pthread_t));
+    unsigned started = 0;
+    if (S.running && ws && th && pipe2(S.wake, O_CLOEXEC | O_NONBLOCK) == 0) {
+        for (; started<workers; ++started) {
+            ws[started] = (serve_worker){ .S = &S, .idx = started };
+            if (pthread_create(&th[started], NULL, serve_worker_main, &ws[started]) != 0) break;
+        }
+    }
+    if (!started) {
+        fprintf(stderr, "{\"ok\":false,\"error\":\"no_workers\"}\n");
+        close(lfd);
+        unlink(path);
+        free(S.running); free(ws); free(th); free(cpus);
+        return 1;
+    }
+    S.workers = started;
+    printf("{\"event\":\"listening\", \"socket\":\"%s\", \"workers\": %u}\n", path, started);
+    fflush(stdout);
 
-        while (mpz_cmp(k, r) < 0 && mpz_cmp_ui(g,1) == 0) {
-            mp_bitcnt_t lim = mpz_get_ui(m);
-            mp_bitcnt_t i = 0;
+    serve_conn **conns = NULL;
+    struct pollfd *pfd = NULL;
+    size_t nconn = 0, capconn = 0, cappfd = 0;
+    char *rbuf = (char*)malloc(SERVE_READ);
+    bool quit = !rbuf;
 
-            mpz_set(ys, y);
-            for (; i < lim && mpz_cmp(k, r) < 0; ++i) {
-                // y = (y*y + c) % n
-                mpz_mul(y,y,y);
-                mpz_add(y,y,c);
-                mpz_mod(y,y,n);
+    while (!quit) {
+        // pfd[0] listens, pfd[1] is the wake pipe, then one per connection
+        if (cappfd < capconn + 2) {
+            struct pollfd *np = (struct pollfd*)realloc(pfd, (capconn + 2) * sizeof *pfd);
+            if (!np) break;
+            pfd = np;
+            cappfd = capconn + 2;
+        }
+        pfd[0] = (struct pollfd){ .fd = lfd, .events = POLLIN };
+        pfd[1] = (struct pollfd){ .fd = S.wake[0], .events = POLLIN };
+        for (size_t i=0; i<nconn; ++i)
+            pfd[i+2] = (struct pollfd){ .fd = conns[i]->fd,
+                                        .events = (short) ((conns[i]->eof ? 0 : POLLIN) |
+                                                           (conn_pending(conns[i]) ? POLLOUT : 0)) };
+        if (poll(pfd, nconn + 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
 
-                // q = q * |x - y| % n
-                mpz_sub(absdiff, x, y);
-                if (mpz_sgn(absdiff) < 0) mpz_neg(absdiff, absdiff);
-                mpz_mul(q,q,absdiff);
-                mpz_mod(q,q,n);
+        if (pfd[1].revents) while (read(S.wake[0], rbuf, SERVE_READ) > 0) {}
 
-                if (max_iters && ++iters >= max_iters) { mpz_clear(k); goto done; }
-                mpz_add_ui(k, k, 1);
+        for (size_t i=0; i<nconn && !quit; ++i) {
+            serve_conn *c = conns[i];
+            short re = pfd[i+2].revents;
+            if (re & POLLOUT) conn_flush(c);
+            if (c->fd < 0) {   // the write failed: the client is gone
+                serve_cancel(&S, NULL, c);
+                continue;
             }
-            gcd_mpz(g, q, n);
-            if (mpz_cmp_ui(g,1) == 1) { mpz_clear(k); break; }
+            if (!c->eof && (re & POLLIN)) {
+                ssize_t r = read(c->fd, rbuf, SERVE_READ);
+                if (r < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+                if (r <= 0) {
+                    c->eof = true;
+                    if (c->len && c->len < c->cap) {   // last line without '\n'
+                        c->buf[c->len] = 0;
+                        c->len = 0;
+                        quit = serve_line(&S, c, &base, c->buf) != 0;
+                    }
+                } else {
+                    if (c->len + (size_t) r > c->cap) {
+                        size_t ncap = c->cap ? c->cap : 4096;
+                        while (ncap < c->len + (size_t) r) ncap *= 2;
+                        char *nb = ncap <= SERVE_LINE_MAX ? (char*)realloc(c->buf, ncap) : NULL;
+                        if (!nb) {
+                            conn_printf(c, "{\"event\":\"error\", \"ok\":false, \"error\":\"line_too_long\"}\n");
+                            serve_cancel(&S, NULL, c);
+                            conn_close(c);
+                            continue;
+                        }
+                        c->buf = nb; c->cap = ncap;
+                    }
+                    memcpy(c->buf + c->len, rbuf, (size_t) r);
+                    c->len += (size_t) r;
+                    size_t start = 0;
+                    for (size_t k=0; k<c->len && !quit; ++k) {
+                        if (c->buf[k] != '\n') continue;
+                        c->buf[k] = 0;
+                        if (k > start && c->buf[k-1] == '\r') c->buf[k-1] = 0;
+                        quit = serve_line(&S, c, &base, c->buf + start) != 0;
+                        start = k + 1;
+                    }
+                    memmove(c->buf, c->buf + start, c->len - start);
+                    c->len -= start;
+                }
+            } else if (re & (POLLHUP | POLLERR | POLLNVAL)) {
+                // hung up without waiting for results: stop its work
+                serve_cancel(&S, NULL, c);
+                conn_close(c);
+            }
+        }
+
+        // drop clients that let too many replies pile up; replies queued by
+        // the workers since the poll go out now rather than a round later
+        for (size_t i=0; i<nconn; ++i) {
+            serve_conn *c = conns[i];
+            pthread_mutex_lock(&c->wlock);
+            bool over = c->overflow && c->fd >= 0;
+            pthread_mutex_unlock(&c->wlock);
+            if (over) {
+                serve_cancel(&S, NULL, c);
+                conn_close(c);
+            } else if (c->fd >= 0 && !conn_flush(c) && c->fd < 0) {
+                serve_cancel(&S, NULL, c);
+            }
+        }
 
-            mpz_set(y, ys);
-            for (mp_bitcnt_t j = 0; j < mpz_get_ui(m) && mpz_cmp_ui(g,1) == 0 && mpz_cmp(k,r) < 0; ++j) {
-                // y = (y*y + c) % n
-                mpz_mul(y,y,y);
-                mpz_add(y,y,c);
-                mpz_mod(y,y,n);
-                mpz_sub(absdiff, x, y);
-                if (mpz_sgn(absdiff) < 0) mpz_neg(absdiff, absdiff);
-                gcd_mpz(g, absdiff, n);
-                if (max_iters && ++iters >= max_iters) { mpz_clear(k); goto done; }
-                mpz_add_ui(k, k, 1);
+        // retire connections that are closed or done, once their jobs and
+        // replies are
+        for (size_t i=0; i<nconn; ) {
+            serve_conn *c = conns[i];
+            if ((c->fd < 0 || (c->eof && !conn_pending(c))) && atomic_load(&c->jobs) == 0) {
+                conn_free(c);
+                conns[i] = conns[--nconn];
+            } else {
+                ++i;
+            }
+        }
+        // closed ones still finishing a job wait for the wake pipe
+        for (size_t i=0; i<nconn; ++i)
+            if (conns[i]->fd < 0) conns[i]->eof = true;
+
+        if (!quit && (pfd[0].revents & POLLIN)) {
+            int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            serve_conn *c = fd >= 0 ? (serve_conn*)calloc(1, sizeof *c) : NULL;
+            if (c && nconn == capconn) {
+                size_t ncap = capconn ? capconn*2 : 16;
+                serve_conn **nc = (serve_conn**)realloc(conns, ncap*sizeof *nc);
+                if (nc) { conns = nc; capconn = ncap; }
+            }
+            if (c && nconn < capconn) {
+                c->fd = fd;
+                c->wake = S.wake[1];
+                pthread_mutex_init(&c->wlock, NULL);
+                atomic_init(&c->jobs, 0);
+                conns[nconn++] = c;
+            } else {
+                free(c);
+                if (fd >= 0) close(fd);
             }
-            mpz_clear(k);
         }
-        mpz_mul_ui(r, r, 2);
     }
 
-    if (mpz_cmp(g, n) == 0) {
-        // fallback: try many single steps to find nontrivial gcd
-        do {
-            // ys = (ys*ys + c) % n
-            mpz_mul(ys,ys,ys);
-            mpz_add(ys,ys,c);
-            mpz_mod(ys,ys,n);
-            mpz_sub(absdiff, x, ys);
-            if (mpz_sgn(absdiff) < 0) mpz_neg(absdiff, absdiff);
-            gcd_mpz(g, absdiff, n);
-        } while (mpz_cmp_ui(g,1) == 0);
+    // shutdown: drop the queue, stop the running jobs, wait for the workers
+    pthread_mutex_lock(&S.lock);
+    S.quit = true;
+    serve_job *dropped = NULL;
+    while (S.len) {
+        serve_job *j = heap_take(&S, S.len - 1);
+        j->next = dropped;
+        dropped = j;
     }
-done:
-    if (mpz_cmp_ui(g,1) > 0 && mpz_cmp(g, n) < 0) mpz_set(factor, g);
-    mpz_clears(y,c,m,g,r,q,x,ys,tmp,absdiff, NULL);
-}
+    for (unsigned w=0; w<S.workers; ++w) if (S.running[w]) cancel_fire(&S.running[w]->cancel);
+    pthread_cond_broadcast(&S.cv);
+    pthread_mutex_unlock(&S.lock);
+    while (dropped) {
+        serve_job *j = dropped;
+        dropped = j->next;
+        job_drop(j, "cancelled");
+    }
+    for (unsigned t=0; t<started; ++t) pthread_join(th[t], NULL);
 
-/* ---------- P-1 (very light, stage 1 only) ---------- */
+    // give the clients a moment to take their last replies
+    uint64_t drain_end = now_ms() + SERVE_DRAIN_MS;
+    for (;;) {
+        size_t np = 0;
+        for (size_t i=0; i<nconn && np < cappfd; ++i)
+            if (conns[i]->fd >= 0 && conn_flush(conns[i]))
+                pfd[np++] = (struct pollfd){ .fd = conns[i]->fd, .events = POLLOUT };
+        uint64_t now = now_ms();
+        if (!np || now >= drain_end) break;
+        if (poll(pfd, np, (int) (drain_end - now)) < 0 && errno != EINTR) break;
+    }
 
-static void pollard_p1_stage1(mpz_t factor, const mpz_t n, unsigned long B) {
-    mpz_set_ui(factor, 1);
-    if (B < 5) return;
-    mpz_t a, d, t;
-    mpz_inits(a,d,t,NULL);
-    mpz_set_ui(a, 2);
+    for (size_t i=0; i<nconn; ++i) conn_free(conns[i]);
+    free(conns);
+    free(pfd);
+    free(rbuf);
+    close(lfd);
+    unlink(path);
+    close(S.wake[0]);
+    close(S.wake[1]);
+    pthread_cond_destroy(&S.cv);
+    pthread_mutex_destroy(&S.lock);
+    free(S.heap);
+    free(S.running);
+    free(ws);
+    free(th);
+    free(cpus);
+    p1_plans_free();
+    plan_close();
+    fc_close();
+    td_primes_free();
+    return 0;
+}
 
-    for (unsigned long p=2; p<=B; ++p) {
-        // raise a to highest power of p <= B
-        unsigned long e = 1;
-        unsigned long pe = p;
-        while (pe * p <= B) { pe *= p; ++e; }
-        // a = a^(p^e) mod n
-        mpz_powm_ui(a, a, pe, n);
+/* cprime submit --socket PATH: send stdin to a serve daemon, half-close, and
+ * copy its replies to stdout until it closes the connection (all of this
+ * client's jobs answered). */
+static int run_submit(int argc, char **argv) {
+    const char *path = NULL;
+    for (int i=2; i<argc; ++i) {
+        if (i+1 < argc && !strcmp(argv[i], "--socket")) { path = argv[++i]; continue; }
+        fprintf(stderr, "{\"ok\":false,\"error\":\"bad_flag\",\"arg\":\"%s\"}\n", argv[i]);
+        return 2;
     }
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    int fd = -1;
+    if (path && strlen(path) < sizeof sa.sun_path) {
+        strcpy(sa.sun_path, path);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*)&sa, sizeof sa) != 0) { close(fd); fd = -1; }
+    }
+    if (fd < 0) {
+        fprintf(stderr, "{\"ok\":false,\"error\":\"bad_socket\",\"arg\":\"%s\"}\n", path ? path : "--socket");
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
 
-    // d = gcd(a-1, n)
-    mpz_sub_ui(t, a, 1);
-    mpz_gcd(d, t, n);
-    if (mpz_cmp_ui(d,1)>0 && mpz_cmp(d, n)<0) mpz_set(factor, d);
-    mpz_clears(a,d,t,NULL);
+    char *buf = (char*)malloc(SERVE_READ);
+    bool in_open = buf != NULL;
+    int rc = buf ? 0 : 1;
+    while (buf) {
+        struct pollfd pfd[2] = { { .fd = fd, .events = POLLIN }, { .fd = 0, .events = in_open ? POLLIN : 0 } };
+        if (poll(pfd, in_open ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            rc = 1;
+            break;
+        }
+        if (pfd[0].revents) {
+            ssize_t r = read(fd, buf, SERVE_READ);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break;
+            fwrite(buf, 1, (size_t) r, stdout);
+            fflush(stdout);
+        }
+        if (in_open && pfd[1].revents) {
+            ssize_t r = read(0, buf, SERVE_READ);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) { shutdown(fd, SHUT_WR); in_open = false; continue; }
+            for (ssize_t off = 0; off < r; ) {
+                ssize_t w = send(fd, buf + off, (size_t)(r - off), MSG_NOSIGNAL);
+                if (w < 0 && errno == EINTR) continue;
+                if (w <= 0) { rc = 1; break; }
+                off += w;
+            }
+        }
+    }
+    free(buf);
+    close(fd);
+    return rc;
 }
 
-/* ---------- factor recursion ---------- */
+/* ---------- bench subcommand (seeded corpus, per-method timings) ---------- */
+
+/* cprime bench [--seed S] [--bits LIST] [--count K] [--methods LIST]
+ *              [--baseline FILE] [--tolerance PCT] [factor flags]
+ *
+ * Builds K inputs of each class at each size in LIST from seed S (the same
+ * seed gives the same corpus and the same runs):
+ *   semiprime   p*q, random primes of b/2 bits
+ *   smooth      a product of 8..16-bit primes
+ *   p1_smooth   p*q with p-1 2^16-smooth (P-1 territory)
+ * and times every method on its own (trial, p1, ecm, siqs, rho: one split
+ * attempt each) and the whole pipeline (full factorization).  Output is
+ * JSON lines:
+ *   {"bench":"corpus", ...}
+ *   {"bench":"throughput", "bits": b, "kernel":..., "mulmods_per_s":..., "rho_iters_per_s":...}
+ *   {"bench":"method", "bits": b, "class":..., "method":..., "count":..., "found":...,
+ *    "median_us":..., "p90_us":..., "p99_us":...}
+ *   {"bench":"summary", ...}
+ * Saved output can be passed back as --baseline: matching rows gain
+ * "baseline", "delta_pct" and "regression" (median slower, or throughput
+ * lower, by more than PCT percent, default 10), and the exit status is 1
+ * if any row regressed.  Each run gets --timeout_ms (default 1000 here). */
+
+#define BENCH_BITS       "32,48,64,80,96,112,128,144,160"
+#define BENCH_COUNT      8
+#define BENCH_TIMEOUT_MS 1000
+#define BENCH_PROBE_MS   50           // per throughput figure
+#define BENCH_RHO_CHUNK  (1u << 14)   // rho step budget per probe call
+#define BENCH_SLACK_US   50           // medians this close are noise, not regressions
+
+enum { BM_TRIAL, BM_P1, BM_ECM, BM_SIQS, BM_RHO, BM_PIPELINE, BM_COUNT };
+static const char *const bench_methods[BM_COUNT] = { "trial", "p1", "ecm", "siqs", "rho", "pipeline" };
+
+enum { BC_SEMI, BC_SMOOTH, BC_P1, BC_COUNT };
+static const char *const bench_classes[BC_COUNT] = { "semiprime", "smooth", "p1_smooth" };
 
 typedef struct {
-    mpz_t *p;  // array of primes
-    int   *e;  // exponents
+    char bench[16], cls[16], method[16];
+    int bits;
+    double median_us, mulmods, rho_iters;
+} bench_row;
+
+typedef struct {
+    bench_row *v;
     size_t len, cap;
-} factor_list;
+} bench_base;
 
-static void fl_init(factor_list *fl) {
-    fl->p = NULL; fl->e = NULL; fl->len = 0; fl->cap = 0;
+/* Random prime of exactly bits bits (top two bits set, so products of two
+ * such primes have exactly the sum of their sizes). */
+static void bench_prime(mpz_t p, gmp_randstate_t rng, int bits) {
+    do {
+        mpz_urandomb(p, rng, (mp_bitcnt_t) bits);
+        mpz_setbit(p, (mp_bitcnt_t) bits - 1);
+        if (bits > 2) mpz_setbit(p, (mp_bitcnt_t) bits - 2);
+        mpz_nextprime(p, p);
+    } while (bits_of(p) != bits);
 }
-static void fl_free(factor_list *fl) {
-    if (fl->p) {
-        for (size_t i=0;i<fl->len;i++) mpz_clear(fl->p[i]);
-        free(fl->p);
+
+/* One corpus input of class cls with exactly bits bits. */
+static void bench_input(mpz_t n, gmp_randstate_t rng, int cls, int bits) {
+    mpz_t p, q; mpz_inits(p, q, NULL);
+    for (;;) {
+        if (cls == BC_SEMI) {
+            bench_prime(p, rng, bits / 2);
+            bench_prime(q, rng, bits - bits / 2);
+            mpz_mul(n, p, q);
+        } else if (cls == BC_SMOOTH) {
+            mpz_set_ui(n, 1);
+            while (bits_of(n) < bits - 16) {
+                bench_prime(p, rng, 8 + (int) gmp_urandomm_ui(rng, 9));
+                mpz_mul(n, n, p);
+            }
+            int left = bits - bits_of(n);
+            if (left < 2) continue;
+            bench_prime(p, rng, left + 1);
+            mpz_mul(n, n, p);
+        } else {
+            int pb = bits / 2;
+            mpz_set_ui(p, 2);
+            while (bits_of(p) < pb - 16) {
+                bench_prime(q, rng, 2 + (int) gmp_urandomm_ui(rng, 15));
+                mpz_mul(p, p, q);
+            }
+            int left = pb - bits_of(p);
+            if (left < 2) continue;
+            bench_prime(q, rng, left + 1);
+            mpz_mul(p, p, q);
+            mpz_add_ui(p, p, 1);
+            if (bits_of(p) != pb || !is_probable_prime(p)) continue;
+            bench_prime(q, rng, bits - pb);
+            mpz_mul(n, p, q);
+        }
+        if (bits_of(n) == bits) break;
     }
-    free(fl->e);
-    fl->p = NULL; fl->e = NULL; fl->len = fl->cap = 0;
+    mpz_clears(p, q, NULL);
 }
-static void fl_push(factor_list *fl, const mpz_t prime, int exp) {
-    // merge if exists
-    for (size_t i=0;i<fl->len;i++) {
-        if (mpz_cmp(fl->p[i], prime) == 0) { fl->e[i] += exp; return; }
+
+/* One timed attempt of method m on n; returns 1 if it split n (pipeline:
+ * factored it completely). */
+static int bench_run(int m, const mpz_t n, gmp_randstate_t rng, factor_params *fp) {
+    mpz_t c, d; mpz_init_set(c, n); mpz_init_set_ui(d, 1);
+    factor_list fl; fl_init(&fl);
+    fp->start_ms = now_ms();
+    thread_deadline_us = fp_deadline_us(fp);
+    int ok = 0;
+    switch (m) {
+    case BM_TRIAL:
+        trial_strip(c, &fl, fp->trial_B);
+        ok = fl.len > 0;
+        break;
+    case BM_P1: {
+        mpz_t b; mpz_init(b);
+        pollard_p1_stage1(d, b, n, fp->p1_B, NULL);
+        if (mpz_cmp_ui(d, 1) == 0 && fp->p1_B2 > fp->p1_B)
+            pollard_p1_stage2(d, b, n, fp->p1_B, fp->p1_B2, NULL);
+        mpz_clear(b);
+        ok = mpz_cmp_ui(d, 1) > 0 && mpz_cmp(d, n) < 0;
+        break;
     }
-    if (fl->len == fl->cap) {
-        size_t ncap = fl->cap? fl->cap*2 : 8;
-        fl->p = (mpz_t*)realloc(fl->p, ncap*sizeof(mpz_t));
-        fl->e = (int*)realloc(fl->e, ncap*sizeof(int));
-        for (size_t j=fl->cap;j<ncap;j++) mpz_init(fl->p[j]);
-        fl->cap = ncap;
+    case BM_ECM:
+        ok = parallel_ecm(d, n, rng, fp);
+        break;
+    case BM_SIQS:
+        ok = siqs_factor(d, n, rng, fp);
+        break;
+    case BM_RHO:
+        ok = parallel_rho(d, n, rng, rho_kernel_for(n), fp);
+        break;
+    default:
+        ok = factor_full(c, &fl, NULL, rng, fp) == 0;
+        break;
     }
-    mpz_set(fl->p[fl->len], prime);
-    fl->e[fl->len] = exp;
-    fl->len++;
+    fl_free(&fl);
+    mpz_clears(c, d, NULL);
+    stats_free(fp->stats);
+    return ok;
 }
 
-typedef struct {
-    uint64_t timeout_ms;   // 0 => no timeout
-    uint64_t start_ms;
-    unsigned long p1_B;    // 0 => skip
-    uint64_t rho_restarts;
-    uint64_t rho_iters;    // per-restart iteration cap (0 => unlimited if no timeout)
-} factor_params;
+/* Modular multiplications per second in the arithmetic the pipeline uses
+ * at this size; *kernel names it. */
+static double bench_mulmods(int bits, gmp_randstate_t rng, const char **kernel) {
+    mpz_t n, x; mpz_inits(n, x, NULL);
+    mpz_urandomb(n, rng, (mp_bitcnt_t) bits);
+    mpz_setbit(n, (mp_bitcnt_t) bits - 1);
+    mpz_setbit(n, 0);
+    mpz_urandomm(x, rng, n);
+    uint64_t done = 0, t0 = now_us(), dt;
+    const unsigned chunk = 4096;
+#if HAVE_RHO128
+    if (bits <= 64) {
+        *kernel = "mont64";
+        mont64 M = mont64_setup(mpz_getlimbn(n, 0));
+        uint64_t v = mpz_getlimbn(x, 0), acc = 0;
+        do {
+            for (unsigned i=0; i<chunk; ++i) v = mont64_mul(v, v, &M);
+            acc ^= v;
+            done += chunk;
+        } while ((dt = now_us() - t0) < BENCH_PROBE_MS * 1000u);
+        mpz_set_ui(x, acc);   // keep the chain live
+    } else if (bits <= 128) {
+        *kernel = "mont128";
+        mont128 M = mont128_setup(n);
+        u128 v = mpz_get_u128(x);
+        do {
+            for (unsigned i=0; i<chunk; ++i) v = mont128_mul(v, v, &M);
+            done += chunk;
+        } while ((dt = now_us() - t0) < BENCH_PROBE_MS * 1000u);
+        mpz_set_u128(x, v);
+    } else
+#endif
+    if (mpz_size(n) >= MONTN_MIN && mpz_size(n) <= MONTN_MAX) {
+        *kernel = "montn";
+        montn M;
+        montn_setup(&M, n);
+        mp_limb_t v[MONTN_MAX];
+        montn_to(v, x, &M);
+        do {
+            for (unsigned i=0; i<chunk; ++i) M.mul(v, v, v, &M);
+            done += chunk;
+        } while ((dt = now_us() - t0) < BENCH_PROBE_MS * 1000u);
+        montn_from(x, v, &M);
+    } else {
+        *kernel = "mpz";
+        do {
+            for (unsigned i=0; i<chunk; ++i) mulmod(x, x, x, n);
+            done += chunk;
+        } while ((dt = now_us() - t0) < BENCH_PROBE_MS * 1000u);
+    }
+    mpz_clears(n, x, NULL);
+    return dt ? (double) done * 1e6 / (double) dt : 0.0;
+}
 
-static int factor_rec(mpz_t n, factor_list *out, gmp_randstate_t rng, const factor_params *fp);
+/* Rho steps per second in the kernel find_split() picks at this size, on
+ * a prime (no early split), as counted by the kernel itself. */
+static double bench_rho_rate(int bits, gmp_randstate_t rng) {
+    mpz_t n, g; mpz_inits(n, g, NULL);
+    bench_prime(n, rng, bits);
+    rho_kernel rho = rho_kernel_for(n);
+    const uint64_t it0 = work.rho_iters;
+    uint64_t t0 = now_us(), dt;
+    do {
+        rho(g, n, rng, BENCH_RHO_CHUNK, NULL, NULL);
+    } while ((dt = now_us() - t0) < BENCH_PROBE_MS * 1000u);
+    uint64_t done = work.rho_iters - it0;
+    mpz_clears(n, g, NULL);
+    return dt ? (double) done * 1e6 / (double) dt : 0.0;
+}
 
-/* Split n into (d, n/d) using methods; returns 1 if split found, 0 otherwise */
-static int find_split(mpz_t d, const mpz_t n, gmp_randstate_t rng, const factor_params *fp) {
-    mpz_set_ui(d, 0);
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
 
-    // 0) Trial divide small primes quickly
-    mpz_t f;
-    mpz_init(f);
-    mpz_t nn; mpz_init_set(nn, n);
-    if (trial_divide(nn, f)) { mpz_set(d, f); mpz_clears(f,nn,NULL); return 1; }
-    mpz_clears(f,nn,NULL);
+/* Nearest-rank percentile of sorted v[0..n). */
+static uint64_t pctl(const uint64_t *v, size_t n, unsigned pc) {
+    size_t r = (n * pc + 99) / 100;
+    return v[r ? r - 1 : 0];
+}
 
-    // 1) Optional Pollard P-1 stage 1
-    if (fp->p1_B > 0) {
-        mpz_t p1d; mpz_init(p1d);
-        pollard_p1_stage1(p1d, n, fp->p1_B);
-        if (mpz_cmp_ui(p1d,1)>0 && mpz_cmp(p1d,n)<0) { mpz_set(d, p1d); mpz_clear(p1d); return 1; }
-        mpz_clear(p1d);
+/* Load the rows of a saved bench run.  0 => ok. */
+static int bench_load(bench_base *B, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char *line = NULL;
+    size_t cap = 0;
+    int rc = 0;
+    while (getline(&line, &cap, f) >= 0) {
+        const char *p = json_ws(line);
+        if (*p != '{') continue;
+        bench_row r = {0};
+        char key[64], val[64];
+        bool q;
+        p = json_ws(p + 1);
+        while (*p && *p != '}') {
+            if (*p != '"' || !(p = json_scalar(p, key, sizeof key, &q))) break;
+            p = json_ws(p);
+            if (*p++ != ':') break;
+            p = json_ws(p);
+            if (*p == '[') { p = strchr(p, ']'); if (!p) break; strcpy(val, ""); ++p; }
+            else if (!(p = json_scalar(p, val, sizeof val, &q))) break;
+            if (!strcmp(key, "bench")) snprintf(r.bench, sizeof r.bench, "%s", val);
+            else if (!strcmp(key, "class")) snprintf(r.cls, sizeof r.cls, "%s", val);
+            else if (!strcmp(key, "method")) snprintf(r.method, sizeof r.method, "%s", val);
+            else if (!strcmp(key, "bits")) r.bits = atoi(val);
+            else if (!strcmp(key, "median_us")) r.median_us = strtod(val, NULL);
+            else if (!strcmp(key, "mulmods_per_s")) r.mulmods = strtod(val, NULL);
+            else if (!strcmp(key, "rho_iters_per_s")) r.rho_iters = strtod(val, NULL);
+            p = json_ws(p);
+            if (*p == ',') p = json_ws(p + 1);
+        }
+        if (strcmp(r.bench, "method") && strcmp(r.bench, "throughput")) continue;
+        if (B->len == B->cap) {
+            size_t ncap = B->cap ? B->cap*2 : 64;
+            bench_row *nv = (bench_row*)realloc(B->v, ncap*sizeof *nv);
+            if (!nv) { rc = -1; break; }
+            B->v = nv; B->cap = ncap;
+        }
+        B->v[B->len++] = r;
     }
+    free(line);
+    fclose(f);
+    return rc;
+}
 
-    // 2) Pollard Rho (Brent) with restarts
-    uint64_t restarts = fp->rho_restarts ? fp->rho_restarts : 256;
-    for (uint64_t r=0; r<restarts; ++r) {
-        if (fp->timeout_ms && now_ms() - fp->start_ms >= fp->timeout_ms) break;
-        mpz_t g; mpz_init(g);
-        uint64_t itcap = fp->rho_iters;
-        if (fp->timeout_ms && itcap == 0) itcap = 5000000ull; // sensible default under timeout regime
-        brent_rho(g, n, rng, itcap);
-        if (mpz_cmp_ui(g,1)>0 && mpz_cmp(g,n)<0) { mpz_set(d, g); mpz_clear(g); return 1; }
-        mpz_clear(g);
+static const bench_row *bench_find(const bench_base *B, const char *bench, int bits,
+                                   const char *cls, const char *method) {
+    for (size_t i=0; i<B->len; ++i) {
+        const bench_row *r = &B->v[i];
+        if (r->bits == bits && !strcmp(r->bench, bench) && !strcmp(r->cls, cls) && !strcmp(r->method, method))
+            return r;
     }
-    return 0;
+    return NULL;
 }
 
-static int factor_rec(mpz_t n, factor_list *out, gmp_randstate_t rng, const factor_params *fp) {
-    // base cases
-    if (mpz_cmp_ui(n, 1) == 0) return 0;
-    if (is_probable_prime(n)) {
-        fl_push(out, n, 1);
-        return 0;
-    }
+/* Print the baseline comparison for one figure as "<pre>baseline" etc.;
+ * returns 1 on regression.  higher tells whether larger is better. */
+static int bench_compare(const char *pre, double cur, double base, bool higher, double tol) {
+    double delta = base > 0 ? (cur - base) * 100.0 / base : 0.0;
+    bool reg = higher ? cur < base * (1.0 - tol / 100.0)
+                      : cur > base * (1.0 + tol / 100.0) + BENCH_SLACK_US;
+    printf(", \"%sbaseline\": %.0f, \"%sdelta_pct\": %.1f, \"%sregression\": %s",
+           pre, base, pre, delta, pre, reg ? "true" : "false");
+    return reg;
+}
 
-    // Timeout?
-    if (fp->timeout_ms && now_ms() - fp->start_ms >= fp->timeout_ms) {
-        return -1; // signal timeout
+/* Parse "a,b,c" into the indices of names[]; returns the bit mask, 0 on error. */
+static unsigned bench_names(const char *s, const char *const *names, int count) {
+    unsigned mask = 0;
+    while (*s) {
+        size_t len = strcspn(s, ",");
+        int k = 0;
+        while (k < count && (strlen(names[k]) != len || strncmp(names[k], s, len))) ++k;
+        if (k == count) return 0;
+        mask |= 1u << k;
+        s += len;
+        if (*s == ',') ++s;
     }
+    return mask;
+}
 
-    // find a nontrivial factor d
-    mpz_t d; mpz_init(d);
-    int ok = find_split(d, n, rng, fp);
-    if (!ok) { mpz_clear(d); return -2; } // failed to split (likely timeout/iteration cap)
+static int run_bench(int argc, char **argv) {
+    factor_stats stats = {0};
+    factor_params base;
+    factor_params_default(&base, &stats);
+    base.timeout_ms = BENCH_TIMEOUT_MS;
+    int *cpus = NULL;
+    unsigned long seed = 1;
+    const char *bits_arg = BENCH_BITS, *base_path = NULL;
+    size_t count = BENCH_COUNT;
+    unsigned methods = (1u << BM_COUNT) - 1, classes = (1u << BC_COUNT) - 1;
+    double tol = 10.0;
 
-    // split n = d * m
-    mpz_t m; mpz_init(m);
-    mpz_divexact(m, n, d);
+    for (int i=2; i<argc; ++i) {
+        const char *err = "bad_flag";
+        if (i+1 < argc && !strcmp(argv[i], "--seed")) {
+            seed = strtoul(argv[i+1], NULL, 10);
+            err = NULL;
+        } else if (i+1 < argc && !strcmp(argv[i], "--bits")) {
+            bits_arg = argv[i+1];
+            err = NULL;
+        } else if (i+1 < argc && !strcmp(argv[i], "--count")) {
+            count = strtoull(argv[i+1], NULL, 10);
+            err = count ? NULL : "bad_count";
+        } else if (i+1 < argc && !strcmp(argv[i], "--methods")) {
+            methods = bench_names(argv[i+1], bench_methods, BM_COUNT);
+            err = methods ? NULL : "bad_methods";
+        } else if (i+1 < argc && !strcmp(argv[i], "--classes")) {
+            classes = bench_names(argv[i+1], bench_classes, BC_COUNT);
+            err = classes ? NULL : "bad_classes";
+        } else if (i+1 < argc && !strcmp(argv[i], "--baseline")) {
+            base_path = argv[i+1];
+            err = NULL;
+        } else if (i+1 < argc && !strcmp(argv[i], "--tolerance")) {
+            tol = strtod(argv[i+1], NULL);
+            err = tol >= 0 ? NULL : "bad_tolerance";
+        } else if (i+1 < argc) {
+            err = factor_flag(&base, argv[i], argv[i+1], &cpus);
+        }
+        if (err) {
+            const char *arg = strcmp(err, "bad_flag") ? argv[i+1] : argv[i];
+            fprintf(stderr, "{\"ok\":false,\"error\":\"%s\",\"arg\":\"%s\"}\n", err, arg);
+            free(cpus);
+            return 2;
+        }
+        ++i;
+    }
+    if (base.ecm_B2 == 0) base.ecm_B2 = 100ull * base.ecm_B1;
+    if (base.ecm_curves == 0) base.ecm_curves = 32;   // ECM alone needs curves; the pipeline keeps the default
 
-    // recurse on d and m
-    int r1 = factor_rec(d, out, rng, fp);
-    if (r1 < 0) { mpz_clears(d,m,NULL); return r1; }
-    int r2 = factor_rec(m, out, rng, fp);
-    if (r2 < 0) { mpz_clears(d,m,NULL); return r2; }
+    int bits[64];
+    size_t nbits = 0;
+    bool bad = !*bits_arg;
+    for (const char *p = bits_arg; *p && !bad; ) {
+        char *end;
+        long b = strtol(p, &end, 10);
+        bad = end == p || b < 16 || b > 4096 || (*end && *end != ',') || nbits == sizeof bits / sizeof bits[0];
+        if (!bad) bits[nbits++] = (int) b;
+        p = *end ? end + 1 : end;
+    }
+    if (bad) {
+        fprintf(stderr, "{\"ok\":false,\"error\":\"bad_bits\",\"arg\":\"%s\"}\n", bits_arg);
+        free(cpus);
+        return 2;
+    }
 
-    mpz_clears(d,m,NULL);
-    return 0;
-}
+    bench_base B = {0};
+    if (base_path && bench_load(&B, base_path) != 0) {
+        fprintf(stderr, "{\"ok\":false,\"error\":\"bad_baseline\",\"arg\":\"%s\"}\n", base_path);
+        free(cpus);
+        return 2;
+    }
 
-/* ---------- JSON output helpers ---------- */
+    printf("{\"bench\":\"corpus\", \"seed\": %lu, \"count\": %zu, \"bits\":[", seed, count);
+    for (size_t i=0; i<nbits; ++i) printf("%s%d", i ? "," : "", bits[i]);
+    printf("], \"classes\":[");
+    for (int c=0, k=0; c<BC_COUNT; ++c) if (classes >> c & 1) printf("%s\"%s\"", k++ ? "," : "", bench_classes[c]);
+    printf("], \"methods\":[");
+    for (int m=0, k=0; m<BM_COUNT; ++m) if (methods >> m & 1) printf("%s\"%s\"", k++ ? "," : "", bench_methods[m]);
+    printf("], \"timeout_ms\": %" PRIu64 ", \"threads\": %u, \"version\":\"%s\"}\n",
+           base.timeout_ms, base.threads, GIT_DESC);
+    fflush(stdout);
 
-static void print_json_header(const mpz_t n) {
-    char *ns = mpz_to_cstr(n);
-    gmp_printf("{\"n\": %Zd, \"n_str\":\"%s\", ", n, ns);
-    free(ns);
-}
+    gmp_randstate_t crng, rng;        // corpus and method streams, both from the seed
+    gmp_randinit_default(crng);
+    gmp_randinit_default(rng);
+    mpz_t *in = (mpz_t*)malloc(count * sizeof(mpz_t));
+    uint64_t *us = (uint64_t*)malloc(count * sizeof(uint64_t));
+    uint64_t rows = 0, compared = 0, regressions = 0, t_all = now_ms();
+    for (size_t i=0; in && i<count; ++i) mpz_init(in[i]);
 
-static void print_factors_json(const factor_list *fl) {
-    // factors as object with string keys (primes) -> exponents
-    printf("\"factors\":{");
-    for (size_t i=0;i<fl->len;i++) {
-        char *ps = mpz_to_cstr(fl->p[i]);
-        printf("%s\"%s\": %d", (i? ",": ""), ps, fl->e[i]);
-        free(ps);
-    }
-    printf("}");
-}
+    for (size_t bi=0; in && us && bi<nbits; ++bi) {
+        int b = bits[bi];
+        gmp_randseed_ui(rng, seed * 1000003ul + (unsigned long) b);
+        const char *kernel = "mpz";
+        double mm = bench_mulmods(b, rng, &kernel);
+        double ri = bench_rho_rate(b, rng);
+        printf("{\"bench\":\"throughput\", \"bits\": %d, \"kernel\":\"%s\", \"mulmods_per_s\": %.0f, \"rho_iters_per_s\": %.0f",
+               b, kernel, mm, ri);
+        const bench_row *r = bench_find(&B, "throughput", b, "", "");
+        if (r) {
+            int reg = bench_compare("mulmods_", mm, r->mulmods, true, tol);
+            reg |= bench_compare("rho_iters_", ri, r->rho_iters, true, tol);
+            compared++;
+            regressions += reg;
+        }
+        printf("}\n");
+        fflush(stdout);
+        rows++;
 
-static void sort_factors(factor_list *fl) {
-    // simple insertion sort by numeric value ascending (tiny lists)
-    for (size_t i=1;i<fl->len;i++) {
-        size_t j=i;
-        while (j>0 && mpz_cmp(fl->p[j-1], fl->p[j]) > 0) {
-            // swap p
-            mpz_t tmp; mpz_init_set(tmp, fl->p[j-1]);
-            mpz_set(fl->p[j-1], fl->p[j]);
-            mpz_set(fl->p[j], tmp);
-            mpz_clear(tmp);
-            // swap e
-            int te = fl->e[j-1]; fl->e[j-1] = fl->e[j]; fl->e[j] = te;
-            --j;
+        for (int cls=0; cls<BC_COUNT; ++cls) {
+            if (!(classes >> cls & 1)) continue;
+            gmp_randseed_ui(crng, seed * 1000003ul + (unsigned long) b * 8 + (unsigned long) cls);
+            for (size_t i=0; i<count; ++i) bench_input(in[i], crng, cls, b);
+
+            for (int m=0; m<BM_COUNT; ++m) {
+                if (!(methods >> m & 1)) continue;
+                if (m == BM_SIQS && (b < SIQS_MIN_BITS || b > SIQS_MAX_BITS)) continue;
+                gmp_randseed_ui(rng, seed * 1000003ul + (unsigned long) b * 64 + (unsigned long) (cls * BM_COUNT + m));
+                factor_params fp = base;
+                if (m == BM_PIPELINE) fp.ecm_curves = 0;
+                bench_run(m, in[0], rng, &fp);          // warm-up: plans, prime tables
+                size_t found = 0;
+                for (size_t i=0; i<count; ++i) {
+                    uint64_t t0 = now_us();
+                    found += (size_t) bench_run(m, in[i], rng, &fp);
+                    us[i] = now_us() - t0;
+                }
+                qsort(us, count, sizeof *us, cmp_u64);
+                uint64_t med = pctl(us, count, 50);
+                printf("{\"bench\":\"method\", \"bits\": %d, \"class\":\"%s\", \"method\":\"%s\", "
+                       "\"count\": %zu, \"found\": %zu, \"median_us\": %" PRIu64 ", \"p90_us\": %" PRIu64 ", "
+                       "\"p99_us\": %" PRIu64,
+                       b, bench_classes[cls], bench_methods[m], count, found, med,
+                       pctl(us, count, 90), pctl(us, count, 99));
+                r = bench_find(&B, "method", b, bench_classes[cls], bench_methods[m]);
+                if (r) {
+                    regressions += bench_compare("", (double) med, r->median_us, false, tol);
+                    compared++;
+                }
+                printf("}\n");
+                fflush(stdout);
+                rows++;
+            }
         }
     }
+    printf("{\"bench\":\"summary\", \"rows\": %" PRIu64 ", \"compared\": %" PRIu64 ", \"regressions\": %" PRIu64
+           ", \"tolerance_pct\": %.1f, \"ms\": %" PRIu64 "}\n",
+           rows, compared, regressions, tol, now_ms() - t_all);
+
+    for (size_t i=0; in && i<count; ++i) mpz_clear(in[i]);
+    free(in);
+    free(us);
+    free(B.v);
+    gmp_randclear(crng);
+    gmp_randclear(rng);
+    free(cpus);
+    p1_plans_free();
+    plan_close();
+    fc_close();
+    td_primes_free();
+    prime_scratch_free();
+    return regressions ? 1 : 0;
 }
 
 /* ---------- main ---------- */
@@ -390,6 +8033,28 @@ int main(int argc, char **argv) {
         return 0;
     }
 
+    if (argc >= 2 && !strcmp(argv[1], "batch")) {
+        return run_batch(argc, argv);
+    }
+    if (argc >= 2 && !strcmp(argv[1], "batchgcd")) {
+        return run_batchgcd(argc, argv);
+    }
+    if (argc >= 2 && !strcmp(argv[1], "serve")) {
+        return run_serve(argc, argv);
+    }
+    if (argc >= 2 && !strcmp(argv[1], "submit")) {
+        return run_submit(argc, argv);
+    }
+    if (argc >= 2 && !strcmp(argv[1], "bench")) {
+        return run_bench(argc, argv);
+    }
+    if (argc >= 2 && (!strcmp(argv[1], "range") || !strcmp(argv[1], "count"))) {
+        return run_range(argc, argv);
+    }
+    if (argc >= 2 && (!strcmp(argv[1], "nextprime") || !strcmp(argv[1], "prevprime") || !strcmp(argv[1], "scan"))) {
+        return run_psearch(argc, argv);
+    }
+
     if (argc < 3) {
         die_usage(prog);
         return 2;
@@ -408,7 +8073,23 @@ int main(int argc, char **argv) {
     int rc = 0;
 
     if (!strcmp(cmd, "prime")) {
-        bool isp = is_probable_prime(N);
+        for (int i=3; i<argc; ++i) {
+            const char *err = i+1<argc && !strcmp(argv[i], "--cache") ? fc_open(argv[++i]) : "bad_flag";
+            if (err) {
+                fprintf(stderr, "{\"ok\":false,\"error\":\"%s\",\"arg\":\"%s\"}\n", err, argv[i]);
+                mpz_clear(N);
+                fc_close();
+                return 2;
+            }
+        }
+        factor_list fl; fl_init(&fl);
+        mpz_t rest; mpz_init(rest);
+        int known = fc_lookup(N, &fl, rest);
+        bool isp = known == FC_PRIME || (known == FC_NONE && is_probable_prime(N));
+        if (known == FC_NONE && isp) fc_store(N, FC_PRIME, &fl, rest);   // composite: nothing to record yet
+        fl_free(&fl);
+        mpz_clear(rest);
+        fc_close();
         int bits = bits_of(N);
         print_json_header(N);
         printf("\"classification\":\"%s\", ", isp? "prime":"composite");
@@ -421,78 +8102,64 @@ int main(int argc, char **argv) {
         printf("}, ");
         printf("\"bits\": %d}\n", bits);
         mpz_clear(N);
+        prime_scratch_free();
         return 0;
     }
 
     if (!strcmp(cmd, "factor")) {
-        // defaults
-        factor_params fp = {
-            .timeout_ms   = 0,
-            .start_ms     = now_ms(),
-            .p1_B         = 200000,      // small but helpful default
-            .rho_restarts = 256,
-            .rho_iters    = 5000000      // per restart; 0 => unlimited if no timeout
-        };
+        factor_stats stats = {0};
+        factor_params fp;
+        factor_params_default(&fp, &stats);
+        int *cpus = NULL;
+        const char *ck_path = NULL, *rs_path = NULL;
+        uint64_t ck_ms = CK_EVERY_MS;
 
         // parse flags
         for (int i=3; i<argc; ++i) {
-            if (!strcmp(argv[i], "--timeout_ms") && i+1<argc) {
-                fp.timeout_ms = strtoull(argv[++i], NULL, 10);
-            } else if (!strcmp(argv[i], "--p1_B") && i+1<argc) {
-                fp.p1_B = strtoul(argv[++i], NULL, 10);
-            } else if (!strcmp(argv[i], "--rho_restarts") && i+1<argc) {
-                fp.rho_restarts = strtoull(argv[++i], NULL, 10);
-            } else if (!strcmp(argv[i], "--rho_iters") && i+1<argc) {
-                fp.rho_iters = strtoull(argv[++i], NULL, 10);
-            } else {
-                fprintf(stderr, "{\"ok\":false,\"error\":\"bad_flag\",\"arg\":\"%s\"}\n", argv[i]);
+            if (i+1<argc && !strcmp(argv[i], "--checkpoint"))    { ck_path = argv[++i]; continue; }
+            if (i+1<argc && !strcmp(argv[i], "--resume"))        { rs_path = argv[++i]; continue; }
+            if (i+1<argc && !strcmp(argv[i], "--checkpoint_ms")) { ck_ms = strtoull(argv[++i], NULL, 10); continue; }
+            const char *err = (i+1<argc) ? factor_flag(&fp, argv[i], argv[i+1], &cpus) : "bad_flag";
+            if (err) {
+                const char *arg = strcmp(err, "bad_flag") ? argv[i+1] : argv[i];
+                fprintf(stderr, "{\"ok\":false,\"error\":\"%s\",\"arg\":\"%s\"}\n", err, arg);
+                free(cpus);
                 mpz_clear(N);
                 return 2;
             }
+            ++i;
         }
 
-        // Quick classification
-        int bits = bits_of(N);
-        bool isp = is_probable_prime(N);
-
-        factor_list fl; fl_init(&fl);
-
-        char status[16]; strcpy(status, "ok");
-        if (isp) {
-            // prime: factors = {N:1}
-            fl_push(&fl, N, 1);
-        } else {
-            // composite: attempt to factor
-            gmp_randstate_t rng; gmp_randinit_default(rng);
-            // seed: time-based (acceptable here)
-            mpz_t seed; mpz_init(seed);
-            mpz_set_ui(seed, (unsigned long) (now_ms() & 0xffffffffu));
-            gmp_randseed(rng, seed);
-            mpz_clear(seed);
-
-            mpz_t ncopy; mpz_init_set(ncopy, N);
-            int fr = factor_rec(ncopy, &fl, rng, &fp);
-            mpz_clear(ncopy);
-            gmp_randclear(rng);
-
-            if (fr == -1) { strcpy(status, "timeout"); }
-            else if (fr < 0) { strcpy(status, "error"); }
+        ckpt ck;
+        if (ck_path || rs_path) {
+            ck_init(&ck, N, ck_path, ck_ms);
+            const char *err = rs_path ? ck_load(&ck, rs_path) : NULL;
+            if (err) {
+                fprintf(stderr, "{\"ok\":false,\"error\":\"%s\",\"arg\":\"%s\"}\n", err, rs_path);
+                ck_free(&ck);
+                free(cpus);
+                mpz_clear(N);
+                return 2;
+            }
+            fp.ck = &ck;
         }
 
-        sort_factors(&fl);
+        // seed: time-based (acceptable here)
+        gmp_randstate_t rng; gmp_randinit_default(rng);
+        gmp_randseed_ui(rng, (unsigned long) (now_ms() & 0xffffffffu));
 
-        // JSON output
+        catch_interrupts();
         print_json_header(N);
-        printf("\"classification\":\"%s\", ", isp? "prime":"composite");
-        print_factors_json(&fl);
-        printf(", \"bits\": %d, \"status\":\"%s\", \"params\":{", bits, status);
-        printf("\"timeout_ms\": %" PRIu64 ", ", fp.timeout_ms);
-        printf("\"p1_B\": %lu, ", fp.p1_B);
-        printf("\"rho_restarts\": %" PRIu64 ", ", fp.rho_restarts);
-        printf("\"rho_iters\": %" PRIu64 "}", fp.rho_iters);
-        printf("}\n");
-
-        fl_free(&fl);
+        factor_print(stdout, N, &fp, rng);
+        gmp_randclear(rng);
+        if (fp.ck) ck_free(&ck);
+        stats_free(&stats);
+        free(cpus);
+        p1_plans_free();
+        plan_close();
+        fc_close();
+        td_primes_free();
+        prime_scratch_free();
         mpz_clear(N);
         return rc;
     }
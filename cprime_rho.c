@@ -1,6 +1,14 @@
 // cprime_rho.c — minimal Pollard's Rho for up to 64-bit N
 // Build: gcc -O3 -march=x86-64 -mtune=generic -pipe -o cprime_rho cprime_rho.c -lm
-// Usage: ./cprime_rho --n <uint64> [--iters K] [--restarts R] [--verbose]
+// Usage: ./cprime_rho --n <uint64> [--iters K] [--restarts R] [--lanes 1|4|8] [--verbose]
+// Prints "prime N", or "factors p1 p2 ..." (every prime factor, with
+// multiplicity, ascending), or "unknown" if a cofactor would not split.
+//
+// Each restart is a Brent walk in Montgomery form (R = 2^64, no division)
+// with one binary gcd per RHO_BATCH steps and backtracking on collapse.
+// --lanes 4|8 advances that many Brent walks (distinct c) in lockstep with
+// Montgomery multiplication and one batch gcd over all lanes; the kernel is
+// picked at runtime (AVX-512 / AVX2+BMI2 clones, generic fallback).
 
 #include <stdio.h>
 #include <stdint.h>
@@ -9,96 +17,276 @@
 #include <string.h>
 #include <time.h>
 
-static uint64_t mul_mod(uint64_t a, uint64_t b, uint64_t m){
-    __uint128_t z = (__uint128_t)a * b;
-    return (uint64_t)(z % m);
+// Montgomery form with R = 2^64 (n odd); REDC as hi(t) - hi(m*n), no division.
+typedef struct { uint64_t n, ninv, one; } mont64;
+
+static mont64 mont_setup(uint64_t n){
+    mont64 M; M.n = n;
+    uint64_t inv = n;                       // Newton: 5 steps reach 64 bits
+    for (int i=0;i<5;++i) inv *= 2 - n*inv;
+    M.ninv = inv;                           // n*ninv == 1 mod 2^64
+    M.one = (uint64_t)(((__uint128_t)1 << 64) % n);
+    return M;
+}
+static inline uint64_t mont_mul(uint64_t a, uint64_t b, const mont64* M){
+    __uint128_t t = (__uint128_t)a * b;
+    uint64_t m = (uint64_t)t * M->ninv;
+    uint64_t mnh = (uint64_t)(((__uint128_t)m * M->n) >> 64);
+    uint64_t th = (uint64_t)(t >> 64);
+    return th >= mnh ? th - mnh : th - mnh + M->n;
+}
+static inline uint64_t to_mont(uint64_t a, const mont64* M){
+    return (uint64_t)(((__uint128_t)(a % M->n) << 64) % M->n);
 }
-static uint64_t add_mod(uint64_t a, uint64_t b, uint64_t m){
+static inline uint64_t add_mod_n(uint64_t a, uint64_t b, uint64_t n){
+    // a, b < n
     uint64_t s = a + b;
-    if (s < a) s -= m;
-    s %= m;
-    return s;
+    return (s < a || s >= n) ? s - n : s;
 }
-static uint64_t pow_mod(uint64_t a, uint64_t e, uint64_t m){
-    uint64_t r = 1 % m;
-    while (e){
-        if (e & 1) r = mul_mod(r, a, m);
-        a = mul_mod(a, a, m);
-        e >>= 1;
-    }
-    return r;
+static inline uint64_t sub_mod_n(uint64_t a, uint64_t b, uint64_t n){
+    return a >= b ? a - b : a - b + n;
 }
 static uint64_t gcd_u64(uint64_t a, uint64_t b){
-    while (b){ uint64_t t = a % b; a = b; b = t; }
-    return a;
+    // binary (Stein) gcd: shifts and subtractions only
+    if (!a) return b;
+    if (!b) return a;
+    int sh = __builtin_ctzll(a | b);
+    a >>= __builtin_ctzll(a);
+    do {
+        b >>= __builtin_ctzll(b);
+        if (a > b){ uint64_t t = a; a = b; b = t; }
+        b -= a;
+    } while (b);
+    return a << sh;
 }
+
+static const uint64_t small_primes[] = {2,3,5,7,11,13,17,19,23,29,31,37,41,43,47,53,59,61,67,71,73,79,83,89,97};
+#define SMALL_PRIMES (sizeof(small_primes)/sizeof(small_primes[0]))
+
+// Deterministic Miller–Rabin for 64-bit in Montgomery form: no composite
+// below 2^64 is a strong pseudoprime to all seven bases.
 static int is_probable_prime(uint64_t n){
     if (n < 2) return 0;
-    static const uint64_t small[] = {2,3,5,7,11,13,17,19,23,0};
-    for (int i=0; small[i]; ++i){ if (n % small[i] == 0) return n == small[i]; }
-    // Deterministic Miller–Rabin for 64-bit
-    uint64_t d = n-1, s = 0;
-    while ((d & 1) == 0){ d >>= 1; ++s; }
-    uint64_t bases[] = {2, 3, 5, 7, 11, 13, 17};
+    for (size_t i=0; i<SMALL_PRIMES; ++i){ if (n % small_primes[i] == 0) return n == small_primes[i]; }
+    if (n < 101*101) return 1;
+    static const uint64_t bases[] = {2, 325, 9375, 28178, 450775, 9780504, 1795265022};
+    mont64 M = mont_setup(n);
+    const uint64_t mone = n - M.one;        // -1 in Montgomery form
+    uint64_t d = n-1;
+    int s = __builtin_ctzll(d);
+    d >>= s;
     for (size_t i=0;i<sizeof(bases)/sizeof(bases[0]);++i){
-        uint64_t a = bases[i] % n; if (a==0) return 1;
-        uint64_t x = pow_mod(a, d, n);
-        if (x==1 || x==n-1) continue;
-        int cont = 0;
-        for (uint64_t r=1; r<s; ++r){
-            x = mul_mod(x, x, n);
-            if (x == n-1){ cont = 1; break; }
+        uint64_t a = bases[i] % n;
+        if (a == 0) continue;
+        uint64_t x = M.one, b = to_mont(a, &M);
+        for (uint64_t e = d; e; e >>= 1){
+            if (e & 1) x = mont_mul(x, b, &M);
+            b = mont_mul(b, b, &M);
+        }
+        if (x == M.one || x == mone) continue;
+        int r = 1;
+        for (; r<s; ++r){
+            x = mont_mul(x, x, &M);
+            if (x == mone) break;
         }
-        if (!cont) return 0;
+        if (r == s) return 0;
     }
     return 1;
 }
-static uint64_t f(uint64_t x, uint64_t c, uint64_t n){
-    // x^2 + c mod n
-    return add_mod(mul_mod(x,x,n), c, n);
+
+#define RHO_BATCH 128
+#define RHO_LANES_MAX 8
+
+// Brent's cycle search on y -> y^2 + c (Montgomery form, n odd): the
+// products of (x - y) are accumulated over RHO_BATCH steps per gcd, and a
+// batch whose product collapsed to n is replayed one step at a time from
+// its saved ys.  Returns a nontrivial factor or 1.
+static uint64_t pollard_rho(const mont64* M, uint64_t c, uint64_t iters){
+    const uint64_t n = M->n;
+    uint64_t x, y = to_mont(2, M), ys = y, q = M->one, g = 1, steps = 0;
+    for (uint64_t r=1; g == 1; r <<= 1){
+        if (steps >= iters) return 1;
+        x = y;
+        for (uint64_t i=0;i<r;++i) y = add_mod_n(mont_mul(y,y,M), c, n);
+        steps += r;
+        for (uint64_t k=0; k<r && g == 1; ){
+            if (steps >= iters) return 1;
+            uint64_t lim = (r - k < RHO_BATCH) ? r - k : RHO_BATCH;
+            ys = y;
+            for (uint64_t i=0;i<lim;++i){
+                y = add_mod_n(mont_mul(y,y,M), c, n);
+                q = mont_mul(q, sub_mod_n(x, y, n), M);
+            }
+            k += lim; steps += lim;
+            g = gcd_u64(q, n);
+        }
+    }
+    if (g == n){
+        do {
+            ys = add_mod_n(mont_mul(ys,ys,M), c, n);
+            g = gcd_u64(sub_mod_n(x, ys, n), n);
+        } while (g == 1);
+    }
+    return g == n ? 1 : g;
 }
-static uint64_t pollard_rho(uint64_t n, uint64_t iters, uint64_t seed_c){
+
+// ---- multi-walk rho: L Brent walks in lockstep, batch gcd across lanes ----
+
+// Finish a batch whose combined gcd was not 1: look lane by lane, and
+// backtrack a lane from its checkpoint if its product collapsed to n.
+static uint64_t lanes_resolve(const mont64* M, int L, const uint64_t* c,
+                              const uint64_t* x, const uint64_t* ys, const uint64_t* q){
+    uint64_t n = M->n;
+    for (int l=0;l<L;++l){
+        uint64_t g = gcd_u64(q[l], n);
+        if (g == 1) continue;
+        if (g != n) return g;
+        uint64_t y = ys[l];
+        for (int i=0;i<RHO_BATCH;++i){
+            y = add_mod_n(mont_mul(y,y,M), c[l], n);
+            g = gcd_u64(sub_mod_n(x[l], y, n), n);
+            if (g != 1) break;
+        }
+        if (g != 1 && g != n) return g;
+    }
+    return 1;
+}
+
+// The body is written for a compile-time lane count so each clone keeps
+// x/y/q in registers and the compiler can vectorize the add/sub/select
+// steps for the target; the 64x64->128 multiply stays per lane (mulx).
+#define RHO_LANES_FN(name, L, attr)                                              \
+attr static uint64_t name(const mont64* M, const uint64_t* c, uint64_t iters){   \
+    const uint64_t n = M->n;                                                     \
+    uint64_t x[L], y[L], ys[L], q[L];                                            \
+    uint64_t y0 = to_mont(2, M);                                                 \
+    for (int l=0;l<L;++l){ y[l] = y0; q[l] = M->one; }                           \
+    uint64_t steps = 0;                                                          \
+    for (uint64_t r=1; steps < iters; r <<= 1){                                  \
+        for (int l=0;l<L;++l) x[l] = y[l];                                       \
+        for (uint64_t i=0;i<r;++i)                                               \
+            for (int l=0;l<L;++l) y[l] = add_mod_n(mont_mul(y[l],y[l],M), c[l], n); \
+        steps += r;                                                              \
+        for (uint64_t k=0; k<r && steps < iters; ){                              \
+            uint64_t lim = (r - k < RHO_BATCH) ? r - k : RHO_BATCH;             \
+            for (int l=0;l<L;++l) ys[l] = y[l];                                  \
+            for (uint64_t i=0;i<lim;++i){                                        \
+                for (int l=0;l<L;++l){                                           \
+                    y[l] = add_mod_n(mont_mul(y[l],y[l],M), c[l], n);            \
+                    q[l] = mont_mul(q[l], sub_mod_n(x[l], y[l], n), M);          \
+                }                                                                \
+            }                                                                    \
+            k += lim; steps += lim;                                              \
+            uint64_t all = q[0];                                                 \
+            for (int l=1;l<L;++l) all = mont_mul(all, q[l], M);                  \
+            if (gcd_u64(all, n) != 1) return lanes_resolve(M, L, c, x, ys, q);   \
+        }                                                                        \
+    }                                                                            \
+    return 1;                                                                    \
+}
+
+RHO_LANES_FN(rho_lanes4_generic, 4, )
+RHO_LANES_FN(rho_lanes8_generic, 8, )
+#if defined(__x86_64__) && defined(__GNUC__)
+RHO_LANES_FN(rho_lanes4_avx2, 4, __attribute__((target("avx2,bmi2"))))
+RHO_LANES_FN(rho_lanes8_avx2, 8, __attribute__((target("avx2,bmi2"))))
+RHO_LANES_FN(rho_lanes8_avx512, 8, __attribute__((target("avx512f,avx512dq,bmi2"))))
+#endif
+
+typedef uint64_t (*rho_lanes_fn)(const mont64*, const uint64_t*, uint64_t);
+
+static rho_lanes_fn pick_lanes(int L, const char** isa){
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    int bmi2 = __builtin_cpu_supports("bmi2");
+    if (L == 8 && bmi2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")){
+        *isa = "avx512"; return rho_lanes8_avx512;
+    }
+    if (bmi2 && __builtin_cpu_supports("avx2")){
+        *isa = "avx2"; return L == 8 ? rho_lanes8_avx2 : rho_lanes4_avx2;
+    }
+#endif
+    *isa = "generic";
+    return L == 8 ? rho_lanes8_generic : rho_lanes4_generic;
+}
+
+typedef struct {
+    uint64_t iters, restarts;
+    int verbose, lanes;
+    rho_lanes_fn lanes_fn;           // NULL => one walk per restart
+} rho_opts;
+
+// A nontrivial factor of composite n, or 1 after o->restarts failed walks.
+static uint64_t split(uint64_t n, const rho_opts* o){
     if ((n & 1) == 0) return 2;
-    uint64_t c = seed_c | 1ULL; // odd c
-    uint64_t x = 2, y = 2, d = 1;
-    for (uint64_t i=0; i<iters; ++i){
-        x = f(x,c,n);
-        y = f(f(y,c,n),c,n);
-        uint64_t diff = x>y ? x-y : y-x;
-        d = gcd_u64(diff, n);
-        if (d > 1 && d < n) return d;
+    mont64 M = mont_setup(n);
+    for (uint64_t r=0; r<o->restarts; ++r){
+        uint64_t d;
+        if (o->lanes_fn){
+            uint64_t c[RHO_LANES_MAX];
+            for (int l=0;l<o->lanes;++l) c[l] = to_mont((rand() % 0xffffffffu) | 1u, &M);
+            d = o->lanes_fn(&M, c, o->iters);
+        } else {
+            d = pollard_rho(&M, to_mont((rand() % 0xffffffffu) | 1u, &M), o->iters);
+        }
+        if (d != 1 && d != n) return d;
+        if (o->verbose) fprintf(stderr,"[restart %llu] no factor of %" PRIu64 "\n",(unsigned long long)r, n);
     }
     return 1;
 }
 
+// Push the prime factors of n onto out[*k]; -1 if a cofactor would not split.
+static int factor_all(uint64_t n, uint64_t* out, int* k, const rho_opts* o){
+    if (n == 1) return 0;
+    if (is_probable_prime(n)){ out[(*k)++] = n; return 0; }
+    uint64_t d = split(n, o);
+    if (d == 1) return -1;
+    if (factor_all(d, out, k, o)) return -1;
+    return factor_all(n / d, out, k, o);
+}
+
+static int cmp_u64(const void* a, const void* b){
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
 int main(int argc, char** argv){
-    uint64_t n = 0, iters = 50000, restarts = 32;
-    int verbose = 0;
+    uint64_t n = 0;
+    rho_opts o = { .iters = 50000, .restarts = 32, .verbose = 0, .lanes = 1, .lanes_fn = NULL };
     for (int i=1;i<argc;i++){
         if (!strcmp(argv[i],"--n") && i+1<argc) n = strtoull(argv[++i],NULL,10);
-        else if (!strcmp(argv[i],"--iters") && i+1<argc) iters = strtoull(argv[++i],NULL,10);
-        else if (!strcmp(argv[i],"--restarts") && i+1<argc) restarts = strtoull(argv[++i],NULL,10);
-        else if (!strcmp(argv[i],"--verbose")) verbose = 1;
+        else if (!strcmp(argv[i],"--iters") && i+1<argc) o.iters = strtoull(argv[++i],NULL,10);
+        else if (!strcmp(argv[i],"--restarts") && i+1<argc) o.restarts = strtoull(argv[++i],NULL,10);
+        else if (!strcmp(argv[i],"--lanes") && i+1<argc) o.lanes = atoi(argv[++i]);
+        else if (!strcmp(argv[i],"--verbose")) o.verbose = 1;
         else {
-            fprintf(stderr,"Usage: %s --n <uint64> [--iters K] [--restarts R] [--verbose]\n", argv[0]);
+            fprintf(stderr,"Usage: %s --n <uint64> [--iters K] [--restarts R] [--lanes 1|4|8] [--verbose]\n", argv[0]);
             return 2;
         }
     }
     if (n==0){ fprintf(stderr,"Error: --n required\n"); return 2; }
+    if (o.lanes!=1 && o.lanes!=4 && o.lanes!=8){ fprintf(stderr,"Error: --lanes must be 1, 4 or 8\n"); return 2; }
     if (is_probable_prime(n)){ printf("prime %" PRIu64 "\n", n); return 0; }
 
     srand((unsigned)time(NULL));
-    for (uint64_t r=0; r<restarts; ++r){
-        uint64_t c = (rand() % 0xffffffffu) | 1u;
-        uint64_t d = pollard_rho(n, iters, c);
-        if (d != 1 && d != n){
-            uint64_t p = d, q = n / d;
-            if (p > q){ uint64_t t=p; p=q; q=t; }
-            printf("factors %" PRIu64 " %" PRIu64 "\n", p, q);
-            return 0;
-        }
-        if (verbose) fprintf(stderr,"[restart %llu] no factor\n",(unsigned long long)r);
+    if (o.lanes > 1){
+        const char* isa;
+        o.lanes_fn = pick_lanes(o.lanes, &isa);
+        if (o.verbose) fprintf(stderr,"[lanes] %d walks/restart, kernel=%s\n", o.lanes, isa);
     }
-    printf("unknown\n");
-    return 1;
+
+    // strip the tiny primes, then split what is left with rho
+    uint64_t fs[64];
+    int k = 0;
+    for (size_t i=0; i<SMALL_PRIMES && n > 1; ++i)
+        while (n % small_primes[i] == 0){ fs[k++] = small_primes[i]; n /= small_primes[i]; }
+    if (factor_all(n, fs, &k, &o) != 0){
+        printf("unknown\n");
+        return 1;
+    }
+    qsort(fs, (size_t)k, sizeof fs[0], cmp_u64);
+    printf("factors");
+    for (int i=0;i<k;++i) printf(" %" PRIu64, fs[i]);
+    printf("\n");
+    return 0;
 }
@@ -4,6 +4,8 @@ set -euo pipefail
 # Usage:
 #   loop64_luby_mt.sh <threads> <p1_B> <restarts> <cpuset or '-'> <logfile> <N> \
 #                     [--iters K] [--schedule S] [--cap ABS] [--timeout SEC] [--extra "..."]
+#
+# <restarts> is per thread; all threads run inside one ./cprime process.
 
 if [[ $# -lt 6 ]]; then
   echo "usage: $0 <threads> <p1_B> <restarts> <cpuset|-> <logfile> <N> [--iters K] [--schedule S] [--cap ABS] [--timeout SEC] [--extra '...']" >&2
@@ -32,59 +34,14 @@ done
 mkdir -p logs
 date +"[loop64_luby_mt] %F %T starting" | tee -a "$LOGFILE"
 
-pids=()
-finish() {
-  for p in "${pids[@]:-}"; do kill "$p" 2>/dev/null || true; done
-}
-trap finish INT TERM
-
-for idx in $(seq 0 $((T-1))); do
-  tlog="logs/thread_${idx}.log"
-  echo "[loop64_luby_mt] spawn thread $idx -> $tlog" | tee -a "$LOGFILE"
-  (
-    BIND=()
-    if [[ "$CPUSET" != "-" ]]; then
-      # naive pinning for ranges like 0-7
-      CPU=$(awk -v base="$CPUSET" -v i="$idx" 'BEGIN{
-        split(base,b,"-"); start=b[1]; end=(length(b[2])?b[2]:b[1]);
-        cpu=start + (i % (end-start+1)); printf "%d", cpu;
-      }')
-      BIND=( taskset -c "$CPU" )
-    fi
-    exec "${BIND[@]}" ./factor_luby.sh "$TARGET" \
-      --p1_B "$P1_B" --restarts "$RESTARTS" --iters "$ITERS" \
-      --schedule "$SCHEDULE" ${CAP:+--cap "$CAP"} \
-      ${TIMEOUT:+--timeout "$TIMEOUT"} \
-      ${EXTRA:+--extra "$EXTRA"} \
-      --log "$tlog"
-  ) >>"$LOGFILE" 2>&1 &
-  pids+=($!)
-done
-
-success=0
-# Keep waiting until a worker exits with rc==0 (success), or all have failed.
-while :; do
-  # update pids to those still running
-  mapfile -t pids < <(jobs -p)
-  ((${#pids[@]})) || break  # none left -> all failed
-  if wait -n; rc=$?; then
-    # wait -n executed and returned the exit code of one job in $rc
-    if [[ $rc -eq 0 ]]; then
-      success=1
-      echo "[loop64_luby_mt] success detected (one worker exit=0). Stopping others..." | tee -a "$LOGFILE"
-      break
-    else
-      # one worker failed; loop continues to wait on remaining
-      :
-    fi
-  fi
-done
-
-finish
-if [[ $success -eq 1 ]]; then
-  echo "[loop64_luby_mt] DONE: factor found by a worker." | tee -a "$LOGFILE"
+if ./factor_luby.sh "$TARGET" \
+    --p1_B "$P1_B" --restarts "$(( RESTARTS * T ))" --iters "$ITERS" \
+    --schedule "$SCHEDULE" --cap "$CAP" --threads "$T" --cpus "$CPUSET" \
+    --timeout "$TIMEOUT" ${EXTRA:+--extra "$EXTRA"} \
+    --log "logs/luby_mt.log" >>"$LOGFILE" 2>&1; then
+  echo "[loop64_luby_mt] DONE: factor found." | tee -a "$LOGFILE"
   exit 0
 else
-  echo "[loop64_luby_mt] DONE: all workers finished without success." | tee -a "$LOGFILE"
+  echo "[loop64_luby_mt] DONE: all restarts finished without success." | tee -a "$LOGFILE"
   exit 1
 fi
@@ -38,6 +38,298 @@ else
   bad "$name" 'composite with factors 4294967291 and 4294967279' "$out"
 fi
 
+# 4) same semiprime on 4 in-process rho walkers, pinned to cpu 0
+name="factor 18446743979220271189 (--threads 4 --cpus 0)"
+out="$(./cprime_cli_demo factor "$N" --timeout_ms 5000 --threads 4 --cpus 0 2>&1)"; rc=$?
+if (( rc == 0 )) && has "$out" '"4294967291": 1' && has "$out" '"4294967279": 1' && has "$out" '"threads": 4'; then
+  ok "$name"
+else
+  bad "$name" 'factors 4294967291 and 4294967279 with "threads": 4' "$out"
+fi
+
+# 5) native restart schedule: tiny Luby budgets still reach the split
+name="factor 18446743979220271189 (--schedule luby --cap)"
+out="$(./cprime_cli_demo factor "$N" --p1_B 0 --rho_iters 2000 --rho_restarts 4096 --schedule luby --cap 64000 2>&1)"; rc=$?
+if (( rc == 0 )) && has "$out" '"4294967291": 1' && has "$out" '"schedule":"luby"' && has "$out" '"cap": 64000'; then
+  ok "$name"
+else
+  bad "$name" 'factors found with "schedule":"luby" and "cap": 64000' "$out"
+fi
+
+# 6) P-1 stage 1: p-1 is 1000-smooth, q = 2^89-1 (ord_q(2) = 89 <= B, so the
+#    plain gcd collapses to n and the chunk replay has to separate them)
+name="factor 714844798881757670950466839545233299060630561 (P-1)"
+N=714844798881757670950466839545233299060630561
+out="$(./cprime_cli_demo factor "$N" --p1_B 1000 --rho_restarts 1 --rho_iters 1000 2>&1)"; rc=$?
+if (( rc == 0 )) && has "$out" '"1154894059803433951": 1' && has "$out" '"618970019642690137449562111": 1'; then
+  ok "$name"
+else
+  bad "$name" 'factors 1154894059803433951 and 618970019642690137449562111' "$out"
+fi
+
+# 7) P-1 stage 2: p-1 = (1000-smooth) * 5000011, so only --p1_B2 reaches it
+name="factor 100219178182980522512457972978397148690055920299 (P-1 stage 2)"
+N=100219178182980522512457972978397148690055920299
+out="$(./cprime_cli_demo factor "$N" --p1_B 1000 --p1_B2 6000000 --rho_restarts 1 --rho_iters 10 2>&1)"; rc=$?
+if (( rc == 0 )) && has "$out" '"82899361198958855683991": 1' && has "$out" '"p1_stage2_us"'; then
+  ok "$name"
+else
+  bad "$name" 'factor 82899361198958855683991 with stage 2 timing' "$out"
+fi
+
+# 8) ECM: 40-bit p times an 80-bit prime, P-1 off and rho starved
+name="factor 1329227995803049760198040791552098499 (ECM)"
+N=1329227995803049760198040791552098499
+out="$(./cprime_cli_demo factor "$N" --p1_B 0 --ecm_curves 200 --ecm_B1 2000 --rho_restarts 1 --rho_iters 10 2>&1)"; rc=$?
+if (( rc == 0 )) && has "$out" '"1099511627791": 1' && has "$out" '"ecm":[' && has "$out" '"factor":"1099511627791"'; then
+  ok "$name"
+else
+  bad "$name" 'factor 1099511627791 found by an ECM curve' "$out"
+fi
+
+# 9) SIQS: balanced 128-bit semiprime, P-1 off and rho starved
+name="factor 171453774158209296062295738586811143169 (SIQS)"
+N=171453774158209296062295738586811143169
+out="$(./cprime_cli_demo factor "$N" --p1_B 0 --rho_restarts 1 --rho_iters 10 --threads 2 2>&1)"; rc=$?
+if (( rc == 0 )) && has "$out" '"10747703393185931869": 1' && has "$out" '"15952596372068787701": 1' && has "$out" '"siqs_rels"'; then
+  ok "$name"
+else
+  bad "$name" 'both 64-bit factors via SIQS' "$out"
+fi
+
+# 10) Native small-cofactor stage: squared 30-bit prime times 13, no GMP methods
+name="factor 13000000182000000637 (small cofactor stage)"
+N=13000000182000000637
+out="$(./cprime_cli_demo factor "$N" --p1_B 0 --rho_restarts 1 --rho_iters 10 2>&1)"; rc=$?
+if (( rc == 0 )) && has "$out" '"13": 1' && has "$out" '"1000000007": 2' && has "$out" '"small_calls": 1'; then
+  ok "$name"
+else
+  bad "$name" '13 * 1000000007^2 from the word-sized stage' "$out"
+fi
+
+# 11) batch: plain and JSON inputs on stdin, one keyed line each, bad input reported in place
+name="batch (stdin -> JSON lines)"
+out="$(printf '15\n\n{"id":"x","n":"1000000016000000063","p1_B":0}\nabc\n' | ./cprime_cli_demo batch --p1_B 1000 2>&1)"; rc=$?
+if (( rc == 0 )) && (( $(wc -l <<<"$out") == 3 )) && has "$out" '{"seq": 0, "n": 15' \
+   && has "$out" '"seq": 1, "id": "x"' && has "$out" '"1000000009": 1' && has "$out" '"seq": 2, "ok":false, "error":"bad_n"'; then
+  ok "$name"
+else
+  bad "$name" 'three lines keyed by seq, the JSON item with its id and factors' "$out"
+fi
+
+# 12) batchgcd: 15 and 21 share 3 across a chunk boundary, 143 shares nothing
+name="batchgcd (shared factors across chunks)"
+out="$(printf '15\n21\nabc\n143\n' | ./cprime_cli_demo batchgcd --chunk 2 2>&1)"; rc=$?
+if (( rc == 0 )) && has "$out" '"seq": 0, "n": 15, "n_str":"15", "gcd":"3", "factors":{"3": 1,"5": 1}' \
+   && has "$out" '"gcd":"3", "factors":{"3": 1,"7": 1}' && has "$out" '"seq": 2, "ok":false' && has "$out" '"n_str":"143", "gcd":"1"}'; then
+  ok "$name"
+else
+  bad "$name" 'gcd 3 for 15 and 21 (factored), gcd 1 for 143' "$out"
+fi
+
+# 13) Deep trial division: 2^5 * 65521^3 * 1000003 * (2^89-1) stripped by --trial_B alone
+name="factor 5571375713215038757424748276659293427116815821216 (--trial_B)"
+N=5571375713215038757424748276659293427116815821216
+out="$(./cprime_cli_demo factor "$N" --trial_B 1048576 --p1_B 0 --rho_restarts 1 --rho_iters 10 2>&1)"; rc=$?
+if (( rc == 0 )) && has "$out" '"factors":{"2": 5,"65521": 3,"1000003": 1,"618970019642690137449562111": 1}' \
+   && has "$out" '"status":"ok"'; then
+  ok "$name"
+else
+  bad "$name" 'small primes with multiplicity, prime cofactor left' "$out"
+fi
+
+# 14) BPSW: 2^127-1 is prime; a strong pseudoprime to bases 2..37 and a square above 2^128 are not
+name="prime 2^127-1 / psp 3317044064679887385961981 / 2^89-1 squared"
+out1="$(./cprime_cli_demo prime 170141183460469231731687303715884105727 2>&1)"
+out2="$(./cprime_cli_demo prime 3317044064679887385961981 2>&1)"
+out3="$(./cprime_cli_demo prime 383123885216472214589586755549637256619304505646776321 2>&1)"
+if has "$out1" '"classification":"prime"' && has "$out2" '"classification":"composite"' && has "$out3" '"classification":"composite"'; then
+  ok "$name"
+else
+  bad "$name" 'prime, composite, composite' "$out1 $out2 $out3"
+fi
+
+# 15) Checkpoint/resume: kill the run mid-rho, finish it from the snapshot
+name="factor 26546691807453486551142617942552104 (--checkpoint, killed, --resume)"
+N=26546691807453486551142617942552104
+ck="$(mktemp)"; rm -f "$ck"
+timeout -s KILL 0.3 ./cprime_cli_demo factor "$N" --siqs 0 --p1_B 0 --rho_iters 0 --checkpoint "$ck" --checkpoint_ms 20 >/dev/null 2>&1
+out="$(./cprime_cli_demo factor "$N" --siqs 0 --p1_B 0 --rho_iters 0 --resume "$ck" 2>&1)"; rc=$?
+rm -f "$ck" "$ck.tmp"
+if (( rc == 0 )) && has "$out" '"factors":{"2": 3,"1000003": 1,"57380586651259": 1,"57830125389269": 1}' \
+   && has "$out" '"status":"ok"'; then
+  ok "$name"
+else
+  bad "$name" 'full factorization from the saved state' "$out"
+fi
+
+# 16) serve: a queued job finishes, a running one is cancelled by id, ping answers
+name="serve --socket (factor, cancel by id, ping, shutdown)"
+sd="$(mktemp -d)"
+./cprime_cli_demo serve --socket "$sd/sock" --workers 2 >/dev/null 2>&1 &
+spid=$!
+for _ in $(seq 50); do [[ -S "$sd/sock" ]] && break; sleep 0.05; done
+out="$( { printf '%s\n' '{"id":"small","n":"1000000016000000063"}' \
+            '{"id":"slow","n":"2797110742512494604113599164203197","siqs":0,"p1_B":0,"rho_iters":0}'
+          sleep 0.3
+          printf '%s\n' '{"op":"cancel","id":"slow"}' '{"op":"ping"}'; } \
+        | timeout 10 ./cprime_cli_demo submit --socket "$sd/sock" 2>&1)"
+echo '{"op":"shutdown"}' | timeout 5 ./cprime_cli_demo submit --socket "$sd/sock" >/dev/null 2>&1
+timeout 5 tail --pid="$spid" -f /dev/null; kill "$spid" 2>/dev/null
+rm -rf "$sd"
+if has "$out" '"factors":{"1000000007": 1,"1000000009": 1}' && has "$out" '"status":"cancelled"' \
+   && has "$out" '"event":"pong"'; then
+  ok "$name"
+else
+  bad "$name" 'small job factored, slow job cancelled, pong' "$out"
+fi
+
+# 17) bench: a tiny seeded run, then compared against itself
+name="bench --bits 40,64 --count 3 (and --baseline)"
+bf="$(mktemp)"
+./cprime_cli_demo bench --bits 40,64 --count 3 --methods trial,rho,pipeline > "$bf" 2>&1; rc1=$?
+out="$(./cprime_cli_demo bench --bits 40,64 --count 3 --methods trial,rho,pipeline --baseline "$bf" --tolerance 1000 2>&1)"; rc2=$?
+base="$(cat "$bf")"; rm -f "$bf"
+if (( rc1 == 0 && rc2 == 0 )) && has "$base" '"bench":"throughput", "bits": 64' \
+   && has "$base" '"class":"semiprime", "method":"pipeline", "count": 3, "found": 3' \
+   && has "$out" '"rows": 20, "compared": 20, "regressions": 0'; then
+  ok "$name"
+else
+  bad "$name" '20 rows, all compared, no regressions' "$out"
+fi
+
+# 18) Stage stats: which method found each split, plus the stderr heartbeat
+name="factor 26546691807453486551142617942552104 (stats splits, --progress_ms)"
+out="$(./cprime_cli_demo factor 26546691807453486551142617942552104 2>&1)"
+err="$(./cprime_cli_demo factor 2797110742512494604113599164203197 --siqs 0 --p1_B 0 --rho_iters 1000000 \
+        --timeout_ms 300 --progress_ms 50 2>&1 >/dev/null)"
+if has "$out" '"splits":[{"bits": 112, "method":"p1", "factor":"1000003"}' && has "$out" '"trial_primes": 1' \
+   && has "$err" '{"progress":{' && has "$err" '"stage":"rho"'; then
+  ok "$name"
+else
+  bad "$name" 'p1 split listed, rho heartbeat on stderr' "$out $err"
+fi
+
+# 19) Adaptive planner: outcomes land in --plan_stats and feed the next run
+name="factor --plan auto --plan_stats FILE (twice)"
+pf="$(mktemp -u)"
+./cprime_cli_demo factor 2797110742512494604113599164203197 --plan_stats "$pf" >/dev/null 2>&1
+out="$(./cprime_cli_demo factor 2797110742512494604113599164203197 --plan auto --plan_stats "$pf" 2>&1)"
+table="$(cat "$pf" 2>/dev/null)"; rm -f "$pf"
+if has "$out" '"factors":{"44526274445984491": 1,"62819330323845367": 1}' && has "$out" '"plan":"auto"' \
+   && has "$table" '# cprime plan v1' && has "$table" '112 siqs 2 2 '; then
+  ok "$name"
+else
+  bad "$name" 'factored twice by SIQS, both runs in the table' "$out $table"
+fi
+
+# 20) Above 128 bits: rho and P-1 stage 2 on the mpn Montgomery kernels
+name="factor 1000000007 x M521, 512-bit p1_stage2 (limb-count kernels)"
+out="$(./cprime_cli_demo factor 6864797708184193335896168803954698810839187821029352510397601324946787397696458335906152005519372039607478196232555037777487994259570559810590534979133255188805400057 --p1_B 0 --siqs 0 2>&1)"
+out2="$(./cprime_cli_demo factor 10779747782298156989963298093318572308610114930402831595796411701404243921780915212809734705150628135508821157282923610822987303033034409511411414984519231 \
+        --p1_B 1000 --p1_B2 5000000 --siqs 0 --rho_restarts 1 2>&1)"
+if has "$out" '"factors":{"1000000007": 1,"6864797660130609714981900799081393217269435300143305409394463459185543183397656052122559640661454554977296311391480858037121987999716643812574028291115057151": 1}' \
+   && has "$out2" '"method":"p1_stage2", "factor":"137749757528680520198777519"'; then
+  ok "$name"
+else
+  bad "$name" 'rho split of the 551-bit n, stage-2 split of the 512-bit n' "$out $out2"
+fi
+
+# 21) cprime_rho: Brent/Montgomery engine prints the full factorization
+name="cprime_rho --n 18446744073709551615 (and --lanes 4)"
+out="$(./cprime_rho --n 18446744073709551615 2>&1)"
+out4="$(./cprime_rho --n 1000000014000000049 --lanes 4 2>&1)"
+if [[ "$out" == "factors 3 5 17 257 641 65537 6700417" && "$out4" == "factors 1000000007 1000000007" ]]; then
+  ok "$name"
+else
+  bad "$name" 'all seven primes of 2^64-1; 1000000007 squared' "$out $out4"
+fi
+
+# 22) range/count: segmented wheel sieve, ordered output across threads
+name="count 0 1000000, range 0 30 (text and delta, --threads 3)"
+out="$(./cprime_cli_demo count 0 1000000 --threads 3 2>&1)"
+txt="$(./cprime_cli_demo range 0 30 --threads 3 2>&1 | tr '\n' ' ')"
+dlt="$(./cprime_cli_demo range 999999900 1000000008 --format delta 2>&1 | tr '\n' ' ')"
+if has "$out" '"count": 78498' && [[ "$txt" == "2 3 5 7 11 13 17 19 23 29 " && "$dlt" == "999999929 8 70 " ]]; then
+  ok "$name"
+else
+  bad "$name" 'pi(10^6) = 78498; the primes to 30; 999999929 +8 +70' "$out | $txt | $dlt"
+fi
+
+# 23) nextprime/prevprime/scan: sieved window, PRP tests on the survivors
+name="nextprime/prevprime around 2^128, scan 999999900 +110 (--threads 3)"
+nx="$(./cprime_cli_demo nextprime 340282366920938463463374607431768211456 --threads 3 2>&1)"
+pv="$(./cprime_cli_demo prevprime 340282366920938463463374607431768211456 --threads 3 2>&1)"
+sc="$(./cprime_cli_demo scan 999999900 110 --threads 3 2>&1 | tr '\n' ' ')"
+if has "$nx" '"nextprime":"340282366920938463463374607431768211507", "distance": 51' \
+   && has "$pv" '"prevprime":"340282366920938463463374607431768211297", "distance": 159' \
+   && [[ "$sc" == "999999929 999999937 1000000007 1000000009 " ]]; then
+  ok "$name"
+else
+  bad "$name" '2^128+51, 2^128-159, the four primes of the window' "$nx | $pv | $sc"
+fi
+
+# 24) --cache: the second run is answered from the file, a cofactor too (prime on a composite records nothing)
+name="factor 2^128+1 twice with --cache, then 1000003 x (2^128+1); batch \"cache\" refused"
+cache="$(mktemp)"; rm -f "$cache"
+./cprime_cli_demo prime 340282366920938463463374607431768211457 --cache "$cache" >/dev/null 2>&1
+out1="$(./cprime_cli_demo factor 340282366920938463463374607431768211457 --cache "$cache" 2>&1)"
+out2="$(./cprime_cli_demo factor 340282366920938463463374607431768211457 --cache "$cache" 2>&1)"
+out3="$(./cprime_cli_demo factor 340283387768039226278764997555590506761634371 --cache "$cache" 2>&1)"
+out4="$(printf '{"n":"15","cache":"%s.b"}\n' "$cache" | ./cprime_cli_demo batch 2>&1)"
+[[ -e "$cache.b" ]] && out4="$out4 (created $cache.b)"
+rm -f "$cache" "$cache.b"
+if has "$out1" '"cache_hits": 0' && has "$out2" '"cache_hits": 1' && has "$out2" '"splits":[]' \
+   && has "$out2" '"factors":{"59649589127497217": 1,"5704689200685129054721": 1}' \
+   && has "$out3" '"factors":{"1000003": 1,"59649589127497217": 1,"5704689200685129054721": 1}' && has "$out3" '"cache_hits": 1' \
+   && has "$out4" '"error":"bad_flag", "arg":"cache"' && ! has "$out4" created; then
+  ok "$name"
+else
+  bad "$name" 'miss, then a hit with no splits, then a cofactor hit; per-line cache is bad_flag' "$out1 | $out2 | $out3"
+fi
+
+# 25) Deadlines inside the walks; timeout and SIGTERM keep what was found
+name="timeout 300 ms with rho_iters 0, then SIGTERM (factors so far + cofactors)"
+n=683700265392379004594046703830254244472127700005917523981219723
+t0=$(date +%s%N)
+out="$(./cprime_cli_demo factor $n --rho_iters 0 --siqs 0 --timeout_ms 300 2>&1)"
+ms=$(( ($(date +%s%N) - t0) / 1000000 ))
+so="$(mktemp)"
+./cprime_cli_demo factor $n --rho_iters 0 --siqs 0 > "$so" 2>&1 &
+pid=$!; sleep 0.5; kill -TERM $pid; wait $pid
+sig="$(cat "$so")"; rm -f "$so"
+want='"factors":{"920049643": 1}, "cofactors":["743112364201394516050093944583220977862090969808590561"]'
+if has "$out" "$want" && has "$out" '"status":"timeout"' && (( ms < 1000 )) \
+   && has "$sig" "$want" && has "$sig" '"status":"interrupted"'; then
+  ok "$name"
+else
+  bad "$name" 'the 30-bit prime, the 180-bit cofactor, under 1 s; same on SIGTERM' "$out ($ms ms) | $sig"
+fi
+
+# 26) Work-stealing pool: a multi-factor tree and a batch, both on 3 workers
+name="factor 6-prime product and batch on --threads 3 (same factors, input order, per-line cpus refused)"
+n=213312418037931179399848869024036635116672716329349111052152556223053
+want='"factors":{"220459139": 1,"599146781": 1,"2708517689": 1,"12660313513": 1,"66680211233": 1,"706287789011640962107": 1}'
+out="$(./cprime_cli_demo factor $n --threads 3 2>&1)"
+bout="$(printf '%s\n' $n 97 '{"id":"b","n":"1000000016000000063"}' x 1000000016000000063 '{"n":"15","cpus":"0"}' \
+        | ./cprime_cli_demo batch --threads 3 2>&1 | grep -o '^{"seq": [0-9]*\|"factors":{[^}]*}\|"error"' | paste -sd' ')"
+bwant="{\"seq\": 0 $want {\"seq\": 1 \"factors\":{\"97\": 1} {\"seq\": 2 \"factors\":{\"1000000007\": 1,\"1000000009\": 1} {\"seq\": 3 \"error\" {\"seq\": 4 \"factors\":{\"1000000007\": 1,\"1000000009\": 1} {\"seq\": 5 \"error\""
+if has "$out" "$want" && has "$out" '"status":"ok"' && [[ "$bout" == "$bwant" ]]; then
+  ok "$name"
+else
+  bad "$name" "$want; batch lines in seq order" "$out | $bout"
+fi
+
+# 27) range/count past the listed sieving primes: streamed, or PRP-tested near 2^64
+name="count 10^16 +10^7 (streamed primes), range 2^64-2^32 window (tested survivors)"
+out="$(./cprime_cli_demo count 10000000000000000 10000000010000000 --threads 2 2>&1)"
+top="$(./cprime_cli_demo range 18446744069414584000 18446744069414584319 --format delta 2>&1 | tr '\n' ' ')"
+if has "$out" '"count": 271897' && [[ "$top" == "18446744069414584057 10 36 56 22 18 50 40 " ]]; then
+  ok "$name"
+else
+  bad "$name" '271897 primes; the 8 primes below 2^64-2^32+320' "$out | $top"
+fi
+
 echo
 printf 'Summary: PASS=%d FAIL=%d\n' "$pass" "$fail"
 exit $(( fail == 0 ? 0 : 1 ))